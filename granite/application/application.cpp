@@ -26,6 +26,7 @@
 #include "scene_formats/light_export.hpp"
 #include "filesystem/filesystem.hpp"
 #include "threading/thread_group.hpp"
+#include "util/frame_arena.hpp"
 
 #ifdef HAVE_GRANITE_AUDIO
 #include "audio/audio_mixer.hpp"
@@ -104,6 +105,9 @@ void Application::run_frame()
 	application_wsi.begin_frame();
 	render_frame(application_wsi.get_smooth_frame_time(), application_wsi.get_smooth_elapsed_time());
 	application_wsi.end_frame();
+	if (auto *group = Global::thread_group())
+		group->end_frame();
+	Util::FrameArena::end_frame();
 }
 
 }
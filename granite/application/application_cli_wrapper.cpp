@@ -82,7 +82,10 @@ void ApplicationCLIWrapper::render_frame(double, double elapsed_time)
 	auto *queue = Global::message_queue();
 	while (queue->available_read_messages())
 	{
+		// With concurrent writers, a message can be counted before it is fully pushed.
 		auto message = queue->read_message();
+		if (!message)
+			break;
 		messages.emplace_back(static_cast<const char *>(message.get_payload_data()));
 		queue->recycle_payload(std::move(message));
 	}
@@ -223,6 +223,12 @@ void init(ManagerFeatureFlags flags, unsigned max_threads)
 	{
 		if (!global_managers.logging)
 			global_managers.logging = new Util::MessageQueue;
+
+		// Formatting and I/O for LOGx happen on a background thread, except for errors,
+		// which are written out before LOGE returns so an abort() right after does not lose them.
+		// Set GRANITE_LOGGING_SYNC to write messages out as they are logged, e.g. when debugging crashes.
+		if (!getenv("GRANITE_LOGGING_SYNC"))
+			Util::start_async_logging();
 	}
 
 #ifdef HAVE_GRANITE_PHYSICS
@@ -273,6 +279,8 @@ void deinit()
 	delete global_managers.thread_group;
 	delete global_managers.filesystem;
 	delete global_managers.event_manager;
+	// Pending messages may still reference the message queue.
+	Util::stop_async_logging();
 	delete global_managers.logging;
 
 	global_managers.common_renderer_data = nullptr;
@@ -479,6 +479,90 @@ private:
 
 }
 
+static void add_thread_group_statistics(Document &doc, const ThreadGroupStatistics &stats,
+                                        const std::vector<Util::ScopeStatistics::Entry> &scope_stats)
+{
+	auto &allocator = doc.GetAllocator();
+	Value threads(kObjectType);
+
+	Value workers(kArrayType);
+	for (auto &w : stats.workers)
+	{
+		Value worker(kObjectType);
+		worker.AddMember("tasks", w.num_tasks, allocator);
+		worker.AddMember("steals", w.num_steals, allocator);
+		worker.AddMember("busyUs", 1e-3 * double(w.busy_ns), allocator);
+		worker.AddMember("idleUs", 1e-3 * double(w.idle_ns), allocator);
+		worker.AddMember("stealUs", 1e-3 * double(w.steal_ns), allocator);
+		workers.PushBack(worker, allocator);
+	}
+	threads.AddMember("workers", workers, allocator);
+
+	static const char *lane_names[] = { "frameCritical", "normal", "background" };
+	static_assert(sizeof(lane_names) / sizeof(*lane_names) == int(TaskPriority::Count), "Missing lane name.");
+	Value lanes(kObjectType);
+	for (int i = 0; i < int(TaskPriority::Count); i++)
+	{
+		auto &l = stats.lanes[i];
+		Value lane(kObjectType);
+		lane.AddMember("tasks", l.num_tasks, allocator);
+		lane.AddMember("averageQueueLatencyUs",
+		               l.num_tasks ? 1e-3 * double(l.total_queue_latency_ns) / double(l.num_tasks) : 0.0,
+		               allocator);
+		lane.AddMember("maxQueueLatencyUs", 1e-3 * double(l.max_queue_latency_ns), allocator);
+		Value histogram(kArrayType);
+		for (auto count : l.queue_latency_histogram)
+			histogram.PushBack(count, allocator);
+		lane.AddMember("queueLatencyHistogramLog2Us", histogram, allocator);
+		lanes.AddMember(StringRef(lane_names[i]), lane, allocator);
+	}
+	threads.AddMember("lanes", lanes, allocator);
+
+	Value frames(kObjectType);
+	frames.AddMember("frames", stats.frames.num_frames, allocator);
+	frames.AddMember("averageTasks",
+	                 stats.frames.num_frames ? double(stats.frames.total_tasks) / double(stats.frames.num_frames) : 0.0,
+	                 allocator);
+	frames.AddMember("minTasks", stats.frames.min_tasks, allocator);
+	frames.AddMember("maxTasks", stats.frames.max_tasks, allocator);
+	threads.AddMember("tasksPerFrame", frames, allocator);
+
+	Value pipelines(kArrayType);
+	for (auto &p : stats.pipelines)
+	{
+		Value pipeline(kObjectType);
+		pipeline.AddMember("desc", Value(p.desc.c_str(), allocator), allocator);
+		pipeline.AddMember("runs", p.num_runs, allocator);
+		pipeline.AddMember("averageCriticalPathUs",
+		                   p.num_runs ? 1e-3 * double(p.total_critical_path_ns) / double(p.num_runs) : 0.0,
+		                   allocator);
+		pipeline.AddMember("maxCriticalPathUs", 1e-3 * double(p.max_critical_path_ns), allocator);
+		pipelines.PushBack(pipeline, allocator);
+	}
+	threads.AddMember("pipelines", pipelines, allocator);
+
+	// Per frame times over the last frames, the entries without a thread sum up all threads.
+	Value scopes(kArrayType);
+	for (auto &e : scope_stats)
+	{
+		Value scope(kObjectType);
+		scope.AddMember("desc", Value(e.scope.c_str(), allocator), allocator);
+		if (!e.thread.empty())
+			scope.AddMember("thread", Value(e.thread.c_str(), allocator), allocator);
+		scope.AddMember("frames", e.num_frames, allocator);
+		scope.AddMember("averageCount", e.avg_count, allocator);
+		scope.AddMember("minUs", 1e-3 * double(e.min_ns), allocator);
+		scope.AddMember("averageUs", 1e-3 * double(e.avg_ns), allocator);
+		scope.AddMember("p95Us", 1e-3 * double(e.p95_ns), allocator);
+		scope.AddMember("p99Us", 1e-3 * double(e.p99_ns), allocator);
+		scope.AddMember("maxUs", 1e-3 * double(e.max_ns), allocator);
+		scopes.PushBack(scope, allocator);
+	}
+	threads.AddMember("scopes", scopes, allocator);
+
+	doc.AddMember("threads", threads, allocator);
+}
+
 static void print_help()
 {
 	LOGI("[--png-path <path>] [--stat <output.json>]\n"
@@ -675,6 +759,9 @@ int application_main_headless(Application *(*create_application)(int, char **),
 					              allocator);
 				}
 
+				add_thread_group_statistics(doc, Global::thread_group()->get_statistics(),
+				                            Global::thread_group()->get_scope_statistics().get_statistics());
+
 				StringBuffer buffer;
 				PrettyWriter<StringBuffer> writer(buffer);
 				//Writer<StringBuffer> writer(buffer);
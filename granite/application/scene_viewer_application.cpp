@@ -29,6 +29,7 @@
 #include "math/muglm/matrix_helper.hpp"
 #include "math/muglm/muglm_impl.hpp"
 #include "threading/task_composer.hpp"
+#include "threading/task_graph.hpp"
 #include "threading/thread_group.hpp"
 
 #include "rapidjson_wrapper.hpp"
@@ -951,6 +952,21 @@ void SceneViewerApplication::update_shadow_scene_aabb()
 	for (auto &caster : shadow_casters)
 		aabb.expand(get_component<RenderInfoComponent>(caster)->world_aabb);
 	shadow_scene_aabb = aabb;
+	shadow_scene_aabb_version = scene.get_entity_pool().advance_change_version();
+}
+
+// Only touches the casters whose world AABB changed since the last update, static casters are skipped.
+// The AABB can only grow until the next full update.
+void SceneViewerApplication::expand_shadow_scene_aabb()
+{
+	auto &scene = scene_loader.get_scene();
+	auto *shadow_casters =
+	    scene.get_entity_pool()
+	        .get_component_group_holder<RenderInfoComponent, RenderableComponent, CastsStaticShadowComponent>();
+	shadow_casters->for_each_changed<RenderInfoComponent>(shadow_scene_aabb_version, [this](Entity &, const auto &caster) {
+		shadow_scene_aabb.expand(get_component<RenderInfoComponent>(caster)->world_aabb);
+	});
+	shadow_scene_aabb_version = scene.get_entity_pool().advance_change_version();
 }
 
 void SceneViewerApplication::setup_shadow_map()
@@ -1034,12 +1050,27 @@ void SceneViewerApplication::update_scene(TaskComposer &composer, double frame_t
 
 	animation_system->animate(frame_time, elapsed_time);
 
+	// The cached transform update is the same every frame, so record it once and relaunch it.
+	if (!transform_update_graph)
+	{
+		transform_update_graph = std::make_unique<TaskGraph>(composer.get_thread_group());
+		auto node = transform_update_graph->add_node("parallel-update-cached-transforms", TaskPriority::FrameCritical);
+		Threaded::scene_record_update_cached_transforms(scene, *transform_update_graph, node, 64);
+	}
+
+	// The listeners and the cached transforms both only depend on the transform tree, so they run concurrently.
+	TaskGroupHandle listeners_done;
 	{
 		TaskComposer update_composer(composer.get_thread_group());
+		update_composer.set_priority(TaskPriority::FrameCritical);
+		update_composer.set_desc("scene-viewer-transform-tree");
 		scene.update_transform_tree(update_composer);
-		Threaded::scene_update_cached_transforms(scene, update_composer, 64);
-		update_composer.get_outgoing_task()->wait();
+		transform_update_graph->launch(update_composer.begin_pipeline_stage());
+		scene.update_transform_listener_components(update_composer);
+		listeners_done = update_composer.get_outgoing_task();
 	}
+	transform_update_graph->wait();
+	listeners_done->wait();
 
 	jitter.step(selected_camera->get_projection(), selected_camera->get_view());
 
@@ -1135,6 +1166,8 @@ void SceneViewerApplication::render_scene(TaskComposer &composer)
 	{
 		if (need_shadow_map_update)
 			update_shadow_scene_aabb();
+		else
+			expand_shadow_scene_aabb();
 		setup_shadow_map();
 	}
 
@@ -1147,6 +1180,8 @@ void SceneViewerApplication::render_frame(double frame_time, double elapsed_time
 {
 	auto *file = Global::thread_group()->get_timeline_trace_file();
 	TaskComposer composer(*Global::thread_group());
+	composer.set_priority(TaskPriority::FrameCritical);
+	composer.set_desc("scene-viewer-frame");
 
 	Util::TimelineTraceFile::Event *e = nullptr;
 
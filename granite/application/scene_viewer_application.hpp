@@ -44,6 +44,7 @@
 namespace Granite
 {
 class TaskComposer;
+class TaskGraph;
 
 class SceneViewerApplication : public Application, public EventHandler
 {
@@ -68,6 +69,7 @@ protected:
 	FPSCamera cam;
 	SceneLoader scene_loader;
 	std::unique_ptr<AnimationSystem> animation_system;
+	std::unique_ptr<TaskGraph> transform_update_graph;
 
 	Camera *selected_camera = nullptr;
 	DirectionalLightComponent *selected_directional = nullptr;
@@ -88,6 +90,8 @@ protected:
 	std::string skydome_irradiance;
 	float skydome_intensity = 1.0f;
 	AABB shadow_scene_aabb;
+	// Change version of the entity pool when shadow_scene_aabb was last updated.
+	uint64_t shadow_scene_aabb_version = 0;
 
 	std::unique_ptr<LightClusterer> cluster;
 	std::unique_ptr<VolumetricFog> volumetric_fog;
@@ -96,6 +100,7 @@ protected:
 
 	void setup_shadow_map();
 	void update_shadow_scene_aabb();
+	void expand_shadow_scene_aabb();
 	void render_ui(Vulkan::CommandBuffer &cmd);
 
 	void add_main_pass(Vulkan::Device &device, const std::string &tag);
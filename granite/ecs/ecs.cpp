@@ -21,27 +21,267 @@
  */
 
 #include "ecs/ecs.hpp"
+#include "util/aligned_alloc.hpp"
+#include "threading/task_composer.hpp"
 
 namespace Granite
 {
+Archetype::Archetype(std::vector<const ArchetypeComponentInfo *> infos_)
+	: infos(std::move(infos_))
+{
+	size_t row_size = sizeof(Entity *);
+	size_t alignment_slack = 0;
+	for (auto *info : infos)
+	{
+		row_size += info->size + sizeof(uint64_t);
+		alignment_slack += info->alignment;
+	}
 
-Entity *EntityPool::create_entity()
+	// Very large components degenerate to one row per chunk.
+	if (alignment_slack < TargetChunkSize)
+		rows_per_chunk = (TargetChunkSize - alignment_slack) / row_size;
+	rows_per_chunk = std::max<size_t>(rows_per_chunk, 1);
+
+	// The entity column comes first, then the change versions, then one array per component type.
+	size_t offset = rows_per_chunk * sizeof(Entity *);
+	version_offsets.reserve(infos.size());
+	for (size_t i = 0; i < infos.size(); i++)
+	{
+		version_offsets.push_back(offset);
+		offset += rows_per_chunk * sizeof(uint64_t);
+	}
+
+	column_offsets.reserve(infos.size());
+	for (auto *info : infos)
+	{
+		offset = (offset + info->alignment - 1) & ~(info->alignment - 1);
+		column_offsets.push_back(offset);
+		offset += rows_per_chunk * info->size;
+	}
+
+	// aligned_alloc() wants the size to be a multiple of the alignment.
+	chunk_alignment = 64;
+	for (auto *info : infos)
+		chunk_alignment = std::max(chunk_alignment, info->alignment);
+	chunk_size = (offset + chunk_alignment - 1) & ~(chunk_alignment - 1);
+}
+
+Archetype::~Archetype()
+{
+	for (size_t row = 0; row < count; row++)
+		for (unsigned column = 0; column < infos.size(); column++)
+			infos[column]->destroy(get_component(row, column));
+	for (auto *chunk : chunks)
+		Util::memalign_free(chunk);
+}
+
+int Archetype::find_column(ComponentType id) const
+{
+	auto itr = std::lower_bound(infos.begin(), infos.end(), id, [](const ArchetypeComponentInfo *info, ComponentType type) {
+		return info->id < type;
+	});
+
+	if (itr != infos.end() && (*itr)->id == id)
+		return int(itr - infos.begin());
+	else
+		return -1;
+}
+
+size_t Archetype::allocate_row(Entity *entity)
+{
+	if (count == chunks.size() * rows_per_chunk)
+	{
+		auto *chunk = static_cast<uint8_t *>(Util::memalign_alloc(chunk_alignment, chunk_size));
+		if (!chunk)
+			throw std::bad_alloc();
+		chunks.push_back(chunk);
+	}
+
+	size_t row = count++;
+	reinterpret_cast<Entity **>(chunks[row / rows_per_chunk])[row % rows_per_chunk] = entity;
+	return row;
+}
+
+Entity *Archetype::remove_row(size_t row)
+{
+	assert(row < count);
+	size_t last = --count;
+	Entity *moved = nullptr;
+
+	if (row != last)
+	{
+		for (unsigned column = 0; column < infos.size(); column++)
+		{
+			infos[column]->relocate(get_component(row, column), get_component(last, column));
+			*get_version(row, column) = *get_version(last, column);
+		}
+		moved = get_entity(last);
+		reinterpret_cast<Entity **>(chunks[row / rows_per_chunk])[row % rows_per_chunk] = moved;
+	}
+
+	// Keep one spare chunk around so an entity going back and forth across a chunk boundary does not thrash.
+	while (chunks.size() > get_chunk_count() + 1)
+	{
+		Util::memalign_free(chunks.back());
+		chunks.pop_back();
+	}
+
+	return moved;
+}
+
+Archetype *Archetype::find_edge(ComponentType id, bool add) const
+{
+	for (auto &edge : edges)
+		if (edge.id == id && edge.add == add)
+			return edge.archetype;
+	return nullptr;
+}
+
+void Archetype::add_edge(ComponentType id, bool add, Archetype *archetype)
+{
+	edges.push_back({ id, add, archetype });
+}
+
+ArchetypeQuery::ArchetypeQuery(std::vector<ComponentType> types_)
+	: types(std::move(types_))
+{
+}
+
+bool ArchetypeQuery::try_add_archetype(Archetype *archetype)
+{
+	size_t offset = columns.size();
+	for (auto type : types)
+	{
+		int column = archetype->find_column(type);
+		if (column < 0)
+		{
+			columns.resize(offset);
+			return false;
+		}
+		columns.push_back(unsigned(column));
+	}
+
+	archetypes.push_back(archetype);
+	return true;
+}
+
+Archetype *EntityPool::get_archetype(std::vector<const ArchetypeComponentInfo *> infos)
 {
+	if (infos.empty())
+		return nullptr;
+
 	Util::Hasher hasher;
-	hasher.u64(++cookie);
-	auto *entity = entity_pool.allocate(this, hasher.get());
-	entity->pool_offset = entities.size();
-	entities.push_back(entity);
-	return entity;
+	for (auto *info : infos)
+		hasher.u64(info->id);
+	auto hash = hasher.get();
+
+	auto *archetype = archetypes.find(hash);
+	if (!archetype)
+	{
+		archetype = archetypes.emplace_yield(hash, std::move(infos));
+		for (auto &query : archetype_queries)
+			query.try_add_archetype(archetype);
+	}
+
+	return archetype;
 }
 
-void EntityPool::free_component(Entity &entity, ComponentType id, ComponentNode *component)
+Archetype *EntityPool::get_archetype_with(Archetype *archetype, const ArchetypeComponentInfo *info)
 {
-	auto *c = component_types.find(id);
-	assert(c);
-	c->free_component(component->get());
-	component_nodes.free(component);
+	if (archetype)
+		if (auto *edge = archetype->find_edge(info->id, true))
+			return edge;
 
+	std::vector<const ArchetypeComponentInfo *> infos;
+	if (archetype)
+		infos = archetype->get_component_infos();
+
+	auto itr = std::lower_bound(infos.begin(), infos.end(), info->id, [](const ArchetypeComponentInfo *a, ComponentType id) {
+		return a->id < id;
+	});
+	infos.insert(itr, info);
+
+	auto *result = get_archetype(std::move(infos));
+	if (archetype)
+		archetype->add_edge(info->id, true, result);
+	return result;
+}
+
+Archetype *EntityPool::get_archetype_without(Archetype *archetype, ComponentType id)
+{
+	if (auto *edge = archetype->find_edge(id, false))
+		return edge;
+
+	std::vector<const ArchetypeComponentInfo *> infos;
+	for (auto *info : archetype->get_component_infos())
+		if (info->id != id)
+			infos.push_back(info);
+
+	// Removing the last archetype component yields no archetype at all, which is not worth caching.
+	auto *result = get_archetype(std::move(infos));
+	if (result)
+		archetype->add_edge(id, false, result);
+	return result;
+}
+
+ArchetypeQuery *EntityPool::register_archetype_query(ComponentType query_id, std::vector<ComponentType> types)
+{
+	auto *query = archetype_queries.emplace_yield(query_id, std::move(types));
+	for (auto &archetype : archetypes)
+		query->try_add_archetype(&archetype);
+	return query;
+}
+
+void EntityPool::move_entity_to_archetype(Entity &entity, Archetype *archetype)
+{
+	auto *source = entity.archetype;
+	size_t source_row = entity.archetype_row;
+	size_t row = archetype ? archetype->allocate_row(&entity) : 0;
+
+	if (source)
+	{
+		auto &infos = source->get_component_infos();
+		for (unsigned i = 0; i < infos.size(); i++)
+		{
+			void *src = source->get_component(source_row, i);
+			int column = archetype ? archetype->find_column(infos[i]->id) : -1;
+			if (column >= 0)
+			{
+				infos[i]->relocate(archetype->get_component(row, unsigned(column)), src);
+				*archetype->get_version(row, unsigned(column)) = *source->get_version(source_row, i);
+			}
+			else
+				infos[i]->destroy(src);
+		}
+
+		if (auto *moved = source->remove_row(source_row))
+		{
+			moved->archetype_row = source_row;
+			update_entity_groups(*moved);
+		}
+	}
+
+	entity.archetype = archetype;
+	entity.archetype_row = row;
+}
+
+void EntityPool::update_entity_groups(Entity &entity)
+{
+	if (!entity.archetype)
+		return;
+
+	// Any group which has a pointer to one of the archetype components must be refreshed.
+	for (auto *info : entity.archetype->get_component_infos())
+	{
+		auto *component_groups = component_to_groups.find(info->id);
+		if (component_groups)
+			for (auto &group : *component_groups)
+				groups.find(group.get_hash())->update_entity(entity);
+	}
+}
+
+void EntityPool::remove_entity_from_groups(Entity &entity, ComponentType id)
+{
 	auto *component_groups = component_to_groups.find(id);
 	if (component_groups)
 	{
@@ -54,8 +294,107 @@ void EntityPool::free_component(Entity &entity, ComponentType id, ComponentNode
 	}
 }
 
+void EntityPool::on_archetype_component_added(Entity &entity, ComponentType id)
+{
+	// Deferred entities are refreshed once in end_deferred_group_updates().
+	if (!defer_group_updates)
+		update_entity_groups(entity);
+	add_entity_to_component_groups(entity, id);
+}
+
+void EntityPool::add_entity_to_component_groups(Entity &entity, ComponentType id)
+{
+	if (defer_group_updates)
+	{
+		deferred_group_updates.push_back({ &entity, id });
+		return;
+	}
+
+	auto *component_groups = component_to_groups.find(id);
+	if (component_groups)
+		for (auto &group : *component_groups)
+			groups.find(group.get_hash())->add_entity(entity);
+}
+
+void EntityPool::begin_deferred_group_updates()
+{
+	assert(!defer_group_updates);
+	defer_group_updates = true;
+}
+
+void EntityPool::end_deferred_group_updates()
+{
+	assert(defer_group_updates);
+	defer_group_updates = false;
+
+	std::stable_sort(deferred_group_updates.begin(), deferred_group_updates.end(),
+	                 [](const DeferredGroupUpdate &a, const DeferredGroupUpdate &b) {
+		                 return a.entity < b.entity;
+	                 });
+
+	Util::SmallVector<Util::Hash, 16> entity_groups;
+	for (size_t i = 0; i < deferred_group_updates.size(); )
+	{
+		auto &entity = *deferred_group_updates[i].entity;
+
+		// The entity might have moved between archetypes, so refresh the groups it was already in.
+		update_entity_groups(entity);
+
+		// Groups which have any of the new components cannot have had the entity before.
+		// A group can have several of them though, so only add once.
+		entity_groups.clear();
+		for (; i < deferred_group_updates.size() && deferred_group_updates[i].entity == &entity; i++)
+		{
+			auto *component_groups = component_to_groups.find(deferred_group_updates[i].id);
+			if (component_groups)
+				for (auto &group : *component_groups)
+					entity_groups.push_back(group.get_hash());
+		}
+
+		std::sort(entity_groups.begin(), entity_groups.end());
+		auto *end = std::unique(entity_groups.begin(), entity_groups.end());
+		for (auto *itr = entity_groups.begin(); itr != end; ++itr)
+			groups.find(*itr)->add_entity(entity);
+	}
+
+	deferred_group_updates.clear();
+}
+
+void EntityPool::free_archetype_component(Entity &entity, ComponentType id)
+{
+	if (!entity.archetype || entity.archetype->find_column(id) < 0)
+		return;
+
+	remove_entity_from_groups(entity, id);
+	move_entity_to_archetype(entity, get_archetype_without(entity.archetype, id));
+	update_entity_groups(entity);
+}
+
+Entity *EntityPool::create_entity()
+{
+	Util::Hasher hasher;
+	hasher.u64(++cookie);
+	auto handle = entity_pool.emplace(this, hasher.get());
+	auto *entity = entity_pool.maybe_get(handle);
+	entity->handle = handle;
+	entity->pool_offset = entities.size();
+	entities.push_back(entity);
+	return entity;
+}
+
+void EntityPool::free_component(Entity &entity, ComponentType id, ComponentNode *component)
+{
+	auto *c = component_types.find(id);
+	assert(c);
+	c->free_component(component->get());
+	component_nodes.free(component);
+
+	remove_entity_from_groups(entity, id);
+}
+
 void EntityPool::delete_entity(Entity *entity)
 {
+	assert(!defer_group_updates);
 	{
 		auto &components = entity->get_components();
 		auto &list = components.inner_list();
@@ -68,13 +407,20 @@ void EntityPool::delete_entity(Entity *entity)
 		}
 	}
 
+	if (auto *archetype = entity->archetype)
+	{
+		for (auto *info : archetype->get_component_infos())
+			remove_entity_from_groups(*entity, info->id);
+		move_entity_to_archetype(*entity, nullptr);
+	}
+
 	auto offset = entity->pool_offset;
 	assert(offset < entities.size());
 
 	entities[offset] = entities.back();
 	entities[offset]->pool_offset = offset;
 	entities.pop_back();
-	entity_pool.free(entity);
+	entity_pool.remove(entity->handle);
 }
 
 EntityPool::~EntityPool()
@@ -137,4 +483,71 @@ void ComponentSet::insert(ComponentType type)
 	set.emplace_yield(type);
 }
 
+void ComponentAccess::add_read(ComponentType id)
+{
+	if (std::find(reads.begin(), reads.end(), id) == reads.end() &&
+	    std::find(writes.begin(), writes.end(), id) == writes.end())
+	{
+		reads.push_back(id);
+	}
+}
+
+void ComponentAccess::add_write(ComponentType id)
+{
+	if (std::find(writes.begin(), writes.end(), id) != writes.end())
+		return;
+
+	// Writing implies reading.
+	auto itr = std::find(reads.begin(), reads.end(), id);
+	if (itr != reads.end())
+		reads.erase(itr);
+	writes.push_back(id);
+}
+
+void ComponentAccess::merge(const ComponentAccess &other)
+{
+	for (auto id : other.writes)
+		add_write(id);
+	for (auto id : other.reads)
+		add_read(id);
+}
+
+bool ComponentAccess::conflicts_with(const ComponentAccess &other) const
+{
+	for (auto id : writes)
+	{
+		if (std::find(other.writes.begin(), other.writes.end(), id) != other.writes.end() ||
+		    std::find(other.reads.begin(), other.reads.end(), id) != other.reads.end())
+		{
+			return true;
+		}
+	}
+
+	for (auto id : other.writes)
+		if (std::find(reads.begin(), reads.end(), id) != reads.end())
+			return true;
+
+	return false;
+}
+
+EntitySystemComposer::EntitySystemComposer(EntityPool &pool_, TaskComposer &composer_)
+	: pool(pool_), composer(composer_)
+{
+}
+
+TaskGroup &EntitySystemComposer::begin_system(const ComponentAccess &access)
+{
+	// If somebody else began a stage in the meantime, we know nothing about the work in it.
+	if (!has_stage || composer.get_pipeline_stage_index() != stage_index || stage_access.conflicts_with(access))
+	{
+		composer.begin_pipeline_stage();
+		stage_index = composer.get_pipeline_stage_index();
+		stage_access = {};
+		has_stage = true;
+	}
+
+	stage_access.merge(access);
+	return composer.get_group();
+}
+
 }
@@ -23,13 +23,21 @@
 #pragma once
 
 #include "util/object_pool.hpp"
+#include "util/generational_handle.hpp"
 #include "util/intrusive.hpp"
 #include "util/intrusive_hash_map.hpp"
 #include "util/compile_time_hash.hpp"
 #include "util/enum_cast.hpp"
+#include "util/small_vector.hpp"
+#include "threading/thread_group.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cassert>
 #include <tuple>
 #include <vector>
+#include <utility>
+#include <type_traits>
 
 namespace Granite
 {
@@ -55,6 +63,10 @@ using ComponentGroupVector = std::vector<std::tuple<Ts *...>>;
 
 class Entity;
 
+// Generational handle to an Entity, see EntityPool::get_entity().
+// Handles of deleted entities are never resolved to a different entity, and 0 is never a valid handle.
+using EntityHandle = uint64_t;
+
 #define GRANITE_COMPONENT_TYPE_HASH(x) ::Util::compile_time_fnv1(#x)
 using ComponentType = uint64_t;
 
@@ -66,6 +78,10 @@ static inline constexpr ::Granite::ComponentType get_component_id_hash() { \
 	return ::Granite::ComponentType(ComponentTypeWrapper::type_id); \
 }
 
+// Opts a component type into archetype storage, see Archetype.
+#define GRANITE_COMPONENT_ARCHETYPE_STORAGE \
+static constexpr bool archetype_storage = true;
+
 struct ComponentSetKey : Util::IntrusiveHashMapEnabled<ComponentSetKey>
 {
 };
@@ -89,7 +105,22 @@ private:
 	Util::IntrusiveHashMap<ComponentSetKey> set;
 };
 
-using ComponentNode = Util::IntrusivePODWrapper<ComponentBase *>;
+struct ComponentNode : Util::IntrusiveHashMapEnabled<ComponentNode>
+{
+	explicit ComponentNode(ComponentBase *component_)
+		: component(component_)
+	{
+	}
+
+	ComponentBase *get() const
+	{
+		return component;
+	}
+
+	ComponentBase *component;
+	// See EntityPool::get_change_version().
+	uint64_t version = 0;
+};
 using ComponentHashMap = Util::IntrusiveHashMapHolder<ComponentNode>;
 using ComponentGroupHashMap = Util::IntrusiveHashMap<ComponentSet>;
 
@@ -110,12 +141,295 @@ struct ComponentIDMapping
 	}
 };
 
+// The component types a system reads and writes. Systems whose accesses do not conflict can run concurrently.
+struct ComponentAccess
+{
+	Util::SmallVector<ComponentType> reads;
+	Util::SmallVector<ComponentType> writes;
+
+	// Component types which are const are only read.
+	template <typename... Ts>
+	static ComponentAccess from_types()
+	{
+		ComponentAccess access;
+		(access.add<Ts>(), ...);
+		return access;
+	}
+
+	template <typename T>
+	void add()
+	{
+		auto id = ComponentIDMapping::get_id<std::remove_const_t<T>>();
+		if (std::is_const<T>::value)
+			add_read(id);
+		else
+			add_write(id);
+	}
+
+	void add_read(ComponentType id);
+	void add_write(ComponentType id);
+	void merge(const ComponentAccess &other);
+	bool conflicts_with(const ComponentAccess &other) const;
+};
+
+template <typename T, typename = void>
+struct IsArchetypeComponent : std::false_type
+{
+};
+
+template <typename T>
+struct IsArchetypeComponent<T, decltype(void(T::archetype_storage))>
+	: std::integral_constant<bool, T::archetype_storage>
+{
+};
+
+// Type-erased operations on an archetype component type.
+struct ArchetypeComponentInfo
+{
+	ComponentType id;
+	size_t size;
+	size_t alignment;
+	// Move-constructs dst from src, then destroys src.
+	void (*relocate)(void *dst, void *src);
+	void (*destroy)(void *ptr);
+};
+
+template <typename T>
+inline const ArchetypeComponentInfo *get_archetype_component_info()
+{
+	static const ArchetypeComponentInfo info = {
+		ComponentIDMapping::get_id<T>(), sizeof(T), alignof(T),
+		[](void *dst, void *src) {
+			auto *t = static_cast<T *>(src);
+			new (dst) T(std::move(*t));
+			t->~T();
+		},
+		[](void *ptr) {
+			static_cast<T *>(ptr)->~T();
+		},
+	};
+	return &info;
+}
+
+// Entities which have the same set of archetype components share an archetype.
+// Their components are stored in fixed size chunks, with one contiguous array per component type,
+// so iterating over them streams linearly through memory.
+// Rows are kept dense, removing a row moves the last row into the hole.
+// Pointers to archetype components are therefore only stable until the next structural change in the EntityPool.
+class Archetype : public Util::IntrusiveHashMapEnabled<Archetype>
+{
+public:
+	enum { TargetChunkSize = 16 * 1024 };
+
+	// Infos must be sorted by component ID.
+	explicit Archetype(std::vector<const ArchetypeComponentInfo *> infos);
+	~Archetype();
+
+	Archetype(const Archetype &) = delete;
+	void operator=(const Archetype &) = delete;
+
+	const std::vector<const ArchetypeComponentInfo *> &get_component_infos() const
+	{
+		return infos;
+	}
+
+	// Returns -1 if the archetype does not have the component type.
+	int find_column(ComponentType id) const;
+
+	size_t get_count() const
+	{
+		return count;
+	}
+
+	size_t get_chunk_count() const
+	{
+		return (count + rows_per_chunk - 1) / rows_per_chunk;
+	}
+
+	size_t get_rows_per_chunk() const
+	{
+		return rows_per_chunk;
+	}
+
+	size_t get_chunk_row_count(size_t chunk) const
+	{
+		return std::min<size_t>(rows_per_chunk, count - chunk * rows_per_chunk);
+	}
+
+	Entity *const *get_chunk_entities(size_t chunk) const
+	{
+		return reinterpret_cast<Entity *const *>(chunks[chunk]);
+	}
+
+	void *get_chunk_column(size_t chunk, unsigned column) const
+	{
+		return chunks[chunk] + column_offsets[column];
+	}
+
+	void *get_component(size_t row, unsigned column) const
+	{
+		return chunks[row / rows_per_chunk] + column_offsets[column] +
+		       (row % rows_per_chunk) * infos[column]->size;
+	}
+
+	Entity *get_entity(size_t row) const
+	{
+		return get_chunk_entities(row / rows_per_chunk)[row % rows_per_chunk];
+	}
+
+	// Every component has a change version, see EntityPool::get_change_version().
+	uint64_t *get_version(size_t row, unsigned column) const
+	{
+		return reinterpret_cast<uint64_t *>(chunks[row / rows_per_chunk] + version_offsets[column]) +
+		       row % rows_per_chunk;
+	}
+
+	// Component storage of the new row is left uninitialized.
+	size_t allocate_row(Entity *entity);
+	// Components in row must already be destroyed or relocated.
+	// The last row is relocated into the hole, and its entity is returned, or nullptr if row was the last row.
+	Entity *remove_row(size_t row);
+
+	Archetype *find_edge(ComponentType id, bool add) const;
+	void add_edge(ComponentType id, bool add, Archetype *archetype);
+
+private:
+	std::vector<const ArchetypeComponentInfo *> infos;
+	std::vector<size_t> column_offsets;
+	std::vector<size_t> version_offsets;
+	std::vector<uint8_t *> chunks;
+	size_t chunk_size = 0;
+	size_t chunk_alignment = 0;
+	size_t rows_per_chunk = 0;
+	size_t count = 0;
+
+	struct Edge
+	{
+		ComponentType id;
+		bool add;
+		Archetype *archetype;
+	};
+	std::vector<Edge> edges;
+};
+
+// The archetypes which contain a set of component types, and the column of each type in them.
+class ArchetypeQuery : public Util::IntrusiveHashMapEnabled<ArchetypeQuery>
+{
+public:
+	explicit ArchetypeQuery(std::vector<ComponentType> types);
+	bool try_add_archetype(Archetype *archetype);
+
+	size_t get_archetype_count() const
+	{
+		return archetypes.size();
+	}
+
+	Archetype *get_archetype(size_t index) const
+	{
+		return archetypes[index];
+	}
+
+	const unsigned *get_columns(size_t index) const
+	{
+		return columns.data() + index * types.size();
+	}
+
+	// Number of entities in all archetypes of the query.
+	size_t get_row_count() const
+	{
+		size_t row_count = 0;
+		for (auto *archetype : archetypes)
+			row_count += archetype->get_count();
+		return row_count;
+	}
+
+	// Calls func(count, entities, Ts *...) for the rows [begin, end) of the query, where rows are numbered
+	// through the archetypes in order. Every call covers a run of rows within one chunk, so ranges can be split
+	// among threads while each thread still streams through the component arrays.
+	// Ts must be the component types the query was created with, in the same order, optionally const.
+	// Writes are not tracked, see mark_range_changed().
+	template <typename... Ts, typename Func>
+	void for_each_chunk_range(size_t begin, size_t end, Func &&func) const
+	{
+		assert(get_hash() == ComponentIDMapping::get_group_id<std::remove_const_t<Ts>...>());
+		for_each_run(begin, end, [&func](const Archetype &archetype, const unsigned *chunk_columns,
+		                                 size_t chunk, size_t chunk_row, size_t rows) {
+			call_chunk_rows<Ts...>(func, archetype, chunk, chunk_row, rows, chunk_columns,
+			                       std::index_sequence_for<Ts...>());
+		});
+	}
+
+	// Stamps the components of every non-const type in Ts with version, for the rows [begin, end) of the query.
+	template <typename... Ts>
+	void mark_range_changed(size_t begin, size_t end, uint64_t version) const
+	{
+		assert(get_hash() == ComponentIDMapping::get_group_id<std::remove_const_t<Ts>...>());
+		for_each_run(begin, end, [version](const Archetype &archetype, const unsigned *chunk_columns,
+		                                   size_t chunk, size_t chunk_row, size_t rows) {
+			mark_chunk_rows<Ts...>(archetype, chunk * archetype.get_rows_per_chunk() + chunk_row, rows,
+			                       chunk_columns, version, std::index_sequence_for<Ts...>());
+		});
+	}
+
+private:
+	std::vector<ComponentType> types;
+	std::vector<Archetype *> archetypes;
+	std::vector<unsigned> columns;
+
+	// Calls func(archetype, columns, chunk, chunk_row, rows) for every run of rows in [begin, end) within one chunk.
+	template <typename Func>
+	void for_each_run(size_t begin, size_t end, const Func &func) const
+	{
+		for (size_t i = 0; i < archetypes.size() && begin < end; i++)
+		{
+			auto &archetype = *archetypes[i];
+			size_t count = archetype.get_count();
+			if (begin < count)
+			{
+				size_t rows_per_chunk = archetype.get_rows_per_chunk();
+				size_t row_end = std::min(end, count);
+				for (size_t row = begin; row < row_end; )
+				{
+					size_t chunk = row / rows_per_chunk;
+					size_t chunk_row = row % rows_per_chunk;
+					size_t rows = std::min(row_end - row, rows_per_chunk - chunk_row);
+					func(archetype, get_columns(i), chunk, chunk_row, rows);
+					row += rows;
+				}
+				begin = count;
+			}
+
+			begin -= count;
+			end -= std::min(end, count);
+		}
+	}
+
+	template <typename... Ts, typename Func, size_t... Indices>
+	static void call_chunk_rows(Func &func, const Archetype &archetype, size_t chunk, size_t chunk_row, size_t rows,
+	                            const unsigned *chunk_columns, std::index_sequence<Indices...>)
+	{
+		func(rows, archetype.get_chunk_entities(chunk) + chunk_row,
+		     static_cast<Ts *>(archetype.get_chunk_column(chunk, chunk_columns[Indices])) + chunk_row...);
+	}
+
+	template <typename... Ts, size_t... Indices>
+	static void mark_chunk_rows(const Archetype &archetype, size_t row, size_t rows, const unsigned *chunk_columns,
+	                            uint64_t version, std::index_sequence<Indices...>)
+	{
+		// Versions of a column are contiguous within a chunk.
+		((std::is_const<Ts>::value ?
+		  void() : void(std::fill_n(archetype.get_version(row, chunk_columns[Indices]), rows, version))), ...);
+	}
+};
+
 class EntityGroupBase : public Util::IntrusiveHashMapEnabled<EntityGroupBase>
 {
 public:
 	virtual ~EntityGroupBase() = default;
 	virtual void add_entity(Entity &entity) = 0;
 	virtual void remove_entity(const Entity &entity) = 0;
+	// Refreshes component pointers after archetype components of the entity moved.
+	virtual void update_entity(Entity &entity) = 0;
 	virtual void reset() = 0;
 };
 
@@ -139,7 +453,7 @@ public:
 	bool has_component(ComponentType id) const
 	{
 		auto itr = components.find(id);
-		return itr != nullptr;
+		return itr != nullptr || (archetype && archetype->find_column(id) >= 0);
 	}
 
 	template <typename T>
@@ -151,21 +465,28 @@ public:
 	template <typename T>
 	T *get_component()
 	{
-		auto *t = components.find(ComponentIDMapping::get_id<T>());
-		if (t)
-			return static_cast<T *>(t->get());
-		else
-			return nullptr;
+		return const_cast<T *>(static_cast<const Entity *>(this)->get_component<T>());
 	}
 
 	template <typename T>
 	const T *get_component() const
 	{
-		auto *t = components.find(ComponentIDMapping::get_id<T>());
-		if (t)
-			return static_cast<const T *>(t->get());
+		if constexpr (IsArchetypeComponent<T>::value)
+		{
+			int column = archetype ? archetype->find_column(ComponentIDMapping::get_id<T>()) : -1;
+			if (column >= 0)
+				return static_cast<const T *>(archetype->get_component(archetype_row, unsigned(column)));
+			else
+				return nullptr;
+		}
 		else
-			return nullptr;
+		{
+			auto *t = components.find(ComponentIDMapping::get_id<T>());
+			if (t)
+				return static_cast<const T *>(t->get());
+			else
+				return nullptr;
+		}
 	}
 
 	template <typename T, typename... Ts>
@@ -174,11 +495,42 @@ public:
 	template <typename T>
 	void free_component();
 
+	// The change version of a component, or nullptr if the entity does not have it.
+	// Stays valid until the next structural change of the entity.
+	uint64_t *get_component_version(ComponentType id)
+	{
+		auto *t = components.find(id);
+		if (t)
+			return &t->version;
+
+		int column = archetype ? archetype->find_column(id) : -1;
+		if (column >= 0)
+			return archetype->get_version(archetype_row, unsigned(column));
+		else
+			return nullptr;
+	}
+
+	// Stamps the component with the pool's current change version.
+	// Can be called concurrently for different entities, or different components of the same entity.
+	void mark_component_changed(ComponentType id);
+
+	template <typename T>
+	void mark_component_changed()
+	{
+		mark_component_changed(ComponentIDMapping::get_id<T>());
+	}
+
+	// Only contains components which are not stored in an archetype.
 	ComponentHashMap &get_components()
 	{
 		return components;
 	}
 
+	Archetype *get_archetype() const
+	{
+		return archetype;
+	}
+
 	EntityPool *get_pool()
 	{
 		return pool;
@@ -189,6 +541,17 @@ public:
 		return hash;
 	}
 
+	EntityHandle get_handle() const
+	{
+		return handle;
+	}
+
+	// Dense index which is unique among live entities of the pool, and reused after deletion.
+	uint32_t get_index() const
+	{
+		return Util::GenerationalHandlePool<Entity, EntityHandle>::get_index(handle);
+	}
+
 	bool mark_for_destruction()
 	{
 		bool ret = !marked;
@@ -199,8 +562,11 @@ public:
 private:
 	EntityPool *pool;
 	Util::Hash hash;
+	EntityHandle handle = 0;
 	size_t pool_offset = 0;
 	ComponentHashMap components;
+	Archetype *archetype = nullptr;
+	size_t archetype_row = 0;
 	bool marked = false;
 };
 
@@ -212,24 +578,40 @@ public:
 	{
 		if (has_all_components<Ts...>(entity))
 		{
-			entity_to_index[entity.get_hash()].get() = entities.size();
+			uint32_t entity_index = entity.get_index();
+			if (entity_index >= entity_to_index.size())
+				entity_to_index.resize(std::max<size_t>(entity_index + 1, entity_to_index.size() * 2), InvalidIndex);
+			entity_to_index[entity_index] = uint32_t(entities.size());
 			groups.push_back(std::make_tuple(entity.get_component<Ts>()...));
+			versions.push_back({ entity.get_component_version(ComponentIDMapping::get_id<Ts>())... });
 			entities.push_back(&entity);
 		}
 	}
 
 	void remove_entity(const Entity &entity) override final
 	{
-		size_t offset;
-		if (entity_to_index.find_and_consume_pod(entity.get_hash(), offset))
+		uint32_t offset = find_offset(entity);
+		if (offset != InvalidIndex)
 		{
 			entities[offset] = entities.back();
 			groups[offset] = groups.back();
-			entity_to_index[entities[offset]->get_hash()].get() = offset;
+			versions[offset] = versions.back();
+			entity_to_index[entities[offset]->get_index()] = offset;
 
-			entity_to_index.erase(entity.get_hash());
+			entity_to_index[entity.get_index()] = InvalidIndex;
 			entities.pop_back();
 			groups.pop_back();
+			versions.pop_back();
+		}
+	}
+
+	void update_entity(Entity &entity) override final
+	{
+		uint32_t offset = find_offset(entity);
+		if (offset != InvalidIndex)
+		{
+			groups[offset] = std::make_tuple(entity.get_component<Ts>()...);
+			versions[offset] = { entity.get_component_version(ComponentIDMapping::get_id<Ts>())... };
 		}
 	}
 
@@ -243,17 +625,74 @@ public:
 		return entities;
 	}
 
+	// Calls func(entity, group_tuple) for every entity where any of Us has changed after version since,
+	// see EntityPool::get_change_version(). All of Us must be part of the group.
+	template <typename... Us, typename Func>
+	void for_each_changed(uint64_t since, Func &&func) const
+	{
+		for (size_t i = 0; i < groups.size(); i++)
+			if (has_changed<Us...>(versions[i], since))
+				func(*entities[i], groups[i]);
+	}
+
+	template <typename... Us>
+	bool any_changed(uint64_t since) const
+	{
+		for (auto &v : versions)
+			if (has_changed<Us...>(v, since))
+				return true;
+		return false;
+	}
+
+	// Stamps the components of every non-const type in Us with version, for the entity at index of get_entities().
+	template <typename... Us>
+	void mark_changed(size_t index, uint64_t version)
+	{
+		auto &v = versions[index];
+		((std::is_const<Us>::value ? void() : void(*v[component_index<std::remove_const_t<Us>>()] = version)), ...);
+	}
+
 	void reset() override final
 	{
 		groups.clear();
+		versions.clear();
 		entities.clear();
 		entity_to_index.clear();
 	}
 
 private:
+	using VersionPointers = std::array<uint64_t *, sizeof...(Ts)>;
 	ComponentGroupVector<Ts...> groups;
+	std::vector<VersionPointers> versions;
 	std::vector<Entity *> entities;
-	Util::IntrusiveHashMap<Util::IntrusivePODWrapper<size_t>> entity_to_index;
+
+	// Indexed by Entity::get_index().
+	enum : uint32_t { InvalidIndex = ~0u };
+	std::vector<uint32_t> entity_to_index;
+
+	uint32_t find_offset(const Entity &entity) const
+	{
+		uint32_t entity_index = entity.get_index();
+		return entity_index < entity_to_index.size() ? entity_to_index[entity_index] : uint32_t(InvalidIndex);
+	}
+
+	template <typename U>
+	static constexpr size_t component_index()
+	{
+		constexpr bool matches[] = { std::is_same<U, Ts>::value... };
+		for (size_t i = 0; i < sizeof...(Ts); i++)
+			if (matches[i])
+				return i;
+		return sizeof...(Ts);
+	}
+
+	template <typename... Us>
+	static bool has_changed(const VersionPointers &v, uint64_t since)
+	{
+		static_assert(sizeof...(Us) > 0, "Need at least one component type.");
+		static_assert(((component_index<Us>() < sizeof...(Ts)) && ...), "Component type is not part of the group.");
+		return ((*v[component_index<Us>()] > since) || ...);
+	}
 
 	template <typename... Us>
 	struct HasAllComponents;
@@ -314,6 +753,12 @@ public:
 	Entity *create_entity();
 	void delete_entity(Entity *entity);
 
+	// Returns nullptr if the entity has been deleted.
+	Entity *get_entity(EntityHandle handle) const
+	{
+		return entity_pool.maybe_get(handle);
+	}
+
 	template <typename... Ts>
 	EntityGroup<Ts...> *get_component_group_holder()
 	{
@@ -349,8 +794,164 @@ public:
 		return group->get_entities();
 	}
 
+	// Calls func(entity, Ts &...) for every entity with all of Ts as part of task_group.
+	// The entities are split into chunks of at least grain entities, which run concurrently,
+	// so func must be safe to call from multiple threads. Component types func only reads should be const.
+	// The entities are captured up front, so no components of Ts may be added or removed until task_group completes.
+	// If all of Ts use archetype storage, the chunks are split directly over the archetype rows.
+	// Every component of a non-const type in Ts counts as changed, see get_change_version().
+	template <typename... Ts, typename Func>
+	void for_each_parallel(TaskGroup &task_group, size_t grain, Func &&func)
+	{
+		static_assert(sizeof...(Ts) > 0, "Need at least one component type.");
+		if constexpr (std::conjunction<IsArchetypeComponent<std::remove_const_t<Ts>>...>::value)
+		{
+			auto *query = get_archetype_query<std::remove_const_t<Ts>...>();
+			task_group.parallel_for(query->get_row_count(), grain,
+			                        [this, query, func = std::forward<Func>(func)](size_t begin, size_t end) {
+				query->template for_each_chunk_range<Ts...>(begin, end, [&func](size_t count, Entity *const *chunk_entities, Ts *... ts) {
+					for (size_t i = 0; i < count; i++)
+						func(*chunk_entities[i], ts[i]...);
+				});
+				query->template mark_range_changed<Ts...>(begin, end, get_change_version());
+			});
+		}
+		else
+		{
+			auto *group = get_component_group_holder<std::remove_const_t<Ts>...>();
+			auto &group_tuples = group->get_groups();
+			auto &group_entities = group->get_entities();
+
+			task_group.parallel_for(group_tuples.size(), grain,
+			                        [this, group, &group_tuples, &group_entities, func = std::forward<Func>(func)](size_t begin, size_t end) {
+				uint64_t version = get_change_version();
+				for (size_t i = begin; i < end; i++)
+				{
+					call_tuple<Ts...>(func, *group_entities[i], group_tuples[i], std::index_sequence_for<Ts...>());
+					group->template mark_changed<Ts...>(i, version);
+				}
+			});
+		}
+	}
+
+	// Same as above, but waits for the iteration to complete.
+	template <typename... Ts, typename Func>
+	void for_each_parallel(ThreadGroup &thread_group, size_t grain, Func &&func)
+	{
+		auto task_group = thread_group.create_task();
+		for_each_parallel<Ts...>(*task_group, grain, std::forward<Func>(func));
+		task_group->wait();
+	}
+
+	// Calls func(count, entities, Ts *...) for every chunk of every archetype which has all of Ts.
+	// All of Ts must use archetype storage.
+	template <typename... Ts, typename Func>
+	void for_each_chunk(Func &&func)
+	{
+		static_assert(sizeof...(Ts) > 0, "Need at least one component type.");
+		static_assert(std::conjunction<IsArchetypeComponent<Ts>...>::value,
+		              "for_each_chunk only supports archetype components.");
+
+		auto *query = get_archetype_query<Ts...>();
+		for (size_t i = 0; i < query->get_archetype_count(); i++)
+		{
+			auto *archetype = query->get_archetype(i);
+			auto *columns = query->get_columns(i);
+			for (size_t chunk = 0; chunk < archetype->get_chunk_count(); chunk++)
+			{
+				call_chunk<Ts...>(func, *archetype, chunk, columns, std::index_sequence_for<Ts...>());
+			}
+		}
+	}
+
+	// Calls func(entity, Ts &...) for every entity with all of Ts, in storage order.
+	template <typename... Ts, typename Func>
+	void for_each_component(Func &&func)
+	{
+		for_each_chunk<Ts...>([&func](size_t count, Entity *const *chunk_entities, Ts *... ts) {
+			for (size_t i = 0; i < count; i++)
+				func(*chunk_entities[i], ts[i]...);
+		});
+	}
+
+	// All of Ts must use archetype storage.
+	template <typename... Ts>
+	ArchetypeQuery *get_archetype_query()
+	{
+		static_assert(std::conjunction<IsArchetypeComponent<Ts>...>::value,
+		              "Archetype queries only support archetype components.");
+		ComponentType query_id = ComponentIDMapping::get_group_id<Ts...>();
+		auto *query = archetype_queries.find(query_id);
+		if (!query)
+			query = register_archetype_query(query_id, { ComponentIDMapping::get_id<Ts>()... });
+		return query;
+	}
+
 	template <typename T, typename... Ts>
 	T *allocate_component(Entity &entity, Ts&&... ts)
+	{
+		if constexpr (IsArchetypeComponent<T>::value)
+			return allocate_archetype_component<T>(entity, std::forward<Ts>(ts)...);
+		else
+			return allocate_pooled_component<T>(entity, std::forward<Ts>(ts)...);
+	}
+
+	void free_component(Entity &entity, ComponentType id, ComponentNode *component);
+	void free_archetype_component(Entity &entity, ComponentType id);
+	void reset_groups();
+
+	// While deferred, entities which gain components are only added to component groups
+	// by end_deferred_group_updates(), once per group instead of once per added component.
+	// Groups must not be used in between. Entities must not be deleted in between.
+	void begin_deferred_group_updates();
+	void end_deferred_group_updates();
+
+	// Components are stamped with the change version when they are allocated, marked as changed,
+	// or written by for_each_parallel(), so systems can skip entities which did not change since they last ran,
+	// see EntityGroup::for_each_changed(). Other writes, e.g. through Entity::get_component(), must be marked
+	// explicitly, which lets systems which only sometimes modify a component report precise changes.
+	uint64_t get_change_version() const
+	{
+		return change_version;
+	}
+
+	// Returns the current change version and moves on to the next one, so everything changed after this call
+	// compares greater than the returned version. Must not be called while systems mark components as changed.
+	uint64_t advance_change_version()
+	{
+		return change_version++;
+	}
+	void reset_groups_for_component_type(ComponentType id);
+
+private:
+	template <typename T, typename... Ts>
+	T *allocate_archetype_component(Entity &entity, Ts&&... ts)
+	{
+		auto *info = get_archetype_component_info<T>();
+		if (entity.archetype)
+		{
+			int column = entity.archetype->find_column(info->id);
+			if (column >= 0)
+			{
+				// In-place modify, like pooled components.
+				auto *comp = static_cast<T *>(entity.archetype->get_component(entity.archetype_row, unsigned(column)));
+				comp->~T();
+				*entity.archetype->get_version(entity.archetype_row, unsigned(column)) = change_version;
+				return new (comp) T(std::forward<Ts>(ts)...);
+			}
+		}
+
+		auto *archetype = get_archetype_with(entity.archetype, info);
+		move_entity_to_archetype(entity, archetype);
+		auto column = unsigned(archetype->find_column(info->id));
+		auto *comp = new (archetype->get_component(entity.archetype_row, column)) T(std::forward<Ts>(ts)...);
+		*archetype->get_version(entity.archetype_row, column) = change_version;
+		on_archetype_component_added(entity, info->id);
+		return comp;
+	}
+
+	template <typename T, typename... Ts>
+	T *allocate_pooled_component(Entity &entity, Ts&&... ts)
 	{
 		ComponentType id = ComponentIDMapping::get_id<T>();
 		auto *t = component_types.find(id);
@@ -370,6 +971,7 @@ public:
 			// In-place modify. Destroy old data, and in-place construct.
 			// Do not need to fiddle with data structures internally.
 			comp->~T();
+			existing->version = change_version;
 			return new (comp) T(std::forward<Ts>(ts)...);
 		}
 		else
@@ -377,29 +979,56 @@ public:
 			auto *comp = allocator->pool.allocate(std::forward<Ts>(ts)...);
 			auto *node = component_nodes.allocate(comp);
 			node->set_hash(id);
+			node->version = change_version;
 			entity.components.insert_replace(node);
 
-			auto *component_groups = component_to_groups.find(id);
-			if (component_groups)
-				for (auto &group : *component_groups)
-					groups.find(group.get_hash())->add_entity(entity);
-
+			add_entity_to_component_groups(entity, id);
 			return comp;
 		}
 	}
 
-	void free_component(Entity &entity, ComponentType id, ComponentNode *component);
-	void reset_groups();
-	void reset_groups_for_component_type(ComponentType id);
+	template <typename... Ts, typename Func, size_t... Indices>
+	static void call_chunk(Func &func, const Archetype &archetype, size_t chunk, const unsigned *columns,
+	                       std::index_sequence<Indices...>)
+	{
+		func(archetype.get_chunk_row_count(chunk), archetype.get_chunk_entities(chunk),
+		     static_cast<Ts *>(archetype.get_chunk_column(chunk, columns[Indices]))...);
+	}
 
-private:
-	Util::ObjectPool<Entity> entity_pool;
+	template <typename... Ts, typename Func, typename Tup, size_t... Indices>
+	static void call_tuple(Func &func, Entity &entity, const Tup &t, std::index_sequence<Indices...>)
+	{
+		func(entity, static_cast<Ts &>(*std::get<Indices>(t))...);
+	}
+
+	Archetype *get_archetype(std::vector<const ArchetypeComponentInfo *> infos);
+	Archetype *get_archetype_with(Archetype *archetype, const ArchetypeComponentInfo *info);
+	Archetype *get_archetype_without(Archetype *archetype, ComponentType id);
+	ArchetypeQuery *register_archetype_query(ComponentType query_id, std::vector<ComponentType> types);
+	void move_entity_to_archetype(Entity &entity, Archetype *archetype);
+	void on_archetype_component_added(Entity &entity, ComponentType id);
+	void add_entity_to_component_groups(Entity &entity, ComponentType id);
+	void update_entity_groups(Entity &entity);
+	void remove_entity_from_groups(Entity &entity, ComponentType id);
+
+	Util::GenerationalHandlePool<Entity, EntityHandle> entity_pool;
+	Util::IntrusiveHashMap<Archetype> archetypes;
+	Util::IntrusiveHashMap<ArchetypeQuery> archetype_queries;
 	Util::IntrusiveHashMapHolder<EntityGroupBase> groups;
 	Util::IntrusiveHashMapHolder<ComponentAllocatorBase> component_types;
 	Util::ObjectPool<ComponentNode> component_nodes;
 	ComponentGroupHashMap component_to_groups;
 	std::vector<Entity *> entities;
 	uint64_t cookie = 0;
+	uint64_t change_version = 1;
+
+	struct DeferredGroupUpdate
+	{
+		Entity *entity;
+		ComponentType id;
+	};
+	std::vector<DeferredGroupUpdate> deferred_group_updates;
+	bool defer_group_updates = false;
 
 	template <typename... Us>
 	struct GroupRegisters;
@@ -434,6 +1063,49 @@ private:
 	void free_groups();
 };
 
+class TaskComposer;
+
+// Adds systems which iterate an EntityPool to the pipeline stages of a TaskComposer.
+// A system joins the current stage and runs concurrently with the systems already in it,
+// unless its component access conflicts with theirs, in which case it begins a new stage.
+class EntitySystemComposer
+{
+public:
+	EntitySystemComposer(EntityPool &pool, TaskComposer &composer);
+
+	// See EntityPool::for_each_parallel().
+	template <typename... Ts, typename Func>
+	void for_each_parallel(size_t grain, Func &&func)
+	{
+		auto &group = begin_system(ComponentAccess::from_types<Ts...>());
+		pool.for_each_parallel<Ts...>(group, grain, std::forward<Func>(func));
+	}
+
+	// For systems which do not split up, func() runs as a single task with the access of Ts.
+	template <typename... Ts>
+	void enqueue_task(TaskFunction func)
+	{
+		begin_system(ComponentAccess::from_types<Ts...>()).enqueue_task(std::move(func));
+	}
+
+	// Returns the task group a system with the given access must add its work to.
+	TaskGroup &begin_system(const ComponentAccess &access);
+
+private:
+	EntityPool &pool;
+	TaskComposer &composer;
+	ComponentAccess stage_access;
+	uint64_t stage_index = 0;
+	bool has_stage = false;
+};
+
+inline void Entity::mark_component_changed(ComponentType id)
+{
+	auto *version = get_component_version(id);
+	if (version)
+		*version = pool->get_change_version();
+}
+
 template <typename T, typename... Ts>
 T *Entity::allocate_component(Ts&&... ts)
 {
@@ -444,11 +1116,18 @@ template <typename T>
 void Entity::free_component()
 {
 	auto id = ComponentIDMapping::get_id<T>();
-	auto *t = components.find(id);
-	if (t)
+	if constexpr (IsArchetypeComponent<T>::value)
+	{
+		pool->free_archetype_component(*this, id);
+	}
+	else
 	{
-		components.erase(t);
-		pool->free_component(*this, t->get_hash(), t);
+		auto *t = components.find(id);
+		if (t)
+		{
+			components.erase(t);
+			pool->free_component(*this, t->get_hash(), t);
+		}
 	}
 }
 
@@ -0,0 +1,205 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ecs/entity_command_buffer.hpp"
+#include "util/aligned_alloc.hpp"
+#include <assert.h>
+
+namespace Granite
+{
+enum { PayloadBlockSize = 16 * 1024, PayloadBlockAlignment = 64 };
+
+EntityCommandBuffer::~EntityCommandBuffer()
+{
+	reset();
+	for (auto &block : blocks)
+		Util::memalign_free(block.data);
+}
+
+EntityCommandBuffer::PendingEntity EntityCommandBuffer::create_entity()
+{
+	return { num_pending_entities++ };
+}
+
+void EntityCommandBuffer::destroy_entity(Entity *entity)
+{
+	destroyed_entities.push_back(entity);
+}
+
+bool EntityCommandBuffer::empty() const
+{
+	return commands.empty() && destroyed_entities.empty() && num_pending_entities == 0;
+}
+
+void *EntityCommandBuffer::allocate_payload(size_t size, size_t alignment)
+{
+	assert(alignment <= PayloadBlockAlignment);
+
+	while (block_index < blocks.size())
+	{
+		auto &block = blocks[block_index];
+		size_t offset = (block_offset + alignment - 1) & ~(alignment - 1);
+		if (offset + size <= block.size)
+		{
+			block_offset = offset + size;
+			return block.data + offset;
+		}
+
+		block_index++;
+		block_offset = 0;
+	}
+
+	// aligned_alloc() wants the size to be a multiple of the alignment.
+	size_t block_size = std::max<size_t>(PayloadBlockSize, size);
+	block_size = (block_size + PayloadBlockAlignment - 1) & ~size_t(PayloadBlockAlignment - 1);
+	auto *data = static_cast<uint8_t *>(Util::memalign_alloc(PayloadBlockAlignment, block_size));
+	if (!data)
+		throw std::bad_alloc();
+
+	blocks.push_back({ data, block_size });
+	block_index = blocks.size() - 1;
+	block_offset = size;
+	return data;
+}
+
+void EntityCommandBuffer::create_entities(EntityPool &pool, EntityCommandListener *listener)
+{
+	created_entities.reserve(num_pending_entities);
+	for (uint32_t i = 0; i < num_pending_entities; i++)
+		created_entities.push_back(listener ? listener->create_entity() : pool.create_entity());
+}
+
+void EntityCommandBuffer::apply_commands()
+{
+	for (auto &command : commands)
+	{
+		auto *entity = command.entity ? command.entity : created_entities[command.pending_entity];
+		command.apply(*entity, command.payload);
+		// The payload was moved from and destroyed.
+		command.discard = nullptr;
+	}
+}
+
+void EntityCommandBuffer::destroy_entities(EntityPool &pool, EntityCommandListener *listener)
+{
+	for (auto *entity : destroyed_entities)
+	{
+		if (listener)
+			listener->destroy_entity(entity);
+		else if (entity->mark_for_destruction())
+			pool.delete_entity(entity);
+	}
+}
+
+void EntityCommandBuffer::play_back(EntityPool &pool, EntityCommandListener *listener)
+{
+	create_entities(pool, listener);
+	pool.begin_deferred_group_updates();
+	apply_commands();
+	pool.end_deferred_group_updates();
+	destroy_entities(pool, listener);
+	reset();
+}
+
+void EntityCommandBuffer::reset()
+{
+	for (auto &command : commands)
+		if (command.discard)
+			command.discard(command.payload);
+
+	commands.clear();
+	destroyed_entities.clear();
+	created_entities.clear();
+	num_pending_entities = 0;
+	block_index = 0;
+	block_offset = 0;
+}
+
+static std::atomic<uint64_t> next_session;
+
+struct ThreadBufferCacheEntry
+{
+	uint64_t session;
+	EntityCommandBuffer *buffer;
+};
+
+// A thread rarely records into more than one queue at a time.
+// If the cache thrashes anyway, the thread just ends up with another buffer in the same queue.
+enum { ThreadBufferCacheSize = 4 };
+static thread_local ThreadBufferCacheEntry thread_buffer_cache[ThreadBufferCacheSize];
+static thread_local unsigned thread_buffer_cache_index;
+
+EntityCommandQueue::EntityCommandQueue()
+{
+	session.store(next_session.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+EntityCommandBuffer &EntityCommandQueue::get_thread_buffer()
+{
+	uint64_t current_session = session.load(std::memory_order_relaxed);
+	for (auto &entry : thread_buffer_cache)
+		if (entry.session == current_session)
+			return *entry.buffer;
+
+	EntityCommandBuffer *buffer;
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		if (free_buffers.empty())
+		{
+			active_buffers.emplace_back(new EntityCommandBuffer);
+		}
+		else
+		{
+			active_buffers.push_back(std::move(free_buffers.back()));
+			free_buffers.pop_back();
+		}
+		buffer = active_buffers.back().get();
+	}
+
+	thread_buffer_cache[thread_buffer_cache_index++ % ThreadBufferCacheSize] = { current_session, buffer };
+	return *buffer;
+}
+
+void EntityCommandQueue::play_back(EntityPool &pool, EntityCommandListener *listener)
+{
+	std::lock_guard<std::mutex> holder{lock};
+
+	for (auto &buffer : active_buffers)
+		buffer->create_entities(pool, listener);
+
+	pool.begin_deferred_group_updates();
+	for (auto &buffer : active_buffers)
+		buffer->apply_commands();
+	pool.end_deferred_group_updates();
+
+	for (auto &buffer : active_buffers)
+	{
+		buffer->destroy_entities(pool, listener);
+		buffer->reset();
+		free_buffers.push_back(std::move(buffer));
+	}
+	active_buffers.clear();
+
+	// Cached buffers from this session are no longer handed out.
+	session.store(next_session.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+}
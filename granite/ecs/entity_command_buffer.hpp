@@ -0,0 +1,184 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "ecs/ecs.hpp"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Granite
+{
+// Lets the owner of the entities, e.g. Scene, keep track of entities created and destroyed by command playback.
+class EntityCommandListener
+{
+public:
+	virtual ~EntityCommandListener() = default;
+	virtual Entity *create_entity() = 0;
+	virtual void destroy_entity(Entity *entity) = 0;
+};
+
+// Records structural changes to entities from threads which do not own the EntityPool,
+// e.g. systems running in parallel, to be played back later on the owning thread.
+// A buffer must only be recorded to by one thread at a time, see EntityCommandQueue.
+class EntityCommandBuffer
+{
+public:
+	// Refers to an entity which is created when the buffer is played back.
+	struct PendingEntity
+	{
+		uint32_t index;
+	};
+
+	EntityCommandBuffer() = default;
+	~EntityCommandBuffer();
+	EntityCommandBuffer(const EntityCommandBuffer &) = delete;
+	void operator=(const EntityCommandBuffer &) = delete;
+
+	PendingEntity create_entity();
+	void destroy_entity(Entity *entity);
+
+	// The component is constructed right away and moved into place on playback.
+	template <typename T, typename... Ts>
+	void allocate_component(Entity *entity, Ts &&... ts)
+	{
+		push_allocate_component<T>(entity, NoPendingEntity, std::forward<Ts>(ts)...);
+	}
+
+	template <typename T, typename... Ts>
+	void allocate_component(PendingEntity entity, Ts &&... ts)
+	{
+		push_allocate_component<T>(nullptr, entity.index, std::forward<Ts>(ts)...);
+	}
+
+	template <typename T>
+	void free_component(Entity *entity)
+	{
+		commands.push_back({ entity, NoPendingEntity, nullptr, apply_free_component<T>, nullptr });
+	}
+
+	template <typename T>
+	void free_component(PendingEntity entity)
+	{
+		commands.push_back({ nullptr, entity.index, nullptr, apply_free_component<T>, nullptr });
+	}
+
+	bool empty() const;
+
+	// Plays back and resets the buffer. Entities are created first, then components are allocated and freed
+	// in recording order, with component group updates batched up at the end, and entities are destroyed last.
+	// Entities referred to must not have been deleted since recording.
+	void play_back(EntityPool &pool, EntityCommandListener *listener = nullptr);
+
+	// Discards all commands without playing them back.
+	void reset();
+
+private:
+	friend class EntityCommandQueue;
+	enum : uint32_t { NoPendingEntity = ~0u };
+	using ApplyFunc = void (*)(Entity &entity, void *payload);
+	using DiscardFunc = void (*)(void *payload);
+
+	struct Command
+	{
+		Entity *entity;
+		uint32_t pending_entity;
+		void *payload;
+		ApplyFunc apply;
+		DiscardFunc discard;
+	};
+
+	std::vector<Command> commands;
+	std::vector<Entity *> destroyed_entities;
+	std::vector<Entity *> created_entities;
+	uint32_t num_pending_entities = 0;
+
+	// Component payloads are bump allocated from blocks, which are kept for the next recording.
+	struct PayloadBlock
+	{
+		uint8_t *data;
+		size_t size;
+	};
+	std::vector<PayloadBlock> blocks;
+	size_t block_index = 0;
+	size_t block_offset = 0;
+	void *allocate_payload(size_t size, size_t alignment);
+
+	void create_entities(EntityPool &pool, EntityCommandListener *listener);
+	void apply_commands();
+	void destroy_entities(EntityPool &pool, EntityCommandListener *listener);
+
+	template <typename T, typename... Ts>
+	void push_allocate_component(Entity *entity, uint32_t pending_entity, Ts &&... ts)
+	{
+		auto *payload = new (allocate_payload(sizeof(T), alignof(T))) T(std::forward<Ts>(ts)...);
+		DiscardFunc discard = std::is_trivially_destructible<T>::value ? nullptr : discard_component<T>;
+		commands.push_back({ entity, pending_entity, payload, apply_allocate_component<T>, discard });
+	}
+
+	template <typename T>
+	static void apply_allocate_component(Entity &entity, void *payload)
+	{
+		auto *t = static_cast<T *>(payload);
+		entity.allocate_component<T>(std::move(*t));
+		t->~T();
+	}
+
+	template <typename T>
+	static void discard_component(void *payload)
+	{
+		static_cast<T *>(payload)->~T();
+	}
+
+	template <typename T>
+	static void apply_free_component(Entity &entity, void *)
+	{
+		entity.free_component<T>();
+	}
+};
+
+// Hands out one EntityCommandBuffer per recording thread, and plays them all back in one batch,
+// so component groups are only updated once per entity for all buffers.
+// The order in which the buffers of different threads are played back is unspecified.
+class EntityCommandQueue
+{
+public:
+	EntityCommandQueue();
+	EntityCommandQueue(const EntityCommandQueue &) = delete;
+	void operator=(const EntityCommandQueue &) = delete;
+
+	// The calling thread's buffer. Can be called from any thread, but not concurrently with play_back().
+	EntityCommandBuffer &get_thread_buffer();
+
+	// Must be called on the thread which owns pool. See EntityCommandBuffer::play_back().
+	void play_back(EntityPool &pool, EntityCommandListener *listener = nullptr);
+
+private:
+	std::mutex lock;
+	std::vector<std::unique_ptr<EntityCommandBuffer>> active_buffers;
+	std::vector<std::unique_ptr<EntityCommandBuffer>> free_buffers;
+	// Unique for every queue and playback, so threads can cache their buffer without ever seeing a stale one.
+	std::atomic<uint64_t> session;
+};
+}
@@ -92,20 +92,23 @@ public:
 	CollisionEvent(Entity *entity0_, Entity *entity1_,
 	               PhysicsHandle *object0_, PhysicsHandle *object1_,
 	               const vec3 &world_point_, const vec3 &normal_)
-		: entity0(entity0_), entity1(entity1_),
+		: pool0(entity0_ ? entity0_->get_pool() : nullptr), pool1(entity1_ ? entity1_->get_pool() : nullptr),
+		  entity0(entity0_ ? entity0_->get_handle() : 0), entity1(entity1_ ? entity1_->get_handle() : 0),
 		  object0(object0_), object1(object1_),
 		  world_point(world_point_), normal(normal_)
 	{
 	}
 
+	// Entities are resolved on access, since an earlier handler might have deleted them.
+	// Returns nullptr in that case.
 	Entity *get_first_entity() const
 	{
-		return entity0;
+		return pool0 ? pool0->get_entity(entity0) : nullptr;
 	}
 
 	Entity *get_second_entity() const
 	{
-		return entity1;
+		return pool1 ? pool1->get_entity(entity1) : nullptr;
 	}
 
 	PhysicsHandle *get_first_handle() const
@@ -129,8 +132,10 @@ public:
 	}
 
 private:
-	Entity *entity0;
-	Entity *entity1;
+	EntityPool *pool0;
+	EntityPool *pool1;
+	EntityHandle entity0;
+	EntityHandle entity1;
 	PhysicsHandle *object0;
 	PhysicsHandle *object1;
 	vec3 world_point;
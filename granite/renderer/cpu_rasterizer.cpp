@@ -304,7 +304,7 @@ unsigned setup_clipped_triangles(TriangleSetup *setup, const vec4 &a, const vec4
 	return output_count;
 }
 
-void rasterize_conservative_triangles(std::vector<uvec2> &coverage,
+void rasterize_conservative_triangles(Util::FrameVector<uvec2> &coverage,
                                       const vec4 *clip_positions,
                                       const unsigned *indices, unsigned num_indices,
                                       uvec2 resolution, CullMode cull)
@@ -23,6 +23,7 @@
 #pragma once
 
 #include "math/math.hpp"
+#include "util/frame_arena.hpp"
 
 #include <vector>
 
@@ -36,7 +37,7 @@ enum class CullMode
 	Both
 };
 
-void rasterize_conservative_triangles(std::vector<uvec2> &coverage,
+void rasterize_conservative_triangles(Util::FrameVector<uvec2> &coverage,
                                       const vec4 *clip_positions,
                                       const unsigned *indices, unsigned num_indices,
                                       uvec2 resolution, CullMode cull);
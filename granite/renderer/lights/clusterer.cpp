@@ -1453,7 +1453,7 @@ static ProjectedResult project_sphere(const RenderContext &context,
 
 void LightClusterer::update_bindless_mask_buffer_spot(uint32_t *masks, unsigned index)
 {
-	std::vector<uvec2> coverage;
+	Util::FrameVector<uvec2> coverage;
 
 	Rasterizer::CullMode cull;
 	const vec2 range = spot_light_z_range(*context, bindless.transforms.model[index]);
@@ -1820,8 +1820,8 @@ void LightClusterer::build_cluster_cpu(Vulkan::CommandBuffer &cmd, Vulkan::Image
 				uint32_t cached_point_mask = 0;
 				uvec4 cached_node = uvec4(0);
 
-				std::vector<uint32_t> tmp_list_buffer;
-				std::vector<uvec4> image_base;
+				Util::FrameVector<uint32_t> tmp_list_buffer;
+				Util::FrameVector<uvec4> image_base;
 				if (ImplementationQuirks::get().clustering_list_iteration)
 					image_base.resize(ClusterPrepassDownsample * resolution_x * resolution_y);
 
@@ -67,6 +67,7 @@ struct CachedSkinTransform
 struct BoundedComponent : ComponentBase
 {
 	GRANITE_COMPONENT_TYPE_DECL(BoundedComponent)
+	GRANITE_COMPONENT_ARCHETYPE_STORAGE
 	const AABB *aabb;
 };
 
@@ -173,6 +174,7 @@ struct PerFrameUpdateComponent : ComponentBase
 struct RenderInfoComponent : ComponentBase
 {
 	GRANITE_COMPONENT_TYPE_DECL(RenderInfoComponent)
+	GRANITE_COMPONENT_ARCHETYPE_STORAGE
 	AABB world_aabb;
 	CachedTransform *transform = nullptr;
 	CachedSkinTransform *skin_transform = nullptr;
@@ -191,6 +193,7 @@ struct CachedTransformComponent : ComponentBase
 struct CachedSpatialTransformTimestampComponent : ComponentBase
 {
 	GRANITE_COMPONENT_TYPE_DECL(CachedSpatialTransformTimestampComponent)
+	GRANITE_COMPONENT_ARCHETYPE_STORAGE
 	uint64_t cookie = 0;
 	Util::Hash timestamp_hash = 0;
 	const uint32_t *current_timestamp = nullptr;
@@ -29,6 +29,7 @@
 #include "math/muglm/muglm_impl.hpp"
 #include "threading/thread_group.hpp"
 #include "threading/task_composer.hpp"
+#include "util/frame_arena.hpp"
 
 #include <algorithm>
 
@@ -883,7 +884,7 @@ void RenderGraph::build_physical_resources()
 
 void RenderGraph::build_transients()
 {
-	std::vector<unsigned> physical_pass_used(physical_dimensions.size());
+	Util::FrameVector<unsigned> physical_pass_used(physical_dimensions.size());
 	for (auto &u : physical_pass_used)
 		u = RenderPass::Unused;
 
@@ -1534,7 +1535,7 @@ void RenderGraph::build_aliases()
 		}
 	};
 
-	std::vector<Range> pass_range(physical_dimensions.size());
+	Util::FrameVector<Range> pass_range(physical_dimensions.size());
 
 	const auto register_reader = [&pass_range](const RenderTextureResource *resource, unsigned pass_index) {
 		if (resource && pass_index != RenderPass::Unused)
@@ -1600,7 +1601,7 @@ void RenderGraph::build_aliases()
 			register_writer(output, subpass.get_physical_pass_index(), true);
 	}
 
-	std::vector<std::vector<unsigned>> alias_chains(physical_dimensions.size());
+	std::vector<Util::FrameVector<unsigned>, Util::FrameAllocator<Util::FrameVector<unsigned>>> alias_chains(physical_dimensions.size());
 
 	physical_aliases.resize(physical_dimensions.size());
 	for (auto &v : physical_aliases)
@@ -3034,7 +3035,7 @@ void RenderGraph::build_physical_barriers()
 	};
 
 	// To handle state inside a physical pass.
-	std::vector<ResourceState> resource_state;
+	Util::FrameVector<ResourceState> resource_state;
 	resource_state.reserve(physical_dimensions.size());
 
 	for (auto &physical_pass : physical_passes)
@@ -3520,7 +3521,7 @@ void RenderGraph::build_barriers()
 
 void RenderGraph::filter_passes(std::vector<unsigned> &list)
 {
-	std::unordered_set<unsigned> seen;
+	std::unordered_set<unsigned, std::hash<unsigned>, std::equal_to<unsigned>, Util::FrameAllocator<unsigned>> seen;
 
 	auto output_itr = std::begin(list);
 	for (auto itr = std::begin(list); itr != std::end(list); ++itr)
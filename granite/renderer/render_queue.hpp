@@ -26,6 +26,7 @@
 #include "util/hash.hpp"
 #include "util/enum_cast.hpp"
 #include "util/intrusive_hash_map.hpp"
+#include "util/frame_arena.hpp"
 #include "math/math.hpp"
 
 #include <vector>
@@ -53,8 +54,9 @@ struct PositionalLightInfo
 	const RenderInfoComponent *transform;
 	Util::Hash transform_hash;
 };
-using VisibilityList = std::vector<RenderableInfo>;
-using PositionalLightList = std::vector<PositionalLightInfo>;
+// Rebuilt every frame, so they live in the frame arena.
+using VisibilityList = Util::FrameVector<RenderableInfo>;
+using PositionalLightList = Util::FrameVector<PositionalLightInfo>;
 
 enum class Queue : unsigned
 {
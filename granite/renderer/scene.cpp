@@ -33,7 +33,7 @@ namespace Granite
 {
 
 Scene::Scene()
-	: spatials(pool.get_component_group<BoundedComponent, RenderInfoComponent, CachedSpatialTransformTimestampComponent>()),
+	: spatials(pool.get_archetype_query<BoundedComponent, RenderInfoComponent, CachedSpatialTransformTimestampComponent>()),
 	  opaque(pool.get_component_group<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, OpaqueComponent>()),
 	  transparent(pool.get_component_group<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, TransparentComponent>()),
 	  positional_lights(pool.get_component_group<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, PositionalLightComponent>()),
@@ -188,12 +188,10 @@ void Scene::gather_visible_opaque_renderables(const Frustum &frustum, Visibility
 	gather_visible_renderables(frustum, list, opaque, 0, opaque.size());
 }
 
-void Scene::gather_visible_opaque_renderables_subset(const Frustum &frustum, VisibilityList &list,
-                                                     unsigned index, unsigned num_indices) const
+void Scene::gather_visible_opaque_renderables_range(const Frustum &frustum, VisibilityList &list,
+                                                    size_t begin_index, size_t end_index) const
 {
-	size_t start_index = (index * opaque.size()) / num_indices;
-	size_t end_index = ((index + 1) * opaque.size()) / num_indices;
-	gather_visible_renderables(frustum, list, opaque, start_index, end_index);
+	gather_visible_renderables(frustum, list, opaque, begin_index, end_index);
 }
 
 void Scene::gather_visible_transparent_renderables(const Frustum &frustum, VisibilityList &list) const
@@ -206,20 +204,16 @@ void Scene::gather_visible_static_shadow_renderables(const Frustum &frustum, Vis
 	gather_visible_renderables(frustum, list, static_shadowing, 0, static_shadowing.size());
 }
 
-void Scene::gather_visible_transparent_renderables_subset(const Frustum &frustum, VisibilityList &list,
-                                                          unsigned index, unsigned num_indices) const
+void Scene::gather_visible_transparent_renderables_range(const Frustum &frustum, VisibilityList &list,
+                                                         size_t begin_index, size_t end_index) const
 {
-	size_t start_index = (index * transparent.size()) / num_indices;
-	size_t end_index = ((index + 1) * transparent.size()) / num_indices;
-	gather_visible_renderables(frustum, list, transparent, start_index, end_index);
+	gather_visible_renderables(frustum, list, transparent, begin_index, end_index);
 }
 
-void Scene::gather_visible_static_shadow_renderables_subset(const Frustum &frustum, VisibilityList &list,
-                                                            unsigned index, unsigned num_indices) const
+void Scene::gather_visible_static_shadow_renderables_range(const Frustum &frustum, VisibilityList &list,
+                                                           size_t begin_index, size_t end_index) const
 {
-	size_t start_index = (index * static_shadowing.size()) / num_indices;
-	size_t end_index = ((index + 1) * static_shadowing.size()) / num_indices;
-	gather_visible_renderables(frustum, list, static_shadowing, start_index, end_index);
+	gather_visible_renderables(frustum, list, static_shadowing, begin_index, end_index);
 }
 
 void Scene::gather_visible_dynamic_shadow_renderables(const Frustum &frustum, VisibilityList &list) const
@@ -229,14 +223,13 @@ void Scene::gather_visible_dynamic_shadow_renderables(const Frustum &frustum, Vi
 		list.push_back({ get_component<RenderableComponent>(object)->renderable.get(), nullptr });
 }
 
-void Scene::gather_visible_dynamic_shadow_renderables_subset(const Frustum &frustum, VisibilityList &list,
-                                                             unsigned index, unsigned num_indices) const
+void Scene::gather_visible_dynamic_shadow_renderables_range(const Frustum &frustum, VisibilityList &list,
+                                                            size_t begin_index, size_t end_index) const
 {
-	size_t start_index = (index * dynamic_shadowing.size()) / num_indices;
-	size_t end_index = ((index + 1) * dynamic_shadowing.size()) / num_indices;
-	gather_visible_renderables(frustum, list, dynamic_shadowing, start_index, end_index);
+	gather_visible_renderables(frustum, list, dynamic_shadowing, begin_index, end_index);
 
-	if (index == 0)
+	// Exactly one range starts at 0, let that one take care of the unbounded objects.
+	if (begin_index == 0)
 		for (auto &object : render_pass_shadowing)
 			list.push_back({ get_component<RenderableComponent>(object)->renderable.get(), nullptr });
 }
@@ -307,20 +300,16 @@ void Scene::gather_visible_positional_lights(const Frustum &frustum, PositionalL
 	gather_positional_lights(frustum, list, positional_lights, 0, positional_lights.size());
 }
 
-void Scene::gather_visible_positional_lights_subset(const Frustum &frustum, VisibilityList &list,
-                                                    unsigned index, unsigned num_indices) const
+void Scene::gather_visible_positional_lights_range(const Frustum &frustum, VisibilityList &list,
+                                                   size_t begin_index, size_t end_index) const
 {
-	size_t start_index = (index * positional_lights.size()) / num_indices;
-	size_t end_index = ((index + 1) * positional_lights.size()) / num_indices;
-	gather_positional_lights(frustum, list, positional_lights, start_index, end_index);
+	gather_positional_lights(frustum, list, positional_lights, begin_index, end_index);
 }
 
-void Scene::gather_visible_positional_lights_subset(const Frustum &frustum, PositionalLightList &list,
-                                                    unsigned index, unsigned num_indices) const
+void Scene::gather_visible_positional_lights_range(const Frustum &frustum, PositionalLightList &list,
+                                                   size_t begin_index, size_t end_index) const
 {
-	size_t start_index = (index * positional_lights.size()) / num_indices;
-	size_t end_index = ((index + 1) * positional_lights.size()) / num_indices;
-	gather_positional_lights(frustum, list, positional_lights, start_index, end_index);
+	gather_positional_lights(frustum, list, positional_lights, begin_index, end_index);
 }
 
 size_t Scene::get_opaque_renderables_count() const
@@ -546,21 +535,14 @@ void Scene::update_transform_tree(Node &node, const mat4 &transform, bool parent
 
 size_t Scene::get_cached_transforms_count() const
 {
-	return spatials.size();
-}
-
-void Scene::update_cached_transforms_subset(unsigned index, unsigned num_indices)
-{
-	size_t begin_index = (spatials.size() * index) / num_indices;
-	size_t end_index = (spatials.size() * (index + 1)) / num_indices;
-	update_cached_transforms_range(begin_index, end_index);
+	return spatials->get_row_count();
 }
 
 void Scene::update_all_transforms()
 {
 	update_transform_tree();
 	update_transform_listener_components();
-	update_cached_transforms_range(0, spatials.size());
+	update_cached_transforms_range(0, get_cached_transforms_count());
 }
 
 void Scene::update_transform_tree()
@@ -569,61 +551,84 @@ void Scene::update_transform_tree()
 		update_transform_tree(*root_node, mat4(1.0f), false);
 }
 
+void Scene::update_camera_transform(CameraComponent &camera, const CachedTransformComponent &transform)
+{
+	camera.camera.set_transform(transform.transform->world_transform);
+}
+
+void Scene::update_directional_light_transform(DirectionalLightComponent &light,
+                                               const CachedTransformComponent &transform)
+{
+	// v = [0, 0, 1, 0].
+	light.direction = normalize(transform.transform->world_transform[2].xyz());
+}
+
 void Scene::update_transform_listener_components()
 {
 	// Update camera transforms.
 	for (auto &c : cameras)
-	{
-		CameraComponent *cam;
-		CachedTransformComponent *transform;
-		std::tie(cam, transform) = c;
-		cam->camera.set_transform(transform->transform->world_transform);
-	}
+		update_camera_transform(*get_component<CameraComponent>(c), *get_component<CachedTransformComponent>(c));
 
 	// Update directional light transforms.
 	for (auto &light : directional_lights)
 	{
-		DirectionalLightComponent *l;
-		CachedTransformComponent *transform;
-		std::tie(l, transform) = light;
-
-		// v = [0, 0, 1, 0].
-		l->direction = normalize(transform->transform->world_transform[2].xyz());
+		update_directional_light_transform(*get_component<DirectionalLightComponent>(light),
+		                                   *get_component<CachedTransformComponent>(light));
 	}
 }
 
-void Scene::update_cached_transforms_range(size_t begin_range, size_t end_range)
+void Scene::update_transform_listener_components(TaskComposer &composer)
 {
-	for (size_t i = begin_range; i < end_range; i++)
-	{
-		auto &s = spatials[i];
+	// There are only a handful of listeners, so they rarely split up.
+	constexpr size_t grain = 64;
+
+	EntitySystemComposer systems(pool, composer);
+	systems.for_each_parallel<CameraComponent, const CachedTransformComponent>(
+			grain, [](Entity &, CameraComponent &camera, const CachedTransformComponent &transform) {
+		update_camera_transform(camera, transform);
+	});
+	systems.for_each_parallel<DirectionalLightComponent, const CachedTransformComponent>(
+			grain, [](Entity &, DirectionalLightComponent &light, const CachedTransformComponent &transform) {
+		update_directional_light_transform(light, transform);
+	});
+}
 
-		BoundedComponent *aabb;
-		RenderInfoComponent *cached_transform;
-		CachedSpatialTransformTimestampComponent *timestamp;
-		std::tie(aabb, cached_transform, timestamp) = s;
+bool Scene::update_cached_transform(const BoundedComponent &aabb, RenderInfoComponent &cached_transform,
+                                    CachedSpatialTransformTimestampComponent &timestamp)
+{
+	if (timestamp.last_timestamp == *timestamp.current_timestamp)
+		return false;
 
-		if (timestamp->last_timestamp != *timestamp->current_timestamp)
+	if (cached_transform.transform)
+	{
+		if (cached_transform.skin_transform)
 		{
-			if (cached_transform->transform)
-			{
-				if (cached_transform->skin_transform)
-				{
-					// TODO: Isolate the AABB per bone.
-					cached_transform->world_aabb = AABB(vec3(FLT_MAX), vec3(-FLT_MAX));
-					for (auto &m : cached_transform->skin_transform->bone_world_transforms)
-						SIMD::transform_and_expand_aabb(cached_transform->world_aabb, *aabb->aabb, m);
-				}
-				else
-				{
-					SIMD::transform_aabb(cached_transform->world_aabb,
-					                     *aabb->aabb,
-					                     cached_transform->transform->world_transform);
-				}
-			}
-			timestamp->last_timestamp = *timestamp->current_timestamp;
+			// TODO: Isolate the AABB per bone.
+			cached_transform.world_aabb = AABB(vec3(FLT_MAX), vec3(-FLT_MAX));
+			for (auto &m : cached_transform.skin_transform->bone_world_transforms)
+				SIMD::transform_and_expand_aabb(cached_transform.world_aabb, *aabb.aabb, m);
+		}
+		else
+		{
+			SIMD::transform_aabb(cached_transform.world_aabb,
+			                     *aabb.aabb,
+			                     cached_transform.transform->world_transform);
 		}
 	}
+	timestamp.last_timestamp = *timestamp.current_timestamp;
+	return true;
+}
+
+void Scene::update_cached_transforms_range(size_t begin_range, size_t end_range)
+{
+	spatials->for_each_chunk_range<const BoundedComponent, RenderInfoComponent, CachedSpatialTransformTimestampComponent>(
+			begin_range, end_range,
+			[](size_t count, Entity *const *chunk_entities, const BoundedComponent *aabbs,
+			   RenderInfoComponent *cached_transforms, CachedSpatialTransformTimestampComponent *timestamps) {
+		for (size_t i = 0; i < count; i++)
+			if (update_cached_transform(aabbs[i], cached_transforms[i], timestamps[i]))
+				chunk_entities[i]->mark_component_changed<RenderInfoComponent>();
+	});
 }
 
 Scene::NodeHandle Scene::create_node()
@@ -785,8 +790,13 @@ Entity *Scene::create_light(const SceneFormats::LightInfo &light, Node *node)
 		entity->allocate_component<PositionalLightComponent>()->light = &positional;
 		entity->allocate_component<RenderableComponent>()->renderable = renderable;
 
-		auto *transform = entity->allocate_component<RenderInfoComponent>();
-		auto *timestamp = entity->allocate_component<CachedSpatialTransformTimestampComponent>();
+		// Archetype components move when the entity gains components, so allocate all of them up front.
+		entity->allocate_component<RenderInfoComponent>();
+		entity->allocate_component<CachedSpatialTransformTimestampComponent>();
+		entity->allocate_component<BoundedComponent>();
+
+		auto *transform = entity->get_component<RenderInfoComponent>();
+		auto *timestamp = entity->get_component<CachedSpatialTransformTimestampComponent>();
 		timestamp->cookie = transform_cookies.fetch_add(1, std::memory_order_relaxed);
 
 		if (node)
@@ -795,8 +805,7 @@ Entity *Scene::create_light(const SceneFormats::LightInfo &light, Node *node)
 			timestamp->current_timestamp = node->get_timestamp_pointer();
 		}
 
-		auto *bounded = entity->allocate_component<BoundedComponent>();
-		bounded->aabb = renderable->get_static_aabb();
+		entity->get_component<BoundedComponent>()->aabb = renderable->get_static_aabb();
 		break;
 	}
 	}
@@ -810,8 +819,12 @@ Entity *Scene::create_renderable(AbstractRenderableHandle renderable, Node *node
 
 	if (renderable->has_static_aabb())
 	{
-		auto *transform = entity->allocate_component<RenderInfoComponent>();
-		auto *timestamp = entity->allocate_component<CachedSpatialTransformTimestampComponent>();
+		entity->allocate_component<RenderInfoComponent>();
+		entity->allocate_component<CachedSpatialTransformTimestampComponent>();
+		entity->allocate_component<BoundedComponent>();
+
+		auto *transform = entity->get_component<RenderInfoComponent>();
+		auto *timestamp = entity->get_component<CachedSpatialTransformTimestampComponent>();
 		timestamp->cookie = transform_cookies.fetch_add(1, std::memory_order_relaxed);
 
 		if (node)
@@ -822,8 +835,7 @@ Entity *Scene::create_renderable(AbstractRenderableHandle renderable, Node *node
 			if (node->get_skin() && !node->get_skin()->cached_skin.empty())
 				transform->skin_transform = &node->get_skin()->cached_skin_transform;
 		}
-		auto *bounded = entity->allocate_component<BoundedComponent>();
-		bounded->aabb = renderable->get_static_aabb();
+		entity->get_component<BoundedComponent>()->aabb = renderable->get_static_aabb();
 	}
 	else
 		entity->allocate_component<UnboundedComponent>();
@@ -905,4 +917,33 @@ void Scene::queue_destroy_entity(Entity *entity)
 	}
 }
 
+namespace
+{
+struct SceneEntityCommandListener final : EntityCommandListener
+{
+	explicit SceneEntityCommandListener(Scene &scene_)
+		: scene(scene_)
+	{
+	}
+
+	Entity *create_entity() override
+	{
+		return scene.create_entity();
+	}
+
+	void destroy_entity(Entity *entity) override
+	{
+		scene.queue_destroy_entity(entity);
+	}
+
+	Scene &scene;
+};
+}
+
+void Scene::play_back_entity_commands(EntityCommandQueue &queue)
+{
+	SceneEntityCommandListener listener(*this);
+	queue.play_back(pool, &listener);
+}
+
 }
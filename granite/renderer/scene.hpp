@@ -25,6 +25,7 @@
 #include "renderer/render_components.hpp"
 #include "scene_formats/scene_formats.hpp"
 #include "ecs/ecs.hpp"
+#include "ecs/entity_command_buffer.hpp"
 #include "math/frustum.hpp"
 #include "threading/thread_group.hpp"
 #include "util/no_init_pod.hpp"
@@ -51,9 +52,22 @@ public:
 	void update_transform_tree();
 	void update_transform_tree(TaskComposer &composer);
 	void update_transform_listener_components();
-	void update_cached_transforms_subset(unsigned index, unsigned num_indices);
+	// Adds the camera and directional light updates as systems which share a pipeline stage of composer.
+	// They must run after the transform tree has been updated.
+	void update_transform_listener_components(TaskComposer &composer);
+	// Ranges index the rows of all archetypes with spatial components, see ArchetypeQuery::for_each_chunk_range().
+	void update_cached_transforms_range(size_t begin_index, size_t end_index);
 	size_t get_cached_transforms_count() const;
 
+	// Per entity work of the transform updates.
+	static void update_camera_transform(CameraComponent &camera, const CachedTransformComponent &transform);
+	static void update_directional_light_transform(DirectionalLightComponent &light,
+	                                               const CachedTransformComponent &transform);
+	// Returns true if the world AABB was recomputed, in which case the caller should mark the RenderInfoComponent
+	// as changed, so consumers of the world AABB can skip static objects, see EntityGroup::for_each_changed().
+	static bool update_cached_transform(const BoundedComponent &aabb, RenderInfoComponent &cached_transform,
+	                                    CachedSpatialTransformTimestampComponent &timestamp);
+
 	void gather_visible_opaque_renderables(const Frustum &frustum, VisibilityList &list) const;
 	void gather_visible_transparent_renderables(const Frustum &frustum, VisibilityList &list) const;
 	void gather_visible_static_shadow_renderables(const Frustum &frustum, VisibilityList &list) const;
@@ -61,18 +75,18 @@ public:
 	void gather_visible_positional_lights(const Frustum &frustum, VisibilityList &list) const;
 	void gather_visible_positional_lights(const Frustum &frustum, PositionalLightList &list) const;
 
-	void gather_visible_opaque_renderables_subset(const Frustum &frustum, VisibilityList &list,
-	                                              unsigned index, unsigned num_indices) const;
-	void gather_visible_transparent_renderables_subset(const Frustum &frustum, VisibilityList &list,
-	                                                   unsigned index, unsigned num_indices) const;
-	void gather_visible_static_shadow_renderables_subset(const Frustum &frustum, VisibilityList &list,
-	                                                     unsigned index, unsigned num_indices) const;
-	void gather_visible_dynamic_shadow_renderables_subset(const Frustum &frustum, VisibilityList &list,
-	                                                      unsigned index, unsigned num_indices) const;
-	void gather_visible_positional_lights_subset(const Frustum &frustum, VisibilityList &list,
-	                                             unsigned index, unsigned num_indices) const;
-	void gather_visible_positional_lights_subset(const Frustum &frustum, PositionalLightList &list,
-	                                             unsigned index, unsigned num_indices) const;
+	void gather_visible_opaque_renderables_range(const Frustum &frustum, VisibilityList &list,
+	                                             size_t begin_index, size_t end_index) const;
+	void gather_visible_transparent_renderables_range(const Frustum &frustum, VisibilityList &list,
+	                                                  size_t begin_index, size_t end_index) const;
+	void gather_visible_static_shadow_renderables_range(const Frustum &frustum, VisibilityList &list,
+	                                                    size_t begin_index, size_t end_index) const;
+	void gather_visible_dynamic_shadow_renderables_range(const Frustum &frustum, VisibilityList &list,
+	                                                     size_t begin_index, size_t end_index) const;
+	void gather_visible_positional_lights_range(const Frustum &frustum, VisibilityList &list,
+	                                            size_t begin_index, size_t end_index) const;
+	void gather_visible_positional_lights_range(const Frustum &frustum, PositionalLightList &list,
+	                                            size_t begin_index, size_t end_index) const;
 
 	size_t get_opaque_renderables_count() const;
 	size_t get_transparent_renderables_count() const;
@@ -217,6 +231,10 @@ public:
 	void queue_destroy_entity(Entity *entity);
 	void destroy_queued_entities();
 
+	// Plays back structural changes recorded by worker threads. Entities are created through create_entity(),
+	// and destroyed through queue_destroy_entity(). Must be called on the thread which owns the scene.
+	void play_back_entity_commands(EntityCommandQueue &queue);
+
 	template <typename T>
 	void remove_entities_with_component()
 	{
@@ -230,7 +248,7 @@ private:
 	Util::ObjectPool<Node> node_pool;
 	Util::ObjectPool<Node::Skinning> skinning_pool;
 	NodeHandle root_node;
-	const ComponentGroupVector<BoundedComponent, RenderInfoComponent, CachedSpatialTransformTimestampComponent> &spatials;
+	ArchetypeQuery *spatials;
 	const ComponentGroupVector<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, OpaqueComponent> &opaque;
 	const ComponentGroupVector<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, TransparentComponent> &transparent;
 	const ComponentGroupVector<RenderInfoComponent, RenderableComponent, CachedSpatialTransformTimestampComponent, PositionalLightComponent> &positional_lights;
@@ -279,8 +297,6 @@ private:
 	Util::ThreadSafeObjectPool<TraversalState> traversal_state_pool;
 	void dispatch_collect_children(TraversalState *state);
 	TaskGroupHandle dispatch_per_node_work(TraversalState *state);
-
-	void update_cached_transforms_range(size_t start_index, size_t end_index);
 };
 
 }
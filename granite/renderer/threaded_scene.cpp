@@ -29,17 +29,18 @@
 namespace Granite::Threaded
 {
 
+// Culling a single object is cheap, make sure chunks are large enough to amortize scheduling.
+static constexpr size_t GatherGrainSize = 64;
+
 void scene_gather_opaque_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
                                      VisibilityList *lists, const unsigned num_tasks)
 {
 	auto &group = composer.begin_pipeline_stage();
 	group.set_desc("gather-opaque-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks]() {
-			scene.gather_visible_opaque_renderables_subset(frustum, lists[i], i, num_tasks);
-		});
-	}
+	group.parallel_reduce(scene.get_opaque_renderables_count(), GatherGrainSize, num_tasks,
+	                      [&frustum, lists, &scene](size_t begin, size_t end, unsigned partial) {
+		scene.gather_visible_opaque_renderables_range(frustum, lists[partial], begin, end);
+	});
 }
 
 void scene_gather_transparent_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
@@ -47,62 +48,59 @@ void scene_gather_transparent_renderables(const Scene &scene, TaskComposer &comp
 {
 	auto &group = composer.begin_pipeline_stage();
 	group.set_desc("gather-transparent-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks]() {
-			scene.gather_visible_transparent_renderables_subset(frustum, lists[i], i, num_tasks);
-		});
-	}
+	group.parallel_reduce(scene.get_transparent_renderables_count(), GatherGrainSize, num_tasks,
+	                      [&frustum, lists, &scene](size_t begin, size_t end, unsigned partial) {
+		scene.gather_visible_transparent_renderables_range(frustum, lists[partial], begin, end);
+	});
+}
+
+static void hash_transforms(Util::Hash &hash, const VisibilityList &list, size_t begin_index)
+{
+	// This way of combining hashes is order independent and serves as a good way of hashing the overall scene.
+	for (size_t i = begin_index; i < list.size(); i++)
+		hash ^= list[i].transform_hash;
 }
 
 void scene_gather_static_shadow_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
-                                            VisibilityList *lists, Util::Hash *transform_hashes, const unsigned num_tasks,
-                                            const std::function<bool ()> &func)
+                                            VisibilityList *lists, Util::Hash *transform_hashes, const unsigned num_tasks)
 {
+	// The hashes are only read once the gather completes, so they can be reset up front.
+	if (transform_hashes)
+		std::fill(transform_hashes, transform_hashes + num_tasks, Util::Hash(0));
+
 	auto &group = composer.begin_pipeline_stage();
 	group.set_desc("gather-static-shadow-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks, func, transform_hashes]() {
-			if (transform_hashes)
-				transform_hashes[i] = 0;
-
-			if (!func || func())
-			{
-				scene.gather_visible_static_shadow_renderables_subset(frustum, lists[i], i, num_tasks);
-
-				// This way of combining hashes is order independent and serves as a good way of hashing the overall scene.
-				if (transform_hashes)
-					for (auto &v : lists[i])
-						transform_hashes[i] ^= v.transform_hash;
-			}
-		});
-	}
+	group.parallel_reduce(scene.get_static_shadow_renderables_count(), GatherGrainSize, num_tasks,
+	                      [&frustum, lists, &scene, transform_hashes](size_t begin, size_t end, unsigned partial) {
+		size_t offset = lists[partial].size();
+		scene.gather_visible_static_shadow_renderables_range(frustum, lists[partial], begin, end);
+		if (transform_hashes)
+			hash_transforms(transform_hashes[partial], lists[partial], offset);
+	});
 }
 
 void scene_gather_dynamic_shadow_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
-                                             VisibilityList *lists, Util::Hash *transform_hashes, const unsigned num_tasks,
-                                             const std::function<bool ()> &func)
+                                             VisibilityList *lists, Util::Hash *transform_hashes, const unsigned num_tasks)
 {
+	if (transform_hashes)
+		std::fill(transform_hashes, transform_hashes + num_tasks, Util::Hash(0));
+
 	auto &group = composer.begin_pipeline_stage();
 	group.set_desc("gather-dynamic-shadow-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks, func, transform_hashes]() {
-			if (transform_hashes)
-				transform_hashes[i] = 0;
-
-			if (!func || func())
-			{
-				scene.gather_visible_dynamic_shadow_renderables_subset(frustum, lists[i], i, num_tasks);
-
-				// This way of combining hashes is order independent and serves as a good way of hashing the overall scene.
-				if (transform_hashes)
-					for (auto &v : lists[i])
-						transform_hashes[i] ^= v.transform_hash;
-			}
-		});
-	}
+
+	auto gather = [&frustum, lists, &scene, transform_hashes](size_t begin, size_t end, unsigned partial) {
+		size_t offset = lists[partial].size();
+		scene.gather_visible_dynamic_shadow_renderables_range(frustum, lists[partial], begin, end);
+		if (transform_hashes)
+			hash_transforms(transform_hashes[partial], lists[partial], offset);
+	};
+
+	// The range starting at 0 also gathers unbounded shadow casters, so make sure it exists.
+	size_t count = scene.get_dynamic_shadow_renderables_count();
+	if (count)
+		group.parallel_reduce(count, GatherGrainSize, num_tasks, std::move(gather));
+	else
+		group.enqueue_task([gather]() { gather(0, 0, 0); });
 }
 
 void scene_gather_positional_light_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
@@ -110,12 +108,10 @@ void scene_gather_positional_light_renderables(const Scene &scene, TaskComposer
 {
 	auto &group = composer.begin_pipeline_stage();
 	group.set_desc("gather-positional-light-renderables");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&frustum, lists, &scene, i, num_tasks]() {
-			scene.gather_visible_positional_lights_subset(frustum, lists[i], i, num_tasks);
-		});
-	}
+	group.parallel_reduce(scene.get_positional_lights_count(), GatherGrainSize, num_tasks,
+	                      [&frustum, lists, &scene](size_t begin, size_t end, unsigned partial) {
+		scene.gather_visible_positional_lights_range(frustum, lists[partial], begin, end);
+	});
 }
 
 void scene_gather_positional_light_renderables_sorted(const Scene &scene, TaskComposer &composer,
@@ -125,13 +121,11 @@ void scene_gather_positional_light_renderables_sorted(const Scene &scene, TaskCo
 	{
 		auto &group = composer.begin_pipeline_stage();
 		group.set_desc("gather-positional-light-renderables");
-		for (unsigned i = 0; i < num_tasks; i++)
-		{
-			group.enqueue_task([&context, lists, &scene, i, num_tasks]() {
-				scene.gather_visible_positional_lights_subset(context.get_visibility_frustum(),
-				                                              lists[i], i, num_tasks);
-			});
-		}
+		group.parallel_reduce(scene.get_positional_lights_count(), GatherGrainSize, num_tasks,
+		                      [&context, lists, &scene](size_t begin, size_t end, unsigned partial) {
+			scene.gather_visible_positional_lights_range(context.get_visibility_frustum(),
+			                                             lists[partial], begin, end);
+		});
 	}
 
 	{
@@ -182,18 +176,13 @@ void compose_parallel_push_renderables(TaskComposer &composer, const RenderConte
 	}
 }
 
-void scene_update_cached_transforms(Scene &scene, TaskComposer &composer, const unsigned num_tasks)
+void scene_record_update_cached_transforms(Scene &scene, TaskGraph &graph, TaskGraph::Node node, const size_t grain)
 {
-	auto &group = composer.begin_pipeline_stage();
-	group.set_desc("parallel-update-cached-transforms");
-	for (unsigned i = 0; i < num_tasks; i++)
-	{
-		group.enqueue_task([&scene, num_tasks, i]() {
-			scene.update_cached_transforms_subset(i, num_tasks);
-			if (i == 0)
-				scene.update_transform_listener_components();
-		});
-	}
+	graph.add_parallel_for(node, [&scene]() {
+		return scene.get_cached_transforms_count();
+	}, grain, [&scene](size_t begin, size_t end) {
+		scene.update_cached_transforms_range(begin, end);
+	});
 }
 
 }
@@ -25,6 +25,7 @@
 #include "renderer/scene.hpp"
 #include "renderer/render_queue.hpp"
 #include "threading/task_composer.hpp"
+#include "threading/task_graph.hpp"
 #include "util/hash.hpp"
 #include "math/frustum.hpp"
 
@@ -32,6 +33,8 @@
 
 namespace Granite::Threaded
 {
+// Gather functions distribute the scene objects over num_tasks lists.
+// Each list is only written by one task at a time, but the order and distribution of objects is not deterministic.
 
 void scene_gather_opaque_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
                                      VisibilityList *lists, const unsigned num_tasks);
@@ -39,10 +42,10 @@ void scene_gather_transparent_renderables(const Scene &scene, TaskComposer &comp
                                           VisibilityList *lists, const unsigned num_tasks);
 void scene_gather_static_shadow_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
                                             VisibilityList *lists, Util::Hash *transform_hashes,
-                                            const unsigned num_tasks, const std::function<bool ()> &cond = {});
+                                            const unsigned num_tasks);
 void scene_gather_dynamic_shadow_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
                                              VisibilityList *lists, Util::Hash *transform_hashes,
-                                             const unsigned num_tasks, const std::function<bool ()> &cond = {});
+                                             const unsigned num_tasks);
 void scene_gather_positional_light_renderables(const Scene &scene, TaskComposer &composer, const Frustum &frustum,
                                                VisibilityList *lists, const unsigned num_tasks);
 void scene_gather_positional_light_renderables_sorted(const Scene &scene, TaskComposer &composer, const RenderContext &context,
@@ -51,6 +54,8 @@ void scene_gather_positional_light_renderables_sorted(const Scene &scene, TaskCo
 void compose_parallel_push_renderables(TaskComposer &composer, const RenderContext &context,
                                        RenderQueue *queues, const VisibilityList *visibility, const unsigned count);
 
-void scene_update_cached_transforms(Scene &scene, TaskComposer &composer, const unsigned num_tasks);
+// Updates the cached world AABBs, recorded once into node of a reusable graph.
+// Cameras and directional lights are updated separately, see Scene::update_transform_listener_components().
+void scene_record_update_cached_transforms(Scene &scene, TaskGraph &graph, TaskGraph::Node node, const size_t grain);
 
 }
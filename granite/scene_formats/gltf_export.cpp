@@ -268,13 +268,13 @@ Hash RemapState::hash(const Mesh &m)
 
 	h.u32(0xff);
 	if (!m.positions.empty())
-		h.data(m.positions.data(), m.positions.size() * sizeof(m.positions[0]));
+		h.bulk(m.positions.data(), m.positions.size() * sizeof(m.positions[0]));
 	h.u32(0xff);
 	if (!m.indices.empty())
-		h.data(m.indices.data(), m.indices.size() * sizeof(m.indices[0]));
+		h.bulk(m.indices.data(), m.indices.size() * sizeof(m.indices[0]));
 	h.u32(0xff);
 	if (!m.attributes.empty())
-		h.data(m.attributes.data(), m.attributes.size() * sizeof(m.attributes[0]));
+		h.bulk(m.attributes.data(), m.attributes.size() * sizeof(m.attributes[0]));
 
 	h.u32(m.count);
 	return h.get();
@@ -325,7 +325,7 @@ void RemapState::filter_input(StateType &output, const SceneType &input)
 unsigned RemapState::emit_buffer(ArrayView<const uint8_t> view)
 {
 	Hasher h;
-	h.data(view.data(), view.size());
+	h.bulk(view.data(), view.size());
 	auto itr = buffer_hash.find(h.get());
 
 	if (itr == end(buffer_hash))
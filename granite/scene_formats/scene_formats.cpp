@@ -63,9 +63,9 @@ static IndexRemapping build_index_remap_list(const Mesh &mesh)
 	for (unsigned i = 0; i < attribute_count; i++)
 	{
 		Hasher h;
-		h.data(mesh.positions.data() + i * mesh.position_stride, mesh.position_stride);
+		h.bulk(mesh.positions.data() + i * mesh.position_stride, mesh.position_stride);
 		if (!mesh.attributes.empty())
-			h.data(mesh.attributes.data() + i * mesh.attribute_stride, mesh.attribute_stride);
+			h.bulk(mesh.attributes.data() + i * mesh.attribute_stride, mesh.attribute_stride);
 
 		auto hash = h.get();
 		auto itr = attribute_remapper.find(hash);
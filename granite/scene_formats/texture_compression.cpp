@@ -959,7 +959,9 @@ void CompressorState::enqueue_compression_block_astc(TaskGroupHandle &compressio
 
 void CompressorState::enqueue_compression(ThreadGroup &group, const CompressorArguments &args)
 {
+	// Compression is throughput work, never let it get in the way of a frame.
 	auto compression_task = group.create_task();
+	compression_task->set_priority(TaskPriority::Background);
 
 	for (unsigned layer = 0; layer < input->get_layout().get_layers(); layer++)
 	{
@@ -1038,6 +1040,7 @@ void CompressorState::enqueue_compression(ThreadGroup &group, const CompressorAr
 		state->output.reset();
 		state->input.reset();
 	});
+	write_task->set_priority(TaskPriority::Background);
 	group.add_dependency(*write_task, *compression_task);
 	write_task->set_fence_counter_signal(signal);
 }
@@ -1099,6 +1102,7 @@ bool compress_texture(ThreadGroup &group, const CompressorArguments &args, const
 
 		output->enqueue_compression(group, args);
 	});
+	setup_task->set_priority(TaskPriority::Background);
 	group.add_dependency(*setup_task, *dep);
 
 	return true;
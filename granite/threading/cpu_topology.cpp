@@ -0,0 +1,233 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "threading/cpu_topology.hpp"
+#include "util/logging.hpp"
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace Granite
+{
+static bool parse_cpu_list(const char *str, std::vector<unsigned> &cpus)
+{
+	cpus.clear();
+	while (*str != '\0' && *str != '\n')
+	{
+		char *end = nullptr;
+		unsigned long first = strtoul(str, &end, 10);
+		if (end == str)
+			return false;
+
+		unsigned long last = first;
+		str = end;
+		if (*str == '-')
+		{
+			str++;
+			last = strtoul(str, &end, 10);
+			if (end == str || last < first)
+				return false;
+			str = end;
+		}
+
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			cpus.push_back(unsigned(cpu));
+
+		if (*str == ',')
+			str++;
+	}
+
+	return !cpus.empty();
+}
+
+#ifdef __linux__
+static bool read_sysfs_line(const std::string &path, char *buffer, size_t size)
+{
+	FILE *file = fopen(path.c_str(), "r");
+	if (!file)
+		return false;
+	bool ret = fgets(buffer, int(size), file) != nullptr;
+	fclose(file);
+	return ret;
+}
+
+static bool read_sysfs_uint(const std::string &path, unsigned &value)
+{
+	char buffer[64];
+	if (!read_sysfs_line(path, buffer, sizeof(buffer)))
+		return false;
+	value = unsigned(strtoul(buffer, nullptr, 10));
+	return true;
+}
+
+static bool read_sysfs_first_cpu(const std::string &path, unsigned &cpu)
+{
+	char buffer[1024];
+	std::vector<unsigned> cpus;
+	if (!read_sysfs_line(path, buffer, sizeof(buffer)) || !parse_cpu_list(buffer, cpus))
+		return false;
+	cpu = cpus.front();
+	return true;
+}
+#endif
+
+bool query_cpu_topology(CPUTopology &topology)
+{
+	topology.cores.clear();
+
+#ifdef __linux__
+	char buffer[1024];
+	std::vector<unsigned> online;
+	if (!read_sysfs_line("/sys/devices/system/cpu/online", buffer, sizeof(buffer)) ||
+	    !parse_cpu_list(buffer, online))
+		return false;
+
+	for (auto cpu : online)
+	{
+		auto base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/";
+		CPUCore core;
+		core.cpu = cpu;
+
+		// Identify cores and domains by their lowest logical CPU, which is unique across packages.
+		if (!read_sysfs_first_cpu(base + "topology/thread_siblings_list", core.physical_core))
+			core.physical_core = cpu;
+		if (!read_sysfs_first_cpu(base + "cache/index3/shared_cpu_list", core.cache_domain) &&
+		    !read_sysfs_first_cpu(base + "topology/cluster_cpus_list", core.cache_domain) &&
+		    !read_sysfs_first_cpu(base + "topology/core_siblings_list", core.cache_domain))
+		{
+			core.cache_domain = 0;
+		}
+
+		// cpu_capacity is the scheduler's view on asymmetric systems, max frequency is a decent fallback.
+		if (!read_sysfs_uint(base + "cpu_capacity", core.capacity) &&
+		    !read_sysfs_uint(base + "cpufreq/cpuinfo_max_freq", core.capacity))
+		{
+			core.capacity = 0;
+		}
+
+		topology.cores.push_back(core);
+	}
+
+	for (auto &core : topology.cores)
+	{
+		core.smt_index = unsigned(std::count_if(topology.cores.begin(), topology.cores.end(), [&](const CPUCore &other) {
+			return other.physical_core == core.physical_core && other.cpu < core.cpu;
+		}));
+	}
+
+	return !topology.cores.empty();
+#else
+	return false;
+#endif
+}
+
+std::vector<int> compute_worker_cpus(const CPUTopology &topology, ThreadAffinityPolicy policy,
+                                     const std::vector<unsigned> &mask, unsigned num_workers)
+{
+	std::vector<int> worker_cpus(num_workers, -1);
+
+	if (policy == ThreadAffinityPolicy::Mask)
+	{
+		if (!mask.empty())
+			for (unsigned i = 0; i < num_workers; i++)
+				worker_cpus[i] = int(mask[i % mask.size()]);
+		return worker_cpus;
+	}
+
+	if (policy == ThreadAffinityPolicy::None || topology.cores.empty())
+		return worker_cpus;
+
+	auto order = topology.cores;
+	std::stable_sort(order.begin(), order.end(), [](const CPUCore &a, const CPUCore &b) {
+		if (a.capacity != b.capacity)
+			return a.capacity > b.capacity;
+		if (a.smt_index != b.smt_index)
+			return a.smt_index < b.smt_index;
+		if (a.cache_domain != b.cache_domain)
+			return a.cache_domain < b.cache_domain;
+		return a.cpu < b.cpu;
+	});
+
+	if (policy == ThreadAffinityPolicy::PhysicalCores)
+	{
+		order.erase(std::remove_if(order.begin(), order.end(), [](const CPUCore &core) {
+			return core.smt_index != 0;
+		}), order.end());
+	}
+
+	// With more workers than cores in PerformanceFirst, wrap around, oversubscribing the fastest cores first.
+	for (unsigned i = 0; i < num_workers; i++)
+	{
+		if (i < order.size())
+			worker_cpus[i] = int(order[i].cpu);
+		else if (policy == ThreadAffinityPolicy::PerformanceFirst)
+			worker_cpus[i] = int(order[i % order.size()].cpu);
+	}
+
+	return worker_cpus;
+}
+
+bool parse_thread_affinity(const char *str, ThreadAffinityPolicy &policy, std::vector<unsigned> &mask)
+{
+	std::vector<unsigned> parsed_mask;
+	ThreadAffinityPolicy parsed_policy;
+	if (strcmp(str, "none") == 0)
+		parsed_policy = ThreadAffinityPolicy::None;
+	else if (strcmp(str, "performance") == 0)
+		parsed_policy = ThreadAffinityPolicy::PerformanceFirst;
+	else if (strcmp(str, "physical") == 0)
+		parsed_policy = ThreadAffinityPolicy::PhysicalCores;
+	else if (parse_cpu_list(str, parsed_mask))
+		parsed_policy = ThreadAffinityPolicy::Mask;
+	else
+	{
+		LOGE("Invalid thread affinity \"%s\", expected none, performance, physical or a CPU list.\n", str);
+		return false;
+	}
+
+	policy = parsed_policy;
+	mask = std::move(parsed_mask);
+	return true;
+}
+
+bool set_current_thread_affinity(unsigned cpu)
+{
+#ifdef __linux__
+	if (cpu >= CPU_SETSIZE)
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+}
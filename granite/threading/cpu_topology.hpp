@@ -0,0 +1,72 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+
+namespace Granite
+{
+struct CPUCore
+{
+	// Logical CPU index as understood by the OS.
+	unsigned cpu = 0;
+	// Logical CPUs with the same physical core are SMT siblings.
+	unsigned physical_core = 0;
+	// Logical CPUs sharing the last level cache, e.g. one CCX, or one cluster on big.LITTLE.
+	unsigned cache_domain = 0;
+	// Relative performance. Higher is faster. All cores are equal if the system does not tell.
+	unsigned capacity = 0;
+	// 0 for the first logical CPU of a physical core, 1 for its first SMT sibling, and so on.
+	unsigned smt_index = 0;
+};
+
+struct CPUTopology
+{
+	std::vector<CPUCore> cores;
+};
+
+enum class ThreadAffinityPolicy
+{
+	// Leave placement to the OS.
+	None,
+	// Fastest cores first, one worker per physical core before SMT siblings, filling one cache domain at a time.
+	PerformanceFirst,
+	// Like PerformanceFirst, but never more than one worker per physical core. Excess workers are not pinned.
+	PhysicalCores,
+	// Workers are pinned round-robin to a user-supplied list of CPUs.
+	Mask
+};
+
+// Reads the topology from sysfs. Only implemented on Linux, returns false elsewhere.
+bool query_cpu_topology(CPUTopology &topology);
+
+// Returns the logical CPU for each worker, or -1 for workers which should not be pinned.
+std::vector<int> compute_worker_cpus(const CPUTopology &topology, ThreadAffinityPolicy policy,
+                                     const std::vector<unsigned> &mask, unsigned num_workers);
+
+// Parses "none", "performance", "physical" or a CPU list such as "0-3,6".
+// Invalid strings are logged, and leave policy and mask unchanged.
+bool parse_thread_affinity(const char *str, ThreadAffinityPolicy &policy, std::vector<unsigned> &mask);
+
+bool set_current_thread_affinity(unsigned cpu);
+}
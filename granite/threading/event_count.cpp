@@ -0,0 +1,114 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "threading/event_count.hpp"
+#include <climits>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Granite
+{
+#ifdef __linux__
+static void futex_wait(std::atomic<uint32_t> *addr, uint32_t expected)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> *addr, int count)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+#endif
+
+EventCount::EventCount()
+{
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex word must be 32-bit.");
+	epoch.store(0, std::memory_order_relaxed);
+	waiters.store(0, std::memory_order_relaxed);
+}
+
+uint32_t EventCount::prepare_wait() noexcept
+{
+	waiters.fetch_add(1, std::memory_order_relaxed);
+	// Pairs with the fence in notify(). Either the notifier sees our waiter count,
+	// or we see whatever state it published before notifying.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return epoch.load(std::memory_order_acquire);
+}
+
+void EventCount::cancel_wait() noexcept
+{
+	waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void EventCount::commit_wait(uint32_t key)
+{
+#ifdef __linux__
+	while (epoch.load(std::memory_order_acquire) == key)
+		futex_wait(&epoch, key);
+#else
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		cond.wait(holder, [&]() {
+			return epoch.load(std::memory_order_relaxed) != key;
+		});
+	}
+#endif
+	waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void EventCount::notify(bool all) noexcept
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (waiters.load(std::memory_order_relaxed) == 0)
+		return;
+
+#ifdef __linux__
+	epoch.fetch_add(1, std::memory_order_release);
+	futex_wake(&epoch, all ? INT_MAX : 1);
+#else
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		epoch.fetch_add(1, std::memory_order_release);
+	}
+
+	if (all)
+		cond.notify_all();
+	else
+		cond.notify_one();
+#endif
+}
+
+void EventCount::notify_one() noexcept
+{
+	notify(false);
+}
+
+void EventCount::notify_all() noexcept
+{
+	notify(true);
+}
+}
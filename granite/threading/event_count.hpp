@@ -0,0 +1,69 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#ifndef __linux__
+#include <mutex>
+#include <condition_variable>
+#endif
+
+namespace Granite
+{
+// Lets threads sleep on a condition without any lock in the notify path.
+// A waiter announces itself, re-checks its condition and only then goes to sleep:
+//
+//   auto key = event.prepare_wait();
+//   if (condition_is_met())
+//       event.cancel_wait();
+//   else
+//       event.commit_wait(key);
+//
+// Notifiers must make the condition visible before calling notify_one() or notify_all().
+// Notifying is just a fence and a load when nobody is waiting.
+// On Linux, sleeping is implemented with a futex, elsewhere it falls back to a condition variable.
+class EventCount
+{
+public:
+	EventCount();
+
+	uint32_t prepare_wait() noexcept;
+	void cancel_wait() noexcept;
+	void commit_wait(uint32_t key);
+
+	void notify_one() noexcept;
+	void notify_all() noexcept;
+
+private:
+	alignas(64) std::atomic<uint32_t> epoch;
+	std::atomic<uint32_t> waiters;
+#ifndef __linux__
+	std::mutex lock;
+	std::condition_variable cond;
+#endif
+
+	void notify(bool all) noexcept;
+};
+}
@@ -33,12 +33,15 @@ TaskComposer::TaskComposer(ThreadGroup &group_)
 void TaskComposer::set_incoming_task(TaskGroupHandle group_)
 {
 	current = std::move(group_);
+	stage_index++;
 }
 
 TaskGroup &TaskComposer::begin_pipeline_stage()
 {
 	auto new_group = group.create_task();
 	auto new_deps = group.create_task();
+	new_group->set_priority(priority);
+	new_deps->set_priority(priority);
 	if (current)
 	{
 		group.add_dependency(*new_group, *current);
@@ -46,6 +49,7 @@ TaskGroup &TaskComposer::begin_pipeline_stage()
 	}
 	current = std::move(new_group);
 	incoming_deps = std::move(new_deps);
+	stage_index++;
 	return *current;
 }
 
@@ -60,17 +64,37 @@ TaskGroup &TaskComposer::get_group()
 TaskGroupHandle TaskComposer::get_outgoing_task()
 {
 	begin_pipeline_stage();
+	if (desc)
+	{
+		current->set_desc(desc);
+		current->deps->record_critical_path = true;
+	}
 	return current;
 }
 
+void TaskComposer::set_desc(const char *desc_)
+{
+	desc = desc_;
+}
+
 TaskGroupHandle TaskComposer::get_pipeline_stage_dependency()
 {
 	return incoming_deps;
 }
 
+void TaskComposer::set_priority(TaskPriority priority_)
+{
+	priority = priority_;
+}
+
 ThreadGroup &TaskComposer::get_thread_group()
 {
 	return group;
 }
 
+uint64_t TaskComposer::get_pipeline_stage_index() const
+{
+	return stage_index;
+}
+
 }
@@ -40,10 +40,23 @@ public:
 	TaskGroupHandle get_pipeline_stage_dependency();
 	ThreadGroup &get_thread_group();
 
+	// Changes every time the current group is replaced, e.g. by begin_pipeline_stage().
+	uint64_t get_pipeline_stage_index() const;
+
+	// Applies to all pipeline stages begun after this call.
+	void set_priority(TaskPriority priority);
+
+	// When set, the critical path through the pipeline is recorded under desc
+	// in ThreadGroup::get_statistics() whenever an outgoing task completes.
+	void set_desc(const char *desc);
+
 private:
 	ThreadGroup &group;
 	TaskGroupHandle current;
 	TaskGroupHandle incoming_deps;
+	TaskPriority priority = TaskPriority::Normal;
+	const char *desc = nullptr;
+	uint64_t stage_index = 0;
 };
 
 }
@@ -0,0 +1,312 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "task_coroutine.hpp requires C++20 coroutines. Configure with GRANITE_CXX20=ON."
+#endif
+
+#include "threading/thread_group.hpp"
+#include "filesystem/filesystem.hpp"
+#include <coroutine>
+#include <optional>
+#include <type_traits>
+#include <exception>
+
+// Coroutines which run on a ThreadGroup. A coroutine can suspend on a TaskGroup, a TaskSignal
+// or blocking work such as file reads. While suspended, it does not occupy a worker;
+// it is resumed by a new task once whatever it waits for has completed.
+
+namespace Granite
+{
+
+class CoroutineTask
+{
+public:
+	struct promise_type;
+	using Handle = std::coroutine_handle<promise_type>;
+
+	struct FinalAwaiter
+	{
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(Handle handle) noexcept
+		{
+			// Destroy the frame first, so everything the coroutine owns is gone once dependees run.
+			auto deps = std::move(handle.promise().completion);
+			handle.destroy();
+			deps->dependency_satisfied();
+		}
+
+		void await_resume() const noexcept
+		{
+		}
+	};
+
+	struct promise_type
+	{
+		ThreadGroup *group = nullptr;
+		TaskPriority priority = TaskPriority::Normal;
+		Internal::TaskDepsHandle completion;
+
+		CoroutineTask get_return_object()
+		{
+			return CoroutineTask(Handle::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() const noexcept
+		{
+			return {};
+		}
+
+		FinalAwaiter final_suspend() const noexcept
+		{
+			return {};
+		}
+
+		void return_void()
+		{
+		}
+
+		// Like any other task, a coroutine must not throw.
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+	};
+
+	CoroutineTask() = default;
+
+	CoroutineTask(CoroutineTask &&other) noexcept
+	    : handle(other.handle)
+	{
+		other.handle = {};
+	}
+
+	CoroutineTask &operator=(CoroutineTask &&other) noexcept
+	{
+		if (this != &other)
+		{
+			if (handle)
+				handle.destroy();
+			handle = other.handle;
+			other.handle = {};
+		}
+		return *this;
+	}
+
+	~CoroutineTask()
+	{
+		if (handle)
+			handle.destroy();
+	}
+
+	// Starts running the coroutine on group. Every time it resumes, it runs as a task with the given priority.
+	// The returned group completes when the coroutine returns, and can be waited on or depended on like
+	// any other task group. Since the coroutine keeps running after this returns,
+	// pass arguments by value rather than by reference to temporaries.
+	TaskGroupHandle launch(ThreadGroup &group, TaskPriority priority = TaskPriority::Normal)
+	{
+		if (!handle)
+			throw std::logic_error("Cannot launch an empty coroutine.");
+
+		auto completion = group.create_task();
+		completion->set_priority(priority);
+
+		auto &promise = handle.promise();
+		promise.group = &group;
+		promise.priority = priority;
+		promise.completion = completion->deps;
+		completion->add_flush_dependency();
+
+		schedule(handle);
+		handle = {};
+		return completion;
+	}
+
+	// Enqueues a task which resumes the coroutine.
+	static void schedule(Handle handle)
+	{
+		auto &promise = handle.promise();
+		auto task = promise.group->create_task([handle]() {
+			handle.resume();
+		});
+		task->set_priority(promise.priority);
+		task->set_desc("coroutine-resume");
+	}
+
+private:
+	explicit CoroutineTask(Handle handle_)
+	    : handle(handle_)
+	{
+	}
+
+	Handle handle;
+};
+
+namespace Internal
+{
+struct TaskGroupAwaiter
+{
+	TaskGroupHandle dependency;
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	void await_suspend(CoroutineTask::Handle handle)
+	{
+		auto &promise = handle.promise();
+		auto resume_task = promise.group->create_task([handle]() {
+			handle.resume();
+		});
+		resume_task->set_priority(promise.priority);
+		resume_task->set_desc("coroutine-resume");
+
+		// Awaiting a group we have not flushed yet implies the flush, like TaskGroup::wait().
+		auto dep = std::move(dependency);
+		promise.group->add_late_dependency(*resume_task, *dep);
+		if (!dep->flushed)
+			dep->flush();
+
+		// The coroutine may resume on another thread as soon as resume_task is flushed,
+		// so nothing in the frame can be touched from here on.
+	}
+
+	void await_resume() const noexcept
+	{
+	}
+};
+
+struct TaskSignalAwaiter
+{
+	TaskSignal &signal;
+	uint64_t count;
+
+	bool await_ready() const
+	{
+		return signal.get_count() >= count;
+	}
+
+	void await_suspend(CoroutineTask::Handle handle)
+	{
+		auto &promise = handle.promise();
+		auto resume_task = promise.group->create_task([handle]() {
+			handle.resume();
+		});
+		resume_task->set_priority(promise.priority);
+		resume_task->set_desc("coroutine-resume");
+		signal.add_dependee(*resume_task, count);
+	}
+
+	void await_resume() const noexcept
+	{
+	}
+};
+
+template <typename Func>
+class BackgroundAwaiter
+{
+public:
+	using Result = std::invoke_result_t<Func &>;
+
+	explicit BackgroundAwaiter(Func func_)
+	    : func(std::move(func_))
+	{
+	}
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	void await_suspend(CoroutineTask::Handle handle)
+	{
+		auto &promise = handle.promise();
+		auto task = promise.group->create_task([this, handle]() {
+			if constexpr (std::is_void_v<Result>)
+				func();
+			else
+				result.emplace(func());
+
+			// Resume in a separate task, so the rest of the coroutine runs with its own priority.
+			if (handle.promise().priority == TaskPriority::Background)
+				handle.resume();
+			else
+				CoroutineTask::schedule(handle);
+		});
+		task->set_priority(TaskPriority::Background);
+		task->set_desc("coroutine-background");
+	}
+
+	Result await_resume()
+	{
+		if constexpr (!std::is_void_v<Result>)
+			return std::move(*result);
+	}
+
+private:
+	Func func;
+	struct Empty
+	{
+	};
+	std::optional<std::conditional_t<std::is_void_v<Result>, Empty, Result>> result;
+};
+}
+
+// co_await group suspends until group has completed.
+inline Internal::TaskGroupAwaiter operator co_await(TaskGroupHandle group)
+{
+	return { std::move(group) };
+}
+
+// co_await wait_for(signal, count) suspends until the signal counter has reached count.
+inline Internal::TaskSignalAwaiter wait_for(TaskSignal &signal, uint64_t count)
+{
+	return { signal, count };
+}
+
+// co_await run_in_background(func) runs blocking work such as I/O as a background task,
+// subject to ThreadGroup::set_max_background_workers(), and returns its result.
+template <typename Func>
+inline Internal::BackgroundAwaiter<Func> run_in_background(Func func)
+{
+	return Internal::BackgroundAwaiter<Func>(std::move(func));
+}
+
+// co_await read_file(fs, path) opens and maps a file in the background.
+// Returns nullptr if the file could not be opened or mapped.
+inline auto read_file(Filesystem &fs, std::string path)
+{
+	return run_in_background([&fs, path = std::move(path)]() -> std::unique_ptr<File> {
+		auto file = fs.open(path, FileMode::ReadOnly);
+		if (!file || !file->map())
+			return {};
+		return file;
+	});
+}
+}
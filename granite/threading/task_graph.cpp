@@ -0,0 +1,196 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "threading/task_graph.hpp"
+#include <stdexcept>
+#include <cstdio>
+
+namespace Granite
+{
+TaskGraph::TaskGraph(ThreadGroup &group_)
+	: group(group_)
+{
+}
+
+TaskGraph::~TaskGraph()
+{
+	if (launched)
+		wait();
+}
+
+std::unique_ptr<TaskGraph::NodeData> TaskGraph::create_node_data(const char *desc, TaskPriority priority)
+{
+	auto node = std::make_unique<NodeData>();
+	node->deps = Internal::TaskDepsHandle(group.allocate_task_deps());
+	node->deps->priority = priority;
+	node->deps->recorded_tasks = &node->tasks;
+	node->deps->recorded_completion = &completion;
+	if (desc)
+	{
+		snprintf(node->deps->desc, sizeof(node->deps->desc), "%s", desc);
+		node->deps->desc_id = Util::TimelineTraceFile::intern_string(node->deps->desc);
+	}
+	return node;
+}
+
+void TaskGraph::check_recording() const
+{
+	if (launched)
+		throw std::logic_error("Cannot modify a TaskGraph which has been launched.");
+}
+
+TaskGraph::Node TaskGraph::add_node(const char *desc, TaskPriority priority)
+{
+	check_recording();
+	nodes.push_back(create_node_data(desc, priority));
+	return Node(nodes.size() - 1);
+}
+
+void TaskGraph::add_task(Node node, TaskFunction func)
+{
+	check_recording();
+	nodes[node]->tasks.emplace_back([f = std::move(func)](Internal::TaskDeps &) {
+		f();
+	});
+}
+
+void TaskGraph::add_parallel_for(Node node, Util::SmallFunction<size_t ()> count, size_t grain,
+                                 ParallelForFunction func)
+{
+	check_recording();
+	Internal::ParallelForStateHandle state(group.parallel_for_pool.allocate(&group));
+	state->func = std::move(func);
+	state->grain = std::max<size_t>(grain, 1);
+
+	auto *thread_group = &group;
+	nodes[node]->tasks.emplace_back([thread_group, state, c = std::move(count)](Internal::TaskDeps &deps) {
+		size_t num_items = c();
+		if (num_items)
+			thread_group->run_parallel_for_range(state, deps, 0, num_items);
+	});
+}
+
+void TaskGraph::add_dependency(Node dependee, Node dependency)
+{
+	check_recording();
+	nodes[dependency]->deps->pending.push_back(nodes[dependee]->deps);
+	nodes[dependency]->has_dependees = true;
+	nodes[dependee]->num_dependencies++;
+}
+
+void TaskGraph::bake()
+{
+	// Everything hangs off a source node which kicks the launch, and feeds into a sink node we can wait for.
+	source = create_node_data("task-graph-source", TaskPriority::FrameCritical);
+	sink = create_node_data("task-graph-sink", TaskPriority::FrameCritical);
+
+	for (auto &node : nodes)
+	{
+		if (node->num_dependencies == 0)
+		{
+			source->deps->pending.push_back(node->deps);
+			node->num_dependencies++;
+		}
+
+		if (!node->has_dependees)
+		{
+			node->deps->pending.push_back(sink->deps);
+			sink->num_dependencies++;
+		}
+	}
+
+	if (nodes.empty())
+	{
+		source->deps->pending.push_back(sink->deps);
+		sink->num_dependencies++;
+	}
+}
+
+void TaskGraph::reset(NodeData &node, unsigned num_dependencies)
+{
+	auto &deps = *node.deps;
+	deps.count.store(0, std::memory_order_relaxed);
+	deps.max_task_ns.store(0, std::memory_order_relaxed);
+	deps.incoming_path_ns.store(0, std::memory_order_relaxed);
+	// One extra dependency for the launch itself, like a TaskGroup's flush.
+	deps.dependency_count.store(num_dependencies + 1, std::memory_order_relaxed);
+	std::lock_guard<std::mutex> holder{deps.cond_lock};
+	deps.done = false;
+}
+
+void TaskGraph::launch()
+{
+	launch(nullptr);
+}
+
+void TaskGraph::launch(TaskGroup &dependency)
+{
+	launch(&dependency);
+}
+
+void TaskGraph::launch(TaskGroup *dependency)
+{
+	if (is_running())
+		throw std::logic_error("Cannot launch a TaskGraph which is still running.");
+	if (dependency && dependency->flushed)
+		throw std::logic_error("Cannot launch a TaskGraph after a task group which has been flushed.");
+
+	if (!launched)
+		bake();
+
+	// The sink is done, but nodes of the previous launch might still be touching their deps.
+	completion.wait();
+	launched = true;
+	completion.outstanding = unsigned(nodes.size()) + 2;
+
+	for (auto &node : nodes)
+		reset(*node, node->num_dependencies);
+	reset(*sink, sink->num_dependencies);
+	reset(*source, dependency ? 1 : 0);
+
+	if (dependency)
+		dependency->deps->pending.push_back(source->deps);
+
+	// Nodes cannot fire before the source has, so release the launch dependency of the source last.
+	for (auto &node : nodes)
+		node->deps->dependency_satisfied();
+	sink->deps->dependency_satisfied();
+	source->deps->dependency_satisfied();
+}
+
+void TaskGraph::wait()
+{
+	if (launched)
+	{
+		group.wait_for_deps(*sink->deps);
+		completion.wait();
+	}
+}
+
+bool TaskGraph::is_running()
+{
+	if (!launched)
+		return false;
+	std::lock_guard<std::mutex> holder{sink->deps->cond_lock};
+	return !sink->deps->done;
+}
+}
@@ -0,0 +1,84 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "threading/thread_group.hpp"
+#include <vector>
+#include <memory>
+
+namespace Granite
+{
+// A task graph which is recorded once and launched any number of times, e.g. once per frame.
+// Launching resets the counters of every node in place. Nothing is allocated for the nodes,
+// and no dependencies are added again, unlike building the same DAG out of TaskGroups every frame.
+// Recorded work is invoked on every launch, so per-launch parameters are passed by
+// updating whatever state the work reads before calling launch().
+class TaskGraph
+{
+public:
+	using Node = unsigned;
+
+	explicit TaskGraph(ThreadGroup &group);
+	~TaskGraph();
+
+	TaskGraph(TaskGraph &&) = delete;
+	void operator=(TaskGraph &&) = delete;
+
+	// Recording. The graph cannot be modified once it has been launched.
+	Node add_node(const char *desc = nullptr, TaskPriority priority = TaskPriority::Normal);
+	void add_task(Node node, TaskFunction func);
+	// count is queried every time the node runs, so the range can change between launches.
+	void add_parallel_for(Node node, Util::SmallFunction<size_t ()> count, size_t grain, ParallelForFunction func);
+	void add_dependency(Node dependee, Node dependency);
+
+	void launch();
+	// Like launch(), but the graph does not start until dependency has completed.
+	// dependency must not have been flushed yet.
+	void launch(TaskGroup &dependency);
+	void wait();
+	bool is_running();
+
+private:
+	ThreadGroup &group;
+
+	struct NodeData
+	{
+		Internal::TaskDepsHandle deps;
+		std::vector<Internal::RecordedTaskFunction> tasks;
+		unsigned num_dependencies = 0;
+		bool has_dependees = false;
+	};
+	// Nodes are referenced by their deps, so they must not move around.
+	std::vector<std::unique_ptr<NodeData>> nodes;
+	std::unique_ptr<NodeData> source;
+	std::unique_ptr<NodeData> sink;
+	Internal::RecordedCompletion completion;
+	bool launched = false;
+
+	std::unique_ptr<NodeData> create_node_data(const char *desc, TaskPriority priority);
+	void check_recording() const;
+	void bake();
+	void reset(NodeData &node, unsigned num_dependencies);
+	void launch(TaskGroup *dependency);
+};
+}
@@ -27,27 +27,79 @@
 #include "vulkan/thread_id.hpp"
 #include "util/string_helpers.hpp"
 #include "util/timeline_trace_file.hpp"
+#include "util/timer.hpp"
 
+#include <algorithm>
+#include <climits>
 #include <cassert>
 #include <stdexcept>
 
 namespace Granite::Internal
 {
 
+static void atomic_max(std::atomic<uint64_t> &value, uint64_t new_value)
+{
+	uint64_t old_value = value.load(std::memory_order_relaxed);
+	while (old_value < new_value &&
+	       !value.compare_exchange_weak(old_value, new_value, std::memory_order_relaxed))
+	{
+	}
+}
+
 void TaskDeps::notify_dependees()
 {
 	if (signal)
 		signal->signal_increment();
 
+	// The acq_rel counter updates order these with respect to the dependees.
+	uint64_t path_ns = incoming_path_ns.load(std::memory_order_relaxed) + max_task_ns.load(std::memory_order_relaxed);
+	if (record_critical_path)
+		group->record_pipeline_critical_path(desc, path_ns);
+
 	for (auto &dep : pending)
+	{
+		atomic_max(dep->incoming_path_ns, path_ns);
 		dep->dependency_satisfied();
-	pending.clear();
+	}
+	if (!recorded_tasks)
+		pending.clear();
 
 	{
 		std::lock_guard<std::mutex> holder{cond_lock};
 		done = true;
 		cond.notify_one();
 	}
+
+	// Nothing can be added to late_pending once done is set.
+	for (auto &dep : late_pending)
+	{
+		atomic_max(dep->incoming_path_ns, path_ns);
+		dep->dependency_satisfied();
+	}
+	late_pending.clear();
+
+	group->wake_helpers();
+
+	// Must be the last access, a TaskGraph may be relaunched and reset these deps right after.
+	if (recorded_completion)
+		recorded_completion->node_completed();
+}
+
+void RecordedCompletion::node_completed()
+{
+	// Decrement under the lock, so the graph cannot go away between the decrement and the notify.
+	std::lock_guard<std::mutex> holder{lock};
+	assert(outstanding > 0);
+	if (--outstanding == 0)
+		cond.notify_all();
+}
+
+void RecordedCompletion::wait()
+{
+	std::unique_lock<std::mutex> holder{lock};
+	cond.wait(holder, [this]() {
+		return outstanding == 0;
+	});
 }
 
 void TaskDeps::task_completed()
@@ -65,11 +117,13 @@ void TaskDeps::dependency_satisfied()
 
 	if (old_deps == 1)
 	{
-		if (pending_tasks.empty())
+		if (recorded_tasks)
+			group->spawn_recorded_tasks(*this);
+		else if (pending_tasks.empty())
 			notify_dependees();
 		else
 		{
-			group->move_to_ready_tasks(pending_tasks);
+			group->move_to_ready_tasks(pending_tasks.data(), pending_tasks.size());
 			pending_tasks.clear();
 		}
 	}
@@ -80,6 +134,44 @@ void TaskDeps::dependency_satisfied()
 namespace Granite
 {
 
+struct WorkerThreadState
+{
+	ThreadGroup *group = nullptr;
+	unsigned index = 0;
+	// Number of tasks currently executing on this thread, nested ones included.
+	unsigned task_depth = 0;
+};
+static thread_local WorkerThreadState current_worker;
+
+Internal::Task *ThreadGroup::allocate_task(Internal::TaskDepsHandle deps, TaskFunction func)
+{
+	return task_pool.allocate(std::move(deps), std::move(func));
+}
+
+void ThreadGroup::free_task(Internal::Task *task)
+{
+	task_pool.free(task);
+}
+
+TaskGroup *ThreadGroup::allocate_task_group()
+{
+	return task_group_pool.allocate(this);
+}
+
+Internal::TaskDeps *ThreadGroup::allocate_task_deps()
+{
+	return task_deps_pool.allocate(this);
+}
+
+void ThreadGroup::flush_thread_cache()
+{
+	task_pool.flush_thread_cache();
+	task_group_pool.flush_thread_cache();
+	task_deps_pool.flush_thread_cache();
+	parallel_for_pool.flush_thread_cache();
+	parallel_reduce_pool.flush_thread_cache();
+}
+
 TaskGroup::TaskGroup(ThreadGroup *group_)
 		: group(group_)
 {
@@ -108,11 +200,7 @@ void TaskGroup::wait()
 {
 	if (!flushed)
 		flush();
-
-	std::unique_lock<std::mutex> holder{deps->cond_lock};
-	deps->cond.wait(holder, [this]() {
-		return deps->done;
-	});
+	group->wait_for_deps(*deps);
 }
 
 TaskGroup::~TaskGroup()
@@ -149,10 +237,13 @@ void ThreadGroup::start(unsigned num_threads)
 	if (active)
 		throw std::logic_error("Cannot start a thread group which has already started.");
 
-	dead = false;
+	dead.store(false, std::memory_order_relaxed);
 	active = true;
 
 	thread_group.resize(num_threads);
+	worker_queues.resize(num_threads);
+	for (auto &q : worker_queues)
+		q = std::make_unique<WorkerQueue>();
 
 	// Make sure the worker threads have the correct global data references.
 	auto ctx = std::shared_ptr<Global::GlobalManagers>(Global::create_thread_context().release(),
@@ -160,10 +251,24 @@ void ThreadGroup::start(unsigned num_threads)
 
 	if (const char *env = getenv("GRANITE_TIMELINE_TRACE"))
 	{
-		LOGI("Enabling JSON timeline tracing to %s.\n", env);
+		LOGI("Enabling binary timeline tracing to %s, convert it with timeline-trace-to-json.\n", env);
 		timeline_trace_file = std::make_unique<Util::TimelineTraceFile>(env);
 	}
 
+	// An invalid override keeps the policy set by the application.
+	if (const char *env = getenv("GRANITE_THREAD_AFFINITY"))
+		parse_thread_affinity(env, affinity_policy, affinity_mask);
+
+	setup_worker_affinity(num_threads);
+
+	// Workers, plus the thread which submits work.
+	task_pool.reserve_thread_caches(num_threads + 1);
+	task_group_pool.reserve_thread_caches(num_threads + 1);
+	task_deps_pool.reserve_thread_caches(num_threads + 1);
+	parallel_for_pool.reserve_thread_caches(num_threads + 1);
+	parallel_reduce_pool.reserve_thread_caches(num_threads + 1);
+	prepare_thread_caches();
+
 	refresh_global_timeline_trace_file();
 	set_main_thread_name();
 
@@ -171,15 +276,60 @@ void ThreadGroup::start(unsigned num_threads)
 	for (auto &t : thread_group)
 	{
 		t = std::make_unique<std::thread>([this, ctx, self_index]() {
+			int cpu = worker_cpus[self_index - 1];
+			if (cpu >= 0 && !set_current_thread_affinity(unsigned(cpu)))
+				LOGW("Failed to pin worker %u to CPU %d.\n", self_index - 1, cpu);
 			refresh_global_timeline_trace_file();
 			set_worker_thread_name(self_index - 1);
 			Global::set_thread_context(*ctx);
+			prepare_thread_caches();
 			thread_looper(self_index);
 		});
 		self_index++;
 	}
 }
 
+void ThreadGroup::prepare_thread_caches()
+{
+	// Tasks are freed on whichever thread completes them, so every thread needs its magazines
+	// before the first frame, or that frame allocates them.
+	task_pool.prepare_thread_cache();
+	task_group_pool.prepare_thread_cache();
+	task_deps_pool.prepare_thread_cache();
+	parallel_for_pool.prepare_thread_cache();
+	parallel_reduce_pool.prepare_thread_cache();
+}
+
+void ThreadGroup::set_affinity_policy(ThreadAffinityPolicy policy, std::vector<unsigned> cpu_mask)
+{
+	affinity_policy = policy;
+	affinity_mask = std::move(cpu_mask);
+}
+
+void ThreadGroup::setup_worker_affinity(unsigned num_threads)
+{
+	worker_cpus.assign(num_threads, -1);
+	if (affinity_policy == ThreadAffinityPolicy::None)
+		return;
+
+	if (affinity_policy != ThreadAffinityPolicy::Mask && !query_cpu_topology(cpu_topology))
+	{
+		LOGW("Could not query CPU topology, workers will not be pinned.\n");
+		return;
+	}
+
+	worker_cpus = compute_worker_cpus(cpu_topology, affinity_policy, affinity_mask, num_threads);
+
+	std::string layout;
+	for (auto cpu : worker_cpus)
+	{
+		if (!layout.empty())
+			layout += ", ";
+		layout += cpu >= 0 ? std::to_string(cpu) : std::string("-");
+	}
+	LOGI("Worker CPU layout: %s.\n", layout.c_str());
+}
+
 void ThreadGroup::submit(TaskGroupHandle &group)
 {
 	group->flush();
@@ -197,18 +347,217 @@ void ThreadGroup::add_dependency(TaskGroup &dependee, TaskGroup &dependency)
 	dependee.deps->dependency_count.fetch_add(1, std::memory_order_relaxed);
 }
 
-void ThreadGroup::move_to_ready_tasks(const std::vector<Internal::Task *> &list)
+void ThreadGroup::add_late_dependency(TaskGroup &dependee, TaskGroup &dependency)
 {
-	std::lock_guard<std::mutex> holder{cond_lock};
-	total_tasks.fetch_add(list.size(), std::memory_order_relaxed);
+	if (dependee.flushed)
+		throw std::logic_error("Cannot add dependency to task group which has been flushed.");
 
-	for (auto &t : list)
-		ready_tasks.push(t);
+	auto &deps = *dependency.deps;
+	std::lock_guard<std::mutex> holder{deps.cond_lock};
+	if (deps.done)
+		return;
 
-	if (list.size() > 1)
-		cond.notify_all();
+	deps.late_pending.push_back(dependee.deps);
+	dependee.deps->dependency_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ThreadGroup::push_injected_tasks(unsigned lane, Internal::Task * const *tasks, size_t count)
+{
+	auto &queue = injected_queues[lane];
+	std::lock_guard<std::mutex> holder{queue.lock};
+
+	if (queue.size + count > queue.ring.size())
+	{
+		size_t new_size = queue.ring.size();
+		while (new_size < queue.size + count)
+			new_size *= 2;
+
+		std::vector<Internal::Task *> new_ring(new_size);
+		for (size_t i = 0; i < queue.size; i++)
+			new_ring[i] = queue.ring[(queue.head + i) & (queue.ring.size() - 1)];
+		queue.ring = std::move(new_ring);
+		queue.head = 0;
+	}
+
+	size_t mask = queue.ring.size() - 1;
+	for (size_t i = 0; i < count; i++)
+		queue.ring[(queue.head + queue.size + i) & mask] = tasks[i];
+	queue.size += count;
+	queue.count.fetch_add(unsigned(count), std::memory_order_release);
+}
+
+Internal::Task *ThreadGroup::pop_injected_task(unsigned lane)
+{
+	auto &queue = injected_queues[lane];
+	if (queue.count.load(std::memory_order_acquire) == 0)
+		return nullptr;
+
+	std::lock_guard<std::mutex> holder{queue.lock};
+	if (queue.size == 0)
+		return nullptr;
+
+	auto *task = queue.ring[queue.head];
+	queue.head = (queue.head + 1) & (queue.ring.size() - 1);
+	queue.size--;
+	queue.count.fetch_sub(1, std::memory_order_relaxed);
+	return task;
+}
+
+void ThreadGroup::move_to_ready_tasks(Internal::Task * const *tasks, size_t count)
+{
+	if (!count)
+		return;
+
+	total_tasks.fetch_add(count, std::memory_order_relaxed);
+
+	// Tasks moved together always come from the same group, so they share priority.
+	unsigned lane = unsigned(tasks[0]->deps->priority);
+	int64_t ready_time = Util::get_current_time_nsecs();
+	for (size_t i = 0; i < count; i++)
+		tasks[i]->ready_time_ns = ready_time;
+
+	size_t pushed = 0;
+	if (current_worker.group == this)
+	{
+		// Keep the work local. It is likely hot in cache and we avoid touching any shared state.
+		auto &deque = worker_queues[current_worker.index]->deques[lane];
+		while (pushed < count && deque.push(tasks[pushed]))
+			pushed++;
+	}
+
+	if (pushed < count)
+		push_injected_tasks(lane, tasks + pushed, count - pushed);
+
+	if (count > 1)
+		idle_event.notify_all();
 	else
-		cond.notify_one();
+		idle_event.notify_one();
+	helper_event.notify_all();
+}
+
+bool ThreadGroup::local_queue_is_empty(TaskPriority priority) const
+{
+	// Threads helping out while waiting push their work to the injected queues.
+	if (current_worker.group != this)
+		return injected_queues[unsigned(priority)].count.load(std::memory_order_relaxed) == 0;
+	return worker_queues[current_worker.index]->deques[unsigned(priority)].empty();
+}
+
+void ThreadGroup::enqueue_nested_task(Internal::TaskDeps &deps, TaskFunction func)
+{
+	// The calling task holds a count, so the group cannot complete under us.
+	deps.count.fetch_add(1, std::memory_order_relaxed);
+	deps.add_reference();
+	Internal::Task *task = allocate_task(Internal::TaskDepsHandle(&deps), std::move(func));
+	move_to_ready_tasks(&task, 1);
+}
+
+void ThreadGroup::spawn_recorded_tasks(Internal::TaskDeps &deps)
+{
+	auto &recorded = *deps.recorded_tasks;
+	if (recorded.empty())
+	{
+		deps.notify_dependees();
+		return;
+	}
+
+	deps.count.store(unsigned(recorded.size()), std::memory_order_relaxed);
+
+	Util::SmallVector<Internal::Task *, 16> tasks;
+	for (auto &func : recorded)
+	{
+		auto *f = &func;
+		auto *d = &deps;
+		deps.add_reference();
+		tasks.push_back(allocate_task(Internal::TaskDepsHandle(d), [f, d]() { (*f)(*d); }));
+	}
+
+	move_to_ready_tasks(tasks.data(), tasks.size());
+}
+
+void ThreadGroup::run_parallel_for_range(const Internal::ParallelForStateHandle &state,
+                                         Internal::TaskDeps &deps, size_t begin, size_t end)
+{
+	// Lazy binary splitting. If our local queue is empty, the work we offered has been stolen,
+	// so there is demand for more and we hand out half of what remains.
+	// Otherwise, nobody is hungry and we chew through the range grain by grain.
+	while (end - begin > state->grain)
+	{
+		if (local_queue_is_empty(deps.priority))
+		{
+			size_t mid = begin + (end - begin) / 2;
+			// Init-capture so the handle is not captured as const, which would make the task non-movable.
+			enqueue_nested_task(deps, [this, state = state, &deps, mid, end]() {
+				run_parallel_for_range(state, deps, mid, end);
+			});
+			end = mid;
+		}
+		else
+		{
+			state->func(begin, begin + state->grain);
+			begin += state->grain;
+		}
+	}
+
+	if (begin < end)
+		state->func(begin, end);
+}
+
+void ThreadGroup::parallel_for(TaskGroup &group, size_t count, size_t grain, ParallelForFunction func)
+{
+	if (group.flushed)
+		throw std::logic_error("Cannot enqueue work to a flushed task group.");
+	if (count == 0)
+		return;
+
+	Internal::ParallelForStateHandle state(parallel_for_pool.allocate(this));
+	state->func = std::move(func);
+	state->grain = std::max<size_t>(grain, 1);
+
+	auto *deps = group.deps.get();
+	enqueue_task(group, [this, state, deps, count]() {
+		run_parallel_for_range(state, *deps, 0, count);
+	});
+}
+
+void ThreadGroup::parallel_reduce(TaskGroup &group, size_t count, size_t grain, unsigned num_partials,
+                                  ParallelReduceFunction func)
+{
+	if (group.flushed)
+		throw std::logic_error("Cannot enqueue work to a flushed task group.");
+	if (count == 0 || num_partials == 0)
+		return;
+
+	Internal::ParallelReduceStateHandle state(parallel_reduce_pool.allocate(this));
+	state->func = std::move(func);
+	state->count = count;
+	state->grain = std::max<size_t>(grain, 1);
+	state->num_partials = num_partials;
+
+	// No point in spinning up partials which can never get a chunk.
+	size_t max_chunks = (count + state->grain - 1) / state->grain;
+	unsigned num_tasks = unsigned(std::min<size_t>(num_partials, max_chunks));
+
+	for (unsigned partial = 0; partial < num_tasks; partial++)
+	{
+		enqueue_task(group, [state, partial]() mutable {
+			size_t begin = state->cursor.load(std::memory_order_relaxed);
+			while (begin < state->count)
+			{
+				// Guided self-scheduling. Big chunks up front keep overhead down,
+				// smaller chunks towards the end keep partials finishing at the same time.
+				size_t remaining = state->count - begin;
+				size_t chunk = std::max(state->grain, remaining / (2 * state->num_partials));
+				chunk = std::min(chunk, remaining);
+
+				if (state->cursor.compare_exchange_weak(begin, begin + chunk, std::memory_order_relaxed))
+				{
+					state->func(begin, begin + chunk, partial);
+					begin = state->cursor.load(std::memory_order_relaxed);
+				}
+			}
+		});
+	}
 }
 
 void Internal::TaskGroupDeleter::operator()(TaskGroup *group)
@@ -221,6 +570,16 @@ void Internal::TaskDepsDeleter::operator()(Internal::TaskDeps *deps)
 	deps->group->free_task_deps(deps);
 }
 
+void Internal::ParallelStateDeleter::operator()(Internal::ParallelForState *state)
+{
+	state->group->free_parallel_for_state(state);
+}
+
+void Internal::ParallelStateDeleter::operator()(Internal::ParallelReduceState *state)
+{
+	state->group->free_parallel_reduce_state(state);
+}
+
 void ThreadGroup::free_task_group(TaskGroup *group)
 {
 	task_group_pool.free(group);
@@ -231,36 +590,129 @@ void ThreadGroup::free_task_deps(Internal::TaskDeps *deps)
 	task_deps_pool.free(deps);
 }
 
-void TaskSignal::signal_increment()
+void ThreadGroup::free_parallel_for_state(Internal::ParallelForState *state)
 {
-	std::lock_guard<std::mutex> holder{lock};
-	counter++;
-	cond.notify_all();
+	parallel_for_pool.free(state);
+}
+
+void ThreadGroup::free_parallel_reduce_state(Internal::ParallelReduceState *state)
+{
+	parallel_reduce_pool.free(state);
+}
+
+TaskSignal::TaskSignal()
+{
+	state.store(0, std::memory_order_relaxed);
+}
+
+uint64_t TaskSignal::get_count() const
+{
+	return state.load(std::memory_order_acquire) >> 1;
+}
+
+void TaskSignal::wake_up_to(uint64_t count)
+{
+	// Releasing a dependee can run arbitrary work which uses this signal again, so only do it once unlocked.
+	Util::SmallVector<Internal::TaskDepsHandle, 4> satisfied;
+
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		// Another increment may have landed since, and it might have found the lock taken.
+		count = std::max(count, state.load(std::memory_order_relaxed) >> 1);
+
+		for (size_t i = 0; i < waiters.size(); )
+		{
+			if (waiters[i]->count <= count)
+			{
+				waiters[i]->woken = true;
+				waiters[i]->cond.notify_one();
+				waiters[i] = waiters.back();
+				waiters.pop_back();
+			}
+			else
+				i++;
+		}
+
+		for (size_t i = 0; i < dependees.size(); )
+		{
+			if (dependees[i].count <= count)
+			{
+				satisfied.push_back(std::move(dependees[i].deps));
+				dependees[i] = std::move(dependees.back());
+				dependees.pop_back();
+			}
+			else
+				i++;
+		}
+
+		if (waiters.empty() && dependees.empty())
+			state.fetch_and(~uint64_t(1), std::memory_order_relaxed);
+	}
+
+	for (auto &deps : satisfied)
+		deps->dependency_satisfied();
+}
+
+bool TaskSignal::register_with_count(uint64_t count)
+{
+	// Must be called with the lock held. Setting the bit routes every later increment through wake_up_to(),
+	// and the returned counter tells us whether an earlier increment already got there.
+	uint64_t old_state = state.fetch_or(1, std::memory_order_acq_rel);
+	if ((old_state >> 1) >= count)
+	{
+		if (!(old_state & 1))
+			state.fetch_and(~uint64_t(1), std::memory_order_relaxed);
+		return false;
+	}
+	return true;
 }
 
 void TaskSignal::wait_until_at_least(uint64_t count)
 {
+	if (get_count() >= count)
+		return;
+
 	std::unique_lock<std::mutex> holder{lock};
-	cond.wait(holder, [&]() -> bool {
-		return counter >= count;
+	if (!register_with_count(count))
+		return;
+
+	Waiter waiter;
+	waiter.count = count;
+	waiters.push_back(&waiter);
+	// The waker notifies with the lock held, so waiter cannot go out of scope under its feet.
+	waiter.cond.wait(holder, [&]() {
+		return waiter.woken;
 	});
 }
 
-TaskGroupHandle ThreadGroup::create_task(std::function<void()> func)
+void TaskSignal::add_dependee(TaskGroup &dependee, uint64_t count)
+{
+	if (dependee.flushed)
+		throw std::logic_error("Cannot add dependency to task group which has been flushed.");
+
+	std::lock_guard<std::mutex> holder{lock};
+	if (!register_with_count(count))
+		return;
+
+	dependee.deps->dependency_count.fetch_add(1, std::memory_order_relaxed);
+	dependees.push_back({ dependee.deps, count });
+}
+
+TaskGroupHandle ThreadGroup::create_task(TaskFunction func)
 {
-	TaskGroupHandle group(task_group_pool.allocate(this));
+	TaskGroupHandle group(allocate_task_group());
 
-	group->deps = Internal::TaskDepsHandle(task_deps_pool.allocate(this));
+	group->deps = Internal::TaskDepsHandle(allocate_task_deps());
 
-	group->deps->pending_tasks.push_back(task_pool.allocate(group->deps, move(func)));
+	group->deps->pending_tasks.push_back(allocate_task(group->deps, std::move(func)));
 	group->deps->count.store(1, std::memory_order_relaxed);
 	return group;
 }
 
 TaskGroupHandle ThreadGroup::create_task()
 {
-	TaskGroupHandle group(task_group_pool.allocate(this));
-	group->deps = Internal::TaskDepsHandle(task_deps_pool.allocate(this));
+	TaskGroupHandle group(allocate_task_group());
+	group->deps = Internal::TaskDepsHandle(allocate_task_deps());
 	group->deps->count.store(0, std::memory_order_relaxed);
 	return group;
 }
@@ -275,27 +727,110 @@ ThreadGroup *TaskGroup::get_thread_group() const
 	return group;
 }
 
-void TaskGroup::enqueue_task(std::function<void()> func)
+void TaskGroup::enqueue_task(TaskFunction func)
 {
-	group->enqueue_task(*this, move(func));
+	group->enqueue_task(*this, std::move(func));
+}
+
+void TaskGroup::parallel_for(size_t count, size_t grain, ParallelForFunction func)
+{
+	group->parallel_for(*this, count, grain, std::move(func));
+}
+
+void TaskGroup::parallel_reduce(size_t count, size_t grain, unsigned num_partials,
+                                ParallelReduceFunction func)
+{
+	group->parallel_reduce(*this, count, grain, num_partials, std::move(func));
+}
+
+void TaskGroup::set_priority(TaskPriority priority)
+{
+	if (flushed)
+		throw std::logic_error("Cannot change priority of a flushed task group.");
+	deps->priority = priority;
 }
 
 void TaskGroup::set_desc(const char *desc)
 {
 	snprintf(deps->desc, sizeof(deps->desc), "%s", desc);
+	deps->desc_id = Util::TimelineTraceFile::intern_string(deps->desc);
 }
 
-void ThreadGroup::enqueue_task(TaskGroup &group, std::function<void()> func)
+void ThreadGroup::enqueue_task(TaskGroup &group, TaskFunction func)
 {
 	if (group.flushed)
 		throw std::logic_error("Cannot enqueue work to a flushed task group.");
 
-	group.deps->pending_tasks.push_back(task_pool.allocate(group.deps, move(func)));
+	group.deps->pending_tasks.push_back(allocate_task(group.deps, std::move(func)));
 	group.deps->count.fetch_add(1, std::memory_order_relaxed);
 }
 
+static bool deps_are_done(Internal::TaskDeps &deps)
+{
+	std::lock_guard<std::mutex> holder{deps.cond_lock};
+	return deps.done;
+}
+
+bool ThreadGroup::can_help_while_waiting() const
+{
+	return wait_helping.load(std::memory_order_relaxed) && current_worker.task_depth == 0;
+}
+
+void ThreadGroup::set_wait_helping(bool enable)
+{
+	wait_helping.store(enable, std::memory_order_relaxed);
+}
+
+void ThreadGroup::wake_helpers()
+{
+	helper_event.notify_all();
+}
+
+template <typename Func>
+void ThreadGroup::help_until(const Func &func)
+{
+	while (!func())
+	{
+		if (auto *task = pop_helper_task())
+		{
+			run_task(task, Util::get_current_time_nsecs());
+			continue;
+		}
+
+		// Same protocol as the workers. Anything which completes a wait or makes tasks ready wakes us.
+		auto key = helper_event.prepare_wait();
+		if (func())
+		{
+			helper_event.cancel_wait();
+			break;
+		}
+
+		if (auto *task = pop_helper_task())
+		{
+			helper_event.cancel_wait();
+			run_task(task, Util::get_current_time_nsecs());
+		}
+		else
+			helper_event.commit_wait(key);
+	}
+}
+
+void ThreadGroup::wait_for_deps(Internal::TaskDeps &deps)
+{
+	if (can_help_while_waiting())
+		help_until([&]() { return deps_are_done(deps); });
+
+	std::unique_lock<std::mutex> holder{deps.cond_lock};
+	deps.cond.wait(holder, [&]() {
+		return deps.done;
+	});
+}
+
 void ThreadGroup::wait_idle()
 {
+	if (can_help_while_waiting())
+		help_until([this]() { return is_idle(); });
+
 	std::unique_lock<std::mutex> holder{wait_cond_lock};
 	wait_cond.wait(holder, [&]() {
 		return total_tasks.load(std::memory_order_relaxed) == completed_tasks.load(std::memory_order_relaxed);
@@ -307,55 +842,299 @@ bool ThreadGroup::is_idle()
 	return total_tasks.load(std::memory_order_acquire) == completed_tasks.load(std::memory_order_acquire);
 }
 
+Internal::Task *ThreadGroup::steal_task(unsigned lane, unsigned first_victim, unsigned num_victims)
+{
+	unsigned num_queues = unsigned(worker_queues.size());
+	for (unsigned i = 0; i < num_victims; i++)
+	{
+		unsigned victim = (first_victim + i) % num_queues;
+		if (auto *task = worker_queues[victim]->deques[lane].steal())
+			return task;
+	}
+
+	return nullptr;
+}
+
+Internal::Task *ThreadGroup::pop_task_from_lane(unsigned worker_index, unsigned lane)
+{
+	auto &queue = *worker_queues[worker_index];
+	if (auto *task = queue.deques[lane].pop())
+		return task;
+
+	if (auto *task = pop_injected_task(lane))
+		return task;
+
+	auto *task = steal_task(lane, worker_index + 1, unsigned(worker_queues.size()) - 1);
+	if (task)
+	{
+		auto &steals = queue.worker_counters.num_steals;
+		steals.store(steals.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	return task;
+}
+
+Internal::Task *ThreadGroup::pop_helper_task()
+{
+	// Helpers have no deque of their own, so they take from the injected queues or steal.
+	for (unsigned lane = 0; lane < unsigned(TaskPriority::Background); lane++)
+	{
+		if (auto *task = pop_injected_task(lane))
+			return task;
+		if (auto *task = steal_task(lane, 0, unsigned(worker_queues.size())))
+			return task;
+	}
+
+	return nullptr;
+}
+
+Internal::Task *ThreadGroup::pop_task(unsigned worker_index)
+{
+	for (unsigned lane = 0; lane < unsigned(TaskPriority::Background); lane++)
+		if (auto *task = pop_task_from_lane(worker_index, lane))
+			return task;
+
+	// Reserve a background slot up front, so the cap is never exceeded.
+	unsigned count = background_workers.load(std::memory_order_relaxed);
+	do
+	{
+		if (count >= max_background_workers.load(std::memory_order_relaxed))
+			return nullptr;
+	} while (!background_workers.compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+
+	auto *task = pop_task_from_lane(worker_index, unsigned(TaskPriority::Background));
+	if (!task)
+		background_workers.fetch_sub(1, std::memory_order_relaxed);
+	return task;
+}
+
+// Single writer, so plain load/store is enough.
+static inline void add_counter(std::atomic<uint64_t> &counter, uint64_t value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+static unsigned queue_latency_bucket(uint64_t latency_ns)
+{
+	uint64_t usecs = latency_ns / 1000;
+	unsigned bucket = 0;
+	while (usecs && bucket < TaskLatencyHistogramBuckets - 1)
+	{
+		usecs >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+void ThreadGroup::record_queue_latency(unsigned worker_index, const Internal::Task &task, int64_t start_ns)
+{
+	auto &counters = worker_queues[worker_index]->counters[unsigned(task.deps->priority)];
+	auto latency = uint64_t(std::max<int64_t>(start_ns - task.ready_time_ns, 0));
+
+	add_counter(counters.num_tasks, 1);
+	add_counter(counters.total_queue_latency_ns, latency);
+	add_counter(counters.queue_latency_histogram[queue_latency_bucket(latency)], 1);
+	if (latency > counters.max_queue_latency_ns.load(std::memory_order_relaxed))
+		counters.max_queue_latency_ns.store(latency, std::memory_order_relaxed);
+}
+
+TaskLaneStatistics ThreadGroup::get_lane_statistics(TaskPriority priority) const
+{
+	TaskLaneStatistics stats;
+	for (auto &queue : worker_queues)
+	{
+		auto &counters = queue->counters[unsigned(priority)];
+		stats.num_tasks += counters.num_tasks.load(std::memory_order_relaxed);
+		stats.total_queue_latency_ns += counters.total_queue_latency_ns.load(std::memory_order_relaxed);
+		stats.max_queue_latency_ns = std::max(stats.max_queue_latency_ns,
+		                                      counters.max_queue_latency_ns.load(std::memory_order_relaxed));
+		for (unsigned i = 0; i < TaskLatencyHistogramBuckets; i++)
+			stats.queue_latency_histogram[i] += counters.queue_latency_histogram[i].load(std::memory_order_relaxed);
+	}
+	return stats;
+}
+
+ThreadGroupStatistics ThreadGroup::get_statistics()
+{
+	ThreadGroupStatistics stats;
+
+	stats.workers.reserve(worker_queues.size());
+	for (auto &queue : worker_queues)
+	{
+		TaskWorkerStatistics worker;
+		for (auto &lane : queue->counters)
+			worker.num_tasks += lane.num_tasks.load(std::memory_order_relaxed);
+		worker.num_steals = queue->worker_counters.num_steals.load(std::memory_order_relaxed);
+		worker.busy_ns = queue->worker_counters.busy_ns.load(std::memory_order_relaxed);
+		worker.idle_ns = queue->worker_counters.idle_ns.load(std::memory_order_relaxed);
+		worker.steal_ns = queue->worker_counters.steal_ns.load(std::memory_order_relaxed);
+		stats.workers.push_back(worker);
+	}
+
+	for (int i = 0; i < NumPriorities; i++)
+		stats.lanes[i] = get_lane_statistics(TaskPriority(i));
+
+	std::lock_guard<std::mutex> holder{statistics_lock};
+	stats.frames = frame_statistics;
+	stats.pipelines.reserve(pipeline_statistics.size());
+	for (auto &pipeline : pipeline_statistics)
+		stats.pipelines.push_back(pipeline.second);
+	std::sort(stats.pipelines.begin(), stats.pipelines.end(), [](const TaskPipelineStatistics &a, const TaskPipelineStatistics &b) {
+		return a.desc < b.desc;
+	});
+	return stats;
+}
+
+void ThreadGroup::end_frame()
+{
+	unsigned completed = completed_tasks.load(std::memory_order_relaxed);
+	std::lock_guard<std::mutex> holder{statistics_lock};
+
+	uint64_t tasks = completed - last_frame_completed_tasks;
+	last_frame_completed_tasks = completed;
+
+	auto &frames = frame_statistics;
+	if (frames.num_frames == 0)
+		frames.min_tasks = frames.max_tasks = tasks;
+	frames.num_frames++;
+	frames.last_tasks = tasks;
+	frames.total_tasks += tasks;
+	frames.min_tasks = std::min(frames.min_tasks, tasks);
+	frames.max_tasks = std::max(frames.max_tasks, tasks);
+
+	scope_statistics.end_frame();
+}
+
+void ThreadGroup::record_pipeline_critical_path(const char *desc, uint64_t critical_path_ns)
+{
+	Util::Hasher h;
+	h.string(desc);
+
+	std::lock_guard<std::mutex> holder{statistics_lock};
+	auto &pipeline = pipeline_statistics[h.get()];
+	if (pipeline.num_runs == 0)
+		pipeline.desc = desc;
+	pipeline.num_runs++;
+	pipeline.last_critical_path_ns = critical_path_ns;
+	pipeline.total_critical_path_ns += critical_path_ns;
+	pipeline.max_critical_path_ns = std::max(pipeline.max_critical_path_ns, critical_path_ns);
+}
+
+void ThreadGroup::set_max_background_workers(unsigned count)
+{
+	max_background_workers.store(std::max(count, 1u), std::memory_order_relaxed);
+}
+
+ThreadGroup::WorkerQueue::WorkerQueue()
+{
+	for (auto &c : counters)
+	{
+		c.num_tasks.store(0, std::memory_order_relaxed);
+		c.total_queue_latency_ns.store(0, std::memory_order_relaxed);
+		c.max_queue_latency_ns.store(0, std::memory_order_relaxed);
+		for (auto &bucket : c.queue_latency_histogram)
+			bucket.store(0, std::memory_order_relaxed);
+	}
+
+	worker_counters.num_steals.store(0, std::memory_order_relaxed);
+	worker_counters.busy_ns.store(0, std::memory_order_relaxed);
+	worker_counters.idle_ns.store(0, std::memory_order_relaxed);
+	worker_counters.steal_ns.store(0, std::memory_order_relaxed);
+}
+
 void ThreadGroup::thread_looper(unsigned index)
 {
 #ifdef GRANITE_VULKAN_MT
 	Vulkan::register_thread_index(index);
-#else
-	(void)index;
 #endif
 
+	unsigned worker_index = index - 1;
+	current_worker.group = this;
+	current_worker.index = worker_index;
+
+	auto &counters = worker_queues[worker_index]->worker_counters;
+	int64_t search_start_ns = Util::get_current_time_nsecs();
+
 	for (;;)
 	{
-		Internal::Task *task = nullptr;
+		Internal::Task *task = pop_task(worker_index);
 
+		if (!task)
 		{
-			std::unique_lock<std::mutex> holder{cond_lock};
-			cond.wait(holder, [&]() {
-				return dead || !ready_tasks.empty();
-			});
-
-			if (dead && ready_tasks.empty())
+			// Announce that we're going to sleep, then look again before committing,
+			// so we cannot miss a notification from move_to_ready_tasks().
+			auto key = idle_event.prepare_wait();
+			task = pop_task(worker_index);
+
+			if (task)
+				idle_event.cancel_wait();
+			else if (dead.load(std::memory_order_acquire))
+			{
+				idle_event.cancel_wait();
 				break;
-
-			task = ready_tasks.front();
-			ready_tasks.pop();
+			}
+			else
+			{
+				int64_t sleep_ns = Util::get_current_time_nsecs();
+				add_counter(counters.steal_ns, uint64_t(sleep_ns - search_start_ns));
+				idle_event.commit_wait(key);
+				search_start_ns = Util::get_current_time_nsecs();
+				add_counter(counters.idle_ns, uint64_t(search_start_ns - sleep_ns));
+				continue;
+			}
 		}
 
-		if (task->func)
-		{
-			Util::TimelineTraceFile::Event *e = nullptr;
-			if (*task->deps->desc != '\0' && timeline_trace_file)
-				e = timeline_trace_file->begin_event(task->deps->desc);
-			task->func();
-			if (e)
-				timeline_trace_file->end_event(e);
-		}
+		int64_t start_ns = Util::get_current_time_nsecs();
+		add_counter(counters.steal_ns, uint64_t(start_ns - search_start_ns));
+		record_queue_latency(worker_index, *task, start_ns);
+		bool is_background = task->deps->priority == TaskPriority::Background;
 
-		task->deps->task_completed();
-		task_pool.free(task);
+		search_start_ns = run_task(task, start_ns);
+		add_counter(counters.busy_ns, uint64_t(search_start_ns - start_ns));
 
-		{
-			auto completed = completed_tasks.fetch_add(1, std::memory_order_relaxed) + 1;
-			//LOGI("Task completed (%u / %u)!\n", completed, total_tasks.load(memory_order_relaxed));
+		if (is_background)
+			background_workers.fetch_sub(1, std::memory_order_relaxed);
+	}
 
-			if (completed == total_tasks.load(std::memory_order_relaxed))
-			{
-				std::lock_guard<std::mutex> holder{wait_cond_lock};
-				wait_cond.notify_one();
-			}
+	flush_thread_cache();
+}
+
+int64_t ThreadGroup::run_task(Internal::Task *task, int64_t start_ns)
+{
+	current_worker.task_depth++;
+
+	if (task->func)
+	{
+		Util::TimelineTraceFile::Event *e = nullptr;
+		if (task->deps->desc_id && timeline_trace_file)
+			e = timeline_trace_file->begin_event_interned(task->deps->desc_id);
+		task->func();
+		if (e)
+			timeline_trace_file->end_event(e);
+	}
+
+	int64_t end_ns = Util::get_current_time_nsecs();
+	auto duration_ns = uint64_t(std::max<int64_t>(end_ns - start_ns, 0));
+	Internal::atomic_max(task->deps->max_task_ns, duration_ns);
+	if (task->deps->desc_id)
+		scope_statistics.record(task->deps->desc_id, duration_ns);
+	task->deps->task_completed();
+	free_task(task);
+
+	current_worker.task_depth--;
+
+	auto completed = completed_tasks.fetch_add(1, std::memory_order_relaxed) + 1;
+	//LOGI("Task completed (%u / %u)!\n", completed, total_tasks.load(memory_order_relaxed));
+
+	if (completed == total_tasks.load(std::memory_order_relaxed))
+	{
+		{
+			std::lock_guard<std::mutex> holder{wait_cond_lock};
+			wait_cond.notify_one();
 		}
+		wake_helpers();
 	}
+
+	return end_ns;
 }
 
 ThreadGroup::ThreadGroup()
@@ -365,6 +1144,15 @@ ThreadGroup::ThreadGroup()
 #endif
 	total_tasks.store(0);
 	completed_tasks.store(0);
+	for (auto &queue : injected_queues)
+	{
+		queue.count.store(0);
+		queue.ring.resize(64);
+	}
+	background_workers.store(0);
+	max_background_workers.store(UINT_MAX);
+	dead.store(false);
+	wait_helping.store(true);
 }
 
 ThreadGroup::~ThreadGroup()
@@ -379,11 +1167,8 @@ void ThreadGroup::stop()
 
 	wait_idle();
 
-	{
-		std::lock_guard<std::mutex> holder{cond_lock};
-		dead = true;
-		cond.notify_all();
-	}
+	dead.store(true, std::memory_order_release);
+	idle_event.notify_all();
 
 	for (auto &t : thread_group)
 	{
@@ -394,8 +1179,9 @@ void ThreadGroup::stop()
 		}
 	}
 
+	worker_queues.clear();
 	active = false;
-	dead = false;
+	dead.store(false, std::memory_order_relaxed);
 }
 
 }
@@ -25,37 +25,122 @@
 #include "util/variant.hpp"
 #include "util/intrusive.hpp"
 #include "util/object_pool.hpp"
+#include "util/small_function.hpp"
+#include "util/small_vector.hpp"
+#include "util/hash.hpp"
 #include "util/timeline_trace_file.hpp"
+#include "util/scope_statistics.hpp"
+#include "threading/work_stealing_deque.hpp"
+#include "threading/event_count.hpp"
+#include "threading/cpu_topology.hpp"
 
 #include <condition_variable>
 #include <mutex>
 #include <thread>
 #include <vector>
-#include <queue>
 #include <future>
 #include <memory>
+#include <string>
+#include <unordered_map>
 
 namespace Granite
 {
 
 class ThreadGroup;
 
-struct TaskSignal
+// Callables up to 64 bytes are stored inline in the task, so submitting a task does not allocate.
+using TaskFunction = Util::SmallFunction<void ()>;
+using ParallelForFunction = Util::SmallFunction<void (size_t, size_t)>;
+using ParallelReduceFunction = Util::SmallFunction<void (size_t, size_t, unsigned)>;
+
+// Ready tasks are always drained from higher priority lanes first.
+enum class TaskPriority : uint8_t
 {
-	std::condition_variable cond;
-	std::mutex lock;
-	uint64_t counter = 0;
+	// Work the current frame is waiting for, e.g. culling and command recording.
+	FrameCritical = 0,
+	Normal,
+	// Work nobody is waiting on this frame, e.g. asset loading and texture compression.
+	Background,
+	Count
+};
 
-	void signal_increment();
-	void wait_until_at_least(uint64_t count);
+enum { TaskLatencyHistogramBuckets = 16 };
+
+struct TaskLaneStatistics
+{
+	uint64_t num_tasks = 0;
+	// Time from a task becoming ready until a worker starts executing it.
+	uint64_t total_queue_latency_ns = 0;
+	uint64_t max_queue_latency_ns = 0;
+	// Bucket 0 counts latencies below 1 us, bucket i > 0 latencies in [2^(i-1), 2^i) us.
+	// The last bucket also counts everything above.
+	uint64_t queue_latency_histogram[TaskLatencyHistogramBuckets] = {};
+};
+
+struct TaskWorkerStatistics
+{
+	uint64_t num_tasks = 0;
+	uint64_t num_steals = 0;
+	// Time spent running tasks.
+	uint64_t busy_ns = 0;
+	// Time spent asleep, waiting for tasks to become ready.
+	uint64_t idle_ns = 0;
+	// Time spent looking for work in the queues, mostly stealing from other workers.
+	uint64_t steal_ns = 0;
+};
+
+struct TaskPipelineStatistics
+{
+	std::string desc;
+	uint64_t num_runs = 0;
+	// Longest chain of task execution times through the pipeline.
+	// This is how long the pipeline takes with an unlimited number of workers.
+	uint64_t last_critical_path_ns = 0;
+	uint64_t total_critical_path_ns = 0;
+	uint64_t max_critical_path_ns = 0;
+};
+
+struct TaskFrameStatistics
+{
+	uint64_t num_frames = 0;
+	uint64_t last_tasks = 0;
+	uint64_t total_tasks = 0;
+	uint64_t min_tasks = 0;
+	uint64_t max_tasks = 0;
+};
+
+struct ThreadGroupStatistics
+{
+	std::vector<TaskWorkerStatistics> workers;
+	TaskLaneStatistics lanes[int(TaskPriority::Count)];
+	TaskFrameStatistics frames;
+	std::vector<TaskPipelineStatistics> pipelines;
 };
 
 struct TaskGroup;
+struct TaskSignal;
+class TaskGraph;
 namespace Internal
 {
 struct TaskDeps;
 struct Task;
 
+// Work recorded into a TaskGraph node, run again every time the graph is launched.
+using RecordedTaskFunction = Util::SmallFunction<void (TaskDeps &)>;
+
+// Counts TaskGraph nodes which are still inside notify_dependees().
+// A node's dependees can complete before it is done with its own deps,
+// so the graph cannot be reset for the next launch until this reaches zero.
+struct RecordedCompletion
+{
+	std::mutex lock;
+	std::condition_variable cond;
+	unsigned outstanding = 0;
+
+	void node_completed();
+	void wait();
+};
+
 struct TaskDepsDeleter
 {
 	void operator()(TaskDeps *deps);
@@ -66,22 +151,32 @@ struct TaskGroupDeleter
 	void operator()(TaskGroup *group);
 };
 
+struct ParallelForState;
+struct ParallelReduceState;
+struct ParallelStateDeleter
+{
+	void operator()(ParallelForState *state);
+	void operator()(ParallelReduceState *state);
+};
+
 struct TaskDeps : Util::IntrusivePtrEnabled<TaskDeps, TaskDepsDeleter, Util::MultiThreadCounter>
 {
 	explicit TaskDeps(ThreadGroup *group_)
 	    : group(group_)
 	{
 		count.store(0, std::memory_order_relaxed);
+		max_task_ns.store(0, std::memory_order_relaxed);
+		incoming_path_ns.store(0, std::memory_order_relaxed);
 		// One implicit dependency is the flush() happening.
 		dependency_count.store(1, std::memory_order_relaxed);
 		desc[0] = '\0';
 	}
 
 	ThreadGroup *group;
-	std::vector<Util::IntrusivePtr<TaskDeps>> pending;
+	Util::SmallVector<Util::IntrusivePtr<TaskDeps>, 4> pending;
 	std::atomic_uint count;
 
-	std::vector<Task *> pending_tasks;
+	Util::SmallVector<Task *> pending_tasks;
 	TaskSignal *signal = nullptr;
 	std::atomic_uint dependency_count;
 
@@ -89,17 +184,35 @@ struct TaskDeps : Util::IntrusivePtrEnabled<TaskDeps, TaskDepsDeleter, Util::Mul
 	void dependency_satisfied();
 	void notify_dependees();
 
+	// Longest task in this group, and the longest chain of tasks leading up to the group.
+	std::atomic<uint64_t> max_task_ns;
+	std::atomic<uint64_t> incoming_path_ns;
+	// Reports the critical path under desc once the group completes, see TaskComposer::set_desc().
+	bool record_critical_path = false;
+
 	std::condition_variable cond;
 	std::mutex cond_lock;
 	bool done = false;
+	TaskPriority priority = TaskPriority::Normal;
+
+	// Dependees added with ThreadGroup::add_late_dependency(). Guarded by cond_lock until done is set.
+	Util::SmallVector<Util::IntrusivePtr<TaskDeps>, 2> late_pending;
+
+	// Set for deps owned by a TaskGraph. Instead of handing over pending_tasks once,
+	// new tasks are spawned from the recorded work every time the deps become ready,
+	// and the dependees are kept around for the next launch.
+	const std::vector<RecordedTaskFunction> *recorded_tasks = nullptr;
+	RecordedCompletion *recorded_completion = nullptr;
 
 	char desc[64];
+	// desc interned with TimelineTraceFile::intern_string(), 0 if there is no desc.
+	uint32_t desc_id = 0;
 };
 using TaskDepsHandle = Util::IntrusivePtr<TaskDeps>;
 
 struct Task
 {
-	Task(TaskDepsHandle deps_, std::function<void ()> func_)
+	Task(TaskDepsHandle deps_, TaskFunction func_)
 		: deps(std::move(deps_)), func(std::move(func_))
 	{
 	}
@@ -107,10 +220,86 @@ struct Task
 	Task() = default;
 
 	TaskDepsHandle deps;
-	std::function<void ()> func;
+	TaskFunction func;
+	int64_t ready_time_ns = 0;
 };
+
+struct ParallelForState : Util::IntrusivePtrEnabled<ParallelForState, ParallelStateDeleter, Util::MultiThreadCounter>
+{
+	explicit ParallelForState(ThreadGroup *group_)
+	    : group(group_)
+	{
+	}
+
+	ThreadGroup *group;
+	ParallelForFunction func;
+	size_t grain = 1;
+};
+using ParallelForStateHandle = Util::IntrusivePtr<ParallelForState>;
+
+struct ParallelReduceState : Util::IntrusivePtrEnabled<ParallelReduceState, ParallelStateDeleter, Util::MultiThreadCounter>
+{
+	explicit ParallelReduceState(ThreadGroup *group_)
+	    : group(group_)
+	{
+		cursor.store(0, std::memory_order_relaxed);
+	}
+
+	ThreadGroup *group;
+	ParallelReduceFunction func;
+	std::atomic<size_t> cursor;
+	size_t count = 0;
+	size_t grain = 1;
+	unsigned num_partials = 1;
+};
+using ParallelReduceStateHandle = Util::IntrusivePtr<ParallelReduceState>;
 }
 
+// A monotonic counter which tasks increment as they complete, so that other threads can pace themselves.
+// Incrementing is a single atomic add unless somebody waits on the counter.
+struct TaskSignal
+{
+	TaskSignal();
+
+	void signal_increment()
+	{
+		uint64_t old_state = state.fetch_add(2, std::memory_order_acq_rel);
+		if (old_state & 1)
+			wake_up_to((old_state >> 1) + 1);
+	}
+
+	void wait_until_at_least(uint64_t count);
+	uint64_t get_count() const;
+
+	// dependee does not start until the counter has reached count. Must be called before dependee is flushed.
+	void add_dependee(TaskGroup &dependee, uint64_t count);
+
+private:
+	// The counter is stored shifted up by one. The low bit is set while there are waiters or dependees,
+	// in which case incrementing takes the lock and only wakes up those whose count has been reached.
+	std::atomic<uint64_t> state;
+
+	struct Waiter
+	{
+		uint64_t count;
+		std::condition_variable cond;
+		bool woken = false;
+	};
+
+	struct Dependee
+	{
+		Internal::TaskDepsHandle deps;
+		uint64_t count;
+	};
+
+	std::mutex lock;
+	Util::SmallVector<Waiter *, 4> waiters;
+	Util::SmallVector<Dependee, 4> dependees;
+
+	void wake_up_to(uint64_t count);
+	bool register_with_count(uint64_t count);
+};
+
 struct TaskGroup : Util::IntrusivePtrEnabled<TaskGroup, Internal::TaskGroupDeleter, Util::MultiThreadCounter>
 {
 	explicit TaskGroup(ThreadGroup *group);
@@ -123,11 +312,15 @@ struct TaskGroup : Util::IntrusivePtrEnabled<TaskGroup, Internal::TaskGroupDelet
 
 	ThreadGroup *group;
 	Internal::TaskDepsHandle deps;
-	void enqueue_task(std::function<void ()> func);
+	void enqueue_task(TaskFunction func);
+	void parallel_for(size_t count, size_t grain, ParallelForFunction func);
+	void parallel_reduce(size_t count, size_t grain, unsigned num_partials, ParallelReduceFunction func);
 	void set_fence_counter_signal(TaskSignal *signal);
 	ThreadGroup *get_thread_group() const;
 
 	void set_desc(const char *desc);
+	// Must be set before the group is flushed. Tasks in the group, including nested ones, inherit the priority.
+	void set_priority(TaskPriority priority);
 
 	unsigned id = 0;
 	bool flushed = false;
@@ -145,6 +338,22 @@ public:
 
 	void start(unsigned num_threads);
 
+	// Decides how workers are pinned to CPUs. Takes effect on the next start().
+	// GRANITE_THREAD_AFFINITY overrides this, see parse_thread_affinity() for the syntax.
+	void set_affinity_policy(ThreadAffinityPolicy policy, std::vector<unsigned> cpu_mask = {});
+
+	// The CPU each worker was pinned to, or -1 if it was not pinned. Valid after start().
+	const std::vector<int> &get_worker_cpus() const
+	{
+		return worker_cpus;
+	}
+
+	// Empty if the topology could not be queried.
+	const CPUTopology &get_cpu_topology() const
+	{
+		return cpu_topology;
+	}
+
 	unsigned get_num_threads() const
 	{
 		return unsigned(thread_group.size());
@@ -152,21 +361,77 @@ public:
 
 	void stop();
 
-	void enqueue_task(TaskGroup &group, std::function<void ()> func);
-	TaskGroupHandle create_task(std::function<void ()> func);
+	void enqueue_task(TaskGroup &group, TaskFunction func);
+	TaskGroupHandle create_task(TaskFunction func);
 	TaskGroupHandle create_task();
 
-	void move_to_ready_tasks(const std::vector<Internal::Task *> &list);
+	// Runs func(begin, end) over chunks of [0, count) as part of group.
+	// The range is split recursively, but only as long as other workers are hungry for work,
+	// so the number of chunks adapts to the load. Chunks are never smaller than grain, except for the tail.
+	void parallel_for(TaskGroup &group, size_t count, size_t grain, ParallelForFunction func);
+
+	// Like parallel_for, but func(begin, end, partial) also receives an index in [0, num_partials).
+	// Chunks with the same partial index never run concurrently, so each partial can accumulate
+	// results without synchronization, to be combined in a later stage.
+	// Chunk sizes start large and shrink towards grain as the range runs out to balance the tail.
+	void parallel_reduce(TaskGroup &group, size_t count, size_t grain, unsigned num_partials,
+	                     ParallelReduceFunction func);
+
+	// Adds a task to a group which is already executing.
+	// Must be called from a task in the same group, since that task is what keeps the group from completing.
+	void enqueue_nested_task(Internal::TaskDeps &deps, TaskFunction func);
+
+	// Limits how many workers may execute background tasks at the same time,
+	// so that frame work always finds a free worker. Default is no limit.
+	void set_max_background_workers(unsigned count);
+	TaskLaneStatistics get_lane_statistics(TaskPriority priority) const;
+
+	// Counters are accumulated from start(). Workers only count tasks they ran themselves,
+	// tasks run by waiting threads are only part of the frame and pipeline statistics.
+	ThreadGroupStatistics get_statistics();
+	// Marks the end of a frame for the tasks per frame statistics.
+	void end_frame();
+	void record_pipeline_critical_path(const char *desc, uint64_t critical_path_ns);
+
+	// Execution time of tasks in groups with a desc, per desc and thread, over the last frames.
+	// Advanced by end_frame().
+	Util::ScopeStatistics &get_scope_statistics()
+	{
+		return scope_statistics;
+	}
+
+	void move_to_ready_tasks(Internal::Task * const *tasks, size_t count);
+	void spawn_recorded_tasks(Internal::TaskDeps &deps);
 
 	void add_dependency(TaskGroup &dependee, TaskGroup &dependency);
+	// Like add_dependency(), but dependency may already have been flushed, or even have completed,
+	// in which case nothing is added. Safe to call while dependency is executing.
+	void add_late_dependency(TaskGroup &dependee, TaskGroup &dependency);
 
 	void free_task_group(TaskGroup *group);
 	void free_task_deps(Internal::TaskDeps *deps);
+	void free_parallel_for_state(Internal::ParallelForState *state);
+	void free_parallel_reduce_state(Internal::ParallelReduceState *state);
 
 	void submit(TaskGroupHandle &group);
 	void wait_idle();
 	bool is_idle();
 
+	// When enabled, a thread which waits in TaskGroup::wait() or wait_idle() runs ready tasks
+	// until its wait is satisfied instead of going to sleep. Only threads which are not already
+	// running a task help out. A task which waits blocks as before, since running unrelated tasks
+	// on top of it could end up waiting on the very task underneath, which would deadlock.
+	// Helpers never pick up background tasks, those are left to the workers and their limit.
+	// Enabled by default.
+	void set_wait_helping(bool enable);
+
+	void wait_for_deps(Internal::TaskDeps &deps);
+	void wake_helpers();
+
+	// Returns objects cached by the calling thread to the pools.
+	// Happens automatically when a thread exits.
+	void flush_thread_cache();
+
 	Util::TimelineTraceFile *get_timeline_trace_file();
 	void refresh_global_timeline_trace_file();
 
@@ -174,17 +439,84 @@ private:
 	Util::ThreadSafeObjectPool<Internal::Task> task_pool;
 	Util::ThreadSafeObjectPool<TaskGroup> task_group_pool;
 	Util::ThreadSafeObjectPool<Internal::TaskDeps> task_deps_pool;
+	Util::ThreadSafeObjectPool<Internal::ParallelForState> parallel_for_pool;
+	Util::ThreadSafeObjectPool<Internal::ParallelReduceState> parallel_reduce_pool;
 
-	std::queue<Internal::Task *> ready_tasks;
+	Internal::Task *allocate_task(Internal::TaskDepsHandle deps, TaskFunction func);
+	void free_task(Internal::Task *task);
+	TaskGroup *allocate_task_group();
+	Internal::TaskDeps *allocate_task_deps();
+
+	enum { NumPriorities = int(TaskPriority::Count) };
+
+	// Only written by the owning worker.
+	struct LaneCounters
+	{
+		std::atomic<uint64_t> num_tasks;
+		std::atomic<uint64_t> total_queue_latency_ns;
+		std::atomic<uint64_t> max_queue_latency_ns;
+		std::atomic<uint64_t> queue_latency_histogram[TaskLatencyHistogramBuckets];
+	};
+
+	struct WorkerCounters
+	{
+		std::atomic<uint64_t> num_steals;
+		std::atomic<uint64_t> busy_ns;
+		std::atomic<uint64_t> idle_ns;
+		std::atomic<uint64_t> steal_ns;
+	};
+
+	// Each worker owns a deque per priority. Tasks which become ready on a worker are pushed there,
+	// idle workers steal from the others.
+	struct alignas(64) WorkerQueue
+	{
+		WorkerQueue();
+		WorkStealingDeque<Internal::Task> deques[NumPriorities];
+		LaneCounters counters[NumPriorities];
+		WorkerCounters worker_counters;
+	};
+	std::vector<std::unique_ptr<WorkerQueue>> worker_queues;
+
+	// Tasks made ready by non-worker threads, or which overflowed a worker deque.
+	// A plain ring buffer which only grows, so steady state pushes do not allocate like std::queue does.
+	struct alignas(64) InjectedQueue
+	{
+		std::mutex lock;
+		std::vector<Internal::Task *> ring;
+		size_t head = 0;
+		size_t size = 0;
+		std::atomic_uint count;
+	};
+	InjectedQueue injected_queues[NumPriorities];
+
+	std::atomic_uint background_workers;
+	std::atomic_uint max_background_workers;
 
 	std::vector<std::unique_ptr<std::thread>> thread_group;
-	std::mutex cond_lock;
-	std::condition_variable cond;
+	EventCount idle_event;
+	// Waiting threads which help out sleep here, so they never consume wakeups meant for workers.
+	EventCount helper_event;
+	std::atomic_bool wait_helping;
 
 	void thread_looper(unsigned self_index);
+	bool local_queue_is_empty(TaskPriority priority) const;
+	void run_parallel_for_range(const Internal::ParallelForStateHandle &state,
+	                            Internal::TaskDeps &deps, size_t begin, size_t end);
+	Internal::Task *pop_task(unsigned worker_index);
+	Internal::Task *pop_task_from_lane(unsigned worker_index, unsigned lane);
+	Internal::Task *pop_injected_task(unsigned lane);
+	Internal::Task *steal_task(unsigned lane, unsigned first_victim, unsigned num_victims);
+	Internal::Task *pop_helper_task();
+	int64_t run_task(Internal::Task *task, int64_t start_ns);
+	friend class TaskGraph;
+	bool can_help_while_waiting() const;
+	template <typename Func>
+	void help_until(const Func &func);
+	void push_injected_tasks(unsigned lane, Internal::Task * const *tasks, size_t count);
+	void record_queue_latency(unsigned worker_index, const Internal::Task &task, int64_t start_ns);
 
 	bool active = false;
-	bool dead = false;
+	std::atomic_bool dead;
 
 	std::condition_variable wait_cond;
 	std::mutex wait_cond_lock;
@@ -192,6 +524,19 @@ private:
 	std::atomic_uint completed_tasks;
 
 	std::unique_ptr<Util::TimelineTraceFile> timeline_trace_file;
+
+	std::mutex statistics_lock;
+	TaskFrameStatistics frame_statistics;
+	unsigned last_frame_completed_tasks = 0;
+	std::unordered_map<Util::Hash, TaskPipelineStatistics> pipeline_statistics;
+	Util::ScopeStatistics scope_statistics;
+
+	ThreadAffinityPolicy affinity_policy = ThreadAffinityPolicy::None;
+	std::vector<unsigned> affinity_mask;
+	CPUTopology cpu_topology;
+	std::vector<int> worker_cpus;
+	void setup_worker_affinity(unsigned num_threads);
+	void prepare_thread_caches();
 };
 
 }
@@ -0,0 +1,119 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace Granite
+{
+// Chase-Lev work-stealing deque.
+// The owning thread pushes and pops at the bottom, any other thread may steal from the top.
+// Capacity is fixed, push() fails when full and the caller must find somewhere else for the item.
+template <typename T>
+class WorkStealingDeque
+{
+public:
+	explicit WorkStealingDeque(unsigned capacity_log2 = 12)
+		: mask((int64_t(1) << capacity_log2) - 1),
+		  ring(new std::atomic<T *>[size_t(1) << capacity_log2])
+	{
+		top.store(0, std::memory_order_relaxed);
+		bottom.store(0, std::memory_order_relaxed);
+	}
+
+	WorkStealingDeque(const WorkStealingDeque &) = delete;
+	void operator=(const WorkStealingDeque &) = delete;
+
+	// Owner only.
+	bool push(T *value) noexcept
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_acquire);
+		if (b - t > mask)
+			return false;
+
+		ring[b & mask].store(value, std::memory_order_relaxed);
+		bottom.store(b + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Owner only.
+	T *pop() noexcept
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+
+		if (t > b)
+		{
+			// Empty.
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		T *value = ring[b & mask].load(std::memory_order_relaxed);
+		if (t == b)
+		{
+			// Last element, race against thieves for it.
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				value = nullptr;
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		return value;
+	}
+
+	// Any thread. Only returns nullptr if the deque was observed to be empty.
+	T *steal() noexcept
+	{
+		for (;;)
+		{
+			int64_t t = top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t b = bottom.load(std::memory_order_acquire);
+			if (t >= b)
+				return nullptr;
+
+			T *value = ring[t & mask].load(std::memory_order_relaxed);
+			if (top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return value;
+		}
+	}
+
+	// Racy estimate, only useful as a hint.
+	bool empty() const noexcept
+	{
+		return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+	}
+
+private:
+	// Keep the owner side and the thief side on separate cache lines.
+	alignas(64) std::atomic<int64_t> top;
+	alignas(64) std::atomic<int64_t> bottom;
+	int64_t mask;
+	std::unique_ptr<std::atomic<T *>[]> ring;
+};
+}
@@ -32,6 +32,7 @@ namespace Util
 #define leading_zeroes(x) ((x) == 0 ? 32 : __builtin_clz(x))
 #define trailing_zeroes(x) ((x) == 0 ? 32 : __builtin_ctz(x))
 #define trailing_ones(x) __builtin_ctz(~uint32_t(x))
+#define trailing_zeroes64(x) ((x) == 0 ? 64 : __builtin_ctzll(x))
 #elif defined(_MSC_VER)
 namespace Internal
 {
@@ -52,11 +53,26 @@ static inline uint32_t ctz(uint32_t x)
 	else
 		return 32;
 }
+
+static inline uint32_t ctz64(uint64_t x)
+{
+#if defined(_M_X64) || defined(_M_ARM64)
+	unsigned long result;
+	if (_BitScanForward64(&result, x))
+		return result;
+	else
+		return 64;
+#else
+	uint32_t lo = ctz(uint32_t(x));
+	return lo == 32 ? 32 + ctz(uint32_t(x >> 32)) : lo;
+#endif
+}
 }
 
 #define leading_zeroes(x) ::Util::Internal::clz(x)
 #define trailing_zeroes(x) ::Util::Internal::ctz(x)
 #define trailing_ones(x) ::Util::Internal::ctz(~uint32_t(x))
+#define trailing_zeroes64(x) ::Util::Internal::ctz64(x)
 #else
 #error "Implement me."
 #endif
@@ -0,0 +1,117 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/epoch_reclamation.hpp"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+namespace Util
+{
+static constexpr uint64_t IdleEpoch = UINT64_MAX;
+
+// One per thread which has ever read, reused once the thread exits. Records are never freed,
+// so the list can be walked without locks.
+struct alignas(64) EpochRecord
+{
+	std::atomic<uint64_t> epoch;
+	std::atomic_bool in_use;
+	EpochRecord *next = nullptr;
+	unsigned depth = 0;
+};
+
+static std::atomic<uint64_t> global_epoch;
+static std::atomic<EpochRecord *> records;
+static std::mutex records_lock;
+
+static EpochRecord *acquire_record()
+{
+	std::lock_guard<std::mutex> holder{records_lock};
+	for (auto *record = records.load(std::memory_order_relaxed); record; record = record->next)
+	{
+		if (!record->in_use.load(std::memory_order_relaxed))
+		{
+			record->in_use.store(true, std::memory_order_relaxed);
+			return record;
+		}
+	}
+
+	auto *record = new EpochRecord;
+	record->epoch.store(IdleEpoch, std::memory_order_relaxed);
+	record->in_use.store(true, std::memory_order_relaxed);
+	record->next = records.load(std::memory_order_relaxed);
+	records.store(record, std::memory_order_release);
+	return record;
+}
+
+struct ThreadEpochRecord
+{
+	~ThreadEpochRecord()
+	{
+		if (record)
+		{
+			std::lock_guard<std::mutex> holder{records_lock};
+			record->epoch.store(IdleEpoch, std::memory_order_release);
+			record->in_use.store(false, std::memory_order_relaxed);
+			record = nullptr;
+		}
+	}
+
+	EpochRecord *record = nullptr;
+};
+static thread_local ThreadEpochRecord thread_record;
+
+void EpochReclamation::enter()
+{
+	auto *record = thread_record.record;
+	if (!record)
+		record = thread_record.record = acquire_record();
+
+	if (record->depth++ == 0)
+	{
+		// Either a writer which scans the records sees this epoch, or this reader sees everything
+		// the writer unlinked before it scanned, see get_reclaimable_epoch().
+		record->epoch.store(global_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+	}
+}
+
+void EpochReclamation::leave()
+{
+	auto *record = thread_record.record;
+	if (--record->depth == 0)
+		record->epoch.store(IdleEpoch, std::memory_order_release);
+}
+
+uint64_t EpochReclamation::retire()
+{
+	// Readers which load the new epoch are guaranteed to see the memory as unlinked.
+	return global_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+}
+
+uint64_t EpochReclamation::get_reclaimable_epoch()
+{
+	uint64_t epoch = IdleEpoch;
+	for (auto *record = records.load(std::memory_order_acquire); record; record = record->next)
+		epoch = std::min(epoch, record->epoch.load(std::memory_order_seq_cst));
+	return epoch;
+}
+}
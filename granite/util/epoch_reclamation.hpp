@@ -0,0 +1,61 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace Util
+{
+// Epoch based reclamation for data structures which are read without taking locks.
+// Readers wrap their accesses in an EpochReadGuard. Writers unlink memory first, then tag it with retire(),
+// and may reclaim it once the tag is at most get_reclaimable_epoch(), since any reader which could
+// still observe the memory has left by then. Read sections should be short, they hold back reclamation.
+// Unlinking stores and the loads readers use to follow links must be sequentially consistent,
+// that is what orders them against the epochs.
+class EpochReclamation
+{
+public:
+	// Nestable.
+	static void enter();
+	static void leave();
+
+	static uint64_t retire();
+	static uint64_t get_reclaimable_epoch();
+};
+
+struct EpochReadGuard
+{
+	EpochReadGuard()
+	{
+		EpochReclamation::enter();
+	}
+
+	~EpochReadGuard()
+	{
+		EpochReclamation::leave();
+	}
+
+	EpochReadGuard(const EpochReadGuard &) = delete;
+	void operator=(const EpochReadGuard &) = delete;
+};
+}
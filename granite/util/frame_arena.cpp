@@ -0,0 +1,141 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/frame_arena.hpp"
+#include "util/aligned_alloc.hpp"
+#include <algorithm>
+#include <atomic>
+
+namespace Util
+{
+static std::atomic<uint64_t> frame_index;
+static std::atomic<uint64_t> chunk_allocation_count;
+
+struct ThreadArena
+{
+	enum { MinChunkSize = 64 * 1024 };
+
+	struct Chunk
+	{
+		uint8_t *data;
+		size_t size;
+	};
+
+	// The last chunk is the one being allocated from.
+	std::vector<Chunk> chunks;
+	size_t offset = 0;
+	uint64_t frame = 0;
+
+	void *allocate(size_t size, size_t alignment);
+	bool add_chunk(size_t min_size);
+	void rewind(uint64_t new_frame);
+
+	~ThreadArena()
+	{
+		for (auto &chunk : chunks)
+			memalign_free(chunk.data);
+	}
+};
+static thread_local ThreadArena thread_arena;
+
+bool ThreadArena::add_chunk(size_t min_size)
+{
+	size_t size = chunks.empty() ? size_t(MinChunkSize) : 2 * chunks.back().size;
+	size = std::max(size, min_size);
+
+	auto *data = static_cast<uint8_t *>(memalign_alloc(64, size));
+	if (!data)
+		return false;
+
+	chunk_allocation_count.fetch_add(1, std::memory_order_relaxed);
+	chunks.push_back({ data, size });
+	offset = 0;
+	return true;
+}
+
+// If the last frame needed more than one chunk, replace them with a single chunk of the combined size,
+// so a steady workload ends up allocating from one chunk without touching the heap at all.
+void ThreadArena::rewind(uint64_t new_frame)
+{
+	frame = new_frame;
+	offset = 0;
+	if (chunks.size() <= 1)
+		return;
+
+	size_t total_size = 0;
+	for (auto &chunk : chunks)
+	{
+		total_size += chunk.size;
+		memalign_free(chunk.data);
+	}
+	chunks.clear();
+	add_chunk(total_size);
+}
+
+void *ThreadArena::allocate(size_t size, size_t alignment)
+{
+	uint64_t current_frame = frame_index.load(std::memory_order_relaxed);
+	if (frame != current_frame)
+		rewind(current_frame);
+
+	if (!chunks.empty())
+	{
+		auto &chunk = chunks.back();
+		auto base = reinterpret_cast<uintptr_t>(chunk.data);
+		uintptr_t aligned = (base + offset + alignment - 1) & ~uintptr_t(alignment - 1);
+		if (aligned + size <= base + chunk.size)
+		{
+			offset = aligned + size - base;
+			return reinterpret_cast<void *>(aligned);
+		}
+	}
+
+	if (!add_chunk(size + alignment))
+		return nullptr;
+
+	auto &chunk = chunks.back();
+	auto base = reinterpret_cast<uintptr_t>(chunk.data);
+	uintptr_t aligned = (base + alignment - 1) & ~uintptr_t(alignment - 1);
+	offset = aligned + size - base;
+	return reinterpret_cast<void *>(aligned);
+}
+
+void *FrameArena::allocate(size_t size, size_t alignment)
+{
+	return thread_arena.allocate(size, alignment);
+}
+
+void FrameArena::end_frame()
+{
+	frame_index.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t FrameArena::get_frame_index()
+{
+	return frame_index.load(std::memory_order_relaxed);
+}
+
+uint64_t FrameArena::get_chunk_allocation_count()
+{
+	return chunk_allocation_count.load(std::memory_order_relaxed);
+}
+}
@@ -0,0 +1,118 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace Util
+{
+// Per-thread linear allocators for data which does not outlive the current frame.
+// Every thread bumps through its own memory, so allocating never takes a lock, and memory may be
+// handed to and "freed" on any thread, which is a no-op. end_frame() rewinds all arenas at once,
+// each thread starts over the next time it allocates and keeps the memory it grew to.
+class FrameArena
+{
+public:
+	// Returns nullptr if the arena cannot grow.
+	static void *allocate(size_t size, size_t alignment);
+
+	// Must only be called when nothing allocated in the current frame is in use anymore.
+	static void end_frame();
+	static uint64_t get_frame_index();
+
+	// Number of times any arena had to allocate memory for itself.
+	static uint64_t get_chunk_allocation_count();
+};
+
+// STL allocator on top of the calling thread's FrameArena.
+template <typename T>
+class FrameAllocator
+{
+public:
+	using value_type = T;
+
+	FrameAllocator() noexcept = default;
+
+	template <typename U>
+	FrameAllocator(const FrameAllocator<U> &) noexcept
+	{
+	}
+
+	T *allocate(size_t count)
+	{
+		void *ptr = FrameArena::allocate(count * sizeof(T), alignof(T));
+		if (!ptr)
+			throw std::bad_alloc();
+		return static_cast<T *>(ptr);
+	}
+
+	void deallocate(T *, size_t) noexcept
+	{
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const FrameAllocator<T> &, const FrameAllocator<U> &) noexcept
+{
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const FrameAllocator<T> &, const FrameAllocator<U> &) noexcept
+{
+	return false;
+}
+
+// std::vector in FrameArena memory. The storage is only valid during the frame it was allocated in.
+// clear() lets go of storage from an earlier frame, so a FrameVector can be kept around as a member
+// as long as it is cleared every frame before it is used. Only trivially destructible types are allowed,
+// so destroying a FrameVector after its frame has ended never touches the stale storage.
+template <typename T>
+class FrameVector : public std::vector<T, FrameAllocator<T>>
+{
+	static_assert(std::is_trivially_destructible<T>::value, "FrameVector requires trivially destructible types.");
+	using Base = std::vector<T, FrameAllocator<T>>;
+
+public:
+	using Base::Base;
+
+	void clear() noexcept
+	{
+		uint64_t frame = FrameArena::get_frame_index();
+		if (frame != storage_frame)
+		{
+			Base().swap(*this);
+			storage_frame = frame;
+		}
+		else
+			Base::clear();
+	}
+
+private:
+	uint64_t storage_frame = FrameArena::get_frame_index();
+};
+}
@@ -29,15 +29,20 @@
 #include <vector>
 #include <stack>
 #include <utility>
+#include <type_traits>
 
 namespace Util
 {
 using GenerationalHandleID = uint32_t;
-template <typename T>
+
+// 32-bit IDs have 24 index bits and 8 generation bits. 64-bit IDs split evenly,
+// for objects which are recycled often enough that an 8-bit generation would wrap around too quickly.
+template <typename T, typename IDType = GenerationalHandleID>
 class GenerationalHandlePool
 {
 public:
-	using ID = GenerationalHandleID;
+	using ID = IDType;
+	static_assert(std::is_same<ID, uint32_t>::value || std::is_same<ID, uint64_t>::value, "ID must be 32-bit or 64-bit.");
 
 	GenerationalHandlePool()
 	{
@@ -61,7 +66,7 @@ public:
 	ID emplace(P&&... p)
 	{
 		auto index = get_vacant_index();
-		auto generation_index = uint8_t(++generation[index]);
+		auto generation_index = ++generation[index];
 
 		// Reserve generation index 0 for sentinel purposes.
 		if (!generation_index)
@@ -116,6 +121,12 @@ public:
 		return *elements[index];
 	}
 
+	// Index into a dense array of all IDs which are alive at the same time, stable while the ID is alive.
+	static uint32_t get_index(ID id)
+	{
+		return memory_index(id);
+	}
+
 	void clear()
 	{
 		for (size_t i = 0; i < elements.size(); i++)
@@ -130,9 +141,13 @@ public:
 	}
 
 private:
+	enum : unsigned { IndexBits = sizeof(ID) == sizeof(uint64_t) ? 32 : 24 };
+	using Generation = typename std::conditional<sizeof(ID) == sizeof(uint64_t), uint32_t, uint8_t>::type;
+	static constexpr ID IndexMask = (ID(1) << IndexBits) - 1;
+
 	Util::ObjectPool<T> pool;
 	std::vector<T *> elements;
-	std::vector<uint8_t> generation;
+	std::vector<Generation> generation;
 	std::stack<uint32_t> vacant_indices;
 
 	uint32_t get_vacant_index()
@@ -141,8 +156,8 @@ private:
 		{
 			size_t current_size = elements.size();
 
-			// If this is ever a problem, we can bump to 64-bit IDs.
-			if (current_size >= (size_t(1) << 24u))
+			// If this is ever a problem with 32-bit IDs, use 64-bit IDs instead.
+			if (current_size >= (size_t(1) << IndexBits))
 				throw std::bad_alloc();
 
 			elements.resize(current_size * 2);
@@ -156,21 +171,20 @@ private:
 		return ret;
 	}
 
-	static ID make_id(uint32_t index, uint32_t generation_index)
+	static ID make_id(uint32_t index, Generation generation_index)
 	{
-		assert(index <= 0x00ffffffu);
-		assert(generation_index <= 0xffu);
-		return (generation_index << 24u) | index;
+		assert(index <= IndexMask);
+		return (ID(generation_index) << IndexBits) | index;
 	}
 
-	static uint32_t generation_index(ID id)
+	static Generation generation_index(ID id)
 	{
-		return (id >> 24u) & 0xffu;
+		return Generation(id >> IndexBits);
 	}
 
 	static uint32_t memory_index(ID id)
 	{
-		return id & 0xffffffu;
+		return uint32_t(id & IndexMask);
 	}
 };
 }
@@ -0,0 +1,261 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/hash.hpp"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define GRANITE_HASH_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define GRANITE_TARGET_AVX2
+#else
+#define GRANITE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace Util
+{
+namespace Internal
+{
+// Four 64-bit lanes consume one 32 byte stripe per step. Each lane adds a 32x32 -> 64-bit product of
+// its key-mixed input, plus the raw input of its neighbor, so the lanes have no dependencies between
+// each other within a stripe. Every block of stripes the lanes are scrambled to avalanche the high bits.
+enum { StripeSize = 32, StripesPerBlock = 16 };
+static const uint64_t bulk_keys[4] = {
+	0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+};
+static const uint64_t bulk_prime = 0x9e3779b1ull;
+
+struct BulkHashImpl
+{
+	void (*accumulate)(uint64_t *acc, const uint8_t *data, size_t num_stripes);
+	void (*scramble)(uint64_t *acc);
+};
+
+static inline uint64_t load64(const uint8_t *data)
+{
+	uint64_t v;
+	memcpy(&v, data, sizeof(v));
+	return v;
+}
+
+static void accumulate_scalar(uint64_t *acc, const uint8_t *data, size_t num_stripes)
+{
+	for (size_t stripe = 0; stripe < num_stripes; stripe++, data += StripeSize)
+	{
+		for (unsigned i = 0; i < 4; i++)
+		{
+			uint64_t v = load64(data + 8 * i);
+			uint64_t k = v ^ bulk_keys[i];
+			acc[i ^ 1] += v;
+			acc[i] += (k & 0xffffffffu) * (k >> 32);
+		}
+	}
+}
+
+static void scramble_scalar(uint64_t *acc)
+{
+	for (unsigned i = 0; i < 4; i++)
+	{
+		acc[i] ^= acc[i] >> 47;
+		acc[i] ^= bulk_keys[i];
+		acc[i] *= bulk_prime;
+	}
+}
+
+#ifdef GRANITE_HASH_X86
+static void accumulate_sse2(uint64_t *acc, const uint8_t *data, size_t num_stripes)
+{
+	__m128i acc0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc));
+	__m128i acc1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + 2));
+	const __m128i key0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bulk_keys));
+	const __m128i key1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bulk_keys + 2));
+
+	for (size_t stripe = 0; stripe < num_stripes; stripe++, data += StripeSize)
+	{
+		__m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+		__m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16));
+		__m128i k0 = _mm_xor_si128(v0, key0);
+		__m128i k1 = _mm_xor_si128(v1, key1);
+		acc0 = _mm_add_epi64(acc0, _mm_shuffle_epi32(v0, _MM_SHUFFLE(1, 0, 3, 2)));
+		acc1 = _mm_add_epi64(acc1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)));
+		acc0 = _mm_add_epi64(acc0, _mm_mul_epu32(k0, _mm_srli_epi64(k0, 32)));
+		acc1 = _mm_add_epi64(acc1, _mm_mul_epu32(k1, _mm_srli_epi64(k1, 32)));
+	}
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(acc), acc0);
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(acc + 2), acc1);
+}
+
+static inline __m128i scramble_lanes_sse2(__m128i acc, __m128i key)
+{
+	const __m128i prime = _mm_set1_epi32(int(bulk_prime));
+	acc = _mm_xor_si128(acc, _mm_srli_epi64(acc, 47));
+	acc = _mm_xor_si128(acc, key);
+	// 64x32-bit multiply, split in two 32x32 -> 64-bit products.
+	__m128i lo = _mm_mul_epu32(acc, prime);
+	__m128i hi = _mm_mul_epu32(_mm_srli_epi64(acc, 32), prime);
+	return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+}
+
+static void scramble_sse2(uint64_t *acc)
+{
+	__m128i acc0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc));
+	__m128i acc1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + 2));
+	acc0 = scramble_lanes_sse2(acc0, _mm_loadu_si128(reinterpret_cast<const __m128i *>(bulk_keys)));
+	acc1 = scramble_lanes_sse2(acc1, _mm_loadu_si128(reinterpret_cast<const __m128i *>(bulk_keys + 2)));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(acc), acc0);
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(acc + 2), acc1);
+}
+
+GRANITE_TARGET_AVX2 static void accumulate_avx2(uint64_t *acc, const uint8_t *data, size_t num_stripes)
+{
+	__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc));
+	const __m256i key = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bulk_keys));
+
+	for (size_t stripe = 0; stripe < num_stripes; stripe++, data += StripeSize)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+		__m256i k = _mm256_xor_si256(v, key);
+		a = _mm256_add_epi64(a, _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+		a = _mm256_add_epi64(a, _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32)));
+	}
+
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(acc), a);
+}
+
+GRANITE_TARGET_AVX2 static void scramble_avx2(uint64_t *acc)
+{
+	const __m256i prime = _mm256_set1_epi32(int(bulk_prime));
+	__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc));
+	a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+	a = _mm256_xor_si256(a, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bulk_keys)));
+	__m256i lo = _mm256_mul_epu32(a, prime);
+	__m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+	a = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(acc), a);
+}
+
+static bool cpu_supports_avx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// AVX2 needs OS support for the YMM state as well.
+	__cpuid(info, 1);
+	bool osxsave_avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+	if (!osxsave_avx || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+static BulkHashImpl select_bulk_hash_impl()
+{
+#ifdef GRANITE_HASH_X86
+	if (cpu_supports_avx2())
+		return { accumulate_avx2, scramble_avx2 };
+	else
+		return { accumulate_sse2, scramble_sse2 };
+#else
+	return { accumulate_scalar, scramble_scalar };
+#endif
+}
+
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t rotl64(uint64_t v, unsigned bits)
+{
+	return (v << bits) | (v >> (64 - bits));
+}
+
+template <typename Accumulate, typename Scramble>
+static inline Hash hash_bulk_impl(const Accumulate &accumulate, const Scramble &scramble,
+                                  const void *data_, size_t size, Hash seed)
+{
+	auto *data = static_cast<const uint8_t *>(data_);
+	uint64_t acc[4];
+	for (unsigned i = 0; i < 4; i++)
+		acc[i] = seed ^ bulk_keys[i];
+
+	size_t num_stripes = size / StripeSize;
+	while (num_stripes >= StripesPerBlock)
+	{
+		accumulate(acc, data, StripesPerBlock);
+		scramble(acc);
+		data += StripesPerBlock * StripeSize;
+		num_stripes -= StripesPerBlock;
+	}
+
+	if (num_stripes)
+	{
+		accumulate(acc, data, num_stripes);
+		data += num_stripes * StripeSize;
+	}
+
+	size_t tail = size % StripeSize;
+	if (tail)
+	{
+		uint8_t last[StripeSize] = {};
+		memcpy(last, data, tail);
+		accumulate(acc, last, 1);
+	}
+
+	uint64_t h = mix64(seed ^ (size * 0x9e3779b97f4a7c15ull) ^ acc[0] ^ rotl64(acc[1], 23));
+	h = mix64(h ^ acc[2] ^ rotl64(acc[3], 41));
+	return h;
+}
+
+Hash hash_bulk(const void *data, size_t size, Hash seed)
+{
+	// Small inputs are dominated by the setup, and are better off with the inlined scalar path.
+	if (size <= 2 * StripeSize)
+		return hash_bulk_scalar(data, size, seed);
+
+	static const BulkHashImpl impl = select_bulk_hash_impl();
+	return hash_bulk_impl(impl.accumulate, impl.scramble, data, size, seed);
+}
+
+Hash hash_bulk_scalar(const void *data, size_t size, Hash seed)
+{
+	return hash_bulk_impl(accumulate_scalar, scramble_scalar, data, size, seed);
+}
+}
+}
@@ -22,6 +22,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
 
@@ -29,6 +30,14 @@ namespace Util
 {
 using Hash = uint64_t;
 
+namespace Internal
+{
+// Multi-lane hash over 32 byte stripes, dispatched to the best SIMD implementation at runtime.
+// All implementations return the same value.
+Hash hash_bulk(const void *data, size_t size, Hash seed);
+Hash hash_bulk_scalar(const void *data, size_t size, Hash seed);
+}
+
 class Hasher
 {
 public:
@@ -39,6 +48,8 @@ public:
 
 	Hasher() = default;
 
+	// Hashes one element at a time. The result is stable, use this for hashes which are persisted,
+	// like the Fossilize and shader cache keys.
 	template <typename T>
 	inline void data(const T *data_, size_t size)
 	{
@@ -47,6 +58,13 @@ public:
 			h = (h * 0x100000001b3ull) ^ data_[i];
 	}
 
+	// Hashes size bytes many at a time, much faster than data() for anything but tiny buffers.
+	// The result depends on the host endianness and may change between versions, so never persist it.
+	inline void bulk(const void *data_, size_t size)
+	{
+		h = Internal::hash_bulk(data_, size, h);
+	}
+
 	inline void u32(uint32_t value)
 	{
 		h = (h * 0x100000001b3ull) ^ value;
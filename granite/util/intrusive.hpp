@@ -259,7 +259,6 @@ public:
 		*this = std::move(other);
 	}
 
-	template <typename U>
 	IntrusivePtr(IntrusivePtr &&other) noexcept
 	{
 		*this = std::move(other);
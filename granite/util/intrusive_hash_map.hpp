@@ -26,10 +26,23 @@
 #include "util/intrusive_list.hpp"
 #include "util/read_write_lock.hpp"
 #include "util/object_pool.hpp"
+#include "util/epoch_reclamation.hpp"
 
+#include "util/bitops.hpp"
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <memory>
+#include <stdint.h>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 namespace Util
 {
 
@@ -81,12 +94,88 @@ struct IntrusivePODWrapper : public IntrusiveHashMapEnabled<IntrusivePODWrapper<
 	T value = {};
 };
 
+namespace Internal
+{
+// Compares the tags of a group of consecutive slots at once, in the style of Swiss tables.
+// match() returns a mask with one bit per matching slot, Stride bits apart.
+struct HashTagGroup
+{
+#if defined(__SSE2__)
+	enum { Size = 16, Stride = 1 };
+	using Mask = uint32_t;
+
+	static Mask match(const uint8_t *tags, uint8_t tag)
+	{
+		__m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tags));
+		return Mask(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(char(tag)))));
+	}
+
+	static unsigned first_slot(Mask mask)
+	{
+		return trailing_zeroes(mask);
+	}
+
+	static Mask first_slots(unsigned count)
+	{
+		return (1u << count) - 1u;
+	}
+#elif defined(__ARM_NEON)
+	enum { Size = 16, Stride = 4 };
+	using Mask = uint64_t;
+
+	static Mask match(const uint8_t *tags, uint8_t tag)
+	{
+		uint8x16_t cmp = vceqq_u8(vld1q_u8(tags), vdupq_n_u8(tag));
+		// There is no movemask, narrowing gives a nibble per slot instead.
+		uint8x8_t narrow = vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4);
+		return vget_lane_u64(vreinterpret_u64_u8(narrow), 0) & 0x8888888888888888ull;
+	}
+
+	static unsigned first_slot(Mask mask)
+	{
+		return trailing_zeroes64(mask) / Stride;
+	}
+
+	static Mask first_slots(unsigned count)
+	{
+		return count >= Size ? ~Mask(0) : ((Mask(1) << (count * Stride)) - 1u);
+	}
+#else
+	enum { Size = 8, Stride = 1 };
+	using Mask = uint32_t;
+
+	static Mask match(const uint8_t *tags, uint8_t tag)
+	{
+		Mask mask = 0;
+		for (unsigned i = 0; i < Size; i++)
+			if (tags[i] == tag)
+				mask |= 1u << i;
+		return mask;
+	}
+
+	static unsigned first_slot(Mask mask)
+	{
+		return trailing_zeroes(mask);
+	}
+
+	static Mask first_slots(unsigned count)
+	{
+		return (1u << count) - 1u;
+	}
+#endif
+};
+}
+
 // This HashMap is non-owning. It just arranges a list of pointers.
 // It's kind of special purpose container used by the Vulkan backend.
 // Dealing with memory ownership is done through composition by a different class.
 // T must inherit from IntrusiveHashMapEnabled<T>.
 // Each instance of T can only be part of one hashmap.
 
+// Every key lives in one of the load_count slots following its hash.
+// Lookups never dereference the values they probe, the full hash is stored next to each value.
+// Each slot also has a one byte tag with the top bits of the hash, so misses compare a group of slots at a time.
+
 template <typename T>
 class IntrusiveHashMapHolder
 {
@@ -95,19 +184,8 @@ public:
 
 	T *find(Hash hash) const
 	{
-		if (values.empty())
-			return nullptr;
-
-		Hash hash_mask = values.size() - 1;
-		auto masked = hash & hash_mask;
-		for (unsigned i = 0; i < load_count; i++)
-		{
-			if (values[masked] && get_hash(values[masked]) == hash)
-				return values[masked];
-			masked = (masked + 1) & hash_mask;
-		}
-
-		return nullptr;
+		size_t index = find_index(hash);
+		return index != NotFound ? slots[index].value : nullptr;
 	}
 
 	template <typename P>
@@ -129,83 +207,50 @@ public:
 	// Returns nullptr if nothing was in the hashmap for this key.
 	T *insert_yield(T *&value)
 	{
-		if (values.empty())
-			grow();
-
-		Hash hash_mask = values.size() - 1;
 		auto hash = get_hash(value);
-		auto masked = hash & hash_mask;
-
-		for (unsigned i = 0; i < load_count; i++)
+		size_t index = find_index(hash);
+		if (index != NotFound)
 		{
-			if (values[masked] && get_hash(values[masked]) == hash)
-			{
-				T *ret = value;
-				value = values[masked];
-				return ret;
-			}
-			else if (!values[masked])
-			{
-				values[masked] = value;
-				list.insert_front(value);
-				return nullptr;
-			}
-			masked = (masked + 1) & hash_mask;
+			T *ret = value;
+			value = slots[index].value;
+			return ret;
 		}
 
-		grow();
-		return insert_yield(value);
+		while (!insert_inner(value))
+			grow();
+		list.insert_front(value);
+		return nullptr;
 	}
 
 	T *insert_replace(T *value)
 	{
-		if (values.empty())
-			grow();
-
-		Hash hash_mask = values.size() - 1;
 		auto hash = get_hash(value);
-		auto masked = hash & hash_mask;
-
-		for (unsigned i = 0; i < load_count; i++)
+		size_t index = find_index(hash);
+		if (index != NotFound)
 		{
-			if (values[masked] && get_hash(values[masked]) == hash)
-			{
-				std::swap(values[masked], value);
-				list.erase(value);
-				list.insert_front(values[masked]);
-				return value;
-			}
-			else if (!values[masked])
-			{
-				assert(!values[masked]);
-				values[masked] = value;
-				list.insert_front(value);
-				return nullptr;
-			}
-			masked = (masked + 1) & hash_mask;
+			std::swap(slots[index].value, value);
+			list.erase(value);
+			list.insert_front(slots[index].value);
+			return value;
 		}
 
-		grow();
-		return insert_replace(value);
+		while (!insert_inner(value))
+			grow();
+		list.insert_front(value);
+		return nullptr;
 	}
 
 	T *erase(Hash hash)
 	{
-		Hash hash_mask = values.size() - 1;
-		auto masked = hash & hash_mask;
+		size_t index = find_index(hash);
+		if (index == NotFound)
+			return nullptr;
 
-		for (unsigned i = 0; i < load_count; i++)
-		{
-			if (values[masked] && get_hash(values[masked]) == hash)
-			{
-				auto *value = values[masked];
-				list.erase(value);
-				values[masked] = nullptr;
-				return value;
-			}
-			masked = (masked + 1) & hash_mask;
-		}
-		return nullptr;
+		auto *value = slots[index].value;
+		list.erase(value);
+		slots[index].value = nullptr;
+		set_tag(index, 0);
+		return value;
 	}
 
 	void erase(T *value)
@@ -216,10 +261,16 @@ public:
 	void clear()
 	{
 		list.clear();
-		values.clear();
+		slots.clear();
+		tags.clear();
 		load_count = 0;
 	}
 
+	size_t get_capacity() const
+	{
+		return slots.size();
+	}
+
 	typename IntrusiveList<T>::Iterator begin()
 	{
 		return list.begin();
@@ -236,33 +287,74 @@ public:
 	}
 
 private:
+	using TagGroup = Internal::HashTagGroup;
+	enum : size_t { NotFound = ~size_t(0) };
 
-	inline bool compare_key(Hash masked, Hash hash) const
+	inline Hash get_hash(const T *value) const
 	{
-		return get_key_for_index(masked) == hash;
+		return static_cast<const IntrusiveHashMapEnabled<T> *>(value)->get_hash();
 	}
 
-	inline Hash get_hash(const T *value) const
+	// Low bits of the hash select the slot, so tag with the high bits. Tag 0 is an empty slot.
+	static inline uint8_t get_tag(Hash hash)
 	{
-		return static_cast<const IntrusiveHashMapEnabled<T> *>(value)->get_hash();
+		return uint8_t(0x80u | (hash >> 57));
 	}
 
-	inline Hash get_key_for_index(Hash masked) const
+	inline void set_tag(size_t index, uint8_t tag)
 	{
-		return get_hash(values[masked]);
+		tags[index] = tag;
+		// The first group is mirrored after the end, so groups can be loaded without wrapping around.
+		if (index < TagGroup::Size)
+			tags[slots.size() + index] = tag;
+	}
+
+	size_t find_index(Hash hash) const
+	{
+		if (slots.empty())
+			return NotFound;
+
+		Hash hash_mask = slots.size() - 1;
+		auto masked = hash & hash_mask;
+		// Most hits are in the first slot, check it before going through the tags,
+		// which is an extra cache miss in large maps.
+		if (slots[masked].hash == hash && slots[masked].value)
+			return masked;
+
+		auto tag = get_tag(hash);
+
+		for (unsigned i = 0; i < load_count; i += TagGroup::Size)
+		{
+			auto mask = TagGroup::match(&tags[masked], tag) &
+			            TagGroup::first_slots(std::min<unsigned>(load_count - i, TagGroup::Size));
+			while (mask)
+			{
+				auto index = (masked + TagGroup::first_slot(mask)) & hash_mask;
+				if (slots[index].hash == hash)
+					return index;
+				mask &= mask - 1;
+			}
+			masked = (masked + TagGroup::Size) & hash_mask;
+		}
+
+		return NotFound;
 	}
 
 	bool insert_inner(T *value)
 	{
-		Hash hash_mask = values.size() - 1;
+		if (slots.empty())
+			return false;
+
+		Hash hash_mask = slots.size() - 1;
 		auto hash = get_hash(value);
 		auto masked = hash & hash_mask;
 
 		for (unsigned i = 0; i < load_count; i++)
 		{
-			if (!values[masked])
+			if (!slots[masked].value)
 			{
-				values[masked] = value;
+				slots[masked] = { hash, value };
+				set_tag(masked, get_tag(hash));
 				return true;
 			}
 			masked = (masked + 1) & hash_mask;
@@ -275,22 +367,24 @@ private:
 		bool success;
 		do
 		{
-			for (auto &v : values)
-				v = nullptr;
-
-			if (values.empty())
+			if (slots.empty())
 			{
-				values.resize(InitialSize);
+				slots.resize(InitialSize);
 				load_count = InitialLoadCount;
 				//LOGI("Growing hashmap to %u elements.\n", InitialSize);
 			}
 			else
 			{
-				values.resize(values.size() * 2);
-				//LOGI("Growing hashmap to %u elements.\n", unsigned(values.size()));
+				slots.resize(slots.size() * 2);
+				//LOGI("Growing hashmap to %u elements.\n", unsigned(slots.size()));
 				load_count++;
 			}
 
+			for (auto &slot : slots)
+				slot = {};
+			tags.clear();
+			tags.resize(slots.size() + TagGroup::Size);
+
 			// Re-insert.
 			success = true;
 			for (auto &t : list)
@@ -304,7 +398,13 @@ private:
 		} while (!success);
 	}
 
-	std::vector<T *> values;
+	struct Slot
+	{
+		Hash hash;
+		T *value;
+	};
+	std::vector<Slot> slots;
+	std::vector<uint8_t> tags;
 	IntrusiveList<T> list;
 	unsigned load_count = 0;
 };
@@ -434,34 +534,248 @@ private:
 template <typename T>
 using IntrusiveHashMapWrapper = IntrusiveHashMap<IntrusivePODWrapper<T>>;
 
+// An index over values owned by an IntrusiveHashMapHolder which can be read without locks.
+// Writers must be serialized externally, readers must be inside an EpochReadGuard.
+// Links are stored and loaded sequentially consistent as EpochReclamation requires.
+// Tables replaced when growing are reclaimed once no reader can observe them anymore.
 template <typename T>
-class ThreadSafeIntrusiveHashMap
+class IntrusiveHashMapLockFreeIndex
 {
 public:
+	IntrusiveHashMapLockFreeIndex()
+	{
+		table.store(nullptr, std::memory_order_relaxed);
+	}
+
+	~IntrusiveHashMapLockFreeIndex()
+	{
+		clear();
+	}
+
+	IntrusiveHashMapLockFreeIndex(const IntrusiveHashMapLockFreeIndex &) = delete;
+	void operator=(const IntrusiveHashMapLockFreeIndex &) = delete;
+
 	T *find(Hash hash) const
 	{
-		lock.lock_read();
-		T *t = hashmap.find(hash);
-		lock.unlock_read();
+		auto *t = table.load(std::memory_order_seq_cst);
+		if (!t)
+			return nullptr;
+
+		auto masked = hash & t->hash_mask;
+		for (unsigned i = 0; i < t->load_count; i++)
+		{
+			auto &slot = t->slots[masked];
+			if (slot.hash.load(std::memory_order_relaxed) == hash)
+			{
+				// The slot might be reused while we look at it, so the value has the final say.
+				T *value = slot.value.load(std::memory_order_seq_cst);
+				if (value && get_hash(value) == hash)
+					return value;
+			}
+			masked = (masked + 1) & t->hash_mask;
+		}
+
+		return nullptr;
+	}
+
+	void insert(T *value)
+	{
+		auto *t = table.load(std::memory_order_relaxed);
+		while (!t || !insert_inner(*t, value))
+			t = grow(t);
+		reclaim();
+	}
 
-		// We can race with the intrusive list internal pointers,
-		// but that's an internal detail which should never be touched outside the hashmap.
-		return t;
+	void replace(T *old_value, T *value)
+	{
+		auto *slot = find_slot(old_value);
+		assert(slot);
+		slot->value.store(value, std::memory_order_seq_cst);
+	}
+
+	void erase(T *value)
+	{
+		auto *slot = find_slot(value);
+		if (slot)
+			slot->value.store(nullptr, std::memory_order_seq_cst);
+	}
+
+	// Not safe with concurrent readers.
+	void clear()
+	{
+		delete table.load(std::memory_order_relaxed);
+		table.store(nullptr, std::memory_order_relaxed);
+		for (auto &retired : retired_tables)
+			delete retired.second;
+		retired_tables.clear();
+	}
+
+private:
+	struct Slot
+	{
+		std::atomic<Hash> hash;
+		std::atomic<T *> value;
+	};
+
+	struct Table
+	{
+		explicit Table(size_t size, unsigned load_count_)
+		    : slots(new Slot[size]), hash_mask(size - 1), load_count(load_count_)
+		{
+			for (size_t i = 0; i < size; i++)
+			{
+				slots[i].hash.store(0, std::memory_order_relaxed);
+				slots[i].value.store(nullptr, std::memory_order_relaxed);
+			}
+		}
+
+		std::unique_ptr<Slot[]> slots;
+		Hash hash_mask;
+		unsigned load_count;
+	};
+
+	std::atomic<Table *> table;
+	std::vector<std::pair<uint64_t, Table *>> retired_tables;
+
+	static inline Hash get_hash(const T *value)
+	{
+		return static_cast<const IntrusiveHashMapEnabled<T> *>(value)->get_hash();
+	}
+
+	Slot *find_slot(T *value)
+	{
+		auto *t = table.load(std::memory_order_relaxed);
+		if (!t)
+			return nullptr;
+
+		auto masked = get_hash(value) & t->hash_mask;
+		for (unsigned i = 0; i < t->load_count; i++)
+		{
+			if (t->slots[masked].value.load(std::memory_order_relaxed) == value)
+				return &t->slots[masked];
+			masked = (masked + 1) & t->hash_mask;
+		}
+		return nullptr;
+	}
+
+	static bool insert_inner(Table &t, T *value)
+	{
+		auto hash = get_hash(value);
+		auto masked = hash & t.hash_mask;
+		for (unsigned i = 0; i < t.load_count; i++)
+		{
+			auto &slot = t.slots[masked];
+			if (!slot.value.load(std::memory_order_relaxed))
+			{
+				slot.hash.store(hash, std::memory_order_relaxed);
+				slot.value.store(value, std::memory_order_seq_cst);
+				return true;
+			}
+			masked = (masked + 1) & t.hash_mask;
+		}
+		return false;
+	}
+
+	Table *grow(Table *old_table)
+	{
+		size_t size = IntrusiveHashMapHolder<T>::InitialSize;
+		unsigned load_count = IntrusiveHashMapHolder<T>::InitialLoadCount;
+		if (old_table)
+		{
+			size = size_t(old_table->hash_mask + 1) * 2;
+			load_count = old_table->load_count + 1;
+		}
+
+		// Same growth policy as IntrusiveHashMapHolder.
+		std::unique_ptr<Table> new_table;
+		bool success;
+		do
+		{
+			new_table.reset(new Table(size, load_count));
+			success = true;
+			if (old_table)
+			{
+				for (Hash i = 0; i <= old_table->hash_mask && success; i++)
+				{
+					auto *value = old_table->slots[i].value.load(std::memory_order_relaxed);
+					if (value && !insert_inner(*new_table, value))
+						success = false;
+				}
+			}
+
+			size *= 2;
+			load_count++;
+		} while (!success);
+
+		// Readers which still see the old table find the same values there.
+		table.store(new_table.get(), std::memory_order_seq_cst);
+		if (old_table)
+			retired_tables.emplace_back(EpochReclamation::retire(), old_table);
+		return new_table.release();
+	}
+
+	void reclaim()
+	{
+		if (retired_tables.empty())
+			return;
+
+		uint64_t epoch = EpochReclamation::get_reclaimable_epoch();
+		size_t count = 0;
+		while (count < retired_tables.size() && retired_tables[count].first <= epoch)
+			delete retired_tables[count++].second;
+		retired_tables.erase(retired_tables.begin(), retired_tables.begin() + count);
+	}
+};
+
+// Lookups do not take any locks, see IntrusiveHashMapLockFreeIndex.
+// Values which are erased or replaced are freed once no lookup can observe them anymore,
+// but as before, callers must not erase values which other threads are still using.
+template <typename T>
+class ThreadSafeIntrusiveHashMap
+{
+public:
+	~ThreadSafeIntrusiveHashMap()
+	{
+		clear();
+	}
+
+	T *find(Hash hash) const
+	{
+		EpochReadGuard guard;
+		return index.find(hash);
 	}
 
 	template <typename P>
 	bool find_and_consume_pod(Hash hash, P &p) const
 	{
-		lock.lock_read();
-		bool ret = hashmap.find_and_consume_pod(hash, p);
-		lock.unlock_read();
-		return ret;
+		EpochReadGuard guard;
+		T *t = index.find(hash);
+		if (t)
+		{
+			p = t->get();
+			return true;
+		}
+		else
+			return false;
 	}
 
+	// Not supposed to be called in racy conditions.
 	void clear()
 	{
 		lock.lock_write();
+		index.clear();
+		auto &list = hashmap.inner_list();
+		auto itr = list.begin();
+		while (itr != list.end())
+		{
+			auto *to_free = itr.get();
+			itr = list.erase(itr);
+			object_pool.free(to_free);
+		}
 		hashmap.clear();
+		for (auto &retired : retired_values)
+			object_pool.free(retired.second);
+		retired_values.clear();
 		lock.unlock_write();
 	}
 
@@ -470,13 +784,20 @@ public:
 	{
 		lock.lock_write();
 		hashmap.erase(value);
+		index.erase(value);
+		retire(value);
 		lock.unlock_write();
 	}
 
 	void erase(Hash hash)
 	{
 		lock.lock_write();
-		hashmap.erase(hash);
+		T *value = hashmap.erase(hash);
+		if (value)
+		{
+			index.erase(value);
+			retire(value);
+		}
 		lock.unlock_write();
 	}
 
@@ -484,7 +805,7 @@ public:
 	T *allocate(P&&... p)
 	{
 		lock.lock_write();
-		T *t = hashmap.allocate(std::forward<P>(p)...);
+		T *t = object_pool.allocate(std::forward<P>(p)...);
 		lock.unlock_write();
 		return t;
 	}
@@ -492,22 +813,36 @@ public:
 	void free(T *value)
 	{
 		lock.lock_write();
-		hashmap.free(value);
+		object_pool.free(value);
 		lock.unlock_write();
 	}
 
 	T *insert_replace(Hash hash, T *value)
 	{
+		static_cast<IntrusiveHashMapEnabled<T> *>(value)->set_hash(hash);
 		lock.lock_write();
-		value = hashmap.insert_replace(hash, value);
+		T *to_delete = hashmap.insert_replace(value);
+		if (to_delete)
+		{
+			index.replace(to_delete, value);
+			retire(to_delete);
+		}
+		else
+			index.insert(value);
 		lock.unlock_write();
 		return value;
 	}
 
 	T *insert_yield(Hash hash, T *value)
 	{
+		static_cast<IntrusiveHashMapEnabled<T> *>(value)->set_hash(hash);
 		lock.lock_write();
-		value = hashmap.insert_yield(hash, value);
+		T *to_delete = hashmap.insert_yield(value);
+		// The value we did not insert was never visible to readers.
+		if (to_delete)
+			object_pool.free(to_delete);
+		else
+			index.insert(value);
 		lock.unlock_write();
 		return value;
 	}
@@ -516,19 +851,15 @@ public:
 	template <typename... P>
 	T *emplace_replace(Hash hash, P&&... p)
 	{
-		lock.lock_write();
-		T *t = hashmap.emplace_replace(hash, std::forward<P>(p)...);
-		lock.unlock_write();
-		return t;
+		T *t = allocate(std::forward<P>(p)...);
+		return insert_replace(hash, t);
 	}
 
 	template <typename... P>
 	T *emplace_yield(Hash hash, P&&... p)
 	{
-		lock.lock_write();
-		T *t = hashmap.emplace_yield(hash, std::forward<P>(p)...);
-		lock.unlock_write();
-		return t;
+		T *t = allocate(std::forward<P>(p)...);
+		return insert_yield(hash, t);
 	}
 
 	// Not supposed to be called in racy conditions,
@@ -543,18 +874,28 @@ public:
 		return hashmap.end();
 	}
 
-	IntrusiveHashMap<T> &get_thread_unsafe()
+private:
+	IntrusiveHashMapHolder<T> hashmap;
+	IntrusiveHashMapLockFreeIndex<T> index;
+	ObjectPool<T> object_pool;
+	std::vector<std::pair<uint64_t, T *>> retired_values;
+	RWSpinLock lock;
+
+	void retire(T *value)
 	{
-		return hashmap;
-	}
+		retired_values.emplace_back(EpochReclamation::retire(), value);
 
-private:
-	IntrusiveHashMap<T> hashmap;
-	mutable RWSpinLock lock;
+		uint64_t epoch = EpochReclamation::get_reclaimable_epoch();
+		size_t count = 0;
+		while (count < retired_values.size() && retired_values[count].first <= epoch)
+			object_pool.free(retired_values[count++].second);
+		retired_values.erase(retired_values.begin(), retired_values.begin() + count);
+	}
 };
 
 // A special purpose hashmap which is split into a read-only, immutable portion and a plain thread-safe one.
 // User can move read-write thread-safe portion to read-only portion when user knows it's safe to do so.
+// Lookups do not take any locks, the read-write portion is read through an IntrusiveHashMapLockFreeIndex.
 template <typename T>
 class ThreadSafeIntrusiveHashMapReadCached
 {
@@ -570,14 +911,13 @@ public:
 		if (t)
 			return t;
 
-		lock.lock_read();
-		t = read_write.find(hash);
-		lock.unlock_read();
-		return t;
+		EpochReadGuard guard;
+		return read_write_index.find(hash);
 	}
 
 	void move_to_read_only()
 	{
+		read_write_index.clear();
 		auto &list = read_write.inner_list();
 		auto itr = list.begin();
 		while (itr != list.end())
@@ -597,15 +937,21 @@ public:
 		if (read_only.find_and_consume_pod(hash, p))
 			return true;
 
-		lock.lock_read();
-		bool ret = read_write.find_and_consume_pod(hash, p);
-		lock.unlock_read();
-		return ret;
+		EpochReadGuard guard;
+		T *t = read_write_index.find(hash);
+		if (t)
+		{
+			p = t->get();
+			return true;
+		}
+		else
+			return false;
 	}
 
 	void clear()
 	{
 		lock.lock_write();
+		read_write_index.clear();
 		clear_list(read_only.inner_list());
 		clear_list(read_write.inner_list());
 		read_only.clear();
@@ -636,6 +982,8 @@ public:
 		T *to_delete = read_write.insert_yield(value);
 		if (to_delete)
 			object_pool.free(to_delete);
+		else
+			read_write_index.insert(value);
 		lock.unlock_write();
 		return value;
 	}
@@ -660,8 +1008,9 @@ public:
 private:
 	IntrusiveHashMapHolder<T> read_only;
 	IntrusiveHashMapHolder<T> read_write;
+	IntrusiveHashMapLockFreeIndex<T> read_write_index;
 	ObjectPool<T> object_pool;
-	mutable RWSpinLock lock;
+	RWSpinLock lock;
 
 	void clear_list(IntrusiveList<T> &list)
 	{
@@ -0,0 +1,825 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/logging.hpp"
+#include "util/message_queue.hpp"
+#include "util/thread_name.hpp"
+#include "util/timer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+namespace Util
+{
+namespace Internal
+{
+std::atomic<int> log_level_threshold;
+std::atomic_bool async_logging_enabled;
+std::atomic_uint log_rate_limit;
+
+static const char *get_log_tag(LogLevel level)
+{
+	switch (level)
+	{
+	case LogLevel::Error:
+		return "[ERROR]: ";
+	case LogLevel::Warn:
+		return "[WARN]: ";
+	default:
+		return "[INFO]: ";
+	}
+}
+
+template <typename T>
+static int format_log_arg(char *buffer, size_t size, const char *spec, const int *stars, unsigned num_stars, T value)
+{
+	switch (num_stars)
+	{
+	case 0:
+		return snprintf(buffer, size, spec, value);
+	case 1:
+		return snprintf(buffer, size, spec, stars[0], value);
+	default:
+		return snprintf(buffer, size, spec, stars[0], stars[1], value);
+	}
+}
+
+static int format_log_arg(char *buffer, size_t size, const char *spec, const int *stars, unsigned num_stars,
+                          const LogArg &arg)
+{
+	switch (arg.type)
+	{
+	case LogArgType::Int:
+		return format_log_arg(buffer, size, spec, stars, num_stars, arg.i);
+	case LogArgType::UInt:
+		return format_log_arg(buffer, size, spec, stars, num_stars, arg.u);
+	case LogArgType::Long:
+		return format_log_arg(buffer, size, spec, stars, num_stars, arg.l);
+	case LogArgType::ULong:
+		return format_log_arg(buffer, size, spec, stars, num_stars, arg.ul);
+	case LogArgType::LongLong:
+		return format_log_arg(buffer, size, spec, stars, num_stars, arg.ll);
+	case LogArgType::ULongLong:
+		return format_log_arg(buffer, size, spec, stars, num_stars, arg.ull);
+	case LogArgType::Double:
+		return format_log_arg(buffer, size, spec, stars, num_stars, arg.d);
+	case LogArgType::Pointer:
+		return format_log_arg(buffer, size, spec, stars, num_stars, arg.p);
+	case LogArgType::String:
+		return format_log_arg(buffer, size, spec, stars, num_stars, arg.s);
+	}
+	return 0;
+}
+
+static int log_arg_as_int(const LogArg &arg)
+{
+	switch (arg.type)
+	{
+	case LogArgType::Int:
+		return arg.i;
+	case LogArgType::UInt:
+		return int(arg.u);
+	default:
+		return 0;
+	}
+}
+
+struct LogConversion
+{
+	const char *spec;
+	size_t spec_len;
+	unsigned num_stars;
+	char conversion;
+};
+
+// Parses the conversion at the '%' fmt points to, and returns the rest of the format string,
+// or nullptr if the format string ends in the middle of the conversion.
+static const char *parse_log_conversion(const char *fmt, LogConversion &conv)
+{
+	conv.spec = fmt++;
+	conv.num_stars = 0;
+
+	while (*fmt && strchr("-+ #0'", *fmt))
+		fmt++;
+
+	if (*fmt == '*')
+	{
+		conv.num_stars++;
+		fmt++;
+	}
+	else
+	{
+		while (*fmt >= '0' && *fmt <= '9')
+			fmt++;
+	}
+
+	if (*fmt == '.')
+	{
+		fmt++;
+		if (*fmt == '*')
+		{
+			conv.num_stars++;
+			fmt++;
+		}
+		else
+		{
+			while (*fmt >= '0' && *fmt <= '9')
+				fmt++;
+		}
+	}
+
+	while (*fmt && strchr("hlLqjzt", *fmt))
+		fmt++;
+
+	if (!*fmt)
+		return nullptr;
+
+	conv.conversion = *fmt++;
+	conv.spec_len = size_t(fmt - conv.spec);
+	return fmt;
+}
+
+// Marks the string arguments consumed by %s conversions.
+static void find_string_conversions(const char *fmt, const LogArg *args, bool *is_string, unsigned count)
+{
+	for (unsigned i = 0; i < count; i++)
+		is_string[i] = false;
+
+	unsigned arg_index = 0;
+	while ((fmt = strchr(fmt, '%')) != nullptr)
+	{
+		if (fmt[1] == '%')
+		{
+			fmt += 2;
+			continue;
+		}
+
+		LogConversion conv;
+		fmt = parse_log_conversion(fmt, conv);
+		arg_index += conv.num_stars;
+		if (!fmt || arg_index >= count)
+			break;
+
+		is_string[arg_index] = conv.conversion == 's' && args[arg_index].type == LogArgType::String;
+		arg_index++;
+	}
+}
+
+// vsnprintf needs a va_list, which cannot be built portably from captured arguments.
+// Instead, walk the format string and hand each conversion to snprintf along with its own argument.
+static size_t format_log_message(char *buffer, size_t size, LogLevel level, const char *fmt,
+                                 const LogArg *args, unsigned count)
+{
+	size_t offset = 0;
+	unsigned arg_index = 0;
+
+	const auto append = [&](const char *str, size_t len) {
+		len = std::min(len, size - 1 - offset);
+		memcpy(buffer + offset, str, len);
+		offset += len;
+	};
+
+	const char *tag = get_log_tag(level);
+	append(tag, strlen(tag));
+
+	while (*fmt && offset + 1 < size)
+	{
+		const char *next = strchr(fmt, '%');
+		if (!next)
+		{
+			append(fmt, strlen(fmt));
+			break;
+		}
+
+		append(fmt, size_t(next - fmt));
+		fmt = next;
+
+		if (fmt[1] == '%')
+		{
+			append("%", 1);
+			fmt += 2;
+			continue;
+		}
+
+		LogConversion conv;
+		fmt = parse_log_conversion(fmt, conv);
+		if (!fmt)
+			break;
+
+		int stars[2];
+		for (unsigned i = 0; i < conv.num_stars; i++)
+			stars[i] = arg_index < count ? log_arg_as_int(args[arg_index++]) : 0;
+
+		if (conv.conversion == 'n')
+		{
+			arg_index++;
+			continue;
+		}
+
+		char spec[32];
+		if (conv.spec_len >= sizeof(spec) || arg_index >= count)
+		{
+			append(conv.spec, conv.spec_len);
+			continue;
+		}
+
+		memcpy(spec, conv.spec, conv.spec_len);
+		spec[conv.spec_len] = '\0';
+
+		int ret = format_log_arg(buffer + offset, size - offset, spec, stars, conv.num_stars, args[arg_index++]);
+		if (ret > 0)
+			offset = std::min(offset + size_t(ret), size - 1);
+	}
+
+	buffer[offset] = '\0';
+	return offset;
+}
+
+static void write_log_message(MessageQueue *queue, const char *message, size_t length)
+{
+	fwrite(message, 1, length, stderr);
+#ifdef _WIN32
+	OutputDebugStringA(message);
+#endif
+
+	if (queue)
+	{
+		while (length && message[length - 1] == '\n')
+			length--;
+
+		auto message_payload = queue->allocate_write_payload(length + 1);
+		if (message_payload)
+		{
+			auto *payload = static_cast<char *>(message_payload.get_payload_data());
+			memcpy(payload, message, length);
+			payload[length] = '\0';
+			queue->push_written_payload(std::move(message_payload));
+		}
+	}
+}
+
+static void log_sync(LogLevel level, MessageQueue *queue, const char *fmt, const LogArg *args, unsigned count)
+{
+	char buffer[16 * 1024];
+	size_t length = format_log_message(buffer, sizeof(buffer), level, fmt, args, count);
+	write_log_message(queue, buffer, length);
+	fflush(stderr);
+}
+
+// Records are 8-byte aligned and never straddle the end of the ring.
+// If a record does not fit before the end, the remainder is filled with a padding record.
+struct LogRecordHeader
+{
+	uint32_t size;
+	uint32_t level;
+	uint32_t num_args;
+	uint32_t reserved;
+	int64_t timestamp;
+	const char *fmt;
+	MessageQueue *queue;
+};
+static constexpr uint32_t LogRecordPadding = ~0u;
+static_assert(sizeof(LogRecordHeader) % 8 == 0, "Log record header must be 8-byte aligned.");
+static_assert(sizeof(LogArg) % 8 == 0, "Log argument must be 8-byte aligned.");
+
+// String arguments are stored as offsets from the record header, with this value standing in for nullptr.
+static constexpr unsigned long long LogStringNull = ~0ull;
+static constexpr size_t LogStringMaxLength = 4 * 1024;
+
+struct LogRing
+{
+	enum { Size = 64 * 1024 };
+
+	// Written by the owning thread.
+	alignas(64) std::atomic<uint64_t> write_pos;
+	uint64_t cached_read_pos = 0;
+
+	// Written by the logging thread.
+	alignas(64) std::atomic<uint64_t> read_pos;
+
+	std::atomic_bool orphaned;
+
+	alignas(64) uint8_t data[Size];
+
+	LogRing()
+	{
+		write_pos.store(0, std::memory_order_relaxed);
+		read_pos.store(0, std::memory_order_relaxed);
+		orphaned.store(false, std::memory_order_relaxed);
+	}
+};
+
+struct AsyncLogger
+{
+	// Serializes start and stop, which must not overlap while the thread is joined.
+	std::mutex control_lock;
+	// Held while consuming records, by the logging thread or by a thread writing out its own ring.
+	std::mutex drain_lock;
+	std::mutex lock;
+	std::condition_variable cond;
+	std::condition_variable flush_cond;
+	std::vector<LogRing *> rings;
+	std::thread thread;
+	bool running = false;
+	bool stopping = false;
+	bool registered_atexit = false;
+	uint64_t flush_requested = 0;
+	uint64_t flush_completed = 0;
+	std::atomic_bool kicked;
+
+	AsyncLogger()
+	{
+		kicked.store(false, std::memory_order_relaxed);
+	}
+
+	void kick();
+	void thread_main();
+	bool drain();
+	void drain_ring(LogRing &ring);
+	void delete_orphaned_rings();
+};
+
+// Threads may log from static destructors, so never destroy the logger.
+static AsyncLogger &get_logger()
+{
+	static auto *logger = new AsyncLogger;
+	return *logger;
+}
+
+struct ThreadLogRing
+{
+	LogRing *ring = nullptr;
+	~ThreadLogRing();
+};
+static thread_local ThreadLogRing thread_log_ring;
+// Set once thread_log_ring is destroyed, later messages from thread_local destructors are written synchronously.
+static thread_local bool thread_log_ring_dead;
+
+ThreadLogRing::~ThreadLogRing()
+{
+	thread_log_ring_dead = true;
+	// The logging thread frees the ring once it has drained it.
+	if (ring)
+		ring->orphaned.store(true, std::memory_order_release);
+}
+
+static LogRing *get_thread_log_ring()
+{
+	if (thread_log_ring_dead)
+		return nullptr;
+
+	if (!thread_log_ring.ring)
+	{
+		auto *ring = new LogRing;
+		auto &logger = get_logger();
+		std::lock_guard<std::mutex> holder{logger.lock};
+		logger.rings.push_back(ring);
+		thread_log_ring.ring = ring;
+	}
+
+	return thread_log_ring.ring;
+}
+
+void AsyncLogger::kick()
+{
+	if (kicked.load(std::memory_order_relaxed) || kicked.exchange(true, std::memory_order_relaxed))
+		return;
+
+	// Notify under the lock so the wakeup cannot slip in between the predicate check and the wait.
+	std::lock_guard<std::mutex> holder{lock};
+	cond.notify_one();
+}
+
+static uint8_t *begin_log_record(LogRing &ring, uint32_t size, uint64_t &end_pos)
+{
+	uint64_t write_pos = ring.write_pos.load(std::memory_order_relaxed);
+	uint32_t offset = uint32_t(write_pos & (LogRing::Size - 1));
+	uint32_t padding = offset + size > LogRing::Size ? LogRing::Size - offset : 0;
+
+	if (write_pos + padding + size - ring.cached_read_pos > LogRing::Size)
+	{
+		ring.cached_read_pos = ring.read_pos.load(std::memory_order_acquire);
+		if (write_pos + padding + size - ring.cached_read_pos > LogRing::Size)
+			return nullptr;
+	}
+
+	if (padding)
+	{
+		auto *header = reinterpret_cast<LogRecordHeader *>(ring.data + offset);
+		header->size = padding;
+		header->level = LogRecordPadding;
+		write_pos += padding;
+	}
+
+	end_pos = write_pos + size;
+	return ring.data + (write_pos & (LogRing::Size - 1));
+}
+
+// Writes a message on the calling thread, after the messages it has queued so far.
+static void log_sync_after_ring(LogRing &ring, LogLevel level, MessageQueue *queue, const char *fmt,
+                                const LogArg *args, unsigned count)
+{
+	get_logger().drain_ring(ring);
+	log_sync(level, queue, fmt, args, count);
+}
+
+void log_record(LogLevel level, MessageQueue *queue, const char *fmt, const LogArg *args, unsigned count)
+{
+	auto *ring = get_thread_log_ring();
+	if (!ring)
+	{
+		log_sync(level, queue, fmt, args, count);
+		return;
+	}
+
+	// Errors often come right before abort(), e.g. in VK_ASSERT, which would lose a queued message.
+	if (level == LogLevel::Error)
+	{
+		log_sync_after_ring(*ring, level, queue, fmt, args, count);
+		return;
+	}
+
+	// Only %s arguments are copied, other char pointers, e.g. for %p, are captured by value.
+	bool copy_string[256];
+	bool has_strings = false;
+	for (unsigned i = 0; i < count; i++)
+		has_strings = has_strings || args[i].type == LogArgType::String;
+	if (has_strings)
+		find_string_conversions(fmt, args, copy_string, count);
+
+	uint32_t string_lengths[256];
+	size_t size = sizeof(LogRecordHeader) + count * sizeof(LogArg);
+	for (unsigned i = 0; i < count; i++)
+	{
+		if (args[i].type == LogArgType::String && copy_string[i] && args[i].s)
+		{
+			string_lengths[i] = uint32_t(std::min(strlen(args[i].s), LogStringMaxLength));
+			size += string_lengths[i] + 1;
+		}
+	}
+	size = (size + 7) & ~size_t(7);
+
+	// Oversized records would starve the ring, just format them here.
+	if (size > LogRing::Size / 4)
+	{
+		log_sync_after_ring(*ring, level, queue, fmt, args, count);
+		return;
+	}
+
+	uint64_t end_pos;
+	uint8_t *record = begin_log_record(*ring, uint32_t(size), end_pos);
+	if (!record)
+	{
+		// Rather than dropping the message, make room for later ones.
+		log_sync_after_ring(*ring, level, queue, fmt, args, count);
+		return;
+	}
+
+	auto *header = reinterpret_cast<LogRecordHeader *>(record);
+	header->size = uint32_t(size);
+	header->level = uint32_t(level);
+	header->num_args = count;
+	header->reserved = 0;
+	header->timestamp = get_current_time_nsecs();
+	header->fmt = fmt;
+	header->queue = queue;
+
+	auto *record_args = reinterpret_cast<LogArg *>(header + 1);
+	size_t string_offset = sizeof(LogRecordHeader) + count * sizeof(LogArg);
+	for (unsigned i = 0; i < count; i++)
+	{
+		record_args[i] = args[i];
+		if (args[i].type != LogArgType::String)
+			continue;
+
+		if (!copy_string[i])
+		{
+			record_args[i].type = LogArgType::Pointer;
+			record_args[i].p = args[i].s;
+		}
+		else if (args[i].s)
+		{
+			memcpy(record + string_offset, args[i].s, string_lengths[i]);
+			record[string_offset + string_lengths[i]] = '\0';
+			record_args[i].ull = string_offset;
+			string_offset += string_lengths[i] + 1;
+		}
+		else
+			record_args[i].ull = LogStringNull;
+	}
+
+	ring->write_pos.store(end_pos, std::memory_order_release);
+
+	// stop_async_logging() may have drained the rings for the last time after the caller saw async logging enabled.
+	// Either it sees this record, or we see the switch, see there.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!async_logging_active())
+	{
+		get_logger().drain_ring(*ring);
+		return;
+	}
+
+	// Normally the logging thread polls, but a ring filling up should be drained before it overflows.
+	if (end_pos - ring->cached_read_pos > LogRing::Size / 2)
+		get_logger().kick();
+}
+
+static void report_suppressed(const char *fmt, unsigned count)
+{
+	if (!log_level_enabled(LogLevel::Warn))
+		return;
+
+	// Only quote the first line of the format string.
+	int fmt_len = int(std::min<size_t>(strcspn(fmt, "\n"), 128));
+	const LogArg args[] = { make_log_arg(count), make_log_arg(fmt_len), make_log_arg(fmt) };
+	static const char report_fmt[] = "Rate limit suppressed %u messages from \"%.*s\"\n";
+
+	if (async_logging_active())
+		log_record(LogLevel::Warn, nullptr, report_fmt, args, 3);
+	else
+		log_sync(LogLevel::Warn, nullptr, report_fmt, args, 3);
+}
+
+bool log_rate_limit_accept_slow(LogRateLimitState &state, const char *fmt, unsigned limit)
+{
+	int64_t now = get_current_time_nsecs();
+	int64_t window_start = state.window_start.load(std::memory_order_relaxed);
+
+	// Only the thread which opens the next window resets it and reports what the last one suppressed.
+	if (now - window_start >= 1000000000ll &&
+	    state.window_start.compare_exchange_strong(window_start, now, std::memory_order_relaxed))
+	{
+		state.count.store(0, std::memory_order_relaxed);
+		unsigned suppressed = state.suppressed.exchange(0, std::memory_order_relaxed);
+		if (suppressed)
+			report_suppressed(fmt, suppressed);
+	}
+
+	if (state.count.fetch_add(1, std::memory_order_relaxed) < limit)
+		return true;
+
+	state.suppressed.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+static void write_log_record(const LogRecordHeader &header, char *buffer, size_t size)
+{
+	LogArg args[256];
+	auto *record = reinterpret_cast<const uint8_t *>(&header);
+	auto *record_args = reinterpret_cast<const LogArg *>(&header + 1);
+	for (unsigned i = 0; i < header.num_args; i++)
+	{
+		args[i] = record_args[i];
+		if (args[i].type == LogArgType::String)
+		{
+			args[i].s = record_args[i].ull == LogStringNull ?
+			            nullptr : reinterpret_cast<const char *>(record + record_args[i].ull);
+		}
+	}
+
+	size_t length = format_log_message(buffer, size, LogLevel(header.level), header.fmt, args, header.num_args);
+	write_log_message(header.queue, buffer, length);
+}
+
+void AsyncLogger::drain_ring(LogRing &ring)
+{
+	std::lock_guard<std::mutex> holder{drain_lock};
+	uint64_t read_pos = ring.read_pos.load(std::memory_order_relaxed);
+	uint64_t write_pos = ring.write_pos.load(std::memory_order_acquire);
+	if (read_pos == write_pos)
+		return;
+
+	char buffer[16 * 1024];
+	while (read_pos < write_pos)
+	{
+		auto *header = reinterpret_cast<const LogRecordHeader *>(ring.data + (read_pos & (LogRing::Size - 1)));
+		if (header->level != LogRecordPadding)
+			write_log_record(*header, buffer, sizeof(buffer));
+		read_pos += header->size;
+	}
+
+	ring.read_pos.store(read_pos, std::memory_order_release);
+	fflush(stderr);
+}
+
+bool AsyncLogger::drain()
+{
+	struct Source
+	{
+		LogRing *ring;
+		uint64_t read_pos;
+		uint64_t write_pos;
+		const LogRecordHeader *head;
+	};
+
+	std::lock_guard<std::mutex> drain_holder{drain_lock};
+	std::vector<Source> sources;
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		sources.reserve(rings.size());
+		for (auto *ring : rings)
+			sources.push_back({ ring, ring->read_pos.load(std::memory_order_relaxed), 0, nullptr });
+	}
+
+	// Only drain what was visible at the start, so a thread spamming messages cannot keep us here forever.
+	for (auto &source : sources)
+		source.write_pos = source.ring->write_pos.load(std::memory_order_acquire);
+
+	const auto advance = [](Source &source) {
+		source.head = nullptr;
+		while (source.read_pos < source.write_pos)
+		{
+			auto *header = reinterpret_cast<const LogRecordHeader *>(
+					source.ring->data + (source.read_pos & (LogRing::Size - 1)));
+			if (header->level != LogRecordPadding)
+			{
+				source.head = header;
+				break;
+			}
+			source.read_pos += header->size;
+		}
+	};
+
+	for (auto &source : sources)
+		advance(source);
+
+	char buffer[16 * 1024];
+	bool wrote = false;
+
+	// Merge the per-thread streams in timestamp order.
+	for (;;)
+	{
+		Source *oldest = nullptr;
+		for (auto &source : sources)
+			if (source.head && (!oldest || source.head->timestamp < oldest->head->timestamp))
+				oldest = &source;
+
+		if (!oldest)
+			break;
+
+		auto &header = *oldest->head;
+		write_log_record(header, buffer, sizeof(buffer));
+		wrote = true;
+
+		oldest->read_pos += header.size;
+		oldest->ring->read_pos.store(oldest->read_pos, std::memory_order_release);
+		advance(*oldest);
+	}
+
+	if (wrote)
+		fflush(stderr);
+	return wrote;
+}
+
+void AsyncLogger::delete_orphaned_rings()
+{
+	std::lock_guard<std::mutex> holder{lock};
+	auto itr = std::remove_if(rings.begin(), rings.end(), [](LogRing *ring) {
+		// The owning thread is gone, so nothing can be written after the orphaned flag.
+		if (!ring->orphaned.load(std::memory_order_acquire))
+			return false;
+		if (ring->read_pos.load(std::memory_order_relaxed) != ring->write_pos.load(std::memory_order_acquire))
+			return false;
+		delete ring;
+		return true;
+	});
+	rings.erase(itr, rings.end());
+}
+
+void AsyncLogger::thread_main()
+{
+	set_current_thread_name("granite-logger");
+
+	for (;;)
+	{
+		uint64_t flush_target;
+		bool done;
+
+		{
+			std::unique_lock<std::mutex> holder{lock};
+			cond.wait_for(holder, std::chrono::milliseconds(5), [this]() {
+				return stopping || kicked.load(std::memory_order_relaxed) || flush_requested != flush_completed;
+			});
+			kicked.store(false, std::memory_order_relaxed);
+			flush_target = flush_requested;
+			done = stopping;
+		}
+
+		drain();
+		delete_orphaned_rings();
+
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			flush_completed = flush_target;
+		}
+		flush_cond.notify_all();
+
+		if (done)
+			break;
+	}
+}
+}
+
+void set_log_level(LogLevel level)
+{
+	Internal::log_level_threshold.store(int(level), std::memory_order_relaxed);
+}
+
+void set_log_rate_limit(unsigned messages_per_second)
+{
+	Internal::log_rate_limit.store(messages_per_second, std::memory_order_relaxed);
+}
+
+void start_async_logging()
+{
+	auto &logger = Internal::get_logger();
+	std::lock_guard<std::mutex> control_holder{logger.control_lock};
+	std::lock_guard<std::mutex> holder{logger.lock};
+	if (logger.running)
+		return;
+
+	logger.running = true;
+	logger.stopping = false;
+	logger.thread = std::thread(&Internal::AsyncLogger::thread_main, &logger);
+
+	// Make sure pending messages are written out if the application exits without stopping.
+	if (!logger.registered_atexit)
+	{
+		atexit(stop_async_logging);
+		logger.registered_atexit = true;
+	}
+
+	Internal::async_logging_enabled.store(true, std::memory_order_relaxed);
+}
+
+void stop_async_logging()
+{
+	auto &logger = Internal::get_logger();
+	std::lock_guard<std::mutex> control_holder{logger.control_lock};
+	std::thread thread;
+
+	{
+		std::lock_guard<std::mutex> holder{logger.lock};
+		if (!logger.running)
+			return;
+
+		Internal::async_logging_enabled.store(false, std::memory_order_relaxed);
+		logger.running = false;
+		logger.stopping = true;
+		thread = std::move(logger.thread);
+		logger.cond.notify_one();
+	}
+
+	// The thread drains all rings one last time before exiting.
+	thread.join();
+
+	// A thread which saw async logging still enabled may have queued a message after that.
+	// Pairs with the fence in log_record(), either we see the message here, or it sees the switch
+	// and writes its ring out itself.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	logger.drain();
+	logger.delete_orphaned_rings();
+}
+
+void flush_async_logging()
+{
+	auto &logger = Internal::get_logger();
+	std::unique_lock<std::mutex> holder{logger.lock};
+	if (!logger.running)
+		return;
+
+	uint64_t target = ++logger.flush_requested;
+	logger.cond.notify_one();
+	logger.flush_cond.wait(holder, [&]() {
+		return logger.flush_completed >= target || !logger.running;
+	});
+}
+}
@@ -25,6 +25,146 @@
 #include <cstdio>
 #include <cstdarg>
 #include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <type_traits>
+
+namespace Util
+{
+class MessageQueue;
+
+enum class LogLevel
+{
+	Info = 0,
+	Warn = 1,
+	Error = 2
+};
+
+// Messages below level are discarded before any formatting or argument capture takes place.
+void set_log_level(LogLevel level);
+
+// Asynchronous logging captures the format string and raw arguments into a per-thread ring,
+// and defers formatting and I/O to a background thread.
+// The format string must have static storage duration, which the LOGx macros guarantee.
+// Arguments of %s conversions are copied, everything else is captured by value.
+// Errors are still written out before LOGE returns, after anything the thread logged earlier.
+void start_async_logging();
+// Drains all pending messages and joins the background thread. Later messages are written synchronously.
+void stop_async_logging();
+// Blocks until every message logged before the call has been written out.
+void flush_async_logging();
+// Limits how many messages a single LOGx call site can emit per second. 0 disables rate limiting, which is the default.
+// Suppressed messages are counted at the call site, and reported when it logs again after its one second window.
+void set_log_rate_limit(unsigned messages_per_second);
+
+namespace Internal
+{
+extern std::atomic<int> log_level_threshold;
+extern std::atomic_bool async_logging_enabled;
+extern std::atomic_uint log_rate_limit;
+
+static inline bool log_level_enabled(LogLevel level)
+{
+	return int(level) >= log_level_threshold.load(std::memory_order_relaxed);
+}
+
+static inline bool async_logging_active()
+{
+	return async_logging_enabled.load(std::memory_order_relaxed);
+}
+
+// One per LOGx call site, as a zero-initialized static.
+struct LogRateLimitState
+{
+	std::atomic<int64_t> window_start;
+	std::atomic_uint count;
+	std::atomic_uint suppressed;
+};
+
+bool log_rate_limit_accept_slow(LogRateLimitState &state, const char *fmt, unsigned limit);
+
+static inline bool log_rate_limit_accept(LogRateLimitState &state, const char *fmt)
+{
+	unsigned limit = log_rate_limit.load(std::memory_order_relaxed);
+	return !limit || log_rate_limit_accept_slow(state, fmt, limit);
+}
+
+enum class LogArgType : uint32_t
+{
+	Int,
+	UInt,
+	Long,
+	ULong,
+	LongLong,
+	ULongLong,
+	Double,
+	Pointer,
+	String
+};
+
+// An argument as it would have been passed through varargs, after default argument promotion.
+struct LogArg
+{
+	LogArgType type;
+	union
+	{
+		int i;
+		unsigned u;
+		long l;
+		unsigned long ul;
+		long long ll;
+		unsigned long long ull;
+		double d;
+		const void *p;
+		const char *s;
+	};
+};
+
+#define GRANITE_LOG_ARG(arg_type, member, value_type) \
+static inline LogArg make_log_arg(value_type v) \
+{ \
+	LogArg arg = {}; \
+	arg.type = LogArgType::arg_type; \
+	arg.member = v; \
+	return arg; \
+}
+GRANITE_LOG_ARG(Int, i, int)
+GRANITE_LOG_ARG(UInt, u, unsigned)
+GRANITE_LOG_ARG(Long, l, long)
+GRANITE_LOG_ARG(ULong, ul, unsigned long)
+GRANITE_LOG_ARG(LongLong, ll, long long)
+GRANITE_LOG_ARG(ULongLong, ull, unsigned long long)
+GRANITE_LOG_ARG(Double, d, double)
+GRANITE_LOG_ARG(Pointer, p, const void *)
+GRANITE_LOG_ARG(String, s, const char *)
+#undef GRANITE_LOG_ARG
+
+static inline LogArg make_log_arg(std::nullptr_t)
+{
+	return make_log_arg(static_cast<const void *>(nullptr));
+}
+
+// Unscoped enums promote like integers, scoped enums are passed as their underlying type.
+template <typename T, typename std::enable_if<std::is_enum<T>::value, int>::type = 0>
+static inline LogArg make_log_arg(T v)
+{
+	return make_log_arg(static_cast<typename std::underlying_type<T>::type>(v) + 0);
+}
+
+LogArg make_log_arg(long double) = delete;
+
+void log_record(LogLevel level, MessageQueue *queue, const char *fmt, const LogArg *args, unsigned count);
+
+template <typename... Ts>
+static inline void log_async(LogLevel level, MessageQueue *queue, const char *fmt, Ts... ts)
+{
+	static_assert(sizeof...(Ts) < 256, "Too many log arguments.");
+	const LogArg args[] = { make_log_arg(ts)..., LogArg{} };
+	log_record(level, queue, fmt, args, unsigned(sizeof...(Ts)));
+}
+}
+}
 
 #ifdef GRANITE_LOGGING_QUEUE
 #include "application/global_managers.hpp"
@@ -62,6 +202,11 @@ static inline void queued_log(const char *tag, const char *fmt, ...)
 	}
 }
 
+static inline MessageQueue *get_log_message_queue()
+{
+	auto *message_queue = ::Granite::Global::message_queue();
+	return message_queue && message_queue->is_uncorked() ? message_queue : nullptr;
+}
 }
 
 #define QUEUED_LOGE(...) do { \
@@ -73,16 +218,18 @@ static inline void queued_log(const char *tag, const char *fmt, ...)
 #define QUEUED_LOGI(...) do { \
 	::Util::queued_log("[INFO]: ", __VA_ARGS__); \
 } while(0)
+#define GRANITE_LOG_MESSAGE_QUEUE() ::Util::get_log_message_queue()
 #else
 #define QUEUED_LOGE(...)
 #define QUEUED_LOGW(...)
 #define QUEUED_LOGI(...)
+#define GRANITE_LOG_MESSAGE_QUEUE() nullptr
 #endif // GRANITE_LOGGING_QUEUE
 
 #if defined(_MSC_VER)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
-#define LOGE(...) do { \
+#define GRANITE_LOGE_SYNC(...) do { \
     fprintf(stderr, "[ERROR]: " __VA_ARGS__); \
     fflush(stderr); \
     char buffer[16 * 1024]; \
@@ -91,7 +238,7 @@ static inline void queued_log(const char *tag, const char *fmt, ...)
     QUEUED_LOGE(__VA_ARGS__); \
 } while(false)
 
-#define LOGW(...) do { \
+#define GRANITE_LOGW_SYNC(...) do { \
     fprintf(stderr, "[WARN]: " __VA_ARGS__); \
     fflush(stderr); \
     char buffer[16 * 1024]; \
@@ -100,7 +247,7 @@ static inline void queued_log(const char *tag, const char *fmt, ...)
     QUEUED_LOGW(__VA_ARGS__); \
 } while(false)
 
-#define LOGI(...) do { \
+#define GRANITE_LOGI_SYNC(...) do { \
     fprintf(stderr, "[INFO]: " __VA_ARGS__); \
     fflush(stderr); \
     char buffer[16 * 1024]; \
@@ -109,7 +256,7 @@ static inline void queued_log(const char *tag, const char *fmt, ...)
     QUEUED_LOGI(__VA_ARGS__); \
 } while(false)
 #else
-#define LOGE(...)                                 \
+#define GRANITE_LOGE_SYNC(...)                    \
 	do                                            \
 	{                                             \
 		fprintf(stderr, "[ERROR]: " __VA_ARGS__); \
@@ -117,7 +264,7 @@ static inline void queued_log(const char *tag, const char *fmt, ...)
 		QUEUED_LOGE(__VA_ARGS__);                 \
 	} while (false)
 
-#define LOGW(...)                                \
+#define GRANITE_LOGW_SYNC(...)                   \
 	do                                           \
 	{                                            \
 		fprintf(stderr, "[WARN]: " __VA_ARGS__); \
@@ -125,7 +272,7 @@ static inline void queued_log(const char *tag, const char *fmt, ...)
 		QUEUED_LOGW(__VA_ARGS__);                \
 	} while (false)
 
-#define LOGI(...)                                \
+#define GRANITE_LOGI_SYNC(...)                   \
 	do                                           \
 	{                                            \
 		fprintf(stderr, "[INFO]: " __VA_ARGS__); \
@@ -133,3 +280,28 @@ static inline void queued_log(const char *tag, const char *fmt, ...)
 		QUEUED_LOGI(__VA_ARGS__);                \
 	} while (false)
 #endif
+
+// Expands to the format string, the extra indirection works around MSVC passing __VA_ARGS__ on as one argument.
+#define GRANITE_LOG_EXPAND(x) x
+#define GRANITE_LOG_FORMAT(fmt, ...) fmt
+
+#define GRANITE_LOG(level, sync_log, ...)                                                                   \
+	do                                                                                                     \
+	{                                                                                                      \
+		if (::Util::Internal::log_level_enabled(level))                                                    \
+		{                                                                                                  \
+			static ::Util::Internal::LogRateLimitState granite_log_rate_limit_state;                       \
+			if (::Util::Internal::log_rate_limit_accept(granite_log_rate_limit_state,                      \
+			        GRANITE_LOG_EXPAND(GRANITE_LOG_FORMAT(__VA_ARGS__, 0))))                               \
+			{                                                                                              \
+				if (::Util::Internal::async_logging_active())                                              \
+					::Util::Internal::log_async(level, GRANITE_LOG_MESSAGE_QUEUE(), __VA_ARGS__);          \
+				else                                                                                       \
+					sync_log(__VA_ARGS__);                                                                 \
+			}                                                                                              \
+		}                                                                                                  \
+	} while (false)
+
+#define LOGE(...) GRANITE_LOG(::Util::LogLevel::Error, GRANITE_LOGE_SYNC, __VA_ARGS__)
+#define LOGW(...) GRANITE_LOG(::Util::LogLevel::Warn, GRANITE_LOGW_SYNC, __VA_ARGS__)
+#define LOGI(...) GRANITE_LOG(::Util::LogLevel::Info, GRANITE_LOGI_SYNC, __VA_ARGS__)
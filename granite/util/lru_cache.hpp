@@ -25,6 +25,11 @@
 #include "util/intrusive_list.hpp"
 #include "util/intrusive_hash_map.hpp"
 #include "util/object_pool.hpp"
+#include "util/small_vector.hpp"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 namespace Util
 {
@@ -160,4 +165,364 @@ private:
 		return h.get();
 	}
 };
+
+// Thread-safe variant of LRUCache. Entries are spread over shards by cookie, each with its own lock,
+// LRU order and an even share of the total cost budget.
+// An entry is pinned while a Handle to it is alive. Pinned entries are never evicted,
+// and an erased entry is only destroyed once its last Handle goes away.
+// Entries are evicted when an insertion goes over budget, or on prune().
+template <typename T>
+class ThreadSafeLRUCache
+{
+	struct CacheEntry;
+
+public:
+	struct Statistics
+	{
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+		uint64_t current_cost = 0;
+		uint64_t num_entries = 0;
+	};
+
+	// Called for entries which are evicted to stay within the cost budget, but not for erased entries.
+	// It is called without any cache lock held, right before the entry is destroyed.
+	using EvictionCallback = std::function<void (uint64_t cookie, T &t, uint64_t cost)>;
+
+	class Handle
+	{
+	public:
+		Handle() = default;
+
+		Handle(Handle &&other) noexcept
+		{
+			*this = std::move(other);
+		}
+
+		Handle &operator=(Handle &&other) noexcept
+		{
+			if (this != &other)
+			{
+				reset();
+				cache = other.cache;
+				entry = other.entry;
+				other.cache = nullptr;
+				other.entry = nullptr;
+			}
+			return *this;
+		}
+
+		~Handle()
+		{
+			reset();
+		}
+
+		void reset()
+		{
+			if (entry)
+				cache->unpin(entry);
+			cache = nullptr;
+			entry = nullptr;
+		}
+
+		T *get() const
+		{
+			return entry ? &entry->t : nullptr;
+		}
+
+		T *operator->() const
+		{
+			return &entry->t;
+		}
+
+		T &operator*() const
+		{
+			return entry->t;
+		}
+
+		explicit operator bool() const
+		{
+			return entry != nullptr;
+		}
+
+	private:
+		friend class ThreadSafeLRUCache;
+		Handle(ThreadSafeLRUCache *cache_, CacheEntry *entry_)
+			: cache(cache_), entry(entry_)
+		{
+		}
+
+		ThreadSafeLRUCache *cache = nullptr;
+		CacheEntry *entry = nullptr;
+	};
+
+	// num_shards is rounded up to a power of two.
+	explicit ThreadSafeLRUCache(unsigned num_shards = 16)
+	{
+		unsigned count = 1;
+		while (count < num_shards)
+			count <<= 1;
+		shards.reset(new Shard[count]);
+		shard_mask = count - 1;
+	}
+
+	// All handles must be released before the cache is destroyed.
+	~ThreadSafeLRUCache()
+	{
+		for (unsigned i = 0; i <= shard_mask; i++)
+		{
+			auto &shard = shards[i];
+			while (!shard.lru.empty())
+			{
+				auto itr = shard.lru.begin();
+				shard.lru.erase(itr);
+				pool.free(itr.get());
+			}
+		}
+	}
+
+	ThreadSafeLRUCache(const ThreadSafeLRUCache &) = delete;
+	void operator=(const ThreadSafeLRUCache &) = delete;
+
+	// Must be set before the cache is used concurrently.
+	void set_eviction_callback(EvictionCallback callback)
+	{
+		eviction_callback = std::move(callback);
+	}
+
+	// Takes effect on the next insertion or prune().
+	void set_total_cost(uint64_t cost)
+	{
+		for (unsigned i = 0; i <= shard_mask; i++)
+		{
+			std::lock_guard<std::mutex> holder{shards[i].lock};
+			shards[i].cost_limit = cost / (shard_mask + 1);
+		}
+	}
+
+	uint64_t get_current_cost() const
+	{
+		return get_statistics().current_cost;
+	}
+
+	Handle find_and_mark_as_recent(uint64_t cookie)
+	{
+		Hash hash = get_hash(cookie);
+		auto &shard = get_shard(hash);
+		std::lock_guard<std::mutex> holder{shard.lock};
+
+		auto *hash_entry = shard.hashmap.find(hash);
+		if (!hash_entry)
+		{
+			shard.misses++;
+			return {};
+		}
+
+		shard.hits++;
+		auto *entry = hash_entry->get();
+		shard.lru.move_to_front(shard.lru, entry);
+		return pin(entry);
+	}
+
+	// If the cookie already exists, e.g. because another thread inserted it first,
+	// the existing entry is returned and the new value is discarded.
+	// The new entry counts against the budget right away, which may evict other entries in its shard.
+	// The returned handle keeps it from being evicted itself.
+	template <typename... P>
+	Handle insert(uint64_t cookie, uint64_t cost, P &&... p)
+	{
+		Hash hash = get_hash(cookie);
+		auto &shard = get_shard(hash);
+
+		// Construct the value outside the lock.
+		auto *entry = pool.allocate(cookie, hash, cost, std::forward<P>(p)...);
+		CacheEntry *existing = nullptr;
+		EntryList evicted;
+		Handle handle;
+
+		{
+			std::lock_guard<std::mutex> holder{shard.lock};
+			auto *hash_entry = shard.hashmap.find(hash);
+			if (hash_entry)
+			{
+				existing = hash_entry->get();
+				shard.lru.move_to_front(shard.lru, existing);
+				handle = pin(existing);
+			}
+			else
+			{
+				handle = pin(entry);
+				shard.lru.insert_front(entry);
+				shard.hashmap.emplace_replace(hash, entry);
+				shard.total_cost += cost;
+				shard.num_entries++;
+				evict(shard, evicted);
+			}
+		}
+
+		if (existing)
+			pool.free(entry);
+		release_evicted(evicted);
+		return handle;
+	}
+
+	bool erase(uint64_t cookie)
+	{
+		Hash hash = get_hash(cookie);
+		auto &shard = get_shard(hash);
+		CacheEntry *entry;
+
+		{
+			std::lock_guard<std::mutex> holder{shard.lock};
+			auto *hash_entry = shard.hashmap.find(hash);
+			if (!hash_entry)
+				return false;
+
+			entry = hash_entry->get();
+			shard.hashmap.erase(hash_entry);
+			shard.lru.erase(entry);
+			shard.total_cost -= entry->cost;
+			shard.num_entries--;
+		}
+
+		// If the entry is pinned, the last handle frees it.
+		if (entry->pin_state.fetch_or(CacheEntry::ErasedBit, std::memory_order_acq_rel) == 0)
+			pool.free(entry);
+		return true;
+	}
+
+	// Evicts unpinned entries until every shard is within its budget. Returns the total cost evicted.
+	uint64_t prune()
+	{
+		uint64_t total_pruned = 0;
+		for (unsigned i = 0; i <= shard_mask; i++)
+		{
+			EntryList evicted;
+			{
+				std::lock_guard<std::mutex> holder{shards[i].lock};
+				evict(shards[i], evicted);
+			}
+
+			for (auto *entry : evicted)
+				total_pruned += entry->cost;
+			release_evicted(evicted);
+		}
+		return total_pruned;
+	}
+
+	Statistics get_statistics() const
+	{
+		Statistics stats;
+		for (unsigned i = 0; i <= shard_mask; i++)
+		{
+			auto &shard = shards[i];
+			std::lock_guard<std::mutex> holder{shard.lock};
+			stats.hits += shard.hits;
+			stats.misses += shard.misses;
+			stats.evictions += shard.evictions;
+			stats.current_cost += shard.total_cost;
+			stats.num_entries += shard.num_entries;
+		}
+		return stats;
+	}
+
+private:
+	struct CacheEntry : IntrusiveListEnabled<CacheEntry>
+	{
+		template <typename... P>
+		CacheEntry(uint64_t cookie_, Hash hash_, uint64_t cost_, P &&... p)
+			: cookie(cookie_), hash(hash_), cost(cost_), t(std::forward<P>(p)...)
+		{
+		}
+
+		uint64_t cookie;
+		Hash hash;
+		uint64_t cost;
+		// Number of live handles, plus ErasedBit once the entry is no longer in the cache.
+		std::atomic<uint32_t> pin_state{0};
+		T t;
+
+		enum : uint32_t { ErasedBit = 0x80000000u };
+	};
+
+	struct alignas(64) Shard
+	{
+		mutable std::mutex lock;
+		IntrusiveList<CacheEntry> lru;
+		IntrusiveHashMap<IntrusivePODWrapper<CacheEntry *>> hashmap;
+		uint64_t total_cost = 0;
+		uint64_t cost_limit = UINT64_MAX;
+		uint64_t num_entries = 0;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+	};
+
+	using EntryList = SmallVector<CacheEntry *>;
+	using Iterator = typename IntrusiveList<CacheEntry>::Iterator;
+
+	std::unique_ptr<Shard[]> shards;
+	unsigned shard_mask = 0;
+	ThreadSafeObjectPool<CacheEntry> pool;
+	EvictionCallback eviction_callback;
+
+	Shard &get_shard(Hash hash)
+	{
+		// The cookie hash is weak in the upper bits, Fibonacci hashing folds the lower bits into them.
+		return shards[((hash * 0x9e3779b97f4a7c15ull) >> 32) & shard_mask];
+	}
+
+	// Pins are taken under the shard lock, but released without it,
+	// so looking up an entry only takes the lock once.
+	Handle pin(CacheEntry *entry)
+	{
+		entry->pin_state.fetch_add(1, std::memory_order_relaxed);
+		return Handle(this, entry);
+	}
+
+	void unpin(CacheEntry *entry)
+	{
+		if (entry->pin_state.fetch_sub(1, std::memory_order_acq_rel) == (CacheEntry::ErasedBit | 1u))
+			pool.free(entry);
+	}
+
+	// Pinned entries are skipped. A pin count of zero seen under the lock cannot go up again,
+	// since pins are only taken under the lock.
+	static void evict(Shard &shard, EntryList &evicted)
+	{
+		auto itr = shard.lru.rbegin();
+		while (shard.total_cost > shard.cost_limit && itr)
+		{
+			auto *entry = itr.get();
+			itr = Iterator(entry->prev);
+			if (entry->pin_state.load(std::memory_order_acquire) != 0)
+				continue;
+
+			shard.lru.erase(entry);
+			shard.hashmap.erase(entry->hash);
+			shard.total_cost -= entry->cost;
+			shard.num_entries--;
+			shard.evictions++;
+			evicted.push_back(entry);
+		}
+	}
+
+	void release_evicted(const EntryList &evicted)
+	{
+		for (auto *entry : evicted)
+		{
+			if (eviction_callback)
+				eviction_callback(entry->cookie, entry->t, entry->cost);
+			pool.free(entry);
+		}
+	}
+
+	static Hash get_hash(uint64_t cookie)
+	{
+		Hasher h;
+		h.u64(cookie);
+		return h.get();
+	}
+};
 }
@@ -101,6 +101,161 @@ MessageQueuePayload LockFreeMessageQueue::allocate_write_payload(size_t size) no
 	return payload;
 }
 
+LockFreeMPMCMessageQueue::LockFreeMPMCMessageQueue()
+{
+	for (unsigned i = 0; i < NumPayloadClasses; i++)
+		payload_capacity[i] = 256u << i;
+	for (unsigned i = 0; i < NumPayloadClasses; i++)
+		write_ring[i].reset((16u * 1024u) >> i);
+	read_ring.reset(32 * 1024);
+
+	// Pre-fill the rings.
+	for (unsigned i = 0; i < NumPayloadClasses; i++)
+	{
+		unsigned count = 512u >> i;
+		for (unsigned j = 0; j < count; j++)
+		{
+			MessageQueuePayload payload;
+			payload.set_payload_data(memalign_calloc(64, payload_capacity[i]), payload_capacity[i]);
+			recycle_payload(std::move(payload));
+		}
+	}
+}
+
+int LockFreeMPMCMessageQueue::get_payload_class(size_t size) const noexcept
+{
+	for (int i = 0; i < NumPayloadClasses; i++)
+		if (size <= payload_capacity[i])
+			return i;
+	return -1;
+}
+
+size_t LockFreeMPMCMessageQueue::available_read_messages() const noexcept
+{
+	return read_ring.read_avail();
+}
+
+MessageQueuePayload LockFreeMPMCMessageQueue::read_message() noexcept
+{
+	MessageQueuePayload payload;
+	read_ring.pop(payload);
+	return payload;
+}
+
+size_t LockFreeMPMCMessageQueue::read_messages(MessageQueuePayload *payloads, size_t count) noexcept
+{
+	return read_ring.pop_n(payloads, count);
+}
+
+bool LockFreeMPMCMessageQueue::push_written_payload(MessageQueuePayload payload) noexcept
+{
+	return read_ring.push(std::move(payload));
+}
+
+size_t LockFreeMPMCMessageQueue::push_written_payloads(MessageQueuePayload *payloads, size_t count) noexcept
+{
+	return read_ring.push_n(payloads, count);
+}
+
+void LockFreeMPMCMessageQueue::recycle_payload(MessageQueuePayload payload) noexcept
+{
+	// Payloads which do not fit in a free ring are simply freed.
+	int payload_class = get_payload_class(payload.get_capacity());
+	if (payload_class >= 0 && payload.get_capacity() == payload_capacity[payload_class])
+		write_ring[payload_class].push(std::move(payload));
+}
+
+void LockFreeMPMCMessageQueue::recycle_payloads(MessageQueuePayload *payloads, size_t count) noexcept
+{
+	// Consecutive payloads of the same class are recycled with one ring operation.
+	size_t i = 0;
+	while (i < count)
+	{
+		int payload_class = get_payload_class(payloads[i].get_capacity());
+		if (payload_class < 0 || payloads[i].get_capacity() != payload_capacity[payload_class])
+		{
+			payloads[i++] = {};
+			continue;
+		}
+
+		size_t end = i + 1;
+		while (end < count && payloads[end].get_capacity() == payload_capacity[payload_class])
+			end++;
+
+		size_t pushed = write_ring[payload_class].push_n(payloads + i, end - i);
+		for (size_t j = i + pushed; j < end; j++)
+			payloads[j] = {};
+		i = end;
+	}
+}
+
+MessageQueuePayload LockFreeMPMCMessageQueue::allocate_write_payload(size_t size) noexcept
+{
+	MessageQueuePayload payload;
+	int payload_class = get_payload_class(size);
+	if (payload_class >= 0)
+	{
+		if (!write_ring[payload_class].pop(payload))
+		{
+			payload.set_payload_data(memalign_calloc(64, payload_capacity[payload_class]),
+			                         payload_capacity[payload_class]);
+		}
+		return payload;
+	}
+
+	payload.set_payload_data(memalign_calloc(64, size), size);
+	return payload;
+}
+
+LockFreeMPMCMessageQueue::Producer::Producer(LockFreeMPMCMessageQueue &queue_)
+	: queue(queue_)
+{
+}
+
+LockFreeMPMCMessageQueue::Producer::~Producer()
+{
+	flush();
+	for (unsigned i = 0; i < NumPayloadClasses; i++)
+		queue.recycle_payloads(cache[i], cache_count[i]);
+}
+
+MessageQueuePayload LockFreeMPMCMessageQueue::Producer::allocate_write_payload(size_t size) noexcept
+{
+	int payload_class = queue.get_payload_class(size);
+	if (payload_class < 0)
+		return queue.allocate_write_payload(size);
+
+	auto &count = cache_count[payload_class];
+	if (!count)
+		count = unsigned(queue.write_ring[payload_class].pop_n(cache[payload_class], CacheSize / 2));
+	if (!count)
+		return queue.allocate_write_payload(size);
+
+	return std::move(cache[payload_class][--count]);
+}
+
+bool LockFreeMPMCMessageQueue::Producer::push_written_payload(MessageQueuePayload payload) noexcept
+{
+	if (pending_count == BatchSize && !flush())
+		return false;
+
+	pending[pending_count++] = std::move(payload);
+	if (pending_count == BatchSize)
+		flush();
+	return true;
+}
+
+bool LockFreeMPMCMessageQueue::Producer::flush() noexcept
+{
+	if (!pending_count)
+		return true;
+
+	size_t pushed = queue.push_written_payloads(pending, pending_count);
+	std::move(pending + pushed, pending + pending_count, pending);
+	pending_count -= unsigned(pushed);
+	return pending_count == 0;
+}
+
 MessageQueue::MessageQueue()
 {
 	corked.store(true);
@@ -125,31 +280,26 @@ MessageQueuePayload MessageQueue::allocate_write_payload(size_t size) noexcept
 {
 	if (corked.load(std::memory_order_relaxed))
 		return {};
-	std::lock_guard<std::mutex> holder{lock};
-	return LockFreeMessageQueue::allocate_write_payload(size);
+	return LockFreeMPMCMessageQueue::allocate_write_payload(size);
 }
 
 bool MessageQueue::push_written_payload(MessageQueuePayload payload) noexcept
 {
-	std::lock_guard<std::mutex> holder{lock};
-	return LockFreeMessageQueue::push_written_payload(std::move(payload));
+	return LockFreeMPMCMessageQueue::push_written_payload(std::move(payload));
 }
 
 size_t MessageQueue::available_read_messages() const noexcept
 {
-	std::lock_guard<std::mutex> holder{lock};
-	return LockFreeMessageQueue::available_read_messages();
+	return LockFreeMPMCMessageQueue::available_read_messages();
 }
 
 MessageQueuePayload MessageQueue::read_message() noexcept
 {
-	std::lock_guard<std::mutex> holder{lock};
-	return LockFreeMessageQueue::read_message();
+	return LockFreeMPMCMessageQueue::read_message();
 }
 
 void MessageQueue::recycle_payload(MessageQueuePayload payload) noexcept
 {
-	std::lock_guard<std::mutex> holder{lock};
-	return LockFreeMessageQueue::recycle_payload(std::move(payload));
+	return LockFreeMPMCMessageQueue::recycle_payload(std::move(payload));
 }
 }
@@ -24,6 +24,7 @@
 
 #include <cassert>
 #include <atomic>
+#include <cstdint>
 #include <vector>
 #include <memory>
 #include <mutex>
@@ -67,8 +68,8 @@ public:
 
 	bool write_and_move(T *values, size_t count) noexcept
 	{
-		size_t current_written = read_count.load(std::memory_order_relaxed);
-		size_t current_read = write_count.load(std::memory_order_acquire);
+		size_t current_read = read_count.load(std::memory_order_acquire);
+		size_t current_written = write_count.load(std::memory_order_relaxed);
 		if (count > ring.size() - (current_written - current_read))
 			return false;
 
@@ -131,6 +132,138 @@ private:
 	std::vector<T> ring;
 };
 
+// Bounded queue which any number of threads can write to and read from concurrently, without locks.
+// Every cell carries a sequence number which tells whether it is free or holds a value for the current lap.
+// Threads claim a contiguous range of cells with a single CAS, so batched operations amortize the contention.
+template <typename T>
+class LockFreeMPMCRingBuffer
+{
+public:
+	explicit LockFreeMPMCRingBuffer(size_t count = 1)
+	{
+		reset(count);
+	}
+
+	// Not thread-safe. Count is rounded up to a power of two.
+	void reset(size_t count)
+	{
+		size_t size = 1;
+		while (size < count)
+			size <<= 1;
+
+		cells.reset(new Cell[size]);
+		mask = size - 1;
+		for (size_t i = 0; i < size; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		enqueue_pos.store(0, std::memory_order_relaxed);
+		dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+
+	size_t capacity() const noexcept
+	{
+		return mask + 1;
+	}
+
+	// Only an estimate while other threads are pushing or popping.
+	size_t read_avail() const noexcept
+	{
+		size_t written = enqueue_pos.load(std::memory_order_relaxed);
+		size_t read = dequeue_pos.load(std::memory_order_relaxed);
+		return written > read ? written - read : 0;
+	}
+
+	// Moves up to count values into the ring, and returns how many were moved.
+	// Values which did not fit are left untouched.
+	size_t push_n(T *values, size_t count) noexcept
+	{
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			// A cell is free for position pos when its sequence is exactly pos.
+			// Nobody but the producer which claims pos can change that, so the scan stays valid if the CAS succeeds.
+			size_t n = 0;
+			while (n < count && cells[(pos + n) & mask].sequence.load(std::memory_order_acquire) == pos + n)
+				n++;
+
+			if (n == 0)
+			{
+				size_t sequence = cells[pos & mask].sequence.load(std::memory_order_acquire);
+				if (intptr_t(sequence - pos) < 0)
+					return 0;
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			if (enqueue_pos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+			{
+				for (size_t i = 0; i < n; i++)
+				{
+					auto &cell = cells[(pos + i) & mask];
+					cell.value = std::move(values[i]);
+					cell.sequence.store(pos + i + 1, std::memory_order_release);
+				}
+				return n;
+			}
+		}
+	}
+
+	// Moves up to count values out of the ring, and returns how many were moved.
+	size_t pop_n(T *values, size_t count) noexcept
+	{
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			// A cell holds the value for position pos when its sequence is pos + 1.
+			size_t n = 0;
+			while (n < count && cells[(pos + n) & mask].sequence.load(std::memory_order_acquire) == pos + n + 1)
+				n++;
+
+			if (n == 0)
+			{
+				size_t sequence = cells[pos & mask].sequence.load(std::memory_order_acquire);
+				if (intptr_t(sequence - (pos + 1)) < 0)
+					return 0;
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			if (dequeue_pos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+			{
+				for (size_t i = 0; i < n; i++)
+				{
+					auto &cell = cells[(pos + i) & mask];
+					values[i] = std::move(cell.value);
+					cell.sequence.store(pos + i + mask + 1, std::memory_order_release);
+				}
+				return n;
+			}
+		}
+	}
+
+	// The value is only moved from if the push succeeds.
+	bool push(T &&value) noexcept
+	{
+		return push_n(&value, 1) == 1;
+	}
+
+	bool pop(T &value) noexcept
+	{
+		return pop_n(&value, 1) == 1;
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	alignas(64) std::atomic<size_t> enqueue_pos;
+	alignas(64) std::atomic<size_t> dequeue_pos;
+	alignas(64) std::unique_ptr<Cell[]> cells;
+	size_t mask = 0;
+};
+
 struct MessageQueuePayloadDeleter
 {
 	void operator()(void *ptr);
@@ -211,7 +344,63 @@ private:
 	size_t payload_capacity[8] = {};
 };
 
-class MessageQueue : private LockFreeMessageQueue
+// Same interface as LockFreeMessageQueue, but any thread can allocate, push, read and recycle payloads.
+class LockFreeMPMCMessageQueue
+{
+public:
+	enum { NumPayloadClasses = 8 };
+	LockFreeMPMCMessageQueue();
+
+	MessageQueuePayload allocate_write_payload(size_t size) noexcept;
+	bool push_written_payload(MessageQueuePayload payload) noexcept;
+	// Returns the number of payloads pushed, payloads which did not fit are left untouched.
+	size_t push_written_payloads(MessageQueuePayload *payloads, size_t count) noexcept;
+
+	// Only an estimate while writers are active, read_message() may still return an empty payload.
+	size_t available_read_messages() const noexcept;
+	MessageQueuePayload read_message() noexcept;
+	// Returns the number of messages read.
+	size_t read_messages(MessageQueuePayload *payloads, size_t count) noexcept;
+
+	void recycle_payload(MessageQueuePayload payload) noexcept;
+	void recycle_payloads(MessageQueuePayload *payloads, size_t count) noexcept;
+
+	// Owned by a single producer thread. Keeps a small cache of recycled payloads,
+	// and batches pushes so the shared rings are only touched once per batch.
+	class Producer
+	{
+	public:
+		explicit Producer(LockFreeMPMCMessageQueue &queue);
+		~Producer();
+
+		Producer(const Producer &) = delete;
+		void operator=(const Producer &) = delete;
+
+		MessageQueuePayload allocate_write_payload(size_t size) noexcept;
+		// Payloads become visible to readers on flush(), or when a full batch is pending.
+		// Returns false if the payload had to be dropped because the queue is full.
+		bool push_written_payload(MessageQueuePayload payload) noexcept;
+		// Returns false if some payloads are still pending because the queue is full.
+		bool flush() noexcept;
+
+	private:
+		enum { CacheSize = 16, BatchSize = 32 };
+		LockFreeMPMCMessageQueue &queue;
+		MessageQueuePayload cache[NumPayloadClasses][CacheSize];
+		unsigned cache_count[NumPayloadClasses] = {};
+		MessageQueuePayload pending[BatchSize];
+		unsigned pending_count = 0;
+	};
+
+private:
+	LockFreeMPMCRingBuffer<MessageQueuePayload> read_ring;
+	LockFreeMPMCRingBuffer<MessageQueuePayload> write_ring[NumPayloadClasses];
+	size_t payload_capacity[NumPayloadClasses] = {};
+
+	int get_payload_class(size_t size) const noexcept;
+};
+
+class MessageQueue : private LockFreeMPMCMessageQueue
 {
 public:
 	MessageQueue();
@@ -228,8 +417,6 @@ public:
 	void recycle_payload(MessageQueuePayload payload) noexcept;
 
 private:
-	mutable std::mutex lock;
-	mutable std::condition_variable cond;
 	std::atomic_bool corked;
 };
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/object_pool.hpp"
+
+namespace Util
+{
+namespace Internal
+{
+// Pools are identified by a slot, which indexes the per-thread magazine array, and an id,
+// which is unique for the lifetime of the process. Slots are recycled when pools die,
+// so a magazine which does not match the current id of its slot belongs to a dead or cleared pool
+// and its objects are dropped, they point to memory which no longer exists.
+struct ObjectPoolRegistry
+{
+	struct Entry
+	{
+		ThreadSafeObjectPoolBase *pool;
+		void (*return_objects)(ThreadSafeObjectPoolBase *, void * const *, unsigned);
+		uint64_t id;
+	};
+
+	std::mutex lock;
+	std::vector<Entry> entries;
+	std::vector<unsigned> free_slots;
+	uint64_t next_id = 1;
+};
+
+// Pools with static storage duration may outlive any static registry, so never destroy it.
+static ObjectPoolRegistry &get_registry()
+{
+	static auto *registry = new ObjectPoolRegistry;
+	return *registry;
+}
+
+struct ThreadMagazines
+{
+	std::vector<std::unique_ptr<ObjectPoolMagazine>> magazines;
+	~ThreadMagazines();
+};
+static thread_local ThreadMagazines thread_magazines;
+// Set once thread_magazines is destroyed, pools used by later thread_local destructors bypass the magazines.
+static thread_local bool thread_magazines_dead;
+
+ThreadMagazines::~ThreadMagazines()
+{
+	thread_magazines_dead = true;
+
+	auto &registry = get_registry();
+	std::lock_guard<std::mutex> holder{registry.lock};
+
+	// The registry lock keeps the pools alive while we return objects to them.
+	for (size_t i = 0; i < magazines.size(); i++)
+	{
+		auto &magazine = magazines[i];
+		if (magazine && magazine->count && i < registry.entries.size() &&
+		    registry.entries[i].id == magazine->pool_id)
+		{
+			auto &entry = registry.entries[i];
+			entry.return_objects(entry.pool, magazine->objects, magazine->count);
+		}
+	}
+}
+
+ThreadSafeObjectPoolBase::ThreadSafeObjectPoolBase(ReturnObjectsFunc return_objects)
+{
+	auto &registry = get_registry();
+	std::lock_guard<std::mutex> holder{registry.lock};
+	id = registry.next_id++;
+	if (registry.free_slots.empty())
+	{
+		slot = unsigned(registry.entries.size());
+		registry.entries.push_back({ this, return_objects, id });
+	}
+	else
+	{
+		slot = registry.free_slots.back();
+		registry.free_slots.pop_back();
+		registry.entries[slot] = { this, return_objects, id };
+	}
+}
+
+ThreadSafeObjectPoolBase::~ThreadSafeObjectPoolBase()
+{
+	auto &registry = get_registry();
+	std::lock_guard<std::mutex> holder{registry.lock};
+	registry.entries[slot] = { nullptr, nullptr, 0 };
+	registry.free_slots.push_back(slot);
+}
+
+void ThreadSafeObjectPoolBase::invalidate_thread_magazines()
+{
+	auto &registry = get_registry();
+	std::lock_guard<std::mutex> holder{registry.lock};
+	id = registry.next_id++;
+	registry.entries[slot].id = id;
+}
+
+ObjectPoolMagazine *ThreadSafeObjectPoolBase::get_thread_magazine()
+{
+	if (thread_magazines_dead)
+		return nullptr;
+
+	auto &magazines = thread_magazines.magazines;
+	if (slot >= magazines.size())
+		magazines.resize(slot + 1);
+
+	auto &magazine = magazines[slot];
+	if (!magazine)
+		magazine.reset(new ObjectPoolMagazine);
+
+	if (magazine->pool_id != id)
+	{
+		magazine->pool_id = id;
+		magazine->count = 0;
+	}
+
+	return magazine.get();
+}
+}
+}
@@ -23,6 +23,7 @@
 #pragma once
 
 #include <cstdlib>
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <vector>
@@ -45,19 +46,8 @@ public:
 	T *allocate(P &&... p)
 	{
 #ifndef OBJECT_POOL_DEBUG
-		if (vacants.empty())
-		{
-			unsigned num_objects = 64u << memory.size();
-			T *ptr = static_cast<T *>(memalign_alloc(std::max(size_t(64), alignof(T)),
-			                                         num_objects * sizeof(T)));
-			if (!ptr)
-				return nullptr;
-
-			for (unsigned i = 0; i < num_objects; i++)
-				vacants.push_back(&ptr[i]);
-
-			memory.emplace_back(ptr);
-		}
+		if (vacants.empty() && !allocate_block())
+			return nullptr;
 
 		T *ptr = vacants.back();
 		vacants.pop_back();
@@ -90,6 +80,21 @@ protected:
 #ifndef OBJECT_POOL_DEBUG
 	std::vector<T *> vacants;
 
+	bool allocate_block()
+	{
+		unsigned num_objects = 64u << memory.size();
+		T *ptr = static_cast<T *>(memalign_alloc(std::max(size_t(64), alignof(T)),
+		                                         num_objects * sizeof(T)));
+		if (!ptr)
+			return false;
+
+		for (unsigned i = 0; i < num_objects; i++)
+			vacants.push_back(&ptr[i]);
+
+		memory.emplace_back(ptr);
+		return true;
+	}
+
 	struct MallocDeleter
 	{
 		void operator()(T *ptr)
@@ -102,36 +107,183 @@ protected:
 #endif
 };
 
+namespace Internal
+{
+// Per-thread free list in front of a ThreadSafeObjectPool.
+struct ObjectPoolMagazine
+{
+	enum { Capacity = 64, BatchSize = 32 };
+	uint64_t pool_id = 0;
+	unsigned count = 0;
+	void *objects[Capacity];
+};
+
+// Hands out magazines to the calling thread, and takes care of returning them to the pool
+// when the thread exits, see object_pool.cpp.
+class ThreadSafeObjectPoolBase
+{
+public:
+	ThreadSafeObjectPoolBase(const ThreadSafeObjectPoolBase &) = delete;
+	void operator=(const ThreadSafeObjectPoolBase &) = delete;
+
+protected:
+	using ReturnObjectsFunc = void (*)(ThreadSafeObjectPoolBase *pool, void * const *objects, unsigned count);
+	explicit ThreadSafeObjectPoolBase(ReturnObjectsFunc return_objects);
+	~ThreadSafeObjectPoolBase();
+
+	// Returns nullptr while the calling thread is being torn down.
+	ObjectPoolMagazine *get_thread_magazine();
+
+	// Objects cached by any thread are forgotten, for when the pool memory goes away.
+	void invalidate_thread_magazines();
+
+	// Lives here rather than in the pool, so it is still alive while the destructor unregisters the pool,
+	// an exiting thread may return objects to it until then.
+	std::mutex lock;
+
+private:
+	unsigned slot;
+	uint64_t id;
+};
+}
+
+// Every thread keeps a small magazine of free objects per pool, which is refilled from
+// and spilled to the shared pool in batches, so the lock is only taken every BatchSize operations.
+// Objects may be freed on a different thread than they were allocated on.
+// Objects cached by a thread go back to the pool when the thread exits.
+// ObjectPool<T> is the first base, so the vacants also outlive the unregistration.
 template<typename T>
-class ThreadSafeObjectPool : private ObjectPool<T>
+class ThreadSafeObjectPool : private ObjectPool<T>, private Internal::ThreadSafeObjectPoolBase
 {
 public:
+	ThreadSafeObjectPool()
+		: ThreadSafeObjectPoolBase(return_objects)
+	{
+	}
+
 	template<typename... P>
 	T *allocate(P &&... p)
 	{
-		std::lock_guard<std::mutex> holder{lock};
-		return ObjectPool<T>::allocate(std::forward<P>(p)...);
+#ifndef OBJECT_POOL_DEBUG
+		auto *magazine = get_thread_magazine();
+		if (!magazine)
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			return ObjectPool<T>::allocate(std::forward<P>(p)...);
+		}
+
+		if (magazine->count == 0)
+			refill(*magazine);
+		if (magazine->count == 0)
+			return nullptr;
+
+		T *ptr = static_cast<T *>(magazine->objects[--magazine->count]);
+		new(ptr) T(std::forward<P>(p)...);
+		return ptr;
+#else
+		return new T(std::forward<P>(p)...);
+#endif
 	}
 
 	void free(T *ptr)
 	{
 #ifndef OBJECT_POOL_DEBUG
 		ptr->~T();
-		std::lock_guard<std::mutex> holder{lock};
-		this->vacants.push_back(ptr);
+		auto *magazine = get_thread_magazine();
+		if (!magazine)
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			this->vacants.push_back(ptr);
+			return;
+		}
+
+		if (magazine->count == Internal::ObjectPoolMagazine::Capacity)
+		{
+			magazine->count -= Internal::ObjectPoolMagazine::BatchSize;
+			return_objects(this, magazine->objects + magazine->count, Internal::ObjectPoolMagazine::BatchSize);
+		}
+		magazine->objects[magazine->count++] = ptr;
 #else
 		delete ptr;
 #endif
 	}
 
+	// Must not race with other threads using the pool.
 	void clear()
 	{
+		invalidate_thread_magazines();
 		std::lock_guard<std::mutex> holder{lock};
 		ObjectPool<T>::clear();
 	}
 
+	// Returns objects cached by the calling thread to the shared pool.
+	void flush_thread_cache()
+	{
+#ifndef OBJECT_POOL_DEBUG
+		auto *magazine = get_thread_magazine();
+		if (magazine)
+		{
+			return_objects(this, magazine->objects, magazine->count);
+			magazine->count = 0;
+		}
+#endif
+	}
+
+	// The calling thread's magazine is otherwise created on its first allocate() or free().
+	void prepare_thread_cache()
+	{
+#ifndef OBJECT_POOL_DEBUG
+		get_thread_magazine();
+#endif
+	}
+
+	// Every thread can hold up to a full magazine. Make sure the shared pool can fill num_threads of them,
+	// so objects migrating between threads do not grow the pool on the hot path.
+	void reserve_thread_caches(unsigned num_threads)
+	{
+#ifndef OBJECT_POOL_DEBUG
+		std::lock_guard<std::mutex> holder{lock};
+		size_t count = size_t(num_threads) * Internal::ObjectPoolMagazine::Capacity;
+		while (this->vacants.size() < count && this->allocate_block())
+		{
+		}
+#else
+		(void)num_threads;
+#endif
+	}
+
 private:
-	std::mutex lock;
+#ifndef OBJECT_POOL_DEBUG
+	void refill(Internal::ObjectPoolMagazine &magazine)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		if (this->vacants.size() < Internal::ObjectPoolMagazine::BatchSize &&
+		    !this->allocate_block() && this->vacants.empty())
+		{
+			return;
+		}
+
+		auto count = std::min<size_t>(Internal::ObjectPoolMagazine::BatchSize, this->vacants.size());
+		for (size_t i = 0; i < count; i++)
+			magazine.objects[i] = this->vacants[this->vacants.size() - count + i];
+		this->vacants.resize(this->vacants.size() - count);
+		magazine.count = unsigned(count);
+	}
+#endif
+
+	static void return_objects(ThreadSafeObjectPoolBase *base, void * const *objects, unsigned count)
+	{
+#ifndef OBJECT_POOL_DEBUG
+		auto *pool = static_cast<ThreadSafeObjectPool *>(base);
+		std::lock_guard<std::mutex> holder{pool->lock};
+		for (unsigned i = 0; i < count; i++)
+			pool->vacants.push_back(static_cast<T *>(objects[i]));
+#else
+		(void)base;
+		(void)objects;
+		(void)count;
+#endif
+	}
 };
 
 }
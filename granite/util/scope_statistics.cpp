@@ -0,0 +1,244 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/scope_statistics.hpp"
+#include "util/timeline_trace_file.hpp"
+#include "util/logging.hpp"
+#include <algorithm>
+
+namespace Util
+{
+static std::atomic<uint64_t> statistics_id_counter;
+// A thread usually records into a single ScopeStatistics, but helpers may run tasks for several thread groups.
+static thread_local std::vector<std::pair<uint64_t, void *>> thread_statistics;
+
+static constexpr uint32_t AllThreads = UINT32_MAX;
+
+struct ScopeStatistics::ThreadState
+{
+	enum { NumSlots = 256 };
+
+	// Written by the owning thread only. end_frame() reads the totals and diffs them against the last frame.
+	struct Slot
+	{
+		std::atomic<uint32_t> scope_plus_one;
+		std::atomic<uint64_t> total_ns;
+		std::atomic<uint64_t> count;
+	};
+
+	explicit ThreadState(uint32_t tid_)
+	    : tid(tid_)
+	{
+		for (auto &slot : slots)
+		{
+			slot.scope_plus_one.store(0, std::memory_order_relaxed);
+			slot.total_ns.store(0, std::memory_order_relaxed);
+			slot.count.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	uint32_t tid;
+	Slot slots[NumSlots];
+	uint64_t last_total_ns[NumSlots] = {};
+	uint64_t last_count[NumSlots] = {};
+	bool warned_full = false;
+};
+
+ScopeStatistics::ScopeStatistics(unsigned window_frames_)
+    : window_frames(std::max(window_frames_, 1u))
+{
+	id = statistics_id_counter.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+ScopeStatistics::~ScopeStatistics()
+{
+}
+
+ScopeStatistics::ThreadState &ScopeStatistics::get_thread_state()
+{
+	for (auto &entry : thread_statistics)
+		if (entry.first == id)
+			return *static_cast<ThreadState *>(entry.second);
+
+	auto state = std::make_unique<ThreadState>(TimelineTraceFile::get_tid());
+	auto *ret = state.get();
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		thread_states.push_back(std::move(state));
+	}
+	thread_statistics.emplace_back(id, ret);
+	return *ret;
+}
+
+void ScopeStatistics::record(uint32_t scope, uint64_t duration_ns)
+{
+	auto &state = get_thread_state();
+	uint32_t key = scope + 1;
+	uint32_t mask = ThreadState::NumSlots - 1;
+
+	for (uint32_t i = 0; i < ThreadState::NumSlots; i++)
+	{
+		auto &slot = state.slots[(scope * 0x9e3779b1u + i) & mask];
+		uint32_t slot_key = slot.scope_plus_one.load(std::memory_order_relaxed);
+		if (slot_key == 0)
+			slot.scope_plus_one.store(key, std::memory_order_release);
+		else if (slot_key != key)
+			continue;
+
+		slot.total_ns.store(slot.total_ns.load(std::memory_order_relaxed) + duration_ns, std::memory_order_relaxed);
+		slot.count.store(slot.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+
+	if (!state.warned_full)
+	{
+		LOGW("Too many scopes on one thread, ignoring some in statistics.\n");
+		state.warned_full = true;
+	}
+}
+
+ScopeStatistics::Series &ScopeStatistics::get_series(uint32_t scope, uint32_t tid)
+{
+	auto &s = series[(uint64_t(scope) << 32) | tid];
+	if (s.window_ns.empty())
+	{
+		s.scope = scope;
+		s.tid = tid;
+		s.window_ns.resize(window_frames);
+		s.window_count.resize(window_frames);
+	}
+	return s;
+}
+
+void ScopeStatistics::push_sample(Series &s, uint64_t ns, uint32_t count)
+{
+	unsigned index = (s.head + s.size) % window_frames;
+	if (s.size == window_frames)
+		s.head = (s.head + 1) % window_frames;
+	else
+		s.size++;
+	s.window_ns[index] = ns;
+	s.window_count[index] = count;
+}
+
+void ScopeStatistics::end_frame()
+{
+	std::lock_guard<std::mutex> holder{lock};
+
+	for (auto &state : thread_states)
+	{
+		for (unsigned i = 0; i < ThreadState::NumSlots; i++)
+		{
+			auto &slot = state->slots[i];
+			uint32_t key = slot.scope_plus_one.load(std::memory_order_acquire);
+			if (key == 0)
+				continue;
+
+			uint64_t count = slot.count.load(std::memory_order_relaxed);
+			uint64_t total_ns = slot.total_ns.load(std::memory_order_relaxed);
+			uint64_t delta_count = count - state->last_count[i];
+			uint64_t delta_ns = total_ns - state->last_total_ns[i];
+			if (delta_count == 0)
+				continue;
+
+			state->last_count[i] = count;
+			state->last_total_ns[i] = total_ns;
+			push_sample(get_series(key - 1, state->tid), delta_ns, uint32_t(delta_count));
+
+			auto &total = get_series(key - 1, AllThreads);
+			if (total.frame_count == 0)
+				frame_totals.push_back(&total);
+			total.frame_ns += delta_ns;
+			total.frame_count += uint32_t(delta_count);
+		}
+	}
+
+	for (auto *total : frame_totals)
+	{
+		push_sample(*total, total->frame_ns, total->frame_count);
+		total->frame_ns = 0;
+		total->frame_count = 0;
+	}
+	frame_totals.clear();
+}
+
+void ScopeStatistics::set_window_size(unsigned window_frames_)
+{
+	std::lock_guard<std::mutex> holder{lock};
+	window_frames = std::max(window_frames_, 1u);
+	series.clear();
+}
+
+std::vector<ScopeStatistics::Entry> ScopeStatistics::get_statistics()
+{
+	std::vector<Entry> entries;
+	std::vector<uint64_t> sorted;
+
+	std::lock_guard<std::mutex> holder{lock};
+	entries.reserve(series.size());
+
+	for (auto &itr : series)
+	{
+		auto &s = itr.second;
+		if (!s.size)
+			continue;
+
+		sorted.clear();
+		uint64_t total_ns = 0;
+		uint64_t total_count = 0;
+		for (unsigned i = 0; i < s.size; i++)
+		{
+			unsigned index = (s.head + i) % window_frames;
+			sorted.push_back(s.window_ns[index]);
+			total_ns += s.window_ns[index];
+			total_count += s.window_count[index];
+		}
+		std::sort(sorted.begin(), sorted.end());
+
+		auto percentile = [&](unsigned p) {
+			size_t rank = (sorted.size() * p + 99) / 100;
+			return sorted[std::max<size_t>(rank, 1) - 1];
+		};
+
+		Entry entry;
+		entry.scope = TimelineTraceFile::get_interned_string(s.scope);
+		if (s.tid != AllThreads)
+			entry.thread = s.tid ? TimelineTraceFile::get_interned_string(s.tid) : "unnamed";
+		entry.num_frames = s.size;
+		entry.min_ns = sorted.front();
+		entry.max_ns = sorted.back();
+		entry.avg_ns = total_ns / s.size;
+		entry.p95_ns = percentile(95);
+		entry.p99_ns = percentile(99);
+		entry.avg_count = double(total_count) / double(s.size);
+		entries.push_back(std::move(entry));
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+		if (a.scope != b.scope)
+			return a.scope < b.scope;
+		return a.thread < b.thread;
+	});
+
+	return entries;
+}
+}
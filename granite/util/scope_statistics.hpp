@@ -0,0 +1,98 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Util
+{
+// Keeps rolling timing statistics per named scope and per thread over the last N frames.
+// Scopes and threads are identified by strings interned with TimelineTraceFile::intern_string().
+// Recording is lock-free, each thread accumulates into its own table,
+// which end_frame() turns into one sample per scope and frame.
+class ScopeStatistics
+{
+public:
+	explicit ScopeStatistics(unsigned window_frames = 120);
+	~ScopeStatistics();
+
+	ScopeStatistics(const ScopeStatistics &) = delete;
+	void operator=(const ScopeStatistics &) = delete;
+
+	// Attributed to the thread name set with TimelineTraceFile::set_tid() at the time the thread first records.
+	void record(uint32_t scope, uint64_t duration_ns);
+	void end_frame();
+
+	// Discards all history.
+	void set_window_size(unsigned window_frames);
+
+	struct Entry
+	{
+		std::string scope;
+		// Empty for the sum over all threads, "unnamed" for threads which never called set_tid().
+		std::string thread;
+		// Frames in the window in which the scope was recorded.
+		unsigned num_frames = 0;
+		// Per frame, the scope time summed over all instances in that frame.
+		uint64_t min_ns = 0;
+		uint64_t max_ns = 0;
+		uint64_t avg_ns = 0;
+		uint64_t p95_ns = 0;
+		uint64_t p99_ns = 0;
+		double avg_count = 0.0;
+	};
+	// Sorted by scope, with the sum over all threads first.
+	std::vector<Entry> get_statistics();
+
+private:
+	struct ThreadState;
+	struct Series
+	{
+		uint32_t scope;
+		uint32_t tid;
+		std::vector<uint64_t> window_ns;
+		std::vector<uint32_t> window_count;
+		unsigned head = 0;
+		unsigned size = 0;
+		uint64_t frame_ns = 0;
+		uint32_t frame_count = 0;
+	};
+
+	std::mutex lock;
+	uint64_t id;
+	unsigned window_frames;
+	std::vector<std::unique_ptr<ThreadState>> thread_states;
+	std::unordered_map<uint64_t, Series> series;
+	std::vector<Series *> frame_totals;
+
+	ThreadState &get_thread_state();
+	Series &get_series(uint32_t scope, uint32_t tid);
+	void push_sample(Series &s, uint64_t ns, uint32_t count);
+};
+}
@@ -0,0 +1,199 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Util
+{
+// Move-only replacement for std::function which stores callables of up to InlineSize bytes inline.
+// Only larger callables fall back to the heap. Unlike std::function, move-only callables are supported.
+template <typename Signature, size_t InlineSize = 64>
+class SmallFunction;
+
+template <typename R, typename... Args, size_t InlineSize>
+class SmallFunction<R (Args...), InlineSize>
+{
+public:
+	SmallFunction() = default;
+
+	SmallFunction(std::nullptr_t) noexcept
+	{
+	}
+
+	template <typename Func,
+	          typename = std::enable_if_t<!std::is_same<std::decay_t<Func>, SmallFunction>::value>>
+	SmallFunction(Func &&func)
+	{
+		assign(std::forward<Func>(func));
+	}
+
+	SmallFunction(SmallFunction &&other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	SmallFunction &operator=(SmallFunction &&other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+			if (other.ops)
+			{
+				other.ops->move(storage, other.storage);
+				ops = other.ops;
+				other.ops = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	SmallFunction(const SmallFunction &) = delete;
+	void operator=(const SmallFunction &) = delete;
+
+	~SmallFunction()
+	{
+		reset();
+	}
+
+	// Like std::function, calling is const even if the stored callable is not.
+	R operator()(Args... args) const
+	{
+		return ops->invoke(storage, std::forward<Args>(args)...);
+	}
+
+	explicit operator bool() const
+	{
+		return ops != nullptr;
+	}
+
+	// Mostly useful for testing that we avoid allocations.
+	bool is_inline() const
+	{
+		return ops && ops->is_inline;
+	}
+
+	void reset()
+	{
+		if (ops)
+		{
+			ops->destroy(storage);
+			ops = nullptr;
+		}
+	}
+
+private:
+	struct Ops
+	{
+		R (*invoke)(void *, Args &&...);
+		void (*move)(void *, void *);
+		void (*destroy)(void *);
+		bool is_inline;
+	};
+
+	template <typename Func>
+	static constexpr bool fits_inline()
+	{
+		return sizeof(Func) <= InlineSize &&
+		       alignof(Func) <= alignof(std::max_align_t) &&
+		       std::is_nothrow_move_constructible<Func>::value;
+	}
+
+	template <typename Func>
+	struct InlineOps
+	{
+		static R invoke(void *storage, Args &&... args)
+		{
+			return (*static_cast<Func *>(storage))(std::forward<Args>(args)...);
+		}
+
+		static void move(void *dst, void *src)
+		{
+			new (dst) Func(std::move(*static_cast<Func *>(src)));
+			static_cast<Func *>(src)->~Func();
+		}
+
+		static void destroy(void *storage)
+		{
+			static_cast<Func *>(storage)->~Func();
+		}
+
+		static constexpr Ops ops = { invoke, move, destroy, true };
+	};
+
+	template <typename Func>
+	struct HeapOps
+	{
+		static Func *&get(void *storage)
+		{
+			return *static_cast<Func **>(storage);
+		}
+
+		static R invoke(void *storage, Args &&... args)
+		{
+			return (*get(storage))(std::forward<Args>(args)...);
+		}
+
+		static void move(void *dst, void *src)
+		{
+			new (dst) Func *(get(src));
+		}
+
+		static void destroy(void *storage)
+		{
+			delete get(storage);
+		}
+
+		static constexpr Ops ops = { invoke, move, destroy, false };
+	};
+
+	template <typename Func>
+	void assign(Func &&func)
+	{
+		using F = std::decay_t<Func>;
+
+		// Empty std::function or null function pointers should result in an empty SmallFunction.
+		if constexpr (std::is_constructible<bool, const F &>::value)
+			if (!static_cast<bool>(func))
+				return;
+
+		if constexpr (fits_inline<F>())
+		{
+			new (storage) F(std::forward<Func>(func));
+			ops = &InlineOps<F>::ops;
+		}
+		else
+		{
+			new (storage) F *(new F(std::forward<Func>(func)));
+			ops = &HeapOps<F>::ops;
+		}
+	}
+
+	static_assert(InlineSize >= sizeof(void *), "Inline storage must be able to hold a pointer.");
+	alignas(std::max_align_t) mutable unsigned char storage[InlineSize];
+	const Ops *ops = nullptr;
+};
+}
@@ -24,19 +24,111 @@
 #include "util/timeline_trace_file.hpp"
 #include "util/thread_name.hpp"
 #include "util/timer.hpp"
+#include "util/hash.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
-#include <cstdio>
+#include <unordered_map>
 
 namespace Util
 {
+namespace
+{
+struct StringTable
+{
+	StringTable()
+	{
+		// Id 0 is the empty string, which is what events get until they are named.
+		strings.emplace_back();
+		Hasher h;
+		h.string("");
+		ids[h.get()] = 0;
+	}
+
+	std::mutex lock;
+	std::unordered_map<Hash, uint32_t> ids;
+	std::vector<std::string> strings;
+};
 
-static thread_local char trace_tid[32];
+struct ThreadTrace
+{
+	uint64_t file_id = 0;
+	void *state = nullptr;
+};
+}
+
+static StringTable &get_string_table()
+{
+	static StringTable table;
+	return table;
+}
+
+static thread_local uint32_t trace_tid;
 static thread_local TimelineTraceFile *trace_file;
+static thread_local ThreadTrace thread_trace;
+// Avoids the global lock for strings this thread has seen before.
+static thread_local std::unordered_map<Hash, uint32_t> interned_strings;
+static std::atomic<uint64_t> file_id_counter;
+
+struct TimelineTraceFile::ThreadState
+{
+	enum { RingSize = 32 * 1024 };
+
+	// Single producer, the owning thread. Single consumer, the writer thread.
+	std::unique_ptr<Event[]> ring{new Event[RingSize]};
+	alignas(64) std::atomic<uint64_t> write_count{0};
+	alignas(64) std::atomic<uint64_t> read_count{0};
+
+	// Events handed out by begin_event() and allocate_event().
+	std::vector<std::unique_ptr<Event>> events;
+	std::vector<Event *> vacant_events;
+};
+
+uint32_t TimelineTraceFile::intern_string(const char *str)
+{
+	Hasher h;
+	h.string(str);
+	auto hash = h.get();
+
+	auto itr = interned_strings.find(hash);
+	if (itr != interned_strings.end())
+		return itr->second;
+
+	auto &table = get_string_table();
+	uint32_t id;
+	{
+		std::lock_guard<std::mutex> holder{table.lock};
+		auto global_itr = table.ids.find(hash);
+		if (global_itr != table.ids.end())
+			id = global_itr->second;
+		else
+		{
+			id = uint32_t(table.strings.size());
+			table.strings.emplace_back(str);
+			table.ids[hash] = id;
+		}
+	}
+
+	interned_strings[hash] = id;
+	return id;
+}
+
+std::string TimelineTraceFile::get_interned_string(uint32_t id)
+{
+	auto &table = get_string_table();
+	std::lock_guard<std::mutex> holder{table.lock};
+	return id < table.strings.size() ? table.strings[id] : std::string();
+}
 
 void TimelineTraceFile::set_tid(const char *tid)
 {
-	snprintf(trace_tid, sizeof(trace_tid), "%s", tid);
+	trace_tid = intern_string(tid);
+}
+
+uint32_t TimelineTraceFile::get_tid()
+{
+	return trace_tid;
 }
 
 void TimelineTraceFile::set_per_thread(TimelineTraceFile *file)
@@ -51,40 +143,83 @@ TimelineTraceFile *TimelineTraceFile::get_per_thread()
 
 void TimelineTraceFile::Event::set_desc(const char *desc_)
 {
-	snprintf(desc, sizeof(desc), "%s", desc_);
+	desc = intern_string(desc_);
 }
 
 void TimelineTraceFile::Event::set_tid(const char *tid_)
 {
-	snprintf(tid, sizeof(tid), "%s", tid_);
+	tid = intern_string(tid_);
 }
 
-TimelineTraceFile::Event *TimelineTraceFile::begin_event(const char *desc, uint32_t pid)
+TimelineTraceFile::ThreadState &TimelineTraceFile::get_thread_state()
 {
-	auto *e = event_pool.allocate();
-	e->pid = pid;
-	e->set_tid(trace_tid);
-	e->set_desc(desc);
-	e->start_ns = get_current_time_nsecs();
-	return e;
+	if (thread_trace.file_id != file_id)
+	{
+		auto state = std::make_unique<ThreadState>();
+		thread_trace.file_id = file_id;
+		thread_trace.state = state.get();
+
+		std::lock_guard<std::mutex> holder{lock};
+		thread_states.push_back(std::move(state));
+	}
+
+	return *static_cast<ThreadState *>(thread_trace.state);
 }
 
 TimelineTraceFile::Event *TimelineTraceFile::allocate_event()
 {
-	auto *e = event_pool.allocate();
-	e->desc[0] = '\0';
-	e->tid[0] = '\0';
+	auto &state = get_thread_state();
+	Event *e;
+	if (state.vacant_events.empty())
+	{
+		state.events.emplace_back(new Event);
+		e = state.events.back().get();
+	}
+	else
+	{
+		e = state.vacant_events.back();
+		state.vacant_events.pop_back();
+	}
+
+	e->desc = 0;
+	e->tid = 0;
 	e->pid = 0;
 	e->start_ns = 0;
 	e->end_ns = 0;
 	return e;
 }
 
+TimelineTraceFile::Event *TimelineTraceFile::begin_event(const char *desc, uint32_t pid)
+{
+	return begin_event_interned(intern_string(desc), pid);
+}
+
+TimelineTraceFile::Event *TimelineTraceFile::begin_event_interned(uint32_t desc, uint32_t pid)
+{
+	auto *e = allocate_event();
+	e->pid = pid;
+	e->tid = trace_tid;
+	e->desc = desc;
+	e->start_ns = get_current_time_nsecs();
+	return e;
+}
+
 void TimelineTraceFile::submit_event(Event *e)
 {
-	std::lock_guard<std::mutex> holder{lock};
-	queued_events.push(e);
-	cond.notify_one();
+	// The event goes back to the vacant list of the submitting thread, which is fine
+	// since all events are owned by the file.
+	auto &state = get_thread_state();
+
+	uint64_t write_count = state.write_count.load(std::memory_order_relaxed);
+	if (write_count - state.read_count.load(std::memory_order_acquire) < ThreadState::RingSize)
+	{
+		state.ring[write_count & (ThreadState::RingSize - 1)] = *e;
+		state.write_count.store(write_count + 1, std::memory_order_release);
+	}
+	else
+		dropped_events.fetch_add(1, std::memory_order_relaxed);
+
+	state.vacant_events.push_back(e);
 }
 
 void TimelineTraceFile::end_event(Event *e)
@@ -93,62 +228,296 @@ void TimelineTraceFile::end_event(Event *e)
 	submit_event(e);
 }
 
+uint64_t TimelineTraceFile::get_num_dropped_events() const
+{
+	return dropped_events.load(std::memory_order_relaxed);
+}
+
 TimelineTraceFile::TimelineTraceFile(const std::string &path)
 {
+	file_id = file_id_counter.fetch_add(1, std::memory_order_relaxed) + 1;
+	dropped_events.store(0, std::memory_order_relaxed);
 	thr = std::thread(&TimelineTraceFile::looper, this, path);
 }
 
+static void write_u32(std::vector<uint8_t> &buffer, uint32_t value)
+{
+	for (unsigned i = 0; i < 4; i++)
+		buffer.push_back(uint8_t(value >> (8 * i)));
+}
+
+static void write_u64(std::vector<uint8_t> &buffer, uint64_t value)
+{
+	for (unsigned i = 0; i < 8; i++)
+		buffer.push_back(uint8_t(value >> (8 * i)));
+}
+
+bool TimelineTraceFile::drain(FILE *file, std::vector<Event> &events, uint32_t &num_strings_written)
+{
+	events.clear();
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		for (auto &state : thread_states)
+		{
+			uint64_t read_count = state->read_count.load(std::memory_order_relaxed);
+			uint64_t write_count = state->write_count.load(std::memory_order_acquire);
+			for (uint64_t i = read_count; i < write_count; i++)
+				events.push_back(state->ring[i & (ThreadState::RingSize - 1)]);
+			state->read_count.store(write_count, std::memory_order_release);
+		}
+	}
+
+	if (!file)
+		return true;
+
+	// Any string an event refers to was interned before the event was pushed.
+	std::vector<uint8_t> buffer;
+	{
+		auto &table = get_string_table();
+		std::lock_guard<std::mutex> holder{table.lock};
+		for (uint32_t i = num_strings_written; i < uint32_t(table.strings.size()); i++)
+		{
+			auto &str = table.strings[i];
+			buffer.push_back(uint8_t(RecordType::String));
+			write_u32(buffer, i);
+			write_u32(buffer, uint32_t(str.size()));
+			buffer.insert(buffer.end(), str.begin(), str.end());
+		}
+		num_strings_written = uint32_t(table.strings.size());
+	}
+
+	for (auto &e : events)
+	{
+		buffer.push_back(uint8_t(RecordType::Event));
+		write_u32(buffer, e.desc);
+		write_u32(buffer, e.tid);
+		write_u32(buffer, e.pid);
+		write_u64(buffer, e.start_ns);
+		write_u64(buffer, e.end_ns);
+	}
+
+	return buffer.empty() || fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+}
+
 void TimelineTraceFile::looper(std::string path)
 {
-	set_current_thread_name("json-trace-io");
+	set_current_thread_name("trace-io");
 
-	FILE *file = fopen(path.c_str(), "w");
+	FILE *file = fopen(path.c_str(), "wb");
 	if (!file)
 		LOGE("Failed to open file: %s.\n", path.c_str());
 
 	if (file)
-		fputs("[\n", file);
+	{
+		uint8_t header[sizeof(FileMagic) + 4];
+		memcpy(header, FileMagic, sizeof(FileMagic));
+		for (unsigned i = 0; i < 4; i++)
+			header[sizeof(FileMagic) + i] = uint8_t(uint32_t(FileVersion) >> (8 * i));
+		fwrite(header, 1, sizeof(header), file);
+	}
 
-	uint64_t base_ts = get_current_time_nsecs();
+	std::vector<Event> events;
+	uint32_t num_strings_written = 0;
 
 	for (;;)
 	{
-		Event *e;
+		bool stop;
 		{
+			// Producers never notify, so poll at a rate which keeps the rings from filling up.
 			std::unique_lock<std::mutex> holder{lock};
-			cond.wait(holder, [this]() {
-				return !queued_events.empty();
+			cond.wait_for(holder, std::chrono::milliseconds(10), [this]() {
+				return dead;
 			});
-			e = queued_events.front();
-			queued_events.pop();
+			stop = dead;
 		}
 
-		if (!e)
-			break;
-
-		auto start_us = int64_t(e->start_ns - base_ts) * 1e-3;
-		auto end_us = int64_t(e->end_ns - base_ts) * 1e-3;
-
-		if (file && start_us <= end_us)
+		if (!drain(file, events, num_strings_written))
 		{
-			fprintf(file, "{ \"name\": \"%s\", \"ph\": \"B\", \"tid\": \"%s\", \"pid\": \"%u\", \"ts\": %f },\n",
-			        e->desc, e->tid, e->pid, start_us);
-			fprintf(file, "{ \"name\": \"%s\", \"ph\": \"E\", \"tid\": \"%s\", \"pid\": \"%u\", \"ts\": %f },\n",
-			        e->desc, e->tid, e->pid, end_us);
+			LOGE("Failed to write timeline trace, stopping.\n");
+			fclose(file);
+			file = nullptr;
 		}
 
-		event_pool.free(e);
+		if (stop)
+			break;
+	}
+
+	if (dropped_events.load(std::memory_order_relaxed))
+	{
+		LOGW("Dropped %llu timeline events since ring buffers were full.\n",
+		     static_cast<unsigned long long>(dropped_events.load(std::memory_order_relaxed)));
 	}
 
-	// Intentionally truncate the JSON so that we can emit "," after the last element.
 	if (file)
 		fclose(file);
 }
 
 TimelineTraceFile::~TimelineTraceFile()
 {
-	submit_event(nullptr);
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		dead = true;
+	}
+	cond.notify_one();
 	if (thr.joinable())
 		thr.join();
 }
+
+namespace
+{
+struct TraceReader
+{
+	const uint8_t *data;
+	size_t size;
+	size_t offset = 0;
+
+	bool read(void *dst, size_t count)
+	{
+		if (offset + count > size)
+			return false;
+		memcpy(dst, data + offset, count);
+		offset += count;
+		return true;
+	}
+
+	bool u32(uint32_t &value)
+	{
+		uint8_t bytes[4];
+		if (!read(bytes, sizeof(bytes)))
+			return false;
+		value = 0;
+		for (unsigned i = 0; i < 4; i++)
+			value |= uint32_t(bytes[i]) << (8 * i);
+		return true;
+	}
+
+	bool u64(uint64_t &value)
+	{
+		uint8_t bytes[8];
+		if (!read(bytes, sizeof(bytes)))
+			return false;
+		value = 0;
+		for (unsigned i = 0; i < 8; i++)
+			value |= uint64_t(bytes[i]) << (8 * i);
+		return true;
+	}
+};
+}
+
+static bool read_file(const char *path, std::vector<uint8_t> &buffer)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	uint8_t block[64 * 1024];
+	size_t read_bytes;
+	while ((read_bytes = fread(block, 1, sizeof(block), file)) != 0)
+		buffer.insert(buffer.end(), block, block + read_bytes);
+	fclose(file);
+	return true;
+}
+
+bool read_timeline_trace(const char *path, TimelineTrace &trace)
+{
+	std::vector<uint8_t> buffer;
+	if (!read_file(path, buffer))
+		return false;
+
+	TraceReader reader = { buffer.data(), buffer.size() };
+	char magic[sizeof(TimelineTraceFile::FileMagic)];
+	uint32_t version;
+	if (!reader.read(magic, sizeof(magic)) || memcmp(magic, TimelineTraceFile::FileMagic, sizeof(magic)) != 0 ||
+	    !reader.u32(version) || version != TimelineTraceFile::FileVersion)
+	{
+		return false;
+	}
+
+	trace = {};
+	while (reader.offset < reader.size)
+	{
+		uint8_t type;
+		reader.read(&type, sizeof(type));
+
+		if (type == uint8_t(TimelineTraceFile::RecordType::String))
+		{
+			uint32_t id, length;
+			if (!reader.u32(id) || !reader.u32(length) || reader.offset + length > reader.size)
+			{
+				trace.truncated = true;
+				break;
+			}
+			if (id >= trace.strings.size())
+				trace.strings.resize(id + 1);
+			trace.strings[id].assign(reinterpret_cast<const char *>(reader.data + reader.offset), length);
+			reader.offset += length;
+		}
+		else if (type == uint8_t(TimelineTraceFile::RecordType::Event))
+		{
+			TimelineTraceFile::Event e;
+			if (!reader.u32(e.desc) || !reader.u32(e.tid) || !reader.u32(e.pid) ||
+			    !reader.u64(e.start_ns) || !reader.u64(e.end_ns))
+			{
+				trace.truncated = true;
+				break;
+			}
+			if (e.start_ns <= e.end_ns)
+				trace.events.push_back(e);
+		}
+		else
+		{
+			LOGE("Unknown record type %u, stopping.\n", type);
+			trace.truncated = true;
+			break;
+		}
+	}
+
+	return true;
+}
+
+static std::string escape_json(const std::string &str)
+{
+	std::string escaped;
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+			escaped += '\\';
+		if (uint8_t(c) < 0x20)
+			continue;
+		escaped += c;
+	}
+	return escaped;
+}
+
+bool write_timeline_trace_json(const char *path, const TimelineTrace &trace)
+{
+	FILE *file = fopen(path, "w");
+	if (!file)
+		return false;
+
+	uint64_t base_ns = UINT64_MAX;
+	for (auto &e : trace.events)
+		base_ns = std::min(base_ns, e.start_ns);
+
+	auto get_string = [&](uint32_t id) -> std::string {
+		return id < trace.strings.size() ? escape_json(trace.strings[id]) : std::string();
+	};
+
+	fputs("[\n", file);
+	for (size_t i = 0; i < trace.events.size(); i++)
+	{
+		auto &e = trace.events[i];
+		auto desc = get_string(e.desc);
+		auto tid = get_string(e.tid);
+		double start_us = 1e-3 * double(e.start_ns - base_ns);
+		double end_us = 1e-3 * double(e.end_ns - base_ns);
+
+		fprintf(file, "{ \"name\": \"%s\", \"ph\": \"B\", \"tid\": \"%s\", \"pid\": \"%u\", \"ts\": %f },\n",
+		        desc.c_str(), tid.c_str(), e.pid, start_us);
+		fprintf(file, "{ \"name\": \"%s\", \"ph\": \"E\", \"tid\": \"%s\", \"pid\": \"%u\", \"ts\": %f }%s\n",
+		        desc.c_str(), tid.c_str(), e.pid, end_us, i + 1 < trace.events.size() ? "," : "");
+	}
+	fputs("]\n", file);
+	return fclose(file) == 0;
+}
 }
@@ -22,18 +22,22 @@
 
 #pragma once
 
-#include "util/object_pool.hpp"
-
+#include <atomic>
 #include <cstdint>
+#include <cstdio>
+#include <memory>
 #include <string>
 #include <thread>
 #include <condition_variable>
 #include <mutex>
-#include <queue>
+#include <vector>
 
 namespace Util
 {
-
+// Records CPU and GPU timeline events into a compact binary file.
+// Every thread pushes completed events into its own ring buffer, which a writer thread drains.
+// Scope names and thread names are interned, so an event is a few integers.
+// Use the timeline-trace-to-json tool to convert the file into Chrome / Perfetto JSON.
 class TimelineTraceFile
 {
 public:
@@ -44,10 +48,16 @@ public:
 	static TimelineTraceFile *get_per_thread();
 	static void set_per_thread(TimelineTraceFile *file);
 
+	// Interned strings are global and live until the process exits. Id 0 is the empty string.
+	static uint32_t intern_string(const char *str);
+	static std::string get_interned_string(uint32_t id);
+	// The interned name set with set_tid().
+	static uint32_t get_tid();
+
 	struct Event
 	{
-		char desc[256];
-		char tid[32];
+		uint32_t desc;
+		uint32_t tid;
 		uint32_t pid;
 		uint64_t start_ns, end_ns;
 
@@ -55,19 +65,58 @@ public:
 		void set_tid(const char *tid);
 	};
 	Event *begin_event(const char *desc, uint32_t pid = 0);
+	// Same as above, for a desc which has already been interned.
+	Event *begin_event_interned(uint32_t desc, uint32_t pid = 0);
 	void end_event(Event *e);
 
 	Event *allocate_event();
 	void submit_event(Event *e);
 
+	// Events which were dropped because a ring buffer was full.
+	uint64_t get_num_dropped_events() const;
+
+	// On-disk format. A header, followed by records which all start with a RecordType byte.
+	// All values are little-endian.
+	enum { FileVersion = 1 };
+	static constexpr char FileMagic[8] = { 'G', 'R', 'N', 'T', 'R', 'A', 'C', 'E' };
+
+	enum class RecordType : uint8_t
+	{
+		// u32 id, u32 length, followed by length bytes.
+		String = 1,
+		// u32 desc, u32 tid, u32 pid, u64 start_ns, u64 end_ns.
+		Event = 2
+	};
+
 private:
-	void looper(std::string path);
+	struct ThreadState;
+	ThreadState &get_thread_state();
+
 	std::thread thr;
 	std::mutex lock;
 	std::condition_variable cond;
+	bool dead = false;
+	uint64_t file_id;
+	std::vector<std::unique_ptr<ThreadState>> thread_states;
+	std::atomic<uint64_t> dropped_events;
 
-	ThreadSafeObjectPool<Event> event_pool;
-	std::queue<Event *> queued_events;
+	void looper(std::string path);
+	bool drain(FILE *file, std::vector<Event> &events, uint32_t &num_strings_written);
+};
+
+// The contents of a trace file written by TimelineTraceFile.
+struct TimelineTrace
+{
+	// Indexed by interned string id.
+	std::vector<std::string> strings;
+	std::vector<TimelineTraceFile::Event> events;
+	// The file ended in the middle of a record, e.g. because the process crashed.
+	// Everything up to the last complete record is still read.
+	bool truncated = false;
 };
 
+// Returns false if the file cannot be read, or is not a timeline trace.
+bool read_timeline_trace(const char *path, TimelineTrace &trace);
+// Writes the events as Chrome / Perfetto JSON.
+bool write_timeline_trace_json(const char *path, const TimelineTrace &trace);
 }
@@ -61,12 +61,10 @@ void Texture::set_path(const std::string &path_)
 
 void Texture::update(std::unique_ptr<Granite::File> file)
 {
-	auto *f = file.release();
-	auto work = [f, this]() {
+	auto work = [updated_file = std::move(file), this]() mutable {
 #if defined(GRANITE_VULKAN_MT) && defined(VULKAN_DEBUG)
 		LOGI("Loading texture in thread index: %u\n", get_current_thread_index());
 #endif
-		std::unique_ptr<Granite::File> updated_file{f};
 		auto size = updated_file->get_size();
 		void *mapped = updated_file->map();
 		if (size && mapped)
@@ -86,8 +84,8 @@ void Texture::update(std::unique_ptr<Granite::File> file)
 
 #ifdef GRANITE_VULKAN_MT
 	auto &workers = *Granite::Global::thread_group();
-	// Workaround, cannot copy the lambda because of owning a unique_ptr.
 	auto task = workers.create_task(std::move(work));
+	task->set_priority(Granite::TaskPriority::Background);
 	task->flush();
 #else
 	work();
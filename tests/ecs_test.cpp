@@ -1,5 +1,11 @@
 #include "ecs/ecs.hpp"
+#include "ecs/entity_command_buffer.hpp"
+#include "threading/task_composer.hpp"
 #include "util/logging.hpp"
+#include "util/timer.hpp"
+#include <memory>
+#include <cmath>
+#include <stdlib.h>
 
 using namespace Granite;
 
@@ -33,7 +39,535 @@ struct CComponent : ComponentBase
 	int v;
 };
 
-int main()
+struct PositionComponent : ComponentBase
+{
+	GRANITE_COMPONENT_TYPE_DECL(PositionComponent)
+	GRANITE_COMPONENT_ARCHETYPE_STORAGE
+	PositionComponent(float x_, float y_)
+		: x(x_), y(y_)
+	{
+	}
+	float x, y;
+};
+
+struct VelocityComponent : ComponentBase
+{
+	GRANITE_COMPONENT_TYPE_DECL(VelocityComponent)
+	GRANITE_COMPONENT_ARCHETYPE_STORAGE
+	VelocityComponent(float x_, float y_)
+		: x(x_), y(y_)
+	{
+	}
+	float x, y;
+};
+
+// Non-trivial, so relocation has to run move constructors and destructors.
+struct NameComponent : ComponentBase
+{
+	GRANITE_COMPONENT_TYPE_DECL(NameComponent)
+	GRANITE_COMPONENT_ARCHETYPE_STORAGE
+	explicit NameComponent(int id_)
+		: id(new int(id_))
+	{
+	}
+	std::unique_ptr<int> id;
+};
+
+static bool check(bool cond, const char *what)
+{
+	if (!cond)
+		LOGE("Check failed: %s\n", what);
+	return cond;
+}
+
+static bool test_archetypes()
+{
+	EntityPool pool;
+	bool ok = true;
+
+	auto &pos_vel = pool.get_component_group<PositionComponent, VelocityComponent>();
+	auto &pos_a = pool.get_component_group<PositionComponent, AComponent>();
+
+	std::vector<Entity *> entities;
+	for (int i = 0; i < 3000; i++)
+	{
+		auto *e = pool.create_entity();
+		e->allocate_component<PositionComponent>(float(i), 0.0f);
+		if (i % 2 == 0)
+			e->allocate_component<VelocityComponent>(1.0f, float(i));
+		if (i % 3 == 0)
+			e->allocate_component<AComponent>(i);
+		if (i % 5 == 0)
+			e->allocate_component<NameComponent>(i);
+		entities.push_back(e);
+	}
+
+	// Remove components and entities, which moves rows around in all archetypes.
+	for (int i = 0; i < 3000; i += 4)
+		entities[i]->free_component<VelocityComponent>();
+	for (int i = 1; i < 3000; i += 7)
+	{
+		pool.delete_entity(entities[i]);
+		entities[i] = nullptr;
+	}
+
+	size_t expected_pos_vel = 0;
+	size_t expected_pos_a = 0;
+	for (int i = 0; i < 3000; i++)
+	{
+		auto *e = entities[i];
+		if (!e)
+			continue;
+
+		ok = check(e->get_component<PositionComponent>()->x == float(i), "position") && ok;
+		bool has_vel = i % 2 == 0 && i % 4 != 0;
+		ok = check(e->has_component<VelocityComponent>() == has_vel, "has velocity") && ok;
+		if (has_vel)
+			ok = check(e->get_component<VelocityComponent>()->y == float(i), "velocity") && ok;
+		if (i % 5 == 0)
+			ok = check(*e->get_component<NameComponent>()->id == i, "name") && ok;
+		else
+			ok = check(!e->get_component<NameComponent>(), "no name") && ok;
+
+		expected_pos_vel += has_vel;
+		expected_pos_a += i % 3 == 0;
+	}
+
+	// The compatibility groups must follow components as they move between chunks.
+	ok = check(pos_vel.size() == expected_pos_vel, "pos_vel size") && ok;
+	for (auto &g : pos_vel)
+		ok = check(get_component<PositionComponent>(g)->x == get_component<VelocityComponent>(g)->y, "pos_vel") && ok;
+	ok = check(pos_a.size() == expected_pos_a, "pos_a size") && ok;
+	for (auto &g : pos_a)
+		ok = check(get_component<PositionComponent>(g)->x == float(get_component<AComponent>(g)->v), "pos_a") && ok;
+
+	size_t visited = 0;
+	pool.for_each_component<VelocityComponent, PositionComponent>([&](Entity &e, VelocityComponent &v, PositionComponent &p) {
+		ok = check(e.get_component<PositionComponent>() == &p, "entity column") && ok;
+		ok = check(v.y == p.x, "chunk columns") && ok;
+		visited++;
+	});
+	ok = check(visited == expected_pos_vel, "for_each_component count") && ok;
+
+	for (auto *e : entities)
+		if (e)
+			pool.delete_entity(e);
+	ok = check(pos_vel.empty() && pos_a.empty(), "groups empty") && ok;
+	return ok;
+}
+
+// Ranges of a query must cover every row exactly once, however they are split across chunks and archetypes.
+static bool test_chunk_ranges()
+{
+	EntityPool pool;
+	bool ok = true;
+
+	std::vector<Entity *> entities;
+	for (int i = 0; i < 5000; i++)
+	{
+		auto *e = pool.create_entity();
+		e->allocate_component<PositionComponent>(float(i), 0.0f);
+		e->allocate_component<VelocityComponent>(float(i), 0.0f);
+		if (i % 3 == 0)
+			e->allocate_component<NameComponent>(i);
+		entities.push_back(e);
+	}
+
+	auto *query = pool.get_archetype_query<PositionComponent, VelocityComponent>();
+	ok = check(query->get_archetype_count() == 2, "archetype count") && ok;
+	ok = check(query->get_row_count() == 5000, "row count") && ok;
+
+	for (size_t split : { size_t(1), size_t(7), size_t(64), size_t(1000), size_t(5000) })
+	{
+		std::vector<unsigned> hits(5000);
+		for (size_t begin = 0; begin < 5000; begin += split)
+		{
+			query->for_each_chunk_range<PositionComponent, const VelocityComponent>(
+					begin, std::min<size_t>(begin + split, 5000),
+					[&](size_t count, Entity *const *chunk_entities, PositionComponent *p, const VelocityComponent *v) {
+				for (size_t i = 0; i < count; i++)
+				{
+					ok = check(chunk_entities[i]->get_component<PositionComponent>() == &p[i], "range entity") && ok;
+					ok = check(p[i].x == v[i].x, "range columns") && ok;
+					hits[size_t(p[i].x)]++;
+				}
+			});
+		}
+
+		ok = check(std::all_of(hits.begin(), hits.end(), [](unsigned h) { return h == 1; }), "range coverage") && ok;
+	}
+
+	for (auto *e : entities)
+		pool.delete_entity(e);
+	return ok;
+}
+
+static bool test_parallel()
+{
+	ThreadGroup threads;
+	threads.start(4);
+	EntityPool pool;
+	bool ok = true;
+
+	std::vector<Entity *> entities;
+	for (int i = 0; i < 10000; i++)
+	{
+		auto *e = pool.create_entity();
+		e->allocate_component<PositionComponent>(float(i), 0.0f);
+		e->allocate_component<VelocityComponent>(1.0f, 2.0f);
+		e->allocate_component<AComponent>(0);
+		if (i % 2 == 0)
+			e->allocate_component<BComponent>(0);
+		entities.push_back(e);
+	}
+
+	pool.for_each_parallel<PositionComponent, const VelocityComponent>(
+		threads, 64, [](Entity &, PositionComponent &p, const VelocityComponent &v) {
+			p.x += v.x;
+			p.y += v.y;
+		});
+
+	// Both readers of PositionComponent share a stage, the writer has to wait for them.
+	TaskComposer composer(threads);
+	EntitySystemComposer systems(pool, composer);
+	systems.for_each_parallel<const PositionComponent, AComponent>(
+		64, [](Entity &, const PositionComponent &p, AComponent &a) {
+			a.v = int(p.x);
+		});
+	auto *first_stage = &composer.get_group();
+	systems.for_each_parallel<const PositionComponent, BComponent>(
+		64, [](Entity &, const PositionComponent &p, BComponent &b) {
+			b.v = int(p.y);
+		});
+	ok = check(&composer.get_group() == first_stage, "shared stage") && ok;
+	systems.for_each_parallel<PositionComponent>(
+		64, [](Entity &, PositionComponent &p) {
+			p.x = -p.x;
+		});
+	ok = check(&composer.get_group() != first_stage, "conflicting stage") && ok;
+	composer.get_outgoing_task()->wait();
+
+	for (int i = 0; i < 10000; i++)
+	{
+		auto *e = entities[i];
+		ok = check(e->get_component<PositionComponent>()->x == -float(i + 1), "position") && ok;
+		ok = check(e->get_component<AComponent>()->v == i + 1, "read before write") && ok;
+		if (i % 2 == 0)
+			ok = check(e->get_component<BComponent>()->v == 2, "second reader") && ok;
+		pool.delete_entity(e);
+	}
+
+	return ok;
+}
+
+static bool test_command_buffers()
+{
+	ThreadGroup threads;
+	threads.start(4);
+	EntityPool pool;
+	EntityCommandQueue queue;
+	bool ok = true;
+
+	enum { NumEntities = 4000 };
+	std::vector<Entity *> entities;
+	for (int i = 0; i < NumEntities; i++)
+	{
+		auto *e = pool.create_entity();
+		e->allocate_component<AComponent>(i);
+		e->allocate_component<PositionComponent>(float(i), 0.0f);
+		entities.push_back(e);
+	}
+
+	auto &ab = pool.get_component_group<AComponent, BComponent>();
+	auto &pos_vel = pool.get_component_group<PositionComponent, VelocityComponent>();
+	auto &pos_vel_name = pool.get_component_group<PositionComponent, VelocityComponent, NameComponent>();
+	auto &a = pool.get_component_group<AComponent>();
+
+	for (int frame = 0; frame < 2; frame++)
+	{
+		auto task = threads.create_task();
+		task->parallel_for(entities.size(), 64, [&](size_t begin, size_t end) {
+			auto &cmd = queue.get_thread_buffer();
+			for (size_t i = begin; i < end; i++)
+			{
+				auto *e = entities[i];
+				if (frame == 0)
+				{
+					cmd.allocate_component<BComponent>(e, int(i));
+					cmd.allocate_component<VelocityComponent>(e, float(i), 0.0f);
+					cmd.allocate_component<NameComponent>(e, int(i));
+					if (i % 3 == 0)
+						cmd.free_component<AComponent>(e);
+
+					auto created = cmd.create_entity();
+					cmd.allocate_component<PositionComponent>(created, -float(i), 0.0f);
+					cmd.allocate_component<VelocityComponent>(created, float(i), 0.0f);
+				}
+				else if (i % 2 == 0)
+				{
+					cmd.free_component<NameComponent>(e);
+					if (i % 4 == 0)
+						cmd.destroy_entity(e);
+				}
+			}
+		});
+		task->wait();
+		queue.play_back(pool);
+	}
+
+	size_t expected_ab = 0;
+	size_t expected_pos_vel = NumEntities;
+	size_t expected_pos_vel_name = 0;
+	for (int i = 0; i < NumEntities; i++)
+	{
+		if (i % 4 == 0)
+			continue;
+		expected_ab += i % 3 != 0;
+		expected_pos_vel++;
+		expected_pos_vel_name += i % 2 != 0;
+
+		auto *e = entities[i];
+		ok = check(e->get_component<BComponent>()->v == i, "deferred B") && ok;
+		ok = check(e->get_component<VelocityComponent>()->x == float(i), "deferred velocity") && ok;
+		ok = check(e->has_component<AComponent>() == (i % 3 != 0), "deferred free") && ok;
+		ok = check(e->has_component<NameComponent>() == (i % 2 != 0), "second frame free") && ok;
+	}
+
+	ok = check(ab.size() == expected_ab, "ab size") && ok;
+	for (auto &g : ab)
+		ok = check(get_component<AComponent>(g)->v == get_component<BComponent>(g)->v, "ab") && ok;
+	ok = check(pos_vel.size() == expected_pos_vel, "pos_vel size") && ok;
+	for (auto &g : pos_vel)
+		ok = check(std::abs(get_component<PositionComponent>(g)->x) == get_component<VelocityComponent>(g)->x, "pos_vel") && ok;
+	ok = check(pos_vel_name.size() == expected_pos_vel_name, "pos_vel_name size") && ok;
+	for (auto &g : pos_vel_name)
+		ok = check(get_component<PositionComponent>(g)->x == float(*get_component<NameComponent>(g)->id), "pos_vel_name") && ok;
+	ok = check(a.size() == expected_ab, "a size") && ok;
+
+	// Every entity which is still alive has a position.
+	std::vector<Entity *> alive;
+	for (auto *e : pool.get_component_entities<PositionComponent>())
+		alive.push_back(e);
+	for (auto *e : alive)
+		pool.delete_entity(e);
+	ok = check(pool.get_component_entities<AComponent>().empty(), "all deleted") && ok;
+	return ok;
+}
+
+static bool test_change_tracking()
+{
+	EntityPool pool;
+	bool ok = true;
+
+	std::vector<Entity *> entities;
+	for (int i = 0; i < 100; i++)
+	{
+		auto *e = pool.create_entity();
+		e->allocate_component<PositionComponent>(float(i), 0.0f);
+		e->allocate_component<AComponent>(i);
+		entities.push_back(e);
+	}
+
+	auto &group = *pool.get_component_group_holder<PositionComponent, AComponent>();
+	auto count_changed = [&](uint64_t since, bool position, bool a) {
+		size_t count = 0;
+		if (position && a)
+			group.for_each_changed<PositionComponent, AComponent>(since, [&](Entity &, const auto &) { count++; });
+		else if (position)
+			group.for_each_changed<PositionComponent>(since, [&](Entity &, const auto &) { count++; });
+		else
+			group.for_each_changed<AComponent>(since, [&](Entity &, const auto &) { count++; });
+		return count;
+	};
+
+	// Allocation counts as a change.
+	ok = check(count_changed(0, true, false) == 100, "allocated") && ok;
+
+	uint64_t since = pool.advance_change_version();
+	ok = check(!group.any_changed<PositionComponent, AComponent>(since), "nothing changed") && ok;
+
+	for (int i = 0; i < 100; i += 10)
+		entities[i]->mark_component_changed<PositionComponent>();
+	for (int i = 0; i < 100; i += 7)
+		entities[i]->mark_component_changed<AComponent>();
+
+	ok = check(count_changed(since, true, false) == 10, "position changed") && ok;
+	ok = check(count_changed(since, false, true) == 15, "a changed") && ok;
+	ok = check(count_changed(since, true, true) == 23, "any changed") && ok;
+
+	// Versions follow components across archetypes and swap-removes.
+	for (int i = 0; i < 100; i += 3)
+		entities[i]->allocate_component<VelocityComponent>(0.0f, 0.0f);
+	pool.delete_entity(entities[1]);
+	ok = check(count_changed(since, true, false) == 10, "position changed after moves") && ok;
+	group.for_each_changed<PositionComponent>(since, [&](Entity &e, const auto &tuple) {
+		ok = check(int(get_component<PositionComponent>(tuple)->x) % 10 == 0, "changed entity") && ok;
+		ok = check(e.get_component<PositionComponent>() == get_component<PositionComponent>(tuple), "changed tuple") && ok;
+	});
+
+	since = pool.advance_change_version();
+	ok = check(!group.any_changed<PositionComponent>(since), "nothing changed again") && ok;
+	entities[2]->allocate_component<AComponent>(-2);
+	ok = check(count_changed(since, false, true) == 1, "reallocation is a change") && ok;
+
+	// Components which for_each_parallel() can write count as changed, the ones it only reads do not.
+	ThreadGroup threads;
+	threads.start(2);
+	since = pool.advance_change_version();
+	pool.for_each_parallel<PositionComponent, const AComponent>(
+		threads, 16, [](Entity &, PositionComponent &p, const AComponent &) { p.y += 1.0f; });
+	ok = check(count_changed(since, true, false) == 99, "pooled write") && ok;
+	ok = check(count_changed(since, false, true) == 0, "pooled read") && ok;
+
+	auto &velocities = *pool.get_component_group_holder<PositionComponent, VelocityComponent>();
+	since = pool.advance_change_version();
+	pool.for_each_parallel<const PositionComponent, VelocityComponent>(
+		threads, 16, [](Entity &, const PositionComponent &p, VelocityComponent &v) { v.x = p.x; });
+	ok = check(!velocities.any_changed<PositionComponent>(since), "archetype read") && ok;
+	size_t velocity_count = 0;
+	velocities.for_each_changed<VelocityComponent>(since, [&](Entity &, const auto &) { velocity_count++; });
+	ok = check(velocity_count == 34 && velocity_count == velocities.get_groups().size(), "archetype write") && ok;
+
+	for (int i = 0; i < 100; i++)
+		if (i != 1)
+			pool.delete_entity(entities[i]);
+	return ok;
+}
+
+static bool test_handles()
+{
+	EntityPool pool;
+	bool ok = true;
+
+	ok = check(pool.get_entity(0) == nullptr, "null handle") && ok;
+
+	std::vector<Entity *> entities;
+	std::vector<EntityHandle> handles;
+	for (int i = 0; i < 100; i++)
+	{
+		auto *e = pool.create_entity();
+		e->allocate_component<AComponent>(i);
+		if (i & 1)
+			e->allocate_component<PositionComponent>(float(i), 0.0f);
+		entities.push_back(e);
+		handles.push_back(e->get_handle());
+	}
+
+	for (int i = 0; i < 100; i++)
+		ok = check(pool.get_entity(handles[i]) == entities[i], "resolve handle") && ok;
+
+	auto &group = *pool.get_component_group_holder<AComponent, PositionComponent>();
+	ok = check(group.get_entities().size() == 50, "group size") && ok;
+
+	// Deleted entities must not resolve, even when their slot is reused.
+	for (int i = 0; i < 100; i += 3)
+	{
+		pool.delete_entity(entities[i]);
+		entities[i] = nullptr;
+	}
+	for (int i = 0; i < 100; i += 3)
+	{
+		auto *e = pool.create_entity();
+		e->allocate_component<AComponent>(-i);
+		e->allocate_component<PositionComponent>(float(-i), 0.0f);
+		entities.push_back(e);
+	}
+
+	for (int i = 0; i < 100; i++)
+		ok = check(pool.get_entity(handles[i]) == entities[i], "resolve after reuse") && ok;
+	for (size_t i = 100; i < entities.size(); i++)
+		ok = check(pool.get_entity(entities[i]->get_handle()) == entities[i], "resolve new") && ok;
+
+	// Group membership is tracked by slot index, so reused slots must not alias the deleted entities.
+	size_t expected = 0;
+	for (auto *e : entities)
+		if (e && e->has_component<PositionComponent>())
+			expected++;
+	ok = check(group.get_entities().size() == expected, "group size after reuse") && ok;
+	for (auto *e : group.get_entities())
+		ok = check(std::find(entities.begin(), entities.end(), e) != entities.end(), "live group entity") && ok;
+
+	for (auto *e : entities)
+	{
+		if (e)
+		{
+			e->free_component<PositionComponent>();
+			ok = check(std::find(group.get_entities().begin(), group.get_entities().end(), e) ==
+			           group.get_entities().end(), "removed from group") && ok;
+		}
+	}
+	ok = check(group.get_entities().empty(), "group empty") && ok;
+
+	for (auto *e : entities)
+		if (e)
+			pool.delete_entity(e);
+	return ok;
+}
+
+// Integrates positions, once through the pointer-based group and once streaming through archetype chunks.
+static void bench_iteration()
+{
+	enum { NumEntities = 100000, NumIterations = 100 };
+	EntityPool pool;
+	std::vector<Entity *> entities;
+
+	for (unsigned i = 0; i < NumEntities; i++)
+	{
+		auto *e = pool.create_entity();
+		entities.push_back(e);
+		e->allocate_component<PositionComponent>(0.0f, 0.0f);
+		e->allocate_component<VelocityComponent>(1.0f, 2.0f);
+		// Interleave pooled allocations, like a real scene does, so pooled components get scattered.
+		e->allocate_component<AComponent>(int(i));
+		e->allocate_component<BComponent>(int(i));
+	}
+
+	auto &group = pool.get_component_group<PositionComponent, VelocityComponent>();
+	Util::Timer timer;
+
+	timer.start();
+	for (unsigned iter = 0; iter < NumIterations; iter++)
+	{
+		for (auto &g : group)
+		{
+			auto *p = get_component<PositionComponent>(g);
+			auto *v = get_component<VelocityComponent>(g);
+			p->x += v->x;
+			p->y += v->y;
+		}
+	}
+	double group_time = timer.end();
+
+	timer.start();
+	for (unsigned iter = 0; iter < NumIterations; iter++)
+	{
+		pool.for_each_chunk<PositionComponent, VelocityComponent>(
+				[](size_t count, Entity *const *, PositionComponent *p, VelocityComponent *v) {
+					for (size_t i = 0; i < count; i++)
+					{
+						p[i].x += v[i].x;
+						p[i].y += v[i].y;
+					}
+				});
+	}
+	double chunk_time = timer.end();
+
+	auto &pooled = pool.get_component_group<AComponent, BComponent>();
+	timer.start();
+	for (unsigned iter = 0; iter < NumIterations; iter++)
+		for (auto &g : pooled)
+			get_component<AComponent>(g)->v += get_component<BComponent>(g)->v;
+	double pooled_time = timer.end();
+
+	LOGI("Iterating %u entities: pooled group %.3f ns, archetype group %.3f ns, archetype chunks %.3f ns per entity.\n",
+	     unsigned(NumEntities), 1e9 * pooled_time / (NumEntities * NumIterations),
+	     1e9 * group_time / (NumEntities * NumIterations), 1e9 * chunk_time / (NumEntities * NumIterations));
+
+	for (auto *e : entities)
+		pool.delete_entity(e);
+}
+
+static void test_pooled()
 {
 	EntityPool pool;
 	auto a = pool.create_entity();
@@ -52,4 +586,42 @@ int main()
 		LOGI("BA: %d, %d\n", get<0>(e)->v, get<1>(e)->v);
 	for (auto &e : group_bc)
 		LOGI("BC: %d\n", get<0>(e)->v);
-}
\ No newline at end of file
+
+	pool.delete_entity(a);
+}
+
+int main()
+{
+	test_pooled();
+	if (!test_archetypes())
+	{
+		LOGE("Archetype test failed.\n");
+		return EXIT_FAILURE;
+	}
+	if (!test_chunk_ranges())
+	{
+		LOGE("Chunk range test failed.\n");
+		return EXIT_FAILURE;
+	}
+	if (!test_parallel())
+	{
+		LOGE("Parallel test failed.\n");
+		return EXIT_FAILURE;
+	}
+	if (!test_command_buffers())
+	{
+		LOGE("Command buffer test failed.\n");
+		return EXIT_FAILURE;
+	}
+	if (!test_change_tracking())
+	{
+		LOGE("Change tracking test failed.\n");
+		return EXIT_FAILURE;
+	}
+	if (!test_handles())
+	{
+		LOGE("Handle test failed.\n");
+		return EXIT_FAILURE;
+	}
+	bench_iteration();
+}
@@ -0,0 +1,194 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/frame_arena.hpp"
+#include "util/logging.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+
+using namespace Util;
+
+static std::atomic<uint64_t> allocation_count;
+
+void *operator new(size_t size)
+{
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	if (void *ptr = malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+struct Item
+{
+	unsigned frame;
+	unsigned index;
+	const void *payload;
+};
+
+template <typename T>
+using StdVector = std::vector<T>;
+
+enum { NumWorkers = 4, NumFrames = 64 };
+
+// Mimics a renderer frame: every worker gathers into its own long-lived list which is cleared every frame,
+// and uses a local scratch list for intermediate results, like the clusterer does.
+template <template <typename> class Vector>
+class FrameSimulation
+{
+public:
+	FrameSimulation()
+	{
+		for (unsigned i = 0; i < NumWorkers; i++)
+			workers[i] = std::thread([this, i]() { worker_loop(i); });
+	}
+
+	~FrameSimulation()
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			done = true;
+		}
+		cond.notify_all();
+		for (auto &w : workers)
+			w.join();
+	}
+
+	bool run_frame(unsigned frame)
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			current_frame = frame;
+			pending = NumWorkers;
+		}
+		cond.notify_all();
+
+		std::unique_lock<std::mutex> holder{lock};
+		cond.wait(holder, [this]() { return pending == 0; });
+
+		// Consume the lists on the main thread, like pushing to a render queue.
+		bool ok = true;
+		for (unsigned i = 0; i < NumWorkers; i++)
+		{
+			if (lists[i].size() != list_size(frame, i))
+				ok = false;
+			for (size_t j = 0; j < lists[i].size(); j++)
+				if (lists[i][j].frame != frame || lists[i][j].index != j)
+					ok = false;
+		}
+		return ok;
+	}
+
+private:
+	Vector<Item> lists[NumWorkers];
+	std::thread workers[NumWorkers];
+	std::mutex lock;
+	std::condition_variable cond;
+	unsigned current_frame = ~0u;
+	unsigned pending = 0;
+	bool done = false;
+
+	static size_t list_size(unsigned frame, unsigned worker)
+	{
+		return 1000 + 37 * ((frame * 7 + worker * 13) % 64);
+	}
+
+	void worker_loop(unsigned index)
+	{
+		unsigned last_frame = ~0u;
+		for (;;)
+		{
+			unsigned frame;
+			{
+				std::unique_lock<std::mutex> holder{lock};
+				cond.wait(holder, [&]() { return done || current_frame != last_frame; });
+				if (done)
+					return;
+				frame = current_frame;
+				last_frame = frame;
+			}
+
+			Vector<unsigned> scratch;
+			auto &list = lists[index];
+			list.clear();
+			for (unsigned i = 0; i < list_size(frame, index); i++)
+			{
+				scratch.push_back(i);
+				list.push_back({ frame, scratch.back(), &list });
+			}
+
+			{
+				std::lock_guard<std::mutex> holder{lock};
+				pending--;
+			}
+			cond.notify_all();
+		}
+	}
+};
+
+template <template <typename> class Vector>
+static bool measure(const char *tag)
+{
+	FrameSimulation<Vector> sim;
+	bool ok = true;
+
+	// Let everything grow to its steady state size first.
+	for (unsigned i = 0; i < NumFrames; i++)
+	{
+		ok = sim.run_frame(i) && ok;
+		FrameArena::end_frame();
+	}
+
+	uint64_t allocations = allocation_count.load() + FrameArena::get_chunk_allocation_count();
+	for (unsigned i = NumFrames; i < 2 * NumFrames; i++)
+	{
+		ok = sim.run_frame(i) && ok;
+		FrameArena::end_frame();
+	}
+	allocations = allocation_count.load() + FrameArena::get_chunk_allocation_count() - allocations;
+
+	LOGI("%s: %.2f heap allocations per frame.\n", tag, double(allocations) / NumFrames);
+	return ok;
+}
+
+int main()
+{
+	if (!measure<StdVector>("std::vector") || !measure<FrameVector>("FrameVector"))
+	{
+		LOGE("Frame data was corrupted.\n");
+		return EXIT_FAILURE;
+	}
+}
@@ -0,0 +1,132 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/hash.hpp"
+#include "util/logging.hpp"
+#include "util/timer.hpp"
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <stdlib.h>
+
+using namespace Util;
+
+// The SIMD implementation picked at runtime must agree with the scalar one for every size and alignment.
+static bool test_bulk_consistency(const std::vector<uint8_t> &buffer)
+{
+	for (size_t offset = 0; offset < 8; offset++)
+	{
+		for (size_t size = 0; size < 1200; size++)
+		{
+			Hash seed = size * 31 + offset;
+			if (Internal::hash_bulk(buffer.data() + offset, size, seed) !=
+			    Internal::hash_bulk_scalar(buffer.data() + offset, size, seed))
+			{
+				LOGE("Bulk hash mismatch for size %zu, offset %zu.\n", size, offset);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Every single bit flip, and every length, must produce a distinct hash.
+static bool test_bulk_distribution(std::vector<uint8_t> buffer)
+{
+	std::vector<Hash> hashes;
+	const size_t size = 1024;
+	for (size_t bit = 0; bit < size * 8; bit++)
+	{
+		buffer[bit >> 3] ^= uint8_t(1u << (bit & 7));
+		Hasher h;
+		h.bulk(buffer.data(), size);
+		hashes.push_back(h.get());
+		buffer[bit >> 3] ^= uint8_t(1u << (bit & 7));
+	}
+
+	std::vector<uint8_t> zeroes(size);
+	for (size_t len = 0; len <= size; len++)
+	{
+		Hasher h;
+		h.bulk(zeroes.data(), len);
+		hashes.push_back(h.get());
+	}
+
+	std::sort(hashes.begin(), hashes.end());
+	if (std::unique(hashes.begin(), hashes.end()) != hashes.end())
+	{
+		LOGE("Bulk hash collision.\n");
+		return false;
+	}
+	return true;
+}
+
+template <typename Func>
+static double bench(const std::vector<uint8_t> &buffer, size_t size, const Func &func)
+{
+	size_t iterations = std::max<size_t>(1, (size_t(64) << 20) / size);
+	Hash sink = 0;
+	auto start = get_current_time_nsecs();
+	for (size_t i = 0; i < iterations; i++)
+		sink ^= func(buffer.data() + (i & 1) * 8, size);
+	auto end = get_current_time_nsecs();
+
+	// Keep the hashes alive.
+	if (sink == 1)
+		LOGI("\n");
+	return double(iterations * size) / (1e-9 * double(end - start)) / double(1 << 30);
+}
+
+int main()
+{
+	std::vector<uint8_t> buffer((size_t(1) << 20) + 16);
+	std::mt19937 rnd(1234);
+	for (auto &b : buffer)
+		b = uint8_t(rnd());
+
+	if (!test_bulk_consistency(buffer) || !test_bulk_distribution(buffer))
+		return EXIT_FAILURE;
+
+	LOGI("GiB / s for data<uint8_t>, data<uint32_t>, bulk scalar and bulk.\n");
+	for (size_t size : { size_t(32), size_t(64), size_t(256), size_t(4096), size_t(1) << 20 })
+	{
+		double bytes = bench(buffer, size, [](const uint8_t *data, size_t n) {
+			Hasher h;
+			h.data(data, n);
+			return h.get();
+		});
+		double words = bench(buffer, size, [](const uint8_t *data, size_t n) {
+			Hasher h;
+			h.data(reinterpret_cast<const uint32_t *>(data), n);
+			return h.get();
+		});
+		double scalar = bench(buffer, size, [](const uint8_t *data, size_t n) {
+			return Internal::hash_bulk_scalar(data, n, 0);
+		});
+		double bulk = bench(buffer, size, [](const uint8_t *data, size_t n) {
+			Hasher h;
+			h.bulk(data, n);
+			return h.get();
+		});
+		LOGI("%8zu bytes: %6.2f %6.2f %6.2f %6.2f\n", size, bytes, words, scalar, bulk);
+	}
+}
@@ -0,0 +1,212 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/intrusive_hash_map.hpp"
+#include "util/logging.hpp"
+#include "util/timer.hpp"
+#include <memory>
+#include <random>
+#include <vector>
+#include <stdlib.h>
+
+using namespace Util;
+
+// Roughly the size of the pipeline and layout objects the Vulkan backend looks up.
+struct Entry : IntrusiveHashMapEnabled<Entry>
+{
+	uint64_t payload[24];
+};
+
+// The previous IntrusiveHashMapHolder probing, which reads the hash through every candidate pointer.
+class PointerProbingHashMap
+{
+public:
+	Entry *find(Hash hash) const
+	{
+		if (values.empty())
+			return nullptr;
+
+		Hash hash_mask = values.size() - 1;
+		auto masked = hash & hash_mask;
+		for (unsigned i = 0; i < load_count; i++)
+		{
+			if (values[masked] && values[masked]->get_hash() == hash)
+				return values[masked];
+			masked = (masked + 1) & hash_mask;
+		}
+
+		return nullptr;
+	}
+
+	void insert(Entry *value)
+	{
+		entries.push_back(value);
+		while (!insert_inner(value))
+			grow();
+	}
+
+	size_t get_capacity() const
+	{
+		return values.size();
+	}
+
+private:
+	std::vector<Entry *> values;
+	std::vector<Entry *> entries;
+	unsigned load_count = 0;
+
+	bool insert_inner(Entry *value)
+	{
+		if (values.empty())
+			return false;
+
+		Hash hash_mask = values.size() - 1;
+		auto masked = value->get_hash() & hash_mask;
+		for (unsigned i = 0; i < load_count; i++)
+		{
+			if (!values[masked])
+			{
+				values[masked] = value;
+				return true;
+			}
+			masked = (masked + 1) & hash_mask;
+		}
+		return false;
+	}
+
+	void grow()
+	{
+		bool success;
+		do
+		{
+			if (values.empty())
+			{
+				values.resize(IntrusiveHashMapHolder<Entry>::InitialSize);
+				load_count = IntrusiveHashMapHolder<Entry>::InitialLoadCount;
+			}
+			else
+			{
+				values.resize(values.size() * 2);
+				load_count++;
+			}
+
+			for (auto &v : values)
+				v = nullptr;
+
+			success = true;
+			for (auto *e : entries)
+			{
+				if (!insert_inner(e))
+				{
+					success = false;
+					break;
+				}
+			}
+		} while (!success);
+	}
+};
+
+constexpr unsigned num_lookups = 4 * 1024 * 1024;
+
+template <typename Map>
+static double bench_lookups(const Map &map, const std::vector<Hash> &keys, uint64_t &found)
+{
+	auto start = get_current_time_nsecs();
+	for (unsigned i = 0; i < num_lookups; i++)
+	{
+		auto *e = map.find(keys[i & (keys.size() - 1)]);
+		if (e)
+			found += e->payload[0];
+	}
+	auto end = get_current_time_nsecs();
+	return double(end - start) / num_lookups;
+}
+
+static bool run_bench(size_t count, std::mt19937_64 &rnd)
+{
+	std::vector<std::unique_ptr<Entry>> entries(count);
+	IntrusiveHashMapHolder<Entry> holder;
+	PointerProbingHashMap reference;
+
+	for (auto &e : entries)
+	{
+		e.reset(new Entry);
+		e->set_hash(rnd());
+		e->payload[0] = 1;
+		Entry *value = e.get();
+		if (holder.insert_yield(value))
+		{
+			LOGE("Hash collision, should not happen.\n");
+			return false;
+		}
+		reference.insert(e.get());
+	}
+
+	std::vector<Hash> hits(64 * 1024);
+	std::vector<Hash> misses(64 * 1024);
+	for (auto &h : hits)
+		h = entries[rnd() % count]->get_hash();
+	for (auto &h : misses)
+		h = rnd();
+
+	uint64_t found = 0;
+	double holder_hit = bench_lookups(holder, hits, found);
+	double reference_hit = bench_lookups(reference, hits, found);
+	double holder_miss = bench_lookups(holder, misses, found);
+	double reference_miss = bench_lookups(reference, misses, found);
+
+	if (found != 2 * uint64_t(num_lookups))
+	{
+		LOGE("Lookups disagree, found %llu.\n", static_cast<unsigned long long>(found));
+		return false;
+	}
+
+	LOGI("%7zu entries, load %.2f (%.2f): hit %.1f ns (%.1f ns), miss %.1f ns (%.1f ns).\n",
+	     count,
+	     double(count) / double(holder.get_capacity()), double(count) / double(reference.get_capacity()),
+	     holder_hit, reference_hit, holder_miss, reference_miss);
+
+	// Erase half and check the rest is still found.
+	for (size_t i = 0; i < count; i += 2)
+		holder.erase(entries[i].get());
+	for (size_t i = 0; i < count; i++)
+	{
+		bool expected = (i & 1) != 0;
+		if ((holder.find(entries[i]->get_hash()) != nullptr) != expected)
+		{
+			LOGE("Lookup after erase failed.\n");
+			return false;
+		}
+	}
+
+	holder.clear();
+	return true;
+}
+
+int main()
+{
+	std::mt19937_64 rnd(1234);
+	LOGI("Lookup time per key, the previous pointer probing in parentheses.\n");
+	for (size_t count : { 1000, 4000, 12000, 16000, 24000, 48000, 64000, 96000, 128000, 256000, 512000 })
+		if (!run_bench(count, rnd))
+			return EXIT_FAILURE;
+}
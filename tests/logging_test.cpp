@@ -0,0 +1,301 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/logging.hpp"
+#include "util/timer.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Util;
+
+// stderr is redirected here for the duration of the test, results are reported on stdout.
+static const char *log_path = "granite-logging-test.txt";
+
+static std::string read_log()
+{
+	fflush(stderr);
+	std::string result;
+	FILE *file = fopen(log_path, "rb");
+	if (!file)
+		return result;
+	char buffer[4096];
+	size_t count;
+	while ((count = fread(buffer, 1, sizeof(buffer), file)) != 0)
+		result.append(buffer, count);
+	fclose(file);
+	return result;
+}
+
+static void truncate_log()
+{
+	if (!freopen(log_path, "w", stderr))
+		abort();
+}
+
+static unsigned count_occurrences(const std::string &str, const char *needle)
+{
+	unsigned count = 0;
+	for (size_t pos = str.find(needle); pos != std::string::npos; pos = str.find(needle, pos + 1))
+		count++;
+	return count;
+}
+
+enum Small : uint8_t { SmallValue = 7 };
+enum class Scoped : int { Value = -3 };
+
+static bool test_formatting()
+{
+	truncate_log();
+
+	char mutable_string[] = "original";
+	const char *null_string = nullptr;
+	int64_t big = -1234567890123ll;
+	size_t size = 4096;
+	uint16_t small = 65535;
+	float f = 0.25f;
+	int value = 42;
+
+	LOGI("int %d, unsigned %u, hex %08x, char %c, bool %d\n", -5, 5u, 0xbeefu, 'x', int(true));
+	LOGI("int64 %lld, size %zu, short %u, enums %d %d\n", static_cast<long long>(big), size, unsigned(small),
+	     SmallValue, int(Scoped::Value));
+	LOGW("float %.3f, double %g, width %*d, precision %.*f, %%\n", f, 1e10, 6, value, 2, 3.14159);
+	LOGE("string \"%s\", padded [%-10s] [%10.3s], pointer %p\n", mutable_string, "left", "truncate",
+	     static_cast<const void *>(mutable_string));
+	LOGI("null %s, literal only\n", null_string ? null_string : "(none)");
+	// Only %s arguments are copied, a char pointer for %p must print its own address.
+	LOGI("char pointer %p %s\n", mutable_string, mutable_string);
+	LOGI("No arguments.\n");
+	// Strings are copied when logged, not when formatted.
+	strcpy(mutable_string, "changed!");
+	flush_async_logging();
+
+	char expected[1024];
+	std::string expected_log;
+	char original[] = "original";
+	snprintf(expected, sizeof(expected), "[INFO]: int %d, unsigned %u, hex %08x, char %c, bool %d\n",
+	         -5, 5u, 0xbeefu, 'x', int(true));
+	expected_log += expected;
+	snprintf(expected, sizeof(expected), "[INFO]: int64 %lld, size %zu, short %u, enums %d %d\n",
+	         static_cast<long long>(big), size, unsigned(small), 7, -3);
+	expected_log += expected;
+	snprintf(expected, sizeof(expected), "[WARN]: float %.3f, double %g, width %*d, precision %.*f, %%\n",
+	         f, 1e10, 6, value, 2, 3.14159);
+	expected_log += expected;
+	snprintf(expected, sizeof(expected), "[ERROR]: string \"%s\", padded [%-10s] [%10.3s], pointer %p\n",
+	         original, "left", "truncate", static_cast<const void *>(mutable_string));
+	expected_log += expected;
+	expected_log += "[INFO]: null (none), literal only\n";
+	snprintf(expected, sizeof(expected), "[INFO]: char pointer %p %s\n",
+	         static_cast<const void *>(mutable_string), original);
+	expected_log += expected;
+	expected_log += "[INFO]: No arguments.\n";
+
+	auto log = read_log();
+	if (log != expected_log)
+	{
+		printf("Formatting mismatch.\nExpected:\n%sGot:\n%s", expected_log.c_str(), log.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool test_level_filter()
+{
+	truncate_log();
+	set_log_level(LogLevel::Warn);
+	LOGI("Filtered.\n");
+	LOGW("Kept warning.\n");
+	LOGE("Kept error.\n");
+	set_log_level(LogLevel::Info);
+	flush_async_logging();
+
+	auto log = read_log();
+	if (log != "[WARN]: Kept warning.\n[ERROR]: Kept error.\n")
+	{
+		printf("Level filter mismatch, got:\n%s", log.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool test_error_sync()
+{
+	truncate_log();
+	LOGI("Queued before the error.\n");
+	LOGE("Fatal error.\n");
+
+	// No flush, the error and everything this thread logged before it must already be out.
+	auto log = read_log();
+	if (log != "[INFO]: Queued before the error.\n[ERROR]: Fatal error.\n")
+	{
+		printf("Error was not written synchronously, got:\n%s", log.c_str());
+		return false;
+	}
+	return true;
+}
+
+static void spam(unsigned count)
+{
+	for (unsigned i = 0; i < count; i++)
+		LOGI("Spam %u.\n", i);
+}
+
+static bool test_rate_limit()
+{
+	truncate_log();
+	set_log_rate_limit(10);
+	spam(100);
+	LOGI("Other call site.\n");
+
+	// Suppressed messages are reported once the one second window has passed and the call site logs again.
+	std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+	spam(1);
+	flush_async_logging();
+	set_log_rate_limit(0);
+
+	auto log = read_log();
+	if (count_occurrences(log, "[INFO]: Spam ") != 11 || count_occurrences(log, "Other call site.") != 1 ||
+	    log.find("Rate limit suppressed 90 messages from \"Spam %u.\"") == std::string::npos)
+	{
+		printf("Rate limit mismatch, got:\n%s", log.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool test_threads()
+{
+	enum { NumThreads = 4, NumMessages = 20000 };
+	truncate_log();
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < NumThreads; i++)
+	{
+		threads.emplace_back([i]() {
+			for (unsigned j = 0; j < NumMessages; j++)
+				LOGI("Thread %u message %u.\n", i, j);
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+	flush_async_logging();
+
+	// A full ring makes the logging thread write out its own messages, nothing is dropped.
+	auto log = read_log();
+	unsigned written = count_occurrences(log, "[INFO]: Thread ");
+	printf("Threads: %u messages written.\n", written);
+	if (written != NumThreads * NumMessages)
+	{
+		printf("Lost messages.\n");
+		return false;
+	}
+	return true;
+}
+
+static bool test_stop_while_logging()
+{
+	enum { NumThreads = 4, NumMessages = 5000 };
+	truncate_log();
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < NumThreads; i++)
+	{
+		threads.emplace_back([i]() {
+			for (unsigned j = 0; j < NumMessages; j++)
+				LOGI("Racing thread %u message %u.\n", i, j);
+		});
+	}
+
+	// Messages logged while the logger stops are written out either way.
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	stop_async_logging();
+	for (auto &t : threads)
+		t.join();
+	start_async_logging();
+
+	auto log = read_log();
+	unsigned written = count_occurrences(log, "[INFO]: Racing thread ");
+	if (written != NumThreads * NumMessages)
+	{
+		printf("Lost %u messages while stopping.\n", NumThreads * NumMessages - written);
+		return false;
+	}
+	return true;
+}
+
+// Batches stay well below the ring capacity and are flushed in between,
+// so the calling thread never has to write out its own ring. We want the cost of queueing.
+static double measure_log_cost(unsigned num_batches)
+{
+	enum { BatchSize = 100 };
+	double total = 0.0;
+	for (unsigned batch = 0; batch < num_batches; batch++)
+	{
+		Timer timer;
+		timer.start();
+		for (unsigned i = 0; i < BatchSize; i++)
+			LOGI("Frame %u: culled %u of %u objects in %.3f ms (%s).\n", i, i * 3, i * 7, 0.125 * i, "shadow");
+		total += timer.end();
+		flush_async_logging();
+	}
+	return total * 1e9 / (num_batches * BatchSize);
+}
+
+static void bench()
+{
+	enum { NumBatches = 20 };
+	truncate_log();
+
+	stop_async_logging();
+	double sync_cost = measure_log_cost(NumBatches);
+
+	start_async_logging();
+	double async_cost = measure_log_cost(NumBatches);
+
+	printf("LOGI cost on the calling thread: synchronous %.1f ns, asynchronous %.1f ns.\n", sync_cost, async_cost);
+}
+
+int main()
+{
+	truncate_log();
+	start_async_logging();
+	bool ok = test_formatting() && test_level_filter() && test_error_sync() && test_rate_limit() &&
+	          test_threads() && test_stop_while_logging();
+	if (ok)
+		bench();
+
+	stop_async_logging();
+	fclose(stderr);
+	remove(log_path);
+
+	if (!ok)
+	{
+		printf("Logging test failed.\n");
+		return EXIT_FAILURE;
+	}
+	printf("Logging test passed.\n");
+}
@@ -1,5 +1,11 @@
 #include "util/lru_cache.hpp"
 #include "util/logging.hpp"
+#include "util/timer.hpp"
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
 
 using namespace Util;
 
@@ -21,7 +27,7 @@ struct Foo
 	unsigned value = 0;
 };
 
-int main()
+static void test_single_threaded()
 {
 	LRUCache<Foo> cache;
 	cache.set_total_cost(20);
@@ -43,4 +49,155 @@ int main()
 	LOGI("=== Pruned ===\n");
 	for (auto &entry : cache)
 		LOGI("Value: %u\n", entry.t.value);
-}
\ No newline at end of file
+}
+
+static bool test_thread_safe()
+{
+	ThreadSafeLRUCache<unsigned> cache(4);
+	cache.set_total_cost(4 * 20);
+
+	unsigned evicted = 0;
+	cache.set_eviction_callback([&](uint64_t, unsigned &, uint64_t) { evicted++; });
+
+	{
+		// A pinned entry survives any amount of pressure.
+		auto pinned = cache.insert(1000, 10, 1000u);
+		for (unsigned i = 0; i < 1000; i++)
+			cache.insert(i, 10, i);
+
+		if (!cache.find_and_mark_as_recent(1000) || *pinned != 1000)
+			return false;
+
+		// Erasing a pinned entry keeps it alive for the handle.
+		if (!cache.erase(1000) || cache.find_and_mark_as_recent(1000) || *pinned != 1000)
+			return false;
+	}
+
+	auto stats = cache.get_statistics();
+	if (stats.current_cost > 4 * 20 || stats.evictions != evicted || stats.hits != 1 || stats.misses != 1)
+		return false;
+
+	// Racing inserts of the same cookie end up with one entry.
+	auto a = cache.insert(5000, 1, 1u);
+	auto b = cache.insert(5000, 1, 2u);
+	return *a == 1 && *b == 1;
+}
+
+// The previous way to share an LRUCache between threads.
+class LockedLRUCache
+{
+public:
+	explicit LockedLRUCache(uint64_t cost)
+	{
+		cache.set_total_cost(cost);
+	}
+
+	bool find(uint64_t cookie, unsigned &value)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		auto *t = cache.find_and_mark_as_recent(cookie);
+		if (t)
+			value = *t;
+		return t != nullptr;
+	}
+
+	void insert(uint64_t cookie, unsigned value)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		*cache.allocate(cookie, 1) = value;
+		cache.prune();
+	}
+
+private:
+	LRUCache<unsigned> cache;
+	std::mutex lock;
+};
+
+class ShardedLRUCache
+{
+public:
+	explicit ShardedLRUCache(uint64_t cost)
+	{
+		cache.set_total_cost(cost);
+	}
+
+	bool find(uint64_t cookie, unsigned &value)
+	{
+		auto handle = cache.find_and_mark_as_recent(cookie);
+		if (handle)
+			value = *handle;
+		return bool(handle);
+	}
+
+	void insert(uint64_t cookie, unsigned value)
+	{
+		cache.insert(cookie, 1, value);
+	}
+
+private:
+	ThreadSafeLRUCache<unsigned> cache;
+};
+
+enum { NumKeys = 8192, CacheCost = 4096, LookupsPerThread = 1 << 18 };
+
+// Every thread looks up keys with a skewed distribution, and inserts whatever it misses.
+template <typename Cache>
+static double bench_lookups(unsigned num_threads, bool &ok)
+{
+	Cache cache(CacheCost);
+	std::atomic<bool> failed{false};
+	std::vector<std::thread> threads;
+
+	auto start = get_current_time_nsecs();
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		threads.emplace_back([&, i]() {
+			std::mt19937 rnd(i);
+			std::geometric_distribution<unsigned> dist(1.0 / (NumKeys / 8));
+			for (unsigned j = 0; j < LookupsPerThread; j++)
+			{
+				unsigned key = dist(rnd) % NumKeys;
+				unsigned value;
+				if (!cache.find(key, value))
+					cache.insert(key, key * 3);
+				else if (value != key * 3)
+					failed = true;
+			}
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+	auto end = get_current_time_nsecs();
+
+	if (failed)
+		ok = false;
+	return double(num_threads) * LookupsPerThread / (1e-9 * double(end - start)) * 1e-6;
+}
+
+int main()
+{
+	test_single_threaded();
+
+	if (!test_thread_safe())
+	{
+		LOGE("ThreadSafeLRUCache test failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	bool ok = true;
+	unsigned hw_threads = std::max(1u, std::thread::hardware_concurrency());
+	LOGI("Million lookups per second, a locked LRUCache in parentheses (%u hardware threads).\n", hw_threads);
+	for (unsigned num_threads = 1; num_threads <= std::max(8u, hw_threads); num_threads *= 2)
+	{
+		double sharded = bench_lookups<ShardedLRUCache>(num_threads, ok);
+		double locked = bench_lookups<LockedLRUCache>(num_threads, ok);
+		LOGI("%2u threads: %8.2f (%8.2f)\n", num_threads, sharded, locked);
+	}
+
+	if (!ok)
+	{
+		LOGE("Lookup returned the wrong value.\n");
+		return EXIT_FAILURE;
+	}
+}
@@ -0,0 +1,234 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/message_queue.hpp"
+#include "util/logging.hpp"
+#include "util/timer.hpp"
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace Util;
+
+enum { TotalMessages = 256 * 1024, MessageSize = 64, ReadBatch = 64 };
+
+struct Message
+{
+	uint32_t producer;
+	uint32_t index;
+};
+
+static MessageQueuePayload make_message(MessageQueuePayload payload, unsigned producer, unsigned index)
+{
+	Message msg = { producer, index };
+	memcpy(payload.get_payload_data(), &msg, sizeof(msg));
+	payload.set_size(sizeof(msg));
+	return payload;
+}
+
+// The previous MessageQueue, where every operation takes a lock around the SPSC queue.
+class LockedQueue
+{
+public:
+	struct Producer
+	{
+		explicit Producer(LockedQueue &queue_)
+		    : queue(queue_)
+		{
+		}
+
+		bool push(unsigned producer, unsigned index)
+		{
+			std::lock_guard<std::mutex> holder{queue.lock};
+			auto payload = queue.queue.allocate_write_payload(MessageSize);
+			return queue.queue.push_written_payload(make_message(std::move(payload), producer, index));
+		}
+
+		void flush()
+		{
+		}
+
+		LockedQueue &queue;
+	};
+
+	size_t read(MessageQueuePayload *payloads)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		size_t count = 0;
+		while (count < ReadBatch && queue.available_read_messages())
+			payloads[count++] = queue.read_message();
+		return count;
+	}
+
+	void recycle(MessageQueuePayload *payloads, size_t count)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		for (size_t i = 0; i < count; i++)
+			queue.recycle_payload(std::move(payloads[i]));
+	}
+
+private:
+	LockFreeMessageQueue queue;
+	std::mutex lock;
+};
+
+// Lock-free, but every message is allocated and pushed individually.
+class MPMCQueue
+{
+public:
+	struct Producer
+	{
+		explicit Producer(MPMCQueue &queue_)
+		    : queue(queue_.queue)
+		{
+		}
+
+		bool push(unsigned producer, unsigned index)
+		{
+			auto payload = queue.allocate_write_payload(MessageSize);
+			return queue.push_written_payload(make_message(std::move(payload), producer, index));
+		}
+
+		void flush()
+		{
+		}
+
+		LockFreeMPMCMessageQueue &queue;
+	};
+
+	size_t read(MessageQueuePayload *payloads)
+	{
+		return queue.read_messages(payloads, ReadBatch);
+	}
+
+	void recycle(MessageQueuePayload *payloads, size_t count)
+	{
+		queue.recycle_payloads(payloads, count);
+	}
+
+	LockFreeMPMCMessageQueue queue;
+};
+
+// Payloads come from a per-producer cache, and pushes are batched.
+class MPMCBatchedQueue : public MPMCQueue
+{
+public:
+	struct Producer
+	{
+		explicit Producer(MPMCBatchedQueue &queue_)
+		    : producer(queue_.queue)
+		{
+		}
+
+		bool push(unsigned producer_index, unsigned index)
+		{
+			auto payload = producer.allocate_write_payload(MessageSize);
+			return producer.push_written_payload(make_message(std::move(payload), producer_index, index));
+		}
+
+		void flush()
+		{
+			while (!producer.flush())
+				std::this_thread::yield();
+		}
+
+		LockFreeMPMCMessageQueue::Producer producer;
+	};
+};
+
+template <typename Queue>
+static double bench_queue(unsigned num_producers, bool &ok)
+{
+	Queue queue;
+	std::vector<std::thread> threads;
+	std::vector<uint64_t> received(num_producers);
+	unsigned per_producer = TotalMessages / num_producers;
+
+	auto start = get_current_time_nsecs();
+
+	// A full queue drops the payload, so resend the same message until it is accepted.
+	for (unsigned i = 0; i < num_producers; i++)
+	{
+		threads.emplace_back([&queue, i, per_producer]() {
+			typename Queue::Producer producer(queue);
+			for (unsigned j = 0; j < per_producer; j++)
+				while (!producer.push(i, j))
+					std::this_thread::yield();
+			producer.flush();
+		});
+	}
+
+	// Readers see each producer's messages in order, so checking the sequence catches loss and duplication.
+	unsigned total = per_producer * num_producers;
+	unsigned count = 0;
+	MessageQueuePayload payloads[ReadBatch];
+	while (count < total)
+	{
+		size_t read_count = queue.read(payloads);
+		if (!read_count)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		for (size_t i = 0; i < read_count; i++)
+		{
+			Message msg;
+			memcpy(&msg, payloads[i].get_payload_data(), sizeof(msg));
+			if (msg.producer >= num_producers || msg.index != received[msg.producer])
+				ok = false;
+			else
+				received[msg.producer]++;
+		}
+
+		queue.recycle(payloads, read_count);
+		count += unsigned(read_count);
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	auto end = get_current_time_nsecs();
+	return double(total) / (1e-9 * double(end - start)) * 1e-6;
+}
+
+int main()
+{
+	bool ok = true;
+	for (unsigned num_producers : { 1u, 4u, 16u })
+	{
+		double locked = bench_queue<LockedQueue>(num_producers, ok);
+		double mpmc = bench_queue<MPMCQueue>(num_producers, ok);
+		double batched = bench_queue<MPMCBatchedQueue>(num_producers, ok);
+		LOGI("%2u producers: locked %.2f Mmsg/s, MPMC %.2f Mmsg/s, MPMC batched %.2f Mmsg/s.\n",
+		     num_producers, locked, mpmc, batched);
+	}
+
+	if (!ok)
+	{
+		LOGE("Messages were lost or reordered.\n");
+		return EXIT_FAILURE;
+	}
+}
@@ -0,0 +1,206 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/object_pool.hpp"
+#include "util/logging.hpp"
+#include "util/timer.hpp"
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+
+using namespace Util;
+
+struct Object
+{
+	explicit Object(unsigned value_)
+	    : value(value_)
+	{
+	}
+	unsigned value;
+	char payload[60];
+};
+
+// The previous ThreadSafeObjectPool, where every allocate and free takes the pool lock.
+class LockedObjectPool
+{
+public:
+	Object *allocate(unsigned value)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		return pool.allocate(value);
+	}
+
+	void free(Object *object)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		pool.free(object);
+	}
+
+private:
+	ObjectPool<Object> pool;
+	std::mutex lock;
+};
+
+enum { ObjectsPerRound = 256, NumRounds = 2000 };
+
+// Every thread allocates a round of objects, then frees the round its neighbor allocated,
+// so half the objects are freed on a different thread than the one which allocated them.
+template <typename Pool>
+static double bench_allocations(unsigned num_threads, bool &ok)
+{
+	Pool pool;
+	std::vector<std::vector<Object *>> rounds(num_threads, std::vector<Object *>(ObjectsPerRound));
+	std::vector<std::thread> threads;
+	threads.reserve(num_threads);
+
+	auto start = get_current_time_nsecs();
+	for (unsigned round = 0; round < NumRounds; round += 100)
+	{
+		for (unsigned i = 0; i < num_threads; i++)
+		{
+			threads.emplace_back([&, i]() {
+				for (unsigned r = 0; r < 100; r++)
+				{
+					auto &own = rounds[i];
+					for (unsigned j = 0; j < ObjectsPerRound; j++)
+						own[j] = pool.allocate(i * ObjectsPerRound + j);
+					for (unsigned j = 0; j < ObjectsPerRound; j++)
+					{
+						if (own[j]->value != i * ObjectsPerRound + j)
+							ok = false;
+						pool.free(own[j]);
+						if ((j & 1) == 0)
+							own[j] = pool.allocate(i * ObjectsPerRound + j);
+						else
+							own[j] = nullptr;
+					}
+					for (auto *object : own)
+						if (object)
+							pool.free(object);
+				}
+			});
+		}
+
+		for (auto &t : threads)
+			t.join();
+		threads.clear();
+
+		// Hand every thread's leftovers to its neighbor.
+		for (unsigned i = 0; i < num_threads; i++)
+		{
+			auto &other = rounds[(i + 1) % num_threads];
+			for (unsigned j = 0; j < ObjectsPerRound; j++)
+				other[j] = pool.allocate(j);
+		}
+
+		for (unsigned i = 0; i < num_threads; i++)
+		{
+			threads.emplace_back([&, i]() {
+				auto &from_neighbor = rounds[(i + 1) % num_threads];
+				for (auto *object : from_neighbor)
+					pool.free(object);
+			});
+		}
+
+		for (auto &t : threads)
+			t.join();
+		threads.clear();
+	}
+	auto end = get_current_time_nsecs();
+
+	double ops = 3.0 * NumRounds * ObjectsPerRound * num_threads;
+	return ops / (1e-9 * double(end - start)) * 1e-6;
+}
+
+// Objects cached by exiting threads must go back to the pool, and dead or cleared pools must not leak
+// into the caches of whichever pool reuses their slot.
+static bool test_lifetimes()
+{
+	for (unsigned iter = 0; iter < 16; iter++)
+	{
+		ThreadSafeObjectPool<Object> pool;
+		std::vector<Object *> objects;
+		std::thread([&]() {
+			for (unsigned i = 0; i < 100; i++)
+				objects.push_back(pool.allocate(i));
+		}).join();
+
+		// Frees from another thread than the one which allocated.
+		std::thread([&]() {
+			for (auto *object : objects)
+				pool.free(object);
+		}).join();
+
+		std::vector<Object *> reallocated;
+		for (unsigned i = 0; i < 100; i++)
+			reallocated.push_back(pool.allocate(i));
+		for (unsigned i = 0; i < 100; i++)
+			if (reallocated[i]->value != i)
+				return false;
+
+		std::sort(reallocated.begin(), reallocated.end());
+		if (std::unique(reallocated.begin(), reallocated.end()) != reallocated.end())
+			return false;
+
+		for (auto *object : reallocated)
+			pool.free(object);
+
+		if (iter & 1)
+		{
+			pool.clear();
+			auto *object = pool.allocate(1u);
+			if (object->value != 1)
+				return false;
+			pool.free(object);
+		}
+	}
+
+	return true;
+}
+
+int main()
+{
+	if (!test_lifetimes())
+	{
+		LOGE("Object pool lifetime test failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	bool ok = true;
+	unsigned hw_threads = std::max(1u, std::thread::hardware_concurrency());
+	LOGI("Million allocations and frees per second, the previous locked pool in parentheses (%u hardware threads).\n",
+	     hw_threads);
+
+	for (unsigned num_threads = 1; num_threads <= std::max(8u, hw_threads); num_threads *= 2)
+	{
+		double cached = bench_allocations<ThreadSafeObjectPool<Object>>(num_threads, ok);
+		double locked = bench_allocations<LockedObjectPool>(num_threads, ok);
+		LOGI("%2u threads: %8.1f (%8.1f)\n", num_threads, cached, locked);
+	}
+
+	if (!ok)
+	{
+		LOGE("Object was corrupted.\n");
+		return EXIT_FAILURE;
+	}
+}
@@ -0,0 +1,153 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "threading/task_coroutine.hpp"
+#include "util/logging.hpp"
+#include <atomic>
+#include <vector>
+#include <stdexcept>
+
+using namespace Granite;
+
+static void check(bool cond, const char *what)
+{
+	if (!cond)
+	{
+		LOGE("Check failed: %s\n", what);
+		throw std::runtime_error(what);
+	}
+}
+
+// analyze -> (parallel stage) -> write, as a single coroutine.
+static CoroutineTask staged_pipeline(ThreadGroup &group, std::vector<uint32_t> &values, uint64_t &sum)
+{
+	auto analyze = group.create_task([&values]() {
+		for (size_t i = 0; i < values.size(); i++)
+			values[i] = uint32_t(i);
+	});
+	co_await analyze;
+
+	auto process = group.create_task();
+	process->parallel_for(values.size(), 64, [&values](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			values[i] *= 2;
+	});
+	co_await process;
+
+	uint64_t total = co_await run_in_background([&values]() {
+		uint64_t s = 0;
+		for (auto v : values)
+			s += v;
+		return s;
+	});
+	sum = total;
+}
+
+static void test_pipeline(ThreadGroup &group)
+{
+	std::vector<uint32_t> values(10000);
+	uint64_t sum = 0;
+	auto done = staged_pipeline(group, values, sum).launch(group);
+
+	// Other groups can depend on a coroutine like on any other group.
+	bool after = false;
+	auto dependee = group.create_task([&]() {
+		after = sum != 0;
+	});
+	group.add_dependency(*dependee, *done);
+	dependee->flush();
+	done->flush();
+	dependee->wait();
+
+	check(after, "Dependee ran before coroutine completed.");
+	check(sum == 10000ull * 9999ull, "Wrong pipeline result.");
+}
+
+static CoroutineTask wait_for_signal(TaskSignal &signal, uint64_t count, std::atomic_uint &resumed)
+{
+	co_await wait_for(signal, count);
+	resumed.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Suspended coroutines must not hold on to workers. With a single worker, the signals
+// could never be raised if any of the waiting coroutines blocked it.
+static void test_suspend_without_worker()
+{
+	ThreadGroup group;
+	group.start(1);
+
+	TaskSignal signal;
+	std::atomic_uint resumed;
+	resumed.store(0);
+
+	std::vector<TaskGroupHandle> waiters;
+	for (unsigned i = 0; i < 16; i++)
+		waiters.push_back(wait_for_signal(signal, i % 4 + 1, resumed).launch(group, TaskPriority::Normal));
+
+	for (auto &w : waiters)
+		w->flush();
+
+	auto signaller = group.create_task();
+	for (unsigned i = 0; i < 4; i++)
+	{
+		signaller->enqueue_task([&signal]() {
+			signal.signal_increment();
+		});
+	}
+	signaller->wait();
+
+	for (auto &w : waiters)
+		w->wait();
+	check(resumed.load() == 16, "Not all coroutines resumed.");
+}
+
+static CoroutineTask await_completed(TaskGroupHandle task, std::atomic_uint &resumed)
+{
+	co_await std::move(task);
+	resumed.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void test_await_completed(ThreadGroup &group)
+{
+	std::atomic_uint resumed;
+	resumed.store(0);
+
+	auto task = group.create_task([]() {});
+	task->wait();
+	await_completed(task, resumed).launch(group)->wait();
+	check(resumed.load() == 1, "Coroutine did not resume after completed group.");
+}
+
+int main()
+{
+	ThreadGroup group;
+	group.start(4);
+
+	for (unsigned i = 0; i < 100; i++)
+	{
+		test_pipeline(group);
+		test_await_completed(group);
+	}
+	test_suspend_without_worker();
+
+	LOGI("Coroutine tasks OK.\n");
+}
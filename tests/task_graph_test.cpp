@@ -0,0 +1,209 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "threading/task_graph.hpp"
+#include "util/logging.hpp"
+#include <atomic>
+#include <vector>
+#include <cstdlib>
+#include <new>
+
+using namespace Granite;
+
+static std::atomic<uint64_t> allocation_count;
+
+// Replace every non-aligned form, so all of them are counted and allocate and free through the same heap.
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	return malloc(size ? size : 1);
+}
+
+void *operator new(size_t size)
+{
+	if (void *ptr = operator new(size, std::nothrow))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+	free(ptr);
+}
+
+struct FrameParameters
+{
+	size_t count = 0;
+	std::vector<uint32_t> values;
+	std::atomic<uint64_t> sum;
+	std::atomic_uint stage;
+	bool order_ok = true;
+};
+
+// Relaunches right after wait() returns, while nodes of the previous launch may still be notifying their dependees.
+static bool test_relaunch(ThreadGroup &group)
+{
+	std::atomic_uint counter;
+	TaskGraph graph(group);
+
+	auto root = graph.add_node("root");
+	graph.add_task(root, [&]() { counter++; });
+
+	for (unsigned i = 0; i < 16; i++)
+	{
+		auto node = graph.add_node("leaf");
+		graph.add_dependency(node, root);
+		graph.add_task(node, [&]() { counter++; });
+	}
+
+	for (unsigned launch = 0; launch < 2000; launch++)
+	{
+		counter = 0;
+		graph.launch();
+		graph.wait();
+		if (counter != 17)
+		{
+			LOGE("Relaunch %u: ran %u tasks, expected 17.\n", launch, counter.load());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main()
+{
+	ThreadGroup group;
+	group.start(4);
+
+	FrameParameters params;
+	params.values.resize(10000);
+
+	// setup -> (fill, count) -> verify
+	TaskGraph graph(group);
+	auto setup = graph.add_node("setup", TaskPriority::FrameCritical);
+	auto fill = graph.add_node("fill", TaskPriority::FrameCritical);
+	auto count = graph.add_node("count", TaskPriority::FrameCritical);
+	auto verify = graph.add_node("verify", TaskPriority::FrameCritical);
+	graph.add_dependency(fill, setup);
+	graph.add_dependency(count, setup);
+	graph.add_dependency(verify, fill);
+	graph.add_dependency(verify, count);
+
+	graph.add_task(setup, [&]() {
+		params.sum = 0;
+		params.stage = 1;
+	});
+
+	graph.add_parallel_for(fill, [&]() { return params.count; }, 64, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			params.values[i] = uint32_t(i);
+	});
+
+	for (unsigned i = 0; i < 4; i++)
+	{
+		graph.add_task(count, [&]() {
+			if (params.stage.load() != 1)
+				params.order_ok = false;
+		});
+	}
+
+	graph.add_task(verify, [&]() {
+		uint64_t sum = 0;
+		for (size_t i = 0; i < params.count; i++)
+			sum += params.values[i];
+		params.sum = sum;
+		params.stage = 2;
+	});
+
+	for (unsigned frame = 0; frame < 200; frame++)
+	{
+		// Launching after an existing task group works like a dependency on it.
+		auto before = group.create_task([&]() {
+			params.stage = 0;
+		});
+
+		if (frame == 100)
+			allocation_count = 0;
+
+		params.count = 1000 + 37 * (frame % 200);
+		std::fill(params.values.begin(), params.values.end(), 0);
+		graph.launch(*before);
+		group.submit(before);
+		graph.wait();
+
+		uint64_t expected = uint64_t(params.count) * (params.count - 1) / 2;
+		if (params.sum != expected || params.stage != 2 || !params.order_ok)
+		{
+			LOGE("Frame %u: got sum %llu, expected %llu.\n", frame,
+			     static_cast<unsigned long long>(params.sum.load()), static_cast<unsigned long long>(expected));
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (allocation_count != 0)
+	{
+		LOGE("Launching the graph performed %llu allocations.\n",
+		     static_cast<unsigned long long>(allocation_count.load()));
+		return EXIT_FAILURE;
+	}
+
+	if (!test_relaunch(group))
+		return EXIT_FAILURE;
+
+	LOGI("Task graph OK.\n");
+}
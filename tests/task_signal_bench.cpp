@@ -0,0 +1,95 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "threading/thread_group.hpp"
+#include "util/logging.hpp"
+#include "util/timer.hpp"
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+using namespace Granite;
+
+// The previous TaskSignal, for reference.
+struct MutexSignal
+{
+	std::condition_variable cond;
+	std::mutex lock;
+	uint64_t counter = 0;
+
+	void signal_increment()
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		counter++;
+		cond.notify_all();
+	}
+
+	void wait_until_at_least(uint64_t count)
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		cond.wait(holder, [&]() -> bool {
+			return counter >= count;
+		});
+	}
+};
+
+constexpr uint64_t num_signals = 1000000;
+// Waiters pace themselves against the signaller like the glTF exporter does, waking up every few increments.
+constexpr uint64_t wait_interval = 64;
+
+// Returns signals per second seen by the signalling thread.
+template <typename Signal>
+static double bench_signal(unsigned num_waiters)
+{
+	Signal signal;
+	std::vector<std::thread> waiters;
+	for (unsigned i = 0; i < num_waiters; i++)
+	{
+		waiters.emplace_back([&signal]() {
+			for (uint64_t count = wait_interval; count <= num_signals; count += wait_interval)
+				signal.wait_until_at_least(count);
+		});
+	}
+
+	auto start = Util::get_current_time_nsecs();
+	for (uint64_t i = 0; i < num_signals; i++)
+		signal.signal_increment();
+	auto end = Util::get_current_time_nsecs();
+
+	for (auto &t : waiters)
+		t.join();
+
+	return double(num_signals) / (1e-9 * double(end - start));
+}
+
+int main()
+{
+	static const unsigned waiter_counts[] = { 0, 1, 4, 16 };
+	for (unsigned num_waiters : waiter_counts)
+	{
+		double mutex_rate = bench_signal<MutexSignal>(num_waiters);
+		double atomic_rate = bench_signal<TaskSignal>(num_waiters);
+		LOGI("%2u waiters: mutex %.2f M signals / s, atomic %.2f M signals / s, speedup %.2fx.\n",
+		     num_waiters, 1e-6 * mutex_rate, 1e-6 * atomic_rate, atomic_rate / mutex_rate);
+	}
+}
@@ -21,10 +21,555 @@
  */
 
 #include "threading/thread_group.hpp"
+#include "threading/task_composer.hpp"
 #include "util/logging.hpp"
+#include "util/timeline_trace_file.hpp"
+#include <atomic>
+#include <vector>
+#include <cstdlib>
+#include <climits>
+#include <chrono>
+#include <thread>
+#include <new>
+#include <string>
+#include <cstdio>
+#include <cstring>
 
 using namespace Granite;
 
+static std::atomic<uint64_t> allocation_count;
+
+// Replace every non-aligned form, so all of them are counted and allocate and free through the same heap.
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	return malloc(size ? size : 1);
+}
+
+void *operator new(size_t size)
+{
+	if (void *ptr = operator new(size, std::nothrow))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+	free(ptr);
+}
+
+static bool test_parallel_for(ThreadGroup &group)
+{
+	constexpr size_t count = 100000;
+	std::vector<unsigned> hits(count);
+
+	auto task = group.create_task();
+	task->parallel_for(count, 64, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			hits[i]++;
+	});
+	task->wait();
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (hits[i] != 1)
+		{
+			LOGE("parallel_for: index %zu was hit %u times.\n", i, hits[i]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool test_parallel_reduce(ThreadGroup &group)
+{
+	constexpr size_t count = 100000;
+	constexpr unsigned num_partials = 4;
+	uint64_t partials[num_partials] = {};
+	std::atomic_uint active[num_partials] = {};
+	std::atomic_bool overlap;
+	overlap = false;
+
+	auto task = group.create_task();
+	task->parallel_reduce(count, 64, num_partials, [&](size_t begin, size_t end, unsigned partial) {
+		if (active[partial].fetch_add(1) != 0)
+			overlap = true;
+		for (size_t i = begin; i < end; i++)
+			partials[partial] += i;
+		active[partial].fetch_sub(1);
+	});
+	task->wait();
+
+	uint64_t sum = 0;
+	for (auto &p : partials)
+		sum += p;
+
+	if (overlap)
+	{
+		LOGE("parallel_reduce: partial was used concurrently.\n");
+		return false;
+	}
+
+	if (sum != uint64_t(count) * (count - 1) / 2)
+	{
+		LOGE("parallel_reduce: got sum %llu.\n", static_cast<unsigned long long>(sum));
+		return false;
+	}
+
+	return true;
+}
+
+static bool test_background_cap(ThreadGroup &group)
+{
+	std::atomic_uint active;
+	std::atomic_uint max_active;
+	active = 0;
+	max_active = 0;
+
+	group.set_max_background_workers(1);
+	auto before = group.get_lane_statistics(TaskPriority::Background);
+
+	auto task = group.create_task();
+	task->set_priority(TaskPriority::Background);
+	for (unsigned i = 0; i < 64; i++)
+	{
+		task->enqueue_task([&]() {
+			unsigned current = active.fetch_add(1) + 1;
+			unsigned expected = max_active.load();
+			while (current > expected && !max_active.compare_exchange_weak(expected, current));
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			active.fetch_sub(1);
+		});
+	}
+	task->wait();
+	group.set_max_background_workers(UINT_MAX);
+
+	if (max_active.load() != 1)
+	{
+		LOGE("Background tasks ran on %u workers concurrently.\n", max_active.load());
+		return false;
+	}
+
+	auto after = group.get_lane_statistics(TaskPriority::Background);
+	if (after.num_tasks - before.num_tasks != 64)
+	{
+		LOGE("Expected 64 background tasks in statistics.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool test_helping_wait()
+{
+	// With a single worker blocked in a nested wait, only the helping main thread can make progress.
+	ThreadGroup group;
+	group.start(1);
+
+	auto main_thread = std::this_thread::get_id();
+	std::atomic_uint helped;
+	std::atomic_bool started;
+	helped = 0;
+	started = false;
+
+	// Make sure the outer task ends up on the worker.
+	group.set_wait_helping(false);
+
+	auto outer = group.create_task([&]() {
+		started = true;
+		auto inner = group.create_task();
+		for (unsigned i = 0; i < 16; i++)
+		{
+			inner->enqueue_task([&]() {
+				if (std::this_thread::get_id() == main_thread)
+					helped.fetch_add(1);
+			});
+		}
+		inner->wait();
+	});
+	outer->flush();
+
+	while (!started)
+		std::this_thread::yield();
+	group.set_wait_helping(true);
+	outer->wait();
+
+	if (helped.load() != 16)
+	{
+		LOGE("Main thread only ran %u of 16 tasks while waiting.\n", helped.load());
+		return false;
+	}
+
+	return true;
+}
+
+static bool test_worker_placement()
+{
+	// Two SMT performance cores in one cache domain, followed by two efficiency cores in another.
+	CPUTopology topology;
+	const struct { unsigned cpu, physical_core, cache_domain, capacity, smt_index; } cores[] = {
+		{ 0, 0, 0, 1024, 0 }, { 1, 0, 0, 1024, 1 }, { 2, 2, 0, 1024, 0 }, { 3, 2, 0, 1024, 1 },
+		{ 4, 4, 4, 512, 0 }, { 5, 5, 4, 512, 0 },
+	};
+	for (auto &c : cores)
+	{
+		CPUCore core;
+		core.cpu = c.cpu;
+		core.physical_core = c.physical_core;
+		core.cache_domain = c.cache_domain;
+		core.capacity = c.capacity;
+		core.smt_index = c.smt_index;
+		topology.cores.push_back(core);
+	}
+
+	auto performance = compute_worker_cpus(topology, ThreadAffinityPolicy::PerformanceFirst, {}, 5);
+	auto physical = compute_worker_cpus(topology, ThreadAffinityPolicy::PhysicalCores, {}, 5);
+	ThreadAffinityPolicy policy;
+	std::vector<unsigned> mask;
+	bool parsed = parse_thread_affinity("1-2,5", policy, mask);
+	auto masked = compute_worker_cpus(topology, policy, mask, 4);
+
+	// A malformed list must not clobber the previous result.
+	bool rejected = !parse_thread_affinity("3,4-x", policy, mask) &&
+	                policy == ThreadAffinityPolicy::Mask && mask == std::vector<unsigned>{ 1, 2, 5 };
+
+	if (performance != std::vector<int>{ 0, 2, 1, 3, 4 } ||
+	    physical != std::vector<int>{ 0, 2, 4, 5, -1 } ||
+	    !parsed || masked != std::vector<int>{ 1, 2, 5, 1 } || !rejected)
+	{
+		LOGE("Unexpected worker placement.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool test_statistics()
+{
+	ThreadGroup group;
+	group.start(2);
+	// Tasks run by a helping main thread are not counted by any worker.
+	group.set_wait_helping(false);
+	group.end_frame();
+
+	// Two stages, so the critical path is the longest task of each stage added together.
+	TaskComposer composer(group);
+	composer.set_desc("test-pipeline");
+	auto &first = composer.begin_pipeline_stage();
+	for (unsigned i = 0; i < 4; i++)
+	{
+		first.enqueue_task([]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		});
+	}
+	composer.begin_pipeline_stage().enqueue_task([]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	});
+	composer.get_outgoing_task()->wait();
+
+	for (unsigned i = 0; i < 10; i++)
+		group.create_task([]() {})->flush();
+	group.wait_idle();
+	group.end_frame();
+
+	auto stats = group.get_statistics();
+
+	if (stats.pipelines.size() != 1 || stats.pipelines[0].desc != "test-pipeline" ||
+	    stats.pipelines[0].num_runs != 1)
+	{
+		LOGE("Pipeline was not recorded.\n");
+		return false;
+	}
+
+	if (stats.pipelines[0].last_critical_path_ns < 7000000)
+	{
+		LOGE("Critical path is too short: %llu ns.\n",
+		     static_cast<unsigned long long>(stats.pipelines[0].last_critical_path_ns));
+		return false;
+	}
+
+	if (stats.frames.num_frames != 2 || stats.frames.last_tasks != 15)
+	{
+		LOGE("Expected 15 tasks in frame, got %llu.\n", static_cast<unsigned long long>(stats.frames.last_tasks));
+		return false;
+	}
+
+	uint64_t worker_tasks = 0;
+	uint64_t busy_ns = 0;
+	for (auto &w : stats.workers)
+	{
+		worker_tasks += w.num_tasks;
+		busy_ns += w.busy_ns;
+	}
+
+	uint64_t lane_tasks = 0;
+	for (auto &lane : stats.lanes)
+	{
+		uint64_t histogram_tasks = 0;
+		for (auto count : lane.queue_latency_histogram)
+			histogram_tasks += count;
+		if (histogram_tasks != lane.num_tasks)
+		{
+			LOGE("Latency histogram does not add up.\n");
+			return false;
+		}
+		lane_tasks += lane.num_tasks;
+	}
+
+	if (worker_tasks != 15 || lane_tasks != 15 || busy_ns < 7000000)
+	{
+		LOGE("Inconsistent worker statistics.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool test_scope_statistics()
+{
+	ThreadGroup group;
+	group.start(2);
+	group.get_scope_statistics().set_window_size(4);
+
+	// The scope sum per frame is what goes into the statistics, not the individual task times.
+	for (unsigned frame = 0; frame < 6; frame++)
+	{
+		auto task = group.create_task();
+		task->set_desc("test-scope");
+		for (unsigned i = 0; i < 2; i++)
+		{
+			task->enqueue_task([frame]() {
+				std::this_thread::sleep_for(std::chrono::milliseconds(frame < 5 ? 1 : 10));
+			});
+		}
+		task->wait();
+		group.create_task([]() {})->wait();
+		group.end_frame();
+	}
+
+	auto stats = group.get_scope_statistics().get_statistics();
+	if (stats.empty() || stats[0].scope != "test-scope" || !stats[0].thread.empty())
+	{
+		LOGE("Scope was not recorded.\n");
+		return false;
+	}
+
+	auto &all = stats[0];
+	if (all.num_frames != 4 || all.avg_count != 2.0 || all.min_ns < 2000000 ||
+	    all.max_ns < 20000000 || all.p99_ns != all.max_ns || all.p95_ns != all.max_ns)
+	{
+		LOGE("Unexpected scope statistics.\n");
+		return false;
+	}
+
+	unsigned thread_frames = 0;
+	for (size_t i = 1; i < stats.size(); i++)
+	{
+		if (stats[i].scope != "test-scope" || stats[i].thread.empty())
+		{
+			LOGE("Unexpected scope entry.\n");
+			return false;
+		}
+		thread_frames += stats[i].num_frames;
+	}
+
+	if (thread_frames < 4)
+	{
+		LOGE("Per thread scopes are missing.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void run_frame(ThreadGroup &group, uint64_t *sums)
+{
+	auto setup = group.create_task([sums]() {
+		for (unsigned i = 0; i < 4; i++)
+			sums[i] = 0;
+	});
+
+	auto work = group.create_task();
+	work->parallel_reduce(4096, 64, 4, [sums](size_t begin, size_t end, unsigned partial) {
+		for (size_t i = begin; i < end; i++)
+			sums[partial] += i;
+	});
+	work->parallel_for(4096, 64, [](size_t, size_t) {});
+	for (unsigned i = 0; i < 4; i++)
+		work->enqueue_task([]() {});
+
+	group.add_dependency(*work, *setup);
+	group.submit(setup);
+	work->wait();
+}
+
+static bool test_allocation_free_submission(ThreadGroup &group)
+{
+	uint64_t sums[4];
+
+	// Let the queues grow to their steady state size.
+	for (unsigned i = 0; i < 64; i++)
+		run_frame(group, sums);
+
+	uint64_t before = allocation_count.load();
+	for (unsigned i = 0; i < 64; i++)
+		run_frame(group, sums);
+	uint64_t allocations = allocation_count.load() - before;
+
+	if (allocations != 0)
+	{
+		LOGE("Task submission performed %llu allocations over 64 frames.\n",
+		     static_cast<unsigned long long>(allocations));
+		return false;
+	}
+
+	return true;
+}
+
+// Events written from several threads must read back, and convert, with their names and threads intact.
+static bool test_timeline_trace_round_trip()
+{
+	const char *path = "thread-group-test-trace.bin";
+	const char *json_path = "thread-group-test-trace.json";
+	constexpr unsigned num_threads = 4;
+	constexpr unsigned num_events = 100;
+
+	{
+		Util::TimelineTraceFile file(path);
+		std::vector<std::thread> threads;
+		for (unsigned i = 0; i < num_threads; i++)
+		{
+			threads.emplace_back([&file, i]() {
+				Util::TimelineTraceFile::set_tid(("trace-thread-" + std::to_string(i)).c_str());
+				uint32_t desc = Util::TimelineTraceFile::intern_string("interned");
+				for (unsigned j = 0; j < num_events; j++)
+				{
+					auto *e = j & 1 ? file.begin_event_interned(desc, i) : file.begin_event("by-name", i);
+					file.end_event(e);
+				}
+			});
+		}
+		for (auto &t : threads)
+			t.join();
+	}
+
+	Util::TimelineTrace trace;
+	if (!Util::read_timeline_trace(path, trace) || trace.truncated || trace.events.size() != num_threads * num_events)
+	{
+		LOGE("Failed to read back the timeline trace.\n");
+		return false;
+	}
+
+	unsigned counts[num_threads][2] = {};
+	for (auto &e : trace.events)
+	{
+		auto &desc = trace.strings[e.desc];
+		if (e.pid >= num_threads || trace.strings[e.tid] != "trace-thread-" + std::to_string(e.pid) ||
+		    (desc != "by-name" && desc != "interned") || e.start_ns > e.end_ns)
+		{
+			LOGE("Unexpected timeline event.\n");
+			return false;
+		}
+		counts[e.pid][desc == "interned"]++;
+	}
+
+	for (auto &c : counts)
+	{
+		if (c[0] != num_events / 2 || c[1] != num_events / 2)
+		{
+			LOGE("Unexpected number of timeline events.\n");
+			return false;
+		}
+	}
+
+	// Every event becomes a begin and an end record.
+	bool converted = Util::write_timeline_trace_json(json_path, trace);
+	unsigned json_records = 0;
+	if (FILE *file = fopen(json_path, "r"))
+	{
+		char line[256];
+		while (fgets(line, sizeof(line), file))
+			if (strstr(line, "\"name\": \"by-name\"") || strstr(line, "\"name\": \"interned\""))
+				json_records++;
+		fclose(file);
+	}
+
+	remove(path);
+	remove(json_path);
+
+	if (!converted || json_records != 2 * num_threads * num_events)
+	{
+		LOGE("Unexpected JSON conversion, %u records.\n", json_records);
+		return false;
+	}
+
+	return true;
+}
+
+// Releasing a dependee may signal the same TaskSignal again, which must not deadlock.
+static bool test_signal_reentry(ThreadGroup &group)
+{
+	TaskSignal signal;
+
+	// Empty task groups complete, and bump their fence counter, inline when they are released.
+	auto reentrant = group.create_task();
+	reentrant->set_fence_counter_signal(&signal);
+	signal.add_dependee(*reentrant, 1);
+	// Keeps the signal on its slow path while the first dependee is released.
+	auto last = group.create_task();
+	signal.add_dependee(*last, 3);
+	reentrant->flush();
+	last->flush();
+
+	signal.signal_increment();
+	signal.signal_increment();
+	last->wait();
+
+	if (signal.get_count() != 3)
+	{
+		LOGE("Unexpected signal count %llu.\n", static_cast<unsigned long long>(signal.get_count()));
+		return false;
+	}
+
+	return true;
+}
+
 int main()
 {
 	ThreadGroup group;
@@ -53,4 +598,25 @@ int main()
 	group.submit(task3);
 
 	group.wait_idle();
+
+	if (!test_parallel_for(group))
+		return EXIT_FAILURE;
+	if (!test_parallel_reduce(group))
+		return EXIT_FAILURE;
+	if (!test_background_cap(group))
+		return EXIT_FAILURE;
+	if (!test_signal_reentry(group))
+		return EXIT_FAILURE;
+	if (!test_timeline_trace_round_trip())
+		return EXIT_FAILURE;
+	if (!test_allocation_free_submission(group))
+		return EXIT_FAILURE;
+	if (!test_helping_wait())
+		return EXIT_FAILURE;
+	if (!test_worker_placement())
+		return EXIT_FAILURE;
+	if (!test_statistics())
+		return EXIT_FAILURE;
+	if (!test_scope_statistics())
+		return EXIT_FAILURE;
 }
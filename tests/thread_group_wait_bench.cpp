@@ -0,0 +1,90 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "threading/thread_group.hpp"
+#include "util/logging.hpp"
+#include "util/timer.hpp"
+#include <atomic>
+#include <cmath>
+
+using namespace Granite;
+
+static std::atomic<uint32_t> sink;
+
+static void spin_work(unsigned iterations)
+{
+	float v = 1.0f;
+	for (unsigned i = 0; i < iterations; i++)
+		v = std::sqrt(v + float(i));
+	sink.fetch_add(uint32_t(v), std::memory_order_relaxed);
+}
+
+// Mimics a frame: a few pipeline stages of small tasks, where the main thread waits for the last one.
+static void run_frame(ThreadGroup &group)
+{
+	constexpr unsigned num_stages = 4;
+	constexpr unsigned tasks_per_stage = 16;
+
+	TaskGroupHandle stages[num_stages];
+	for (unsigned i = 0; i < num_stages; i++)
+	{
+		stages[i] = group.create_task();
+		stages[i]->set_priority(TaskPriority::FrameCritical);
+		for (unsigned j = 0; j < tasks_per_stage; j++)
+			stages[i]->enqueue_task([]() { spin_work(20000); });
+		if (i)
+			group.add_dependency(*stages[i], *stages[i - 1]);
+	}
+
+	auto last = stages[num_stages - 1];
+	for (auto &stage : stages)
+		group.submit(stage);
+	last->wait();
+}
+
+static double bench_frame_time(unsigned num_workers, bool helping)
+{
+	ThreadGroup group;
+	group.start(num_workers);
+	group.set_wait_helping(helping);
+
+	for (unsigned i = 0; i < 10; i++)
+		run_frame(group);
+
+	constexpr unsigned num_frames = 100;
+	auto start = Util::get_current_time_nsecs();
+	for (unsigned i = 0; i < num_frames; i++)
+		run_frame(group);
+	auto end = Util::get_current_time_nsecs();
+	return 1e-6 * double(end - start) / num_frames;
+}
+
+int main()
+{
+	for (unsigned num_workers = 1; num_workers <= 4; num_workers++)
+	{
+		double blocking = bench_frame_time(num_workers, false);
+		double helping = bench_frame_time(num_workers, true);
+		LOGI("%u workers: blocking wait %.3f ms / frame, helping wait %.3f ms / frame, speedup %.2fx.\n",
+		     num_workers, blocking, helping, blocking / helping);
+	}
+}
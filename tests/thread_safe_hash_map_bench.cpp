@@ -0,0 +1,156 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/intrusive_hash_map.hpp"
+#include "util/logging.hpp"
+#include "util/timer.hpp"
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+
+using namespace Util;
+
+struct Entry : IntrusiveHashMapEnabled<Entry>
+{
+	explicit Entry(uint64_t key_)
+	    : key(key_)
+	{
+	}
+	uint64_t key;
+};
+
+// The previous ThreadSafeIntrusiveHashMap, where every lookup takes the read lock.
+class ReadLockedHashMap
+{
+public:
+	Entry *find(Hash hash) const
+	{
+		lock.lock_read();
+		Entry *t = hashmap.find(hash);
+		lock.unlock_read();
+		return t;
+	}
+
+	Entry *emplace_yield(Hash hash, uint64_t key)
+	{
+		lock.lock_write();
+		Entry *t = hashmap.emplace_yield(hash, key);
+		lock.unlock_write();
+		return t;
+	}
+
+private:
+	IntrusiveHashMap<Entry> hashmap;
+	mutable RWSpinLock lock;
+};
+
+static Hash hash_key(uint64_t key)
+{
+	Hasher h;
+	h.u64(key);
+	return h.get();
+}
+
+constexpr unsigned num_warm_entries = 4096;
+constexpr unsigned lookups_per_thread = 2 * 1024 * 1024;
+
+// Returns millions of lookups per second over all reader threads.
+// With a writer, one more thread keeps inserting new entries while the readers run.
+template <typename Map>
+static double bench_lookups(unsigned num_threads, bool with_writer, bool &ok)
+{
+	Map map;
+	for (uint64_t i = 0; i < num_warm_entries; i++)
+		map.emplace_yield(hash_key(i), i);
+
+	std::atomic_bool done;
+	done.store(false);
+	std::atomic_bool failed;
+	failed.store(false);
+
+	std::thread writer;
+	if (with_writer)
+	{
+		writer = std::thread([&]() {
+			for (uint64_t i = num_warm_entries; !done.load(std::memory_order_relaxed); i++)
+			{
+				map.emplace_yield(hash_key(i), i);
+				std::this_thread::yield();
+			}
+		});
+	}
+
+	std::vector<std::thread> readers;
+	auto start = get_current_time_nsecs();
+	for (unsigned t = 0; t < num_threads; t++)
+	{
+		readers.emplace_back([&, t]() {
+			std::minstd_rand rnd(t + 1);
+			for (unsigned i = 0; i < lookups_per_thread; i++)
+			{
+				uint64_t key = rnd() % num_warm_entries;
+				auto *e = map.find(hash_key(key));
+				if (!e || e->key != key)
+					failed.store(true, std::memory_order_relaxed);
+			}
+		});
+	}
+
+	for (auto &r : readers)
+		r.join();
+	auto end = get_current_time_nsecs();
+
+	done.store(true);
+	if (writer.joinable())
+		writer.join();
+
+	if (failed.load())
+		ok = false;
+	return 1e3 * double(num_threads) * lookups_per_thread / double(end - start);
+}
+
+int main()
+{
+	bool ok = true;
+	unsigned hw_threads = std::max(1u, std::thread::hardware_concurrency());
+	LOGI("Million lookups per second, the previous read-locked map in parentheses (%u hardware threads).\n",
+	     hw_threads);
+
+	for (bool with_writer : { false, true })
+	{
+		for (unsigned num_threads = 1; num_threads <= std::max(8u, hw_threads); num_threads *= 2)
+		{
+			double lock_free = bench_lookups<ThreadSafeIntrusiveHashMap<Entry>>(num_threads, with_writer, ok);
+			double read_locked = bench_lookups<ReadLockedHashMap>(num_threads, with_writer, ok);
+			LOGI("%2u readers%s: %8.1f (%8.1f)\n", num_threads, with_writer ? " + inserting writer" : "",
+			     lock_free, read_locked);
+		}
+	}
+
+	if (!ok)
+	{
+		LOGE("Lookup returned the wrong entry.\n");
+		return EXIT_FAILURE;
+	}
+}
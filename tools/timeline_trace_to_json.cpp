@@ -0,0 +1,57 @@
+/* Copyright (c) 2017-2020 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/logging.hpp"
+#include "util/timeline_trace_file.hpp"
+
+#include <cstdlib>
+
+using namespace Util;
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3)
+	{
+		LOGE("Usage: %s <trace.bin> <trace.json>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	TimelineTrace trace;
+	if (!read_timeline_trace(argv[1], trace))
+	{
+		LOGE("%s is not a timeline trace.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	// A trace which was cut short, e.g. by a crash, is still converted up to the last complete record.
+	if (trace.truncated)
+		LOGW("Trace is truncated, converted %zu events.\n", trace.events.size());
+
+	if (!write_timeline_trace_json(argv[2], trace))
+	{
+		LOGE("Failed to write %s.\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Converted %zu events.\n", trace.events.size());
+	return EXIT_SUCCESS;
+}